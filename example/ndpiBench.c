@@ -0,0 +1,472 @@
+/*
+ * ndpiBench.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Detection throughput benchmark (make bench).
+
+  Every pcap file given on the command line is a corpus: it is loaded in
+  memory first, then replayed <loops> times through flow lookup and
+  ndpi_detection_process_packet() with a fresh flow manager per loop, so
+  that no pcap I/O is measured. Results can be saved as JSON (-j) and
+  compared with a previous run (-b): the exit code is 1 when a corpus got
+  slower than the tolerance allows or when its detection results changed.
+*/
+
+#ifdef linux
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <libgen.h>
+#include <pcap.h>
+#include <json.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+
+#define BENCH_MAX_CORPORA     64
+
+struct bench_corpus {
+  char *path;
+  int datalink;
+  u_int8_t *data;                       /* packets, back to back */
+  struct bench_pkt {
+    u_int64_t offset, time;             /* time in msec */
+    u_int16_t caplen, len;
+  } *pkts;
+  u_int32_t num_pkts;
+  u_int64_t num_bytes;
+
+  /* results */
+  u_int32_t num_flows, detected_flows;
+  double seconds, pps, gbps, cycles_per_pkt, flows_per_sec;
+  long peak_rss_kb;
+};
+
+static struct ndpi_detection_module_struct *ndpi_struct;
+static ndpi_flow_manager_t *flow_manager;
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiBench [-l <loops>][-c <core>][-p <protos>][-j <file>]\n"
+	 "          [-b <baseline>][-t <tolerance>] <file.pcap> [<file.pcap> ...]\n\n"
+	 "Usage:\n"
+	 "  -l <loops>                | Times each corpus is replayed. Default: 10\n"
+	 "  -c <core>                 | Core the benchmark is pinned to. Default: not pinned\n"
+	 "  -p <file>.protos          | Specify a protocol file (eg. protos.txt)\n"
+	 "  -j <file.json>            | Save the results in JSON format\n"
+	 "  -b <file.json>            | Compare the results with a previous -j file (exit code 1 on regression)\n"
+	 "  -t <tolerance>            | Allowed slowdown in percent for -b. Default: 10\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+static void *malloc_wrapper(unsigned long size) {
+  return malloc(size);
+}
+
+/* ***************************************************** */
+
+static void free_wrapper(void *freeable) {
+  free(freeable);
+}
+
+/* ***************************************************** */
+
+static void debug_printf(u_int32_t protocol, void *id_struct,
+			 ndpi_log_level_t log_level,
+			 const char *format, ...) {
+}
+
+/* ***************************************************** */
+
+static inline u_int64_t bench_cycles(void) {
+#if defined(__i386__) || defined(__x86_64__)
+  u_int32_t lo, hi;
+
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return(((u_int64_t)hi << 32) | lo);
+#else
+  return(0); /* not available: cycles/packet is reported as 0 */
+#endif
+}
+
+/* ***************************************************** */
+
+static int load_corpus(struct bench_corpus *c) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *h;
+  const u_char *p;
+  u_int64_t data_len = 0, data_size = 0;
+  u_int32_t pkts_size = 0;
+  pcap_t *pcap;
+
+  if((pcap = pcap_open_offline(c->path, errbuf)) == NULL) {
+    printf("ERROR: unable to open %s: %s\n", c->path, errbuf);
+    return(-1);
+  }
+
+  c->datalink = pcap_datalink(pcap);
+
+  while(pcap_next_ex(pcap, &h, &p) == 1) {
+    if(c->num_pkts == pkts_size) {
+      pkts_size = pkts_size ? pkts_size * 2 : 4096;
+      if((c->pkts = realloc(c->pkts, pkts_size * sizeof(struct bench_pkt))) == NULL)
+	goto no_memory;
+    }
+
+    if(data_len + h->caplen > data_size) {
+      data_size = data_size ? data_size * 2 : 1048576;
+      if(data_size < data_len + h->caplen) data_size = data_len + h->caplen;
+      if((c->data = realloc(c->data, data_size)) == NULL)
+	goto no_memory;
+    }
+
+    memcpy(&c->data[data_len], p, h->caplen);
+    c->pkts[c->num_pkts].offset = data_len;
+    c->pkts[c->num_pkts].time = ((u_int64_t)h->ts.tv_sec) * 1000 + h->ts.tv_usec / 1000;
+    c->pkts[c->num_pkts].caplen = h->caplen, c->pkts[c->num_pkts].len = h->len;
+    c->num_pkts++, c->num_bytes += h->len, data_len += h->caplen;
+  }
+
+  pcap_close(pcap);
+  return(0);
+
+ no_memory:
+  printf("ERROR: not enough memory to load %s\n", c->path);
+  pcap_close(pcap);
+  return(-1);
+}
+
+/* ***************************************************** */
+
+static void flow_detected(ndpi_managed_flow_t *flow, void *user_data) {
+  struct bench_corpus *c = (struct bench_corpus*)user_data;
+
+  if(flow->detected_protocol != NDPI_PROTOCOL_UNKNOWN)
+    c->detected_flows++;
+}
+
+/* ***************************************************** */
+
+static void process_packet(struct bench_corpus *c, struct bench_pkt *pkt) {
+  const u_int8_t *packet = &c->data[pkt->offset], *l3;
+  u_int16_t ethertype, l2_len, l3_len;
+
+  switch(c->datalink) {
+  case DLT_EN10MB:
+    if(pkt->caplen < 14) return;
+    ethertype = (packet[12] << 8) + packet[13], l2_len = 14;
+    break;
+
+  case DLT_NULL:
+    if(pkt->caplen < 4) return;
+    ethertype = 0 /* IP version */, l2_len = 4;
+    break;
+
+  case 113 /* Linux Cooked Capture */:
+    if(pkt->caplen < 16) return;
+    ethertype = (packet[14] << 8) + packet[15], l2_len = 16;
+    break;
+
+  default:
+    ethertype = 0, l2_len = 0;
+    break;
+  }
+
+  if(ndpi_decap_packet(&packet[l2_len], pkt->caplen - l2_len, ethertype, NULL, &l3, &l3_len) != 0)
+    return;
+
+  ndpi_flow_manager_process_packet(flow_manager, l3, l3_len, pkt->time);
+}
+
+/* ***************************************************** */
+
+static void run_corpus(struct bench_corpus *c, u_int32_t loops) {
+  struct timespec begin, end;
+  struct rusage usage;
+  u_int64_t cycles, tot_pkts = (u_int64_t)c->num_pkts * loops;
+  u_int32_t l, i;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  cycles = bench_cycles();
+
+  for(l = 0; l < loops; l++) {
+    c->num_flows = c->detected_flows = 0;
+
+    if((flow_manager = ndpi_flow_manager_init(ndpi_struct, 0, 0)) == NULL) {
+      printf("ERROR: not enough memory\n");
+      exit(-1);
+    }
+
+    ndpi_flow_manager_set_callbacks(flow_manager, flow_detected, NULL, NULL, c);
+
+    for(i = 0; i < c->num_pkts; i++)
+      process_packet(c, &c->pkts[i]);
+
+    c->num_flows = flow_manager->num_flows;
+    if(l == loops - 1) getrusage(RUSAGE_SELF, &usage); /* peak with the flow table still allocated */
+    ndpi_flow_manager_release(flow_manager);
+  }
+
+  cycles = bench_cycles() - cycles;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  c->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  if(c->seconds <= 0) c->seconds = 1e-9;
+
+  c->pps = tot_pkts / c->seconds;
+  c->gbps = (c->num_bytes * loops * 8.0) / c->seconds / 1e9;
+  c->cycles_per_pkt = tot_pkts ? (double)cycles / tot_pkts : 0;
+  c->flows_per_sec = ((double)c->num_flows * loops) / c->seconds;
+  c->peak_rss_kb = usage.ru_maxrss;
+}
+
+/* ***************************************************** */
+
+static json_object *results_to_json(struct bench_corpus *corpora, u_int32_t num_corpora, u_int32_t loops) {
+  json_object *jObj_main = json_object_new_object(), *jArray = json_object_new_array();
+  u_int32_t i;
+
+  json_object_object_add(jObj_main, "ndpi.version", json_object_new_string(ndpi_revision()));
+  json_object_object_add(jObj_main, "loops", json_object_new_int(loops));
+
+  for(i = 0; i < num_corpora; i++) {
+    struct bench_corpus *c = &corpora[i];
+    json_object *jObj = json_object_new_object();
+
+    json_object_object_add(jObj, "name", json_object_new_string(basename(c->path)));
+    json_object_object_add(jObj, "packets", json_object_new_int64(c->num_pkts));
+    json_object_object_add(jObj, "bytes", json_object_new_int64(c->num_bytes));
+    json_object_object_add(jObj, "flows", json_object_new_int64(c->num_flows));
+    json_object_object_add(jObj, "detected.flows", json_object_new_int64(c->detected_flows));
+    json_object_object_add(jObj, "pps", json_object_new_double(c->pps));
+    json_object_object_add(jObj, "gbps", json_object_new_double(c->gbps));
+    json_object_object_add(jObj, "cycles.per.packet", json_object_new_double(c->cycles_per_pkt));
+    json_object_object_add(jObj, "flows.per.sec", json_object_new_double(c->flows_per_sec));
+    json_object_object_add(jObj, "peak.rss.kb", json_object_new_int64(c->peak_rss_kb));
+    json_object_array_add(jArray, jObj);
+  }
+
+  json_object_object_add(jObj_main, "corpora", jArray);
+  return(jObj_main);
+}
+
+/* ***************************************************** */
+
+static double json_get_double(json_object *jObj, const char *key) {
+  json_object *v;
+
+  return(json_object_object_get_ex(jObj, key, &v) ? json_object_get_double(v) : 0);
+}
+
+/* ***************************************************** */
+
+/* Returns the number of regressions found */
+static int compare_with_baseline(struct bench_corpus *corpora, u_int32_t num_corpora,
+				 const char *baseline_path, double tolerance) {
+  json_object *jBaseline, *jArray;
+  u_int32_t i;
+  int j, regressions = 0;
+
+  if(((jBaseline = json_object_from_file((char*)baseline_path)) == NULL)
+     || !json_object_object_get_ex(jBaseline, "corpora", &jArray)) {
+    printf("ERROR: unable to read baseline %s\n", baseline_path);
+    return(1);
+  }
+
+  printf("\nComparison with %s (tolerance %.1f%%):\n", baseline_path, tolerance);
+
+  for(i = 0; i < num_corpora; i++) {
+    struct bench_corpus *c = &corpora[i];
+    json_object *jObj = NULL;
+    double base_pps, base_cycles;
+
+    for(j = 0; j < json_object_array_length(jArray); j++) {
+      json_object *jName, *jItem = json_object_array_get_idx(jArray, j);
+
+      if(json_object_object_get_ex(jItem, "name", &jName)
+	 && (strcmp(json_object_get_string(jName), basename(c->path)) == 0)) {
+	jObj = jItem;
+	break;
+      }
+    }
+
+    if(jObj == NULL) {
+      printf("\t%-24s not in the baseline\n", basename(c->path));
+      continue;
+    }
+
+    base_pps = json_get_double(jObj, "pps"), base_cycles = json_get_double(jObj, "cycles.per.packet");
+
+    printf("\t%-24s pps %+7.2f%%", basename(c->path),
+	   base_pps ? (c->pps - base_pps) * 100 / base_pps : 0);
+    if(base_cycles && c->cycles_per_pkt)
+      printf("  cycles/pkt %+7.2f%%", (c->cycles_per_pkt - base_cycles) * 100 / base_cycles);
+
+    if(base_pps && (c->pps < base_pps * (1 - tolerance / 100))) {
+      printf("  REGRESSION (throughput)");
+      regressions++;
+    }
+
+    if(((u_int32_t)json_get_double(jObj, "flows") != c->num_flows)
+       || ((u_int32_t)json_get_double(jObj, "detected.flows") != c->detected_flows)) {
+      printf("  REGRESSION (detected flows %u, baseline %u)", c->detected_flows,
+	     (u_int32_t)json_get_double(jObj, "detected.flows"));
+      regressions++;
+    }
+
+    printf("\n");
+  }
+
+  json_object_put(jBaseline);
+  return(regressions);
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  struct bench_corpus corpora[BENCH_MAX_CORPORA];
+  char *protoFilePath = NULL, *jsonFilePath = NULL, *baselinePath = NULL;
+  u_int32_t loops = 10, num_corpora = 0, i;
+  double tolerance = 10;
+  int opt, core = -1, rc = 0;
+  NDPI_PROTOCOL_BITMASK all;
+
+  while((opt = getopt(argc, argv, "l:c:p:j:b:t:h")) != EOF) {
+    switch(opt) {
+    case 'l':
+      loops = atoi(optarg);
+      break;
+
+    case 'c':
+      core = atoi(optarg);
+      break;
+
+    case 'p':
+      protoFilePath = optarg;
+      break;
+
+    case 'j':
+      jsonFilePath = optarg;
+      break;
+
+    case 'b':
+      baselinePath = optarg;
+      break;
+
+    case 't':
+      tolerance = atof(optarg);
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  if((optind == argc) || (loops == 0))
+    help();
+
+#ifdef linux
+  if(core >= 0) {
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+
+    if(sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0)
+      printf("WARNING: unable to pin the benchmark to core %d\n", core);
+  }
+#endif
+
+  ndpi_struct = ndpi_init_detection_module(1000, malloc_wrapper, free_wrapper, debug_printf);
+  if(ndpi_struct == NULL) {
+    printf("ERROR: global structure initialization failed\n");
+    return(-1);
+  }
+
+  NDPI_BITMASK_SET_ALL(all);
+  ndpi_set_protocol_detection_bitmask2(ndpi_struct, &all);
+
+  if(protoFilePath != NULL)
+    ndpi_load_protocols_file(ndpi_struct, protoFilePath);
+
+  memset(corpora, 0, sizeof(corpora));
+
+  printf("%-24s %10s %12s %8s %10s %12s %10s\n",
+	 "Corpus", "Packets", "pps", "Gbps", "cycles/pkt", "flows/s", "RSS (KB)");
+
+  for(i = 0; (optind < argc) && (i < BENCH_MAX_CORPORA); i++, optind++) {
+    struct bench_corpus *c = &corpora[num_corpora];
+
+    c->path = argv[optind];
+    if(load_corpus(c) != 0) {
+      rc = -1;
+      break;
+    }
+
+    run_corpus(c, loops);
+    num_corpora++;
+
+    /* the packets are not needed anymore */
+    free(c->data), free(c->pkts);
+    c->data = NULL, c->pkts = NULL;
+
+    printf("%-24s %10u %12.0f %8.3f %10.0f %12.0f %10ld\n",
+	   basename(c->path), c->num_pkts, c->pps, c->gbps,
+	   c->cycles_per_pkt, c->flows_per_sec, c->peak_rss_kb);
+  }
+
+  if((rc == 0) && (jsonFilePath != NULL)) {
+    json_object *jObj = results_to_json(corpora, num_corpora, loops);
+    FILE *fp = fopen(jsonFilePath, "w");
+
+    if(fp == NULL) {
+      printf("ERROR: unable to create %s\n", jsonFilePath);
+      rc = -1;
+    } else {
+      fprintf(fp, "%s\n", json_object_to_json_string_ext(jObj, JSON_C_TO_STRING_PRETTY));
+      fclose(fp);
+    }
+
+    json_object_put(jObj);
+  }
+
+  if((rc == 0) && (baselinePath != NULL)
+     && (compare_with_baseline(corpora, num_corpora, baselinePath, tolerance) > 0)) {
+    printf("\nERROR: performance or detection regression against %s\n", baselinePath);
+    rc = 1;
+  }
+
+  ndpi_exit_detection_module(ndpi_struct, free_wrapper);
+
+  return(rc);
+}
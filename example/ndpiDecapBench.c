@@ -0,0 +1,234 @@
+/*
+ * ndpiDecapBench.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Throughput of ndpi_decap_packet() on synthetic nested packets. Each
+  packet is first checked (innermost offset and tunnel identifiers), then
+  decapsulated in a tight loop.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+
+#define BENCH_PKT_LEN     256
+
+struct bench_packet {
+  const char *name;
+  u_int8_t data[BENCH_PKT_LEN];
+  u_int16_t len, inner_offset, num_layers;
+  u_int32_t teid, vni, gre_key;
+};
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiDecapBench [-n <iterations>]\n\n"
+	 "Usage:\n"
+	 "  -n <iterations>           | Decapsulations per packet type. Default: 10000000\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+static u_int16_t put_ipv4(u_int8_t *p, u_int8_t proto, u_int16_t payload_len) {
+  u_int16_t tot_len = 20 + payload_len;
+
+  p[0] = 0x45, p[2] = tot_len >> 8, p[3] = tot_len & 0xFF;
+  p[8] = 64, p[9] = proto;
+  p[12] = 10, p[15] = 1, p[16] = 10, p[19] = 2;
+  return(20);
+}
+
+/* ***************************************************** */
+
+static u_int16_t put_ipv6(u_int8_t *p, u_int8_t nxt, u_int16_t payload_len) {
+  p[0] = 0x60, p[4] = payload_len >> 8, p[5] = payload_len & 0xFF;
+  p[6] = nxt, p[7] = 64;
+  p[8] = 0x20, p[9] = 0x01, p[23] = 1;
+  p[24] = 0x20, p[25] = 0x01, p[39] = 2;
+  return(40);
+}
+
+/* ***************************************************** */
+
+static u_int16_t put_udp(u_int8_t *p, u_int16_t sport, u_int16_t dport, u_int16_t payload_len) {
+  u_int16_t len = 8 + payload_len;
+
+  p[0] = sport >> 8, p[1] = sport & 0xFF, p[2] = dport >> 8, p[3] = dport & 0xFF;
+  p[4] = len >> 8, p[5] = len & 0xFF;
+  return(8);
+}
+
+/* ***************************************************** */
+
+/* innermost packet: IPv4/UDP DNS-sized query */
+#define INNER_PAYLOAD   32
+#define INNER_LEN       (20 + 8 + INNER_PAYLOAD)
+
+static u_int16_t put_inner(u_int8_t *p) {
+  u_int16_t off = put_ipv4(p, 17, 8 + INNER_PAYLOAD);
+
+  off += put_udp(&p[off], 40000, 53, INNER_PAYLOAD);
+  return(off + INNER_PAYLOAD);
+}
+
+/* ***************************************************** */
+
+static void build_packets(struct bench_packet *pkts, int *num_pkts) {
+  struct bench_packet *b;
+  u_int16_t off;
+  int n = 0;
+
+  /* plain IPv4/UDP: cost of a packet without tunnels */
+  b = &pkts[n++], b->name = "IPv4";
+  b->len = put_inner(b->data);
+
+  /* IPv4/UDP/GTP-U (with a PDU session container)/IPv4 */
+  b = &pkts[n++], b->name = "GTP-U+ext";
+  off = put_ipv4(b->data, 17, 8 + 16 + INNER_LEN);
+  off += put_udp(&b->data[off], 2152, 2152, 16 + INNER_LEN);
+  b->data[off] = 0x34 /* v1, PT, E */, b->data[off+1] = 0xFF;
+  b->data[off+4] = 0x12, b->data[off+5] = 0x34, b->data[off+6] = 0x56, b->data[off+7] = 0x78;
+  b->data[off+11] = 0x85 /* PDU session container */;
+  b->data[off+12] = 1 /* 4 bytes */, b->data[off+15] = 0 /* no more */;
+  off += 16;
+  b->inner_offset = off, b->num_layers = 1, b->teid = 0x12345678;
+  b->len = off + put_inner(&b->data[off]);
+
+  /* IPv6/GRE (key)/IPv4 */
+  b = &pkts[n++], b->name = "IPv6+GRE";
+  off = put_ipv6(b->data, 47, 8 + INNER_LEN);
+  b->data[off] = 0x20 /* K */, b->data[off+2] = 0x08, b->data[off+3] = 0x00;
+  b->data[off+7] = 42;
+  off += 8;
+  b->inner_offset = off, b->num_layers = 1, b->gre_key = 42;
+  b->len = off + put_inner(&b->data[off]);
+
+  /* IPv4/UDP/VXLAN/Ethernet/VLAN/IPv4 */
+  b = &pkts[n++], b->name = "VXLAN+VLAN";
+  off = put_ipv4(b->data, 17, 8 + 8 + 18 + INNER_LEN);
+  off += put_udp(&b->data[off], 50000, 4789, 8 + 18 + INNER_LEN);
+  b->data[off] = 0x08, b->data[off+6] = 7;
+  off += 8;
+  b->data[off+12] = 0x81, b->data[off+13] = 0x00, b->data[off+15] = 100;
+  b->data[off+16] = 0x08, b->data[off+17] = 0x00;
+  off += 18;
+  b->inner_offset = off, b->num_layers = 2, b->vni = 7;
+  b->len = off + put_inner(&b->data[off]);
+
+  /* MPLS (2 labels)/IPv6/IPv4 in IPv6 */
+  b = &pkts[n++], b->name = "MPLS+IPinIP";
+  b->data[2] = 0x10, b->data[6] = 0x21 /* S */, b->data[7] = 64;
+  off = 8;
+  off += put_ipv6(&b->data[off], 4, INNER_LEN);
+  b->inner_offset = off, b->num_layers = 2;
+  b->len = off + put_inner(&b->data[off]);
+
+  *num_pkts = n;
+}
+
+/* ***************************************************** */
+
+static int check_packet(struct bench_packet *b, u_int16_t ethertype) {
+  ndpi_tunnel_info_t info;
+  const u_int8_t *inner;
+  u_int16_t inner_len;
+
+  if(ndpi_decap_packet(b->data, b->len, ethertype, &info, &inner, &inner_len) != 0) {
+    printf("ERROR: %s: decapsulation failed\n", b->name);
+    return(-1);
+  }
+
+  if((inner != &b->data[b->inner_offset]) || (inner_len != INNER_LEN)
+     || (info.num_layers != b->num_layers)
+     || (b->teid && (!info.has_gtp_teid || (info.gtp_teid != b->teid)))
+     || (b->vni && (!info.has_vxlan_vni || (info.vxlan_vni != b->vni)))
+     || (b->gre_key && (!info.has_gre_key || (info.gre_key != b->gre_key)))) {
+    printf("ERROR: %s: unexpected result (offset %u, len %u, layers %u)\n", b->name,
+	   (unsigned int)(inner - b->data), inner_len, info.num_layers);
+    return(-1);
+  }
+
+  return(0);
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  struct bench_packet pkts[8];
+  u_int64_t iterations = 10000000, i;
+  int opt, num_pkts, n;
+
+  while((opt = getopt(argc, argv, "n:h")) != EOF) {
+    switch(opt) {
+    case 'n':
+      iterations = strtoull(optarg, NULL, 10);
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  memset(pkts, 0, sizeof(pkts));
+  build_packets(pkts, &num_pkts);
+
+  printf("%-14s %10s %10s %10s\n", "Packet", "Mpps", "ns/pkt", "Gbps");
+
+  for(n = 0; n < num_pkts; n++) {
+    u_int16_t ethertype = (n == num_pkts - 1) ? 0x8847 /* MPLS */ : 0;
+    struct timespec begin, end;
+    volatile u_int32_t sink = 0;
+    const u_int8_t *inner;
+    u_int16_t inner_len;
+    ndpi_tunnel_info_t info;
+    double nsec;
+
+    if(check_packet(&pkts[n], ethertype) != 0)
+      return(-1);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for(i = 0; i < iterations; i++) {
+      ndpi_decap_packet(pkts[n].data, pkts[n].len, ethertype, &info, &inner, &inner_len);
+      sink += inner_len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    nsec = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+    if(nsec <= 0) nsec = 1;
+
+    printf("%-14s %10.2f %10.2f %10.2f\n", pkts[n].name,
+	   (iterations * 1e3) / nsec, nsec / iterations,
+	   (iterations * pkts[n].len * 8.0) / nsec);
+  }
+
+  return(0);
+}
@@ -0,0 +1,140 @@
+/*
+ * ndpiFlows.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Prints the flow records exported by a running ndpiReader -e <name> as
+  soon as their detection completes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+#include "ndpiFlowsConsumer.h"
+
+#define IDLE_SLEEP_USEC   1000
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiFlows -e <name> [-c <count>]\n\n"
+	 "Usage:\n"
+	 "  -e <name>                 | Shared memory segment passed to ndpiReader -e\n"
+	 "  -c <count>                | Number of records to print (0 = until ndpiReader exits). Default: 0\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+static void printRecord(struct ndpi_flows_consumer *c, u_int32_t ring_id, struct ndpi_flow_record *r) {
+  char lower[INET6_ADDRSTRLEN], upper[INET6_ADDRSTRLEN];
+  int af = (r->ip_version == 6) ? AF_INET6 : AF_INET;
+  u_int32_t i;
+
+  inet_ntop(af, r->lower_ip, lower, sizeof(lower));
+  inet_ntop(af, r->upper_ip, upper, sizeof(upper));
+
+  printf("[thread %u] %s %s:%u <-> %s:%u [proto: ", ring_id,
+	 (r->l4_protocol == 6) ? "TCP" : ((r->l4_protocol == 17) ? "UDP" : "IP"),
+	 lower, ntohs(r->lower_port), upper, ntohs(r->upper_port));
+
+  printf("%s", ndpi_flows_consumer_proto_name(c, r->protocol_stack[0]));
+  for(i = 1; (i < NDPI_FLOWS_STACK_LEN) && (r->protocol_stack[i] != NDPI_PROTOCOL_UNKNOWN); i++)
+    printf("/%s", ndpi_flows_consumer_proto_name(c, r->protocol_stack[i]));
+
+  printf("][%llu pkts/%llu bytes]", (long long unsigned int)r->packets, (long long unsigned int)r->bytes);
+
+  if(r->host_server_name[0] != '\0')
+    printf("[%.*s]", NDPI_FLOWS_HOST_NAME_LEN, r->host_server_name);
+
+  printf("\n");
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  struct ndpi_flows_consumer *c;
+  struct ndpi_flow_record record;
+  u_int64_t count = 0, n = 0, dropped = 0;
+  char *shmName = NULL;
+  u_int32_t ring_id;
+  int opt, alive = 1;
+
+  while((opt = getopt(argc, argv, "e:c:h")) != EOF) {
+    switch(opt) {
+    case 'e':
+      shmName = optarg;
+      break;
+
+    case 'c':
+      count = strtoull(optarg, NULL, 10);
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  if(shmName == NULL)
+    help();
+
+  if((c = ndpi_flows_consumer_open(shmName)) == NULL) {
+    printf("ERROR: unable to open flow export segment %s (is ndpiReader -e running?)\n", shmName);
+    return(-1);
+  }
+
+  while((count == 0) || (n < count)) {
+    u_int64_t num_read = 0;
+
+    for(ring_id = 0; ring_id < c->hdr->num_rings; ring_id++) {
+      while(((count == 0) || (n < count)) && ndpi_flows_consumer_read(c, ring_id, &record)) {
+	printRecord(c, ring_id, &record);
+	num_read++, n++;
+      }
+    }
+
+    if(num_read > 0)
+      continue;
+
+    /* one more pass after ndpiReader is gone: the records it wrote last */
+    if(!alive) break;
+    alive = ndpi_flows_consumer_producer_alive(c);
+
+    fflush(stdout);
+    usleep(IDLE_SLEEP_USEC);
+  }
+
+  for(ring_id = 0; ring_id < c->hdr->num_rings; ring_id++)
+    dropped += ndpi_flows_consumer_dropped(c, ring_id);
+
+  printf("%llu records read, %llu dropped by ndpiReader (rings full)\n",
+	 (long long unsigned int)n, (long long unsigned int)dropped);
+
+  ndpi_flows_consumer_close(c);
+
+  return(0);
+}
@@ -0,0 +1,128 @@
+/*
+ * ndpiFlowsConsumer.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#include "ndpi_api.h"
+#include "ndpiFlowsConsumer.h"
+
+/* ***************************************************** */
+
+struct ndpi_flows_consumer* ndpi_flows_consumer_open(const char *name) {
+  struct ndpi_flows_consumer *c;
+  struct ndpi_flows_shm_header *hdr;
+  struct stat st;
+  int fd;
+
+  /* read-write: the consumer advances the tail of the rings */
+  if((fd = shm_open(name, O_RDWR, 0)) < 0)
+    return(NULL);
+
+  if((fstat(fd, &st) != 0)
+     || (st.st_size < (off_t)sizeof(struct ndpi_flows_shm_header))
+     || ((hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    close(fd);
+    return(NULL);
+  }
+
+  close(fd);
+
+  if((hdr->magic != NDPI_FLOWS_SHM_MAGIC)
+     || (hdr->version != NDPI_FLOWS_SHM_VERSION)
+     || (hdr->record_len != sizeof(struct ndpi_flow_record))
+     || (hdr->ring_slots == 0) || ((hdr->ring_slots & (hdr->ring_slots - 1)) != 0)
+     || (hdr->num_protocols > NDPI_FLOWS_NUM_PROTOCOLS)
+     || ((size_t)st.st_size < NDPI_FLOWS_SHM_LEN(hdr->num_rings, hdr->ring_slots))
+     || ((c = (struct ndpi_flows_consumer*)calloc(1, sizeof(struct ndpi_flows_consumer))) == NULL)) {
+    munmap(hdr, st.st_size);
+    return(NULL);
+  }
+
+  c->hdr = hdr, c->len = st.st_size;
+
+  return(c);
+}
+
+/* ***************************************************** */
+
+void ndpi_flows_consumer_close(struct ndpi_flows_consumer *c) {
+  if(c == NULL) return;
+
+  munmap(c->hdr, c->len);
+  free(c);
+}
+
+/* ***************************************************** */
+
+int ndpi_flows_consumer_read(struct ndpi_flows_consumer *c, u_int32_t ring_id,
+			     struct ndpi_flow_record *record) {
+  struct ndpi_flows_ring *ring;
+  u_int64_t tail;
+
+  if(ring_id >= c->hdr->num_rings)
+    return(0);
+
+  ring = NDPI_FLOWS_SHM_RING(c->hdr, ring_id);
+  tail = ring->tail;
+
+  if(tail == ring->head)
+    return(0);
+
+  /* the record is complete once head has been seen past it */
+  ndpi_memory_barrier();
+  memcpy(record, NDPI_FLOWS_RING_RECORD(ring, c->hdr->ring_slots, tail), sizeof(struct ndpi_flow_record));
+
+  /* the slot is handed back to the producer only after the copy */
+  ndpi_memory_barrier();
+  ring->tail = tail + 1;
+
+  return(1);
+}
+
+/* ***************************************************** */
+
+u_int64_t ndpi_flows_consumer_dropped(struct ndpi_flows_consumer *c, u_int32_t ring_id) {
+  if(ring_id >= c->hdr->num_rings)
+    return(0);
+
+  return(NDPI_FLOWS_SHM_RING(c->hdr, ring_id)->dropped);
+}
+
+/* ***************************************************** */
+
+const char* ndpi_flows_consumer_proto_name(struct ndpi_flows_consumer *c, u_int16_t protocol_id) {
+  if(protocol_id >= c->hdr->num_protocols)
+    return("Unknown");
+
+  return(c->hdr->protocol_names[protocol_id]);
+}
+
+/* ***************************************************** */
+
+int ndpi_flows_consumer_producer_alive(struct ndpi_flows_consumer *c) {
+  return((kill(c->hdr->pid, 0) == 0) ? 1 : 0);
+}
@@ -0,0 +1,96 @@
+/*
+ * ndpiFlowsConsumer.h
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __NDPI_FLOWS_CONSUMER_H__
+#define __NDPI_FLOWS_CONSUMER_H__
+
+/*
+  Reading side of the flow records exported by ndpiReader -e <name>.
+  Local applications can build ndpiFlowsConsumer.c with their sources
+  (it only depends on the nDPI headers): each ring must be read by a
+  single consumer at a time.
+*/
+
+#include "ndpiReaderFlows.h"
+
+struct ndpi_flows_consumer {
+  struct ndpi_flows_shm_header *hdr;
+  size_t len;
+};
+
+/**
+ * Map the segment exported by ndpiReader -e <name>
+ *
+ * @par    name = the name of the shared memory segment
+ * @return the consumer or NULL if the segment is missing or incompatible
+ *
+ */
+struct ndpi_flows_consumer* ndpi_flows_consumer_open(const char *name);
+
+/**
+ * Unmap the segment and free the consumer
+ *
+ * @par    c = the consumer
+ *
+ */
+void ndpi_flows_consumer_close(struct ndpi_flows_consumer *c);
+
+/**
+ * Copy the oldest unread record of a ring, if any
+ *
+ * @par    c       = the consumer
+ * @par    ring_id = the ring (reader thread) to read
+ * @par    record  = where the record is copied
+ * @return 1 if a record was copied, 0 if the ring is empty
+ *
+ */
+int ndpi_flows_consumer_read(struct ndpi_flows_consumer *c, u_int32_t ring_id,
+			     struct ndpi_flow_record *record);
+
+/**
+ * Number of records a ring dropped because it was full
+ *
+ * @par    c       = the consumer
+ * @par    ring_id = the ring (reader thread)
+ * @return the number of dropped records
+ *
+ */
+u_int64_t ndpi_flows_consumer_dropped(struct ndpi_flows_consumer *c, u_int32_t ring_id);
+
+/**
+ * Name of a protocol id found in a record protocol stack
+ *
+ * @par    c           = the consumer
+ * @par    protocol_id = the protocol id
+ * @return the protocol name
+ *
+ */
+const char* ndpi_flows_consumer_proto_name(struct ndpi_flows_consumer *c, u_int16_t protocol_id);
+
+/**
+ * Check whether the ndpiReader that created the segment is still running
+ *
+ * @par    c = the consumer
+ * @return 1 if it is running, 0 otherwise (no more records will be written)
+ *
+ */
+int ndpi_flows_consumer_producer_alive(struct ndpi_flows_consumer *c);
+
+#endif /* __NDPI_FLOWS_CONSUMER_H__ */
@@ -47,25 +47,46 @@
 #include "../config.h"
 
 #include "ndpi_api.h"
+#include "ndpiReaderStats.h"
+#include "ndpiReaderFlows.h"
 
 #include <sys/socket.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#if defined(linux) && defined(HAVE_LIBNUMA)
+#include <numa.h>
+#include <numaif.h>
+#define NDPI_READER_NUMA
+#endif
 
 #define MAX_NUM_READER_THREADS     16
+#define TRACE_RING_EVENTS          (1 << 18) /* per thread, 24 bytes each */
 
 /**
  * @brief Set main components necessary to the detection
  * @details TODO
  */
+static void allocThreadInfo(u_int16_t thread_id);
 static void setupDetection(u_int16_t thread_id);
 
 /**
  * Client parameters
  */
 static char *_pcap_file[MAX_NUM_READER_THREADS]; /**< Ingress pcap file/interafaces */
-static FILE *playlist_fp[MAX_NUM_READER_THREADS] = { NULL }; /**< Ingress playlist */
 static char *_bpf_filter      = NULL; /**< bpf filter  */
 static char *_protoFilePath   = NULL; /**< Protocol file path  */
+static char *_snapshotPath    = NULL; /**< Precompiled rules snapshot path  */
 static char *_jsonFilePath    = NULL; /**< JSON file path  */
+static char *_statsShmName    = NULL; /**< Live stats shared memory name  */
+static char *_orderFilePath   = NULL; /**< Pinned dissector order path  */
+static char *_flowsShmName    = NULL; /**< Flow export shared memory name  */
+static char *_traceFilePath   = NULL; /**< Binary trace file prefix  */
+static char *_traceProtocols  = NULL; /**< Protocols traced (all if NULL)  */
+static struct ndpi_stats_shm_header *stats_shm = NULL; /**< Live stats segment */
+static struct ndpi_flows_shm_header *flows_shm = NULL; /**< Flow export segment */
 static json_object *jArray_known_flows, *jArray_unknown_flows;
 static u_int8_t live_capture = 0;
 /**
@@ -84,6 +105,7 @@ static int core_affinity[MAX_NUM_READER_THREADS];
  * Detection parameters
  */
 static u_int32_t detection_tick_resolution = 1000;
+static u_int32_t reorder_interval = 0; /* packets, 0 = registration order */
 static time_t capture_until = 0;
 
 #define IDLE_SCAN_PERIOD           10 /* msec (use detection_tick_resolution = 1000) */
@@ -92,22 +114,10 @@ static time_t capture_until = 0;
 
 #define NUM_ROOTS                 512
 
-static u_int32_t num_flows;
+#define FLOW_CACHE_BITS             8
+#define FLOW_CACHE_SIZE           (1 << FLOW_CACHE_BITS) /* detected flows, per thread */
 
-struct thread_stats {
-  u_int32_t guessed_flow_protocols;
-  u_int64_t raw_packet_count;
-  u_int64_t ip_packet_count;
-  u_int64_t total_wire_bytes, total_ip_bytes, total_discarded_bytes;
-  u_int64_t protocol_counter[NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS + 1];
-  u_int64_t protocol_counter_bytes[NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS + 1];
-  u_int32_t protocol_flows[NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS + 1];
-  u_int32_t ndpi_flow_count;
-  u_int64_t tcp_count, udp_count;
-  u_int64_t mpls_count, pppoe_count, vlan_count, fragmented_count;
-  u_int64_t packet_len[6];
-  u_int16_t max_packet_len;
-};
+static u_int32_t num_flows;
 
 struct reader_thread {
   struct ndpi_detection_module_struct *ndpi_struct;
@@ -121,15 +131,83 @@ struct reader_thread {
   pthread_t pthread;
   int _pcap_datalink_type;
 
-  /* TODO Add barrier */
-  struct thread_stats stats;
+  /* last values published to the live stats segment (-m) */
+  u_int64_t last_stats_publish_time;
+  u_int64_t last_stats_packets, last_stats_bytes;
+
+  /* keep the hot counters off the cache lines of the other fields */
+  struct thread_stats stats __ndpi_stats_aligned;
 
   struct ndpi_flow *idle_flows[IDLE_SCAN_BUDGET];
+
+  /* direct-mapped cache of flows whose detection is completed */
+  struct ndpi_flow *flow_cache[FLOW_CACHE_SIZE];
+
+#ifdef NDPI_READER_NUMA
+  int numa_node; /* -1 when the thread is not bound to a core */
+  u_int32_t numa_local_pages, numa_remote_pages;
+#endif
+
+  /* playlist with -n > 1: packets exchanged with the threads owning their flows */
+  struct packet_batch *out_batch[MAX_NUM_READER_THREADS];
+  pthread_mutex_t inbox_lock;
+  pthread_cond_t inbox_cond;
+  struct packet_batch * volatile inbox_head;
+  struct packet_batch *inbox_tail;
+  u_int32_t inbox_batches;
+};
+
+/*
+  Allocated on the node of the core each thread is bound to (-g). The
+  thread then builds its detection module and flows itself, so that
+  they are first touched on the same node.
+*/
+static struct reader_thread *ndpi_thread_info[MAX_NUM_READER_THREADS];
+
+/* threads wait for each other to be set up before processing packets */
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setup_cond = PTHREAD_COND_INITIALIZER;
+static int num_threads_ready = 0, start_processing = 0;
+
+/*
+  Playlist (-i <file> listing one pcap file per line) processed by
+  several threads. Each flow is owned by the thread selected by a
+  symmetric hash of its tuple, hence flows spanning several files are
+  never split: packets read by another thread are copied into batches
+  and queued to the owner, which processes them between its own packets
+  and while waiting for a file to read.
+
+  The files are read one at a time, in playlist order, by whichever
+  thread is free: the reader flushes its batches before handing over the
+  next file, so every owner sees the packets of its flows in capture
+  order. The queue of each owner is bounded: the reader waits when an
+  owner falls behind.
+*/
+#define ROUTE_BATCH_SIZE          (128 * 1024) /* bytes */
+#define ROUTE_MAX_QUEUED_BATCHES  64 /* per owner: 8 MB */
+
+struct routed_packet {
+  u_int64_t time;
+  u_int16_t ipsize, rawsize;
+  u_int32_t __padding;
+  /* followed by ipsize bytes of IP packet, padded to 8 bytes */
+};
+
+struct packet_batch {
+  struct packet_batch *next;
+  u_int32_t len;
+  u_int8_t data[ROUTE_BATCH_SIZE];
 };
 
-static struct reader_thread ndpi_thread_info[MAX_NUM_READER_THREADS];
+static struct {
+  char **files;
+  u_int32_t num_files, next_file;
+  volatile u_int8_t reading; /* a thread is reading playlist.files[next_file-1] */
+  u_int8_t route_packets; /* more than one thread processes the playlist */
+} playlist;
+
+static pthread_mutex_t playlist_lock = PTHREAD_MUTEX_INITIALIZER;
 
-#define GTP_U_V1_PORT        2152
 #define MAX_NDPI_FLOWS  200000000
 /**
  * @brief ID tracking
@@ -147,14 +225,15 @@ static u_int32_t size_id_struct = 0;		//< ID tracking structure size
 
 // flow tracking
 typedef struct ndpi_flow {
-  u_int32_t lower_ip;
-  u_int32_t upper_ip;
+  /* full 128 bit addresses: IPv4 uses the first word only, the rest is zero */
+  u_int32_t lower_ip[4];
+  u_int32_t upper_ip[4];
   u_int16_t lower_port;
   u_int16_t upper_port;
-  u_int8_t detection_completed, protocol;
-  u_int16_t __padding;
+  u_int8_t ip_version, detection_completed, protocol;
+  u_int8_t __padding;
   struct ndpi_flow_struct *ndpi_flow;
-  char lower_name[32], upper_name[32];
+  char lower_name[48], upper_name[48];
 
   u_int64_t last_seen;
 
@@ -167,26 +246,48 @@ typedef struct ndpi_flow {
   void *src_id, *dst_id;
 } ndpi_flow_t;
 
+static void exportFlow(u_int16_t thread_id, struct ndpi_flow *flow);
+
+// packet addresses and ports, as they appear on the wire
+struct flow_tuple {
+  const u_int32_t *src, *dst;
+  u_int16_t sport, dport;
+  u_int16_t l4_packet_len;
+  u_int8_t ip_version, protocol;
+};
+
 
 static u_int32_t size_flow_struct = 0;
 
 static void help(u_int long_help) {
   printf("ndpiReader -i <file|device> [-f <filter>][-s <duration>]\n"
-	 "          [-p <protos>][-l <loops>[-d][-h][-t][-v <level>]\n"
-	 "          [-n <threads>] [-j <file>]\n\n"
+	 "          [-p <protos>|-S <snapshot>][-l <loops>[-d][-h][-t][-v <level>]\n"
+	 "          [-n <threads>] [-j <file>] [-m <name>] [-e <name>] [-o <packets>|-O <file>]\n"
+	 "          [-T <file> [-E <protos>]]\n\n"
 	 "Usage:\n"
 	 "  -i <file.pcap|device>     | Specify a pcap file/playlist to read packets from or a device for live capture (comma-separated list)\n"
 	 "  -f <BPF filter>           | Specify a BPF filter for filtering selected traffic\n"
 	 "  -s <duration>             | Maximum capture duration in seconds (live traffic capture only)\n"
 	 "  -p <file>.protos          | Specify a protocol file (eg. protos.txt)\n"
+	 "  -S <file>                 | Specify a rules snapshot created with ndpiSnapshot\n"
 	 "  -l <num loops>            | Number of detection loops (test only)\n"
-	 "  -n <num threads>          | Number of threads. Default: number of interfaces in -i. Ignored with pcap files.\n"
+	 "  -n <num threads>          | Number of threads. Default: number of interfaces in -i. Ignored with a single pcap file:\n"
+	 "                            | with a playlist its files are read in order and flows are split by tuple hash\n"
 	 "  -j <file.json>            | Specify a file to write the content of packets in .json format\n"
+	 "  -o <packets>              | Reorder the dissectors by hit rate every <packets> packets\n"
+	 "  -O <file>                 | Pin the dissector order printed by -o (\"tcp|udp <proto> ...\" lines)\n"
+	 "  -T <file>                 | Record a binary trace, written to <file>.<thread id> at exit (see ndpiTrace)\n"
+	 "  -E <proto,...>            | Trace only these protocols (Unknown for the packet events). Default: all\n"
+#ifndef WIN32
+	 "  -m <name>                 | Publish live statistics in the shared memory segment <name> (see ndpiStats)\n"
+	 "  -e <name>                 | Export the flows, once detected, to the shared memory rings <name> (see ndpiFlows)\n"
+#endif
 #ifdef linux
-         "  -g <id:id...>             | Thread affinity mask (one core id per thread)\n"
+         "  -g <id:id...>             | Thread affinity mask (one core id per thread). The state of\n"
+         "                            | each thread is allocated on the NUMA node of its core\n"
 #endif
 	 "  -d                        | Disable protocol guess and use only DPI\n"
-	 "  -t                        | Dissect GTP tunnels\n"
+	 "  -t                        | Decapsulate tunnels (GTP-U, GRE, VXLAN, IP-in-IP, MPLS)\n"
 	 "  -h                        | This help\n"
 	 "  -v <1|2>                  | Verbose 'unknown protocol' packet print. 1=verbose, 2=very verbose\n"
 	 "  -V <1|2>                  | Verbose nDPI trace log print. 1=trace, 2=debug\n");
@@ -194,8 +295,9 @@ static void help(u_int long_help) {
   if(long_help) {
     printf("\n\nSupported protocols:\n");
     num_threads = 1;
+    allocThreadInfo(0);
     setupDetection(0);
-    ndpi_dump_protocols(ndpi_thread_info[0].ndpi_struct);
+    ndpi_dump_protocols(ndpi_thread_info[0]->ndpi_struct);
   }
 
   exit(!long_help);
@@ -210,7 +312,7 @@ static void parseOptions(int argc, char **argv) {
   u_int num_cores = sysconf( _SC_NPROCESSORS_ONLN );
 #endif
 
-  while ((opt = getopt(argc, argv, "df:g:i:hp:l:s:tv:V:n:j:")) != EOF) {
+  while ((opt = getopt(argc, argv, "de:E:f:g:i:hp:l:m:o:O:s:S:tT:v:V:n:j:")) != EOF) {
     switch (opt) {
     case 'd':
       enable_protocol_guess = 0;
@@ -232,10 +334,30 @@ static void parseOptions(int argc, char **argv) {
       num_loops = atoi(optarg);
       break;
 
+    case 'm':
+      _statsShmName = optarg;
+      break;
+
+    case 'e':
+      _flowsShmName = optarg;
+      break;
+
+    case 'E':
+      _traceProtocols = optarg;
+      break;
+
     case 'n':
       num_threads = atoi(optarg);
       break;
 
+    case 'o':
+      reorder_interval = atoi(optarg);
+      break;
+
+    case 'O':
+      _orderFilePath = optarg;
+      break;
+
     case 'p':
       _protoFilePath = optarg;
       break;
@@ -244,10 +366,18 @@ static void parseOptions(int argc, char **argv) {
       capture_until = atoi(optarg);
       break;
 
+    case 'S':
+      _snapshotPath = optarg;
+      break;
+
     case 't':
       decode_tunnels = 1;
       break;
 
+    case 'T':
+      _traceFilePath = optarg;
+      break;
+
     case 'v':
       verbose = atoi(optarg);
       break;
@@ -437,7 +567,7 @@ static void printFlow(u_int16_t thread_id, struct ndpi_flow *flow) {
 
   printf("[proto: %u/%s][%u pkts/%u bytes][%s]\n",
 	 flow->detected_protocol,
-	 ndpi_get_proto_name(ndpi_thread_info[thread_id].ndpi_struct, flow->detected_protocol),
+	 ndpi_get_proto_name(ndpi_thread_info[thread_id]->ndpi_struct, flow->detected_protocol),
 	 flow->packets, flow->bytes,
 	 flow->host_server_name);
 #endif
@@ -450,7 +580,7 @@ static void printFlow(u_int16_t thread_id, struct ndpi_flow *flow) {
     json_object_object_add(jObj,"host_b.name",json_object_new_string(flow->upper_name));
     json_object_object_add(jObj,"host_n.port",json_object_new_int(ntohs(flow->upper_port)));
     json_object_object_add(jObj,"detected.protocol",json_object_new_int(flow->detected_protocol));
-    json_object_object_add(jObj,"detected.protocol.name",json_object_new_string(ndpi_get_proto_name(ndpi_thread_info[thread_id].ndpi_struct, flow->detected_protocol)));
+    json_object_object_add(jObj,"detected.protocol.name",json_object_new_string(ndpi_get_proto_name(ndpi_thread_info[thread_id]->ndpi_struct, flow->detected_protocol)));
     json_object_object_add(jObj,"packets",json_object_new_int(flow->packets));
     json_object_object_add(jObj,"bytes",json_object_new_int(flow->bytes));
     
@@ -466,10 +596,31 @@ static void printFlow(u_int16_t thread_id, struct ndpi_flow *flow) {
 
 /* ***************************************************** */
 
+/* DNS responses: the IPv4 answers follow the query name (name@a.b.c.d;e.f.g.h) */
+static void appendDNSAddresses(struct ndpi_flow *flow) {
+  struct ndpi_flow_struct *ndpi_flow = flow->ndpi_flow;
+  u_int len = strlen(flow->host_server_name), i, num_addresses = 0;
+  char buf[32];
+
+  for(i = 0; (i < ndpi_flow->protos.dns.num_records) && (len < sizeof(flow->host_server_name) - 1); i++) {
+    ndpi_dns_record_t *r = &ndpi_flow->protos.dns.records[i];
+    u_int32_t addr;
+
+    if(r->rsp_type != NDPI_DNS_TYPE_A)
+      continue;
+
+    memcpy(&addr, &ndpi_flow->protos.dns.rdata[r->data_offset], sizeof(addr));
+    len += snprintf(&flow->host_server_name[len], sizeof(flow->host_server_name) - len, "%s%s",
+		    (num_addresses++ == 0) ? "@" : ";", intoaV4(ntohl(addr), buf, sizeof(buf)));
+  }
+}
+
+/* ***************************************************** */
+
 static void free_ndpi_flow(struct ndpi_flow *flow) {
-  if(flow->ndpi_flow) { ndpi_free(flow->ndpi_flow); flow->ndpi_flow = NULL; }
-  if(flow->src_id)    { ndpi_free(flow->src_id); flow->src_id = NULL;       }
-  if(flow->dst_id)    { ndpi_free(flow->dst_id); flow->dst_id = NULL;       }
+  if(flow->ndpi_flow) { ndpi_free_tag(flow->ndpi_flow); flow->ndpi_flow = NULL; }
+  if(flow->src_id)    { ndpi_free_id_state(flow->src_id); ndpi_free_tag(flow->src_id); flow->src_id = NULL; }
+  if(flow->dst_id)    { ndpi_free_id_state(flow->dst_id); ndpi_free_tag(flow->dst_id); flow->dst_id = NULL; }
 }
 
 /* ***************************************************** */
@@ -483,20 +634,67 @@ static void ndpi_flow_freer(void *node) {
 
 /* ***************************************************** */
 
+/*
+  The slot only depends on the sum of the two endpoints, so both
+  directions of a flow (and its canonical lower/upper key) map to it.
+*/
+static u_int32_t flow_cache_slot(u_int8_t ip_version, u_int8_t protocol,
+				 const u_int32_t *a, const u_int32_t *b,
+				 u_int16_t port_a, u_int16_t port_b) {
+  u_int32_t h = protocol + port_a + port_b;
+
+  h += a[0] + b[0];
+  if(ip_version == 6)
+    h += a[1] + b[1] + a[2] + b[2] + a[3] + b[3];
+
+  return((h * 0x9E3779B1) >> (32 - FLOW_CACHE_BITS));
+}
+
+/* ***************************************************** */
+
+static int flow_tuple_match(const struct ndpi_flow *flow, const struct flow_tuple *t) {
+  size_t addr_len = (t->ip_version == 4) ? 4 : 16;
+
+  if((flow->ip_version != t->ip_version) || (flow->protocol != t->protocol))
+    return(0);
+
+  if((flow->lower_port == t->sport) && (flow->upper_port == t->dport)
+     && (memcmp(flow->lower_ip, t->src, addr_len) == 0)
+     && (memcmp(flow->upper_ip, t->dst, addr_len) == 0))
+    return(1);
+
+  return((flow->lower_port == t->dport) && (flow->upper_port == t->sport)
+	 && (memcmp(flow->lower_ip, t->dst, addr_len) == 0)
+	 && (memcmp(flow->upper_ip, t->src, addr_len) == 0));
+}
+
+/* ***************************************************** */
+
+static void flow_cache_evict(u_int16_t thread_id, struct ndpi_flow *flow) {
+  u_int32_t slot = flow_cache_slot(flow->ip_version, flow->protocol, flow->lower_ip, flow->upper_ip,
+				   flow->lower_port, flow->upper_port);
+
+  if(ndpi_thread_info[thread_id]->flow_cache[slot] == flow)
+    ndpi_thread_info[thread_id]->flow_cache[slot] = NULL;
+}
+
+/* ***************************************************** */
+
 static void node_idle_scan_walker(const void *node, ndpi_VISIT which, int depth, void *user_data) {
   struct ndpi_flow *flow = *(struct ndpi_flow **) node;
   u_int16_t thread_id = *((u_int16_t *) user_data);
 
-  if(ndpi_thread_info[thread_id].num_idle_flows == IDLE_SCAN_BUDGET) /* TODO optimise with a budget-based walk */
+  if(ndpi_thread_info[thread_id]->num_idle_flows == IDLE_SCAN_BUDGET) /* TODO optimise with a budget-based walk */
     return;
 
   if((which == ndpi_preorder) || (which == ndpi_leaf)) { /* Avoid walking the same node multiple times */
-    if(flow->last_seen + MAX_IDLE_TIME < ndpi_thread_info[thread_id].last_time) {
+    if(flow->last_seen + MAX_IDLE_TIME < ndpi_thread_info[thread_id]->last_time) {
+      flow_cache_evict(thread_id, flow);
       free_ndpi_flow(flow);
-      ndpi_thread_info[thread_id].stats.ndpi_flow_count--;
+      ndpi_thread_info[thread_id]->stats.ndpi_flow_count--;
 
       /* adding to a queue (we can't delete it from the tree inline ) */
-      ndpi_thread_info[thread_id].idle_flows[ndpi_thread_info[thread_id].num_idle_flows++] = flow;
+      ndpi_thread_info[thread_id]->idle_flows[ndpi_thread_info[thread_id]->num_idle_flows++] = flow;
     }
   }
 }
@@ -537,17 +735,35 @@ static void node_print_known_proto_walker(const void *node, ndpi_VISIT which, in
 
 /* ***************************************************** */
 
+/* Moves the packets, bytes and flow already counted to the new protocol of the flow */
+static void set_flow_protocol(u_int16_t thread_id, struct ndpi_flow *flow, u_int32_t protocol) {
+  struct thread_stats *stats = &ndpi_thread_info[thread_id]->stats;
+
+  if(protocol == flow->detected_protocol)
+    return;
+
+  stats->protocol_counter[flow->detected_protocol] -= flow->packets, stats->protocol_counter[protocol] += flow->packets;
+  stats->protocol_counter_bytes[flow->detected_protocol] -= flow->bytes, stats->protocol_counter_bytes[protocol] += flow->bytes;
+  stats->protocol_flows[flow->detected_protocol]--, stats->protocol_flows[protocol]++;
+
+  flow->detected_protocol = protocol;
+}
+
+/* ***************************************************** */
+
 static unsigned int node_guess_undetected_protocol(u_int16_t thread_id,
 						   struct ndpi_flow *flow) {
-  flow->detected_protocol = ndpi_guess_undetected_protocol(ndpi_thread_info[thread_id].ndpi_struct,
-							   flow->protocol,
-							   ntohl(flow->lower_ip),
-							   ntohs(flow->lower_port),
-							   ntohl(flow->upper_ip),
-							   ntohs(flow->upper_port));
+  /* the library guesses on IPv4 addresses only: IPv6 flows are guessed by port */
+  set_flow_protocol(thread_id, flow,
+		    ndpi_guess_undetected_protocol(ndpi_thread_info[thread_id]->ndpi_struct,
+						   flow->protocol,
+						   (flow->ip_version == 4) ? ntohl(flow->lower_ip[0]) : 0,
+						   ntohs(flow->lower_port),
+						   (flow->ip_version == 4) ? ntohl(flow->upper_ip[0]) : 0,
+						   ntohs(flow->upper_port)));
   // printf("Guess state: %u\n", flow->detected_protocol);
   if(flow->detected_protocol != 0)
-    ndpi_thread_info[thread_id].stats.guessed_flow_protocols++;
+    ndpi_thread_info[thread_id]->stats.guessed_flow_protocols++;
 
   return flow->detected_protocol;
 }
@@ -576,10 +792,20 @@ static void node_proto_guess_walker(const void *node, ndpi_VISIT which, int dept
       }
     }
 
-    ndpi_thread_info[thread_id].stats.protocol_counter[flow->detected_protocol]       += flow->packets;
-    ndpi_thread_info[thread_id].stats.protocol_counter_bytes[flow->detected_protocol] += flow->bytes;
-    ndpi_thread_info[thread_id].stats.protocol_flows[flow->detected_protocol]++;
+    /* protocol counters are updated by packet_processing() */
+  }
+}
+
+/* ***************************************************** */
+
+static int node_addr_cmp(const u_int32_t *a, const u_int32_t *b) {
+  int i;
+
+  for(i=0; i<4; i++) {
+    if(a[i] < b[i]) return(-1); else { if(a[i] > b[i]) return(1); }
   }
+
+  return(0);
 }
 
 /* ***************************************************** */
@@ -587,10 +813,12 @@ static void node_proto_guess_walker(const void *node, ndpi_VISIT which, int dept
 static int node_cmp(const void *a, const void *b) {
   struct ndpi_flow *fa = (struct ndpi_flow*)a;
   struct ndpi_flow *fb = (struct ndpi_flow*)b;
+  int rc;
 
-  if(fa->lower_ip   < fb->lower_ip  ) return(-1); else { if(fa->lower_ip   > fb->lower_ip  ) return(1); }
+  if(fa->ip_version < fb->ip_version) return(-1); else { if(fa->ip_version > fb->ip_version) return(1); }
+  if((rc = node_addr_cmp(fa->lower_ip, fb->lower_ip)) != 0) return(rc);
   if(fa->lower_port < fb->lower_port) return(-1); else { if(fa->lower_port > fb->lower_port) return(1); }
-  if(fa->upper_ip   < fb->upper_ip  ) return(-1); else { if(fa->upper_ip   > fb->upper_ip  ) return(1); }
+  if((rc = node_addr_cmp(fa->upper_ip, fb->upper_ip)) != 0) return(rc);
   if(fa->upper_port < fb->upper_port) return(-1); else { if(fa->upper_port > fb->upper_port) return(1); }
   if(fa->protocol   < fb->protocol  ) return(-1); else { if(fa->protocol   > fb->protocol  ) return(1); }
 
@@ -599,6 +827,86 @@ static int node_cmp(const void *a, const void *b) {
 
 /* ***************************************************** */
 
+/*
+  Multiplicative hash over the whole (canonical) flow key: unlike a plain
+  sum it keeps IPv6 addresses that differ only in their prefix, or whose
+  words just swap, in different roots.
+*/
+static u_int32_t node_hash(const struct ndpi_flow *flow) {
+  u_int32_t h = flow->protocol, i;
+
+#define NODE_HASH_MIX(h, w) { h ^= (w); h *= 0x9E3779B1; h ^= h >> 16; }
+  for(i=0; i<4; i++) {
+    if((flow->ip_version == 4) && (i > 0)) break; /* the other words are zero */
+
+    NODE_HASH_MIX(h, flow->lower_ip[i]);
+    NODE_HASH_MIX(h, flow->upper_ip[i]);
+  }
+
+  NODE_HASH_MIX(h, ((u_int32_t)flow->lower_port << 16) | flow->upper_port);
+#undef NODE_HASH_MIX
+
+  return(h);
+}
+
+/* ***************************************************** */
+
+static void update_l4_stats(u_int16_t thread_id, u_int8_t l4_proto, u_int16_t l4_packet_len) {
+  if(l4_packet_len < 64)
+    ndpi_thread_info[thread_id]->stats.packet_len[0]++;
+  else if(l4_packet_len >= 64 && l4_packet_len < 128)
+    ndpi_thread_info[thread_id]->stats.packet_len[1]++;
+  else if(l4_packet_len >= 128 && l4_packet_len < 256)
+    ndpi_thread_info[thread_id]->stats.packet_len[2]++;
+  else if(l4_packet_len >= 256 && l4_packet_len < 1024)
+    ndpi_thread_info[thread_id]->stats.packet_len[3]++;
+  else if(l4_packet_len >= 1024 && l4_packet_len < 1500)
+    ndpi_thread_info[thread_id]->stats.packet_len[4]++;
+  else if(l4_packet_len >= 1500)
+    ndpi_thread_info[thread_id]->stats.packet_len[5]++;
+
+  if(l4_packet_len > ndpi_thread_info[thread_id]->stats.max_packet_len)
+    ndpi_thread_info[thread_id]->stats.max_packet_len = l4_packet_len;
+
+  if(l4_proto == 6 && l4_packet_len >= 20)
+    ndpi_thread_info[thread_id]->stats.tcp_count++;
+  else if(l4_proto == 17 && l4_packet_len >= 8)
+    ndpi_thread_info[thread_id]->stats.udp_count++;
+}
+
+/* ***************************************************** */
+
+/* Same checks and port extraction as get_ndpi_flow(), without the lookup */
+static int get_flow_tuple(const struct ndpi_iphdr *iph, const struct ndpi_ip6_hdr *iph6,
+			  u_int16_t ipsize, struct flow_tuple *t) {
+  const u_int8_t *l4;
+
+  if(iph) {
+    if((ipsize < 20) || ((iph->ihl * 4) > ipsize) || (ipsize < ntohs(iph->tot_len))
+       || ((iph->frag_off & htons(0x1FFF)) != 0))
+      return(0);
+
+    t->ip_version = 4, t->protocol = iph->protocol;
+    t->src = &iph->saddr, t->dst = &iph->daddr;
+    t->l4_packet_len = ntohs(iph->tot_len) - (iph->ihl * 4);
+    l4 = (const u_int8_t*)iph + (iph->ihl * 4);
+  } else {
+    t->ip_version = 6, t->protocol = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    t->src = (const u_int32_t*)&iph6->ip6_src, t->dst = (const u_int32_t*)&iph6->ip6_dst;
+    t->l4_packet_len = ntohs(iph6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    l4 = (const u_int8_t*)iph6 + sizeof(struct ndpi_ip6_hdr);
+  }
+
+  if((t->protocol == 6 && t->l4_packet_len >= 20) || (t->protocol == 17 && t->l4_packet_len >= 8))
+    t->sport = get_u_int16_t(l4, 0), t->dport = get_u_int16_t(l4, 2);
+  else
+    t->sport = t->dport = 0;
+
+  return(1);
+}
+
+/* ***************************************************** */
+
 static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
 				       const u_int8_t version,
 				       const struct ndpi_iphdr *iph,
@@ -612,18 +920,16 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
   u_int32_t idx, l4_offset;
   struct ndpi_tcphdr *tcph = NULL;
   struct ndpi_udphdr *udph = NULL;
-  u_int32_t lower_ip;
-  u_int32_t upper_ip;
+  u_int32_t saddr[4] = { 0 }, daddr[4] = { 0 };
+  const u_int32_t *lower_ip, *upper_ip;
   u_int16_t lower_port;
   u_int16_t upper_port;
+  u_int8_t l4_proto;
+  int addr_cmp;
   struct ndpi_flow flow;
   void *ret;
   u_int8_t *l3;
 
-  /*
-    Note: to keep things simple (ndpiReader is just a demo app)
-    we handle IPv6 a-la-IPv4.
-  */
   if(version == 4) {
     if(ipsize < 20)
       return NULL;
@@ -634,50 +940,41 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
 
     l4_offset = iph->ihl * 4;
     l3 = (u_int8_t*)iph;
+    l4_proto = iph->protocol;
+    saddr[0] = iph->saddr, daddr[0] = iph->daddr;
   } else {
     l4_offset = sizeof(struct ndpi_ip6_hdr);
     l3 = (u_int8_t*)iph6;
+    l4_proto = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    memcpy(saddr, &iph6->ip6_src, sizeof(saddr));
+    memcpy(daddr, &iph6->ip6_dst, sizeof(daddr));
   }
 
-  if(l4_packet_len < 64)
-    ndpi_thread_info[thread_id].stats.packet_len[0]++;
-  else if(l4_packet_len >= 64 && l4_packet_len < 128)
-    ndpi_thread_info[thread_id].stats.packet_len[1]++;
-  else if(l4_packet_len >= 128 && l4_packet_len < 256)
-    ndpi_thread_info[thread_id].stats.packet_len[2]++;
-  else if(l4_packet_len >= 256 && l4_packet_len < 1024)
-    ndpi_thread_info[thread_id].stats.packet_len[3]++;
-  else if(l4_packet_len >= 1024 && l4_packet_len < 1500)
-    ndpi_thread_info[thread_id].stats.packet_len[4]++;
-  else if(l4_packet_len >= 1500)
-    ndpi_thread_info[thread_id].stats.packet_len[5]++;
+  update_l4_stats(thread_id, l4_proto, l4_packet_len);
 
-  if(l4_packet_len > ndpi_thread_info[thread_id].stats.max_packet_len)
-    ndpi_thread_info[thread_id].stats.max_packet_len = l4_packet_len;
+  addr_cmp = node_addr_cmp(saddr, daddr);
 
-  if(iph->saddr < iph->daddr) {
-    lower_ip = iph->saddr;
-    upper_ip = iph->daddr;
+  if(addr_cmp < 0) {
+    lower_ip = saddr;
+    upper_ip = daddr;
   } else {
-    lower_ip = iph->daddr;
-    upper_ip = iph->saddr;
+    lower_ip = daddr;
+    upper_ip = saddr;
   }
 
-  *proto = iph->protocol;
-
-  if(iph->protocol == 6 && l4_packet_len >= 20) {
-    ndpi_thread_info[thread_id].stats.tcp_count++;
+  *proto = l4_proto;
 
+  if(l4_proto == 6 && l4_packet_len >= 20) {
     // tcp
     tcph = (struct ndpi_tcphdr *) ((u_int8_t *) l3 + l4_offset);
-    if(iph->saddr < iph->daddr) {
+    if(addr_cmp < 0) {
       lower_port = tcph->source;
       upper_port = tcph->dest;
     } else {
       lower_port = tcph->dest;
       upper_port = tcph->source;
 
-      if(iph->saddr == iph->daddr) {
+      if(addr_cmp == 0) {
 	if(lower_port > upper_port) {
 	  u_int16_t p = lower_port;
 
@@ -686,12 +983,10 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
 	}
       }
     }
-  } else if(iph->protocol == 17 && l4_packet_len >= 8) {
+  } else if(l4_proto == 17 && l4_packet_len >= 8) {
     // udp
-    ndpi_thread_info[thread_id].stats.udp_count++;
-
     udph = (struct ndpi_udphdr *) ((u_int8_t *) l3 + l4_offset);
-    if(iph->saddr < iph->daddr) {
+    if(addr_cmp < 0) {
       lower_port = udph->source;
       upper_port = udph->dest;
     } else {
@@ -704,19 +999,16 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
     upper_port = 0;
   }
 
-  flow.protocol = iph->protocol;
-  flow.lower_ip = lower_ip, flow.upper_ip = upper_ip;
+  flow.ip_version = version, flow.protocol = l4_proto;
+  memcpy(flow.lower_ip, lower_ip, sizeof(flow.lower_ip));
+  memcpy(flow.upper_ip, upper_ip, sizeof(flow.upper_ip));
   flow.lower_port = lower_port, flow.upper_port = upper_port;
 
-  if(0)
-    printf("[NDPI] [%u][%u:%u <-> %u:%u]\n",
-	   iph->protocol, lower_ip, ntohs(lower_port), upper_ip, ntohs(upper_port));
-
-  idx = (lower_ip + upper_ip + iph->protocol + lower_port + upper_port) % NUM_ROOTS;
-  ret = ndpi_tfind(&flow, &ndpi_thread_info[thread_id].ndpi_flows_root[idx], node_cmp);
+  idx = node_hash(&flow) % NUM_ROOTS;
+  ret = ndpi_tfind(&flow, &ndpi_thread_info[thread_id]->ndpi_flows_root[idx], node_cmp);
 
   if(ret == NULL) {
-    if(ndpi_thread_info[thread_id].stats.ndpi_flow_count == MAX_NDPI_FLOWS) {
+    if(ndpi_thread_info[thread_id]->stats.ndpi_flow_count == MAX_NDPI_FLOWS) {
       printf("ERROR: maximum flow count (%u) has been exceeded\n", MAX_NDPI_FLOWS);
       exit(-1);
     } else {
@@ -728,35 +1020,31 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
       }
 
       memset(newflow, 0, sizeof(struct ndpi_flow));
-      newflow->protocol = iph->protocol;
-      newflow->lower_ip = lower_ip, newflow->upper_ip = upper_ip;
+      newflow->ip_version = version, newflow->protocol = l4_proto;
+      memcpy(newflow->lower_ip, lower_ip, sizeof(newflow->lower_ip));
+      memcpy(newflow->upper_ip, upper_ip, sizeof(newflow->upper_ip));
       newflow->lower_port = lower_port, newflow->upper_port = upper_port;
 
-      if(version == 4) {
-	inet_ntop(AF_INET, &lower_ip, newflow->lower_name, sizeof(newflow->lower_name));
-	inet_ntop(AF_INET, &upper_ip, newflow->upper_name, sizeof(newflow->upper_name));
-      } else {
-	inet_ntop(AF_INET6, &iph6->ip6_src, newflow->lower_name, sizeof(newflow->lower_name));
-	inet_ntop(AF_INET6, &iph6->ip6_dst, newflow->upper_name, sizeof(newflow->upper_name));
-      }
+      inet_ntop((version == 4) ? AF_INET : AF_INET6, newflow->lower_ip, newflow->lower_name, sizeof(newflow->lower_name));
+      inet_ntop((version == 4) ? AF_INET : AF_INET6, newflow->upper_ip, newflow->upper_name, sizeof(newflow->upper_name));
 
-      if((newflow->ndpi_flow = calloc(1, size_flow_struct)) == NULL) {
+      if((newflow->ndpi_flow = ndpi_calloc_tag(1, size_flow_struct, NDPI_MEM_FLOWS)) == NULL) {
 	printf("[NDPI] %s(2): not enough memory\n", __FUNCTION__);
 	return(NULL);
       }
 
-      if((newflow->src_id = calloc(1, size_id_struct)) == NULL) {
+      if((newflow->src_id = ndpi_calloc_tag(1, size_id_struct, NDPI_MEM_FLOWS)) == NULL) {
 	printf("[NDPI] %s(3): not enough memory\n", __FUNCTION__);
 	return(NULL);
       }
 
-      if((newflow->dst_id = calloc(1, size_id_struct)) == NULL) {
+      if((newflow->dst_id = ndpi_calloc_tag(1, size_id_struct, NDPI_MEM_FLOWS)) == NULL) {
 	printf("[NDPI] %s(4): not enough memory\n", __FUNCTION__);
 	return(NULL);
       }
       
-      ndpi_tsearch(newflow, &ndpi_thread_info[thread_id].ndpi_flows_root[idx], node_cmp); /* Add */
-      ndpi_thread_info[thread_id].stats.ndpi_flow_count++;
+      ndpi_tsearch(newflow, &ndpi_thread_info[thread_id]->ndpi_flows_root[idx], node_cmp); /* Add */
+      ndpi_thread_info[thread_id]->stats.ndpi_flow_count++;
 
       *src = newflow->src_id, *dst = newflow->dst_id;
 
@@ -767,7 +1055,7 @@ static struct ndpi_flow *get_ndpi_flow(u_int16_t thread_id,
   } else {
     struct ndpi_flow *flow = *(struct ndpi_flow**)ret;
 
-    if(flow->lower_ip == lower_ip && flow->upper_ip == upper_ip
+    if(node_addr_cmp(flow->lower_ip, lower_ip) == 0 && node_addr_cmp(flow->upper_ip, upper_ip) == 0
        && flow->lower_port == lower_port && flow->upper_port == upper_port)
       *src = flow->src_id, *dst = flow->dst_id;
     else
@@ -785,14 +1073,7 @@ static struct ndpi_flow *get_ndpi_flow6(u_int16_t thread_id,
 					struct ndpi_id_struct **src,
 					struct ndpi_id_struct **dst,
 					u_int8_t *proto) {
-  struct ndpi_iphdr iph;
-
-  memset(&iph, 0, sizeof(iph));
-  iph.version = 4;
-  iph.saddr = iph6->ip6_src.__u6_addr.__u6_addr32[2] + iph6->ip6_src.__u6_addr.__u6_addr32[3];
-  iph.daddr = iph6->ip6_dst.__u6_addr.__u6_addr32[2] + iph6->ip6_dst.__u6_addr.__u6_addr32[3];
-  iph.protocol = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-  return(get_ndpi_flow(thread_id, 6, &iph, ip_offset,
+  return(get_ndpi_flow(thread_id, 6, NULL, ip_offset,
 		       sizeof(struct ndpi_ip6_hdr),
 		       ntohs(iph6->ip6_ctlun.ip6_un1.ip6_un1_plen),
 		       src, dst, proto, iph6));
@@ -800,33 +1081,197 @@ static struct ndpi_flow *get_ndpi_flow6(u_int16_t thread_id,
 
 /* ***************************************************** */
 
+static void allocThreadInfo(u_int16_t thread_id) {
+  struct reader_thread *t = NULL;
+#ifdef NDPI_READER_NUMA
+  int node = -1;
+
+  if((core_affinity[thread_id] >= 0) && (numa_available() >= 0)
+     && ((node = numa_node_of_cpu(core_affinity[thread_id])) >= 0)) {
+    /* pages are zeroed and bound to the node */
+    if((t = (struct reader_thread*)numa_alloc_onnode(sizeof(struct reader_thread), node)) == NULL)
+      node = -1;
+  }
+#endif
+
+  if(t == NULL) {
+    /* the stats must not share their cache lines: honour their alignment */
+#ifdef WIN32
+    t = (struct reader_thread*)malloc(sizeof(struct reader_thread));
+#else
+    if(posix_memalign((void**)&t, NDPI_STATS_CACHE_LINE, sizeof(struct reader_thread)) != 0)
+      t = NULL;
+#endif
+
+    if(t == NULL) {
+      printf("ERROR: not enough memory for thread %u\n", thread_id);
+      exit(-1);
+    }
+
+    memset(t, 0, sizeof(struct reader_thread));
+  }
+
+#ifdef NDPI_READER_NUMA
+  t->numa_node = node;
+#endif
+  pthread_mutex_init(&t->inbox_lock, NULL);
+  pthread_cond_init(&t->inbox_cond, NULL);
+  ndpi_thread_info[thread_id] = t;
+}
+
+/* ***************************************************** */
+
+static void freeThreadInfo(u_int16_t thread_id) {
+  struct reader_thread *t = ndpi_thread_info[thread_id];
+
+  if(t == NULL) return;
+
+  pthread_mutex_destroy(&t->inbox_lock);
+  pthread_cond_destroy(&t->inbox_cond);
+
+#ifdef NDPI_READER_NUMA
+  if(t->numa_node >= 0)
+    numa_free(t, sizeof(struct reader_thread));
+  else
+#endif
+    free(t);
+
+  ndpi_thread_info[thread_id] = NULL;
+}
+
+/* ***************************************************** */
+
+/* Lines "tcp <proto> <proto> ..." and "udp <proto> ...", as printed by printDissectorOrder() */
+static void loadDissectorOrder(u_int16_t thread_id) {
+  struct ndpi_detection_module_struct *ndpi_struct = ndpi_thread_info[thread_id]->ndpi_struct;
+  u_int16_t protocol_ids[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
+  char line[4096], *proto, *tok;
+  u_int32_t num_ids;
+  u_int8_t l4_proto;
+  FILE *fd;
+
+  if((fd = fopen(_orderFilePath, "r")) == NULL) {
+    printf("ERROR: unable to open dissector order file %s\n", _orderFilePath);
+    exit(-1);
+  }
+
+  while(fgets(line, sizeof(line), fd) != NULL) {
+    if((proto = strtok_r(line, " \t\r\n", &tok)) == NULL) continue;
+
+    if(strcasecmp(proto, "tcp") == 0)      l4_proto = IPPROTO_TCP;
+    else if(strcasecmp(proto, "udp") == 0) l4_proto = IPPROTO_UDP;
+    else continue;
+
+    for(num_ids = 0; ((proto = strtok_r(NULL, " \t\r\n", &tok)) != NULL)
+	  && (num_ids < NDPI_MAX_SUPPORTED_PROTOCOLS + 1); ) {
+      int id = ndpi_get_protocol_id(ndpi_struct, proto);
+
+      if(id < 0)
+	printf("WARNING: unknown protocol %s in %s\n", proto, _orderFilePath);
+      else
+	protocol_ids[num_ids++] = id;
+    }
+
+    ndpi_set_dissector_order(ndpi_struct, l4_proto, protocol_ids, num_ids);
+  }
+
+  fclose(fd);
+}
+
+/* ***************************************************** */
+
+static void enableTrace(u_int16_t thread_id) {
+  struct ndpi_detection_module_struct *ndpi_struct = ndpi_thread_info[thread_id]->ndpi_struct;
+  NDPI_PROTOCOL_BITMASK protocols;
+  char *list, *name, *where;
+  int protocol_id;
+
+  if(ndpi_trace_enable(ndpi_struct, TRACE_RING_EVENTS) != 0) {
+    printf("ERROR: unable to allocate the trace ring\n");
+    exit(-1);
+  }
+
+  if(_traceProtocols == NULL)
+    return;
+
+  if((list = strdup(_traceProtocols)) == NULL) {
+    printf("ERROR: not enough memory\n");
+    exit(-1);
+  }
+
+  NDPI_BITMASK_RESET(protocols);
+
+  for(name = strtok_r(list, ",", &where); name != NULL; name = strtok_r(NULL, ",", &where)) {
+    if((protocol_id = ndpi_get_protocol_id(ndpi_struct, name)) < 0) {
+      printf("ERROR: unknown protocol %s in -E\n", name);
+      exit(-1);
+    }
+
+    NDPI_ADD_PROTOCOL_TO_BITMASK(protocols, protocol_id);
+  }
+
+  free(list);
+  ndpi_trace_set_protocols(ndpi_struct, &protocols);
+}
+
+/* ***************************************************** */
+
+static void dumpTrace(u_int16_t thread_id) {
+  char path[256];
+
+  snprintf(path, sizeof(path), "%s.%u", _traceFilePath, thread_id);
+
+  if((ndpi_trace_dump(ndpi_thread_info[thread_id]->ndpi_struct, path) == 0) && (!json_flag))
+    printf("Trace of thread %u written to %s\n", thread_id, path);
+}
+
+/* ***************************************************** */
+
 static void setupDetection(u_int16_t thread_id) {
   NDPI_PROTOCOL_BITMASK all;
 
-  memset(&ndpi_thread_info[thread_id], 0, sizeof(ndpi_thread_info[thread_id]));
-
   // init global detection structure
-  ndpi_thread_info[thread_id].ndpi_struct = ndpi_init_detection_module(detection_tick_resolution, malloc_wrapper, free_wrapper, debug_printf);
-  if(ndpi_thread_info[thread_id].ndpi_struct == NULL) {
+  ndpi_thread_info[thread_id]->ndpi_struct = ndpi_init_detection_module(detection_tick_resolution, malloc_wrapper, free_wrapper, debug_printf);
+  if(ndpi_thread_info[thread_id]->ndpi_struct == NULL) {
     printf("ERROR: global structure initialization failed\n");
     exit(-1);
   }
 
   // enable all protocols
   NDPI_BITMASK_SET_ALL(all);
-  ndpi_set_protocol_detection_bitmask2(ndpi_thread_info[thread_id].ndpi_struct, &all);
+  ndpi_set_protocol_detection_bitmask2(ndpi_thread_info[thread_id]->ndpi_struct, &all);
 
   // allocate memory for id and flow tracking
   size_id_struct = ndpi_detection_get_sizeof_ndpi_id_struct();
   size_flow_struct = ndpi_detection_get_sizeof_ndpi_flow_struct();
 
   // clear memory for results
-  memset(ndpi_thread_info[thread_id].stats.protocol_counter, 0, sizeof(ndpi_thread_info[thread_id].stats.protocol_counter));
-  memset(ndpi_thread_info[thread_id].stats.protocol_counter_bytes, 0, sizeof(ndpi_thread_info[thread_id].stats.protocol_counter_bytes));
-  memset(ndpi_thread_info[thread_id].stats.protocol_flows, 0, sizeof(ndpi_thread_info[thread_id].stats.protocol_flows));
+  memset(ndpi_thread_info[thread_id]->stats.protocol_counter, 0, sizeof(ndpi_thread_info[thread_id]->stats.protocol_counter));
+  memset(ndpi_thread_info[thread_id]->stats.protocol_counter_bytes, 0, sizeof(ndpi_thread_info[thread_id]->stats.protocol_counter_bytes));
+  memset(ndpi_thread_info[thread_id]->stats.protocol_flows, 0, sizeof(ndpi_thread_info[thread_id]->stats.protocol_flows));
+
+  if(_snapshotPath != NULL) {
+    if(ndpi_load_snapshot(ndpi_thread_info[thread_id]->ndpi_struct, _snapshotPath) != 0) {
+      printf("ERROR: unable to load snapshot %s\n", _snapshotPath);
+      exit(-1);
+    }
+  }
 
   if(_protoFilePath != NULL)
-    ndpi_load_protocols_file(ndpi_thread_info[thread_id].ndpi_struct, _protoFilePath);
+    ndpi_load_protocols_file(ndpi_thread_info[thread_id]->ndpi_struct, _protoFilePath);
+
+  if(reorder_interval > 0) {
+    if(ndpi_enable_adaptive_order(ndpi_thread_info[thread_id]->ndpi_struct, reorder_interval) != 0) {
+      printf("ERROR: unable to enable adaptive dissector ordering\n");
+      exit(-1);
+    }
+  }
+
+  if(_orderFilePath != NULL)
+    loadDissectorOrder(thread_id);
+
+  if(_traceFilePath != NULL)
+    enableTrace(thread_id);
 }
 
 /* ***************************************************** */
@@ -834,17 +1279,22 @@ static void setupDetection(u_int16_t thread_id) {
 static void terminateDetection(u_int16_t thread_id) {
   int i;
 
+  memset(ndpi_thread_info[thread_id]->flow_cache, 0, sizeof(ndpi_thread_info[thread_id]->flow_cache));
+
   for(i=0; i<NUM_ROOTS; i++) {
-    ndpi_tdestroy(ndpi_thread_info[thread_id].ndpi_flows_root[i], ndpi_flow_freer);
-    ndpi_thread_info[thread_id].ndpi_flows_root[i] = NULL;
+    ndpi_tdestroy(ndpi_thread_info[thread_id]->ndpi_flows_root[i], ndpi_flow_freer);
+    ndpi_thread_info[thread_id]->ndpi_flows_root[i] = NULL;
   }
 
-  ndpi_exit_detection_module(ndpi_thread_info[thread_id].ndpi_struct, free_wrapper);
+  if(_traceFilePath != NULL)
+    dumpTrace(thread_id);
+
+  ndpi_exit_detection_module(ndpi_thread_info[thread_id]->ndpi_struct, free_wrapper);
 }
 
 /* ***************************************************** */
 
-// ipsize = header->len - ip_offset ; rawsize = header->len
+// ipsize = captured bytes from ip_offset ; rawsize = header->len
 static unsigned int packet_processing(u_int16_t thread_id,
 				      const u_int64_t time,
 				      const struct ndpi_iphdr *iph,
@@ -854,8 +1304,27 @@ static unsigned int packet_processing(u_int16_t thread_id,
   struct ndpi_id_struct *src, *dst;
   struct ndpi_flow *flow;
   struct ndpi_flow_struct *ndpi_flow = NULL;
-  u_int32_t i, protocol = 0;
+  u_int32_t i, protocol = 0, slot = 0;
   u_int8_t proto;
+  struct flow_tuple tuple;
+  int cacheable;
+
+  /* fast path: packets of flows whose detection is completed */
+  if((cacheable = get_flow_tuple(iph, iph6, ipsize, &tuple)) != 0) {
+    slot = flow_cache_slot(tuple.ip_version, tuple.protocol, tuple.src, tuple.dst, tuple.sport, tuple.dport);
+    flow = ndpi_thread_info[thread_id]->flow_cache[slot];
+
+    if((flow != NULL) && flow_tuple_match(flow, &tuple)) {
+      update_l4_stats(thread_id, tuple.protocol, tuple.l4_packet_len);
+      ndpi_thread_info[thread_id]->stats.ip_packet_count++;
+      ndpi_thread_info[thread_id]->stats.total_wire_bytes += rawsize + 24 /* CRC etc */, ndpi_thread_info[thread_id]->stats.total_ip_bytes += rawsize;
+      flow->packets++, flow->bytes += rawsize;
+      flow->last_seen = time;
+      ndpi_thread_info[thread_id]->stats.protocol_counter[flow->detected_protocol]++;
+      ndpi_thread_info[thread_id]->stats.protocol_counter_bytes[flow->detected_protocol] += rawsize;
+      return(0);
+    }
+  }
 
   if(iph)
     flow = get_ndpi_flow(thread_id, 4, iph, ip_offset, ipsize,
@@ -865,27 +1334,36 @@ static unsigned int packet_processing(u_int16_t thread_id,
     flow = get_ndpi_flow6(thread_id, iph6, ip_offset, &src, &dst, &proto);
 
   if(flow != NULL) {
-    ndpi_thread_info[thread_id].stats.ip_packet_count++;
-    ndpi_thread_info[thread_id].stats.total_wire_bytes += rawsize + 24 /* CRC etc */, ndpi_thread_info[thread_id].stats.total_ip_bytes += rawsize;
+    ndpi_thread_info[thread_id]->stats.ip_packet_count++;
+    ndpi_thread_info[thread_id]->stats.total_wire_bytes += rawsize + 24 /* CRC etc */, ndpi_thread_info[thread_id]->stats.total_ip_bytes += rawsize;
     ndpi_flow = flow->ndpi_flow;
     flow->packets++, flow->bytes += rawsize;
     flow->last_seen = time;
+
+    /* live per-protocol counters, moved to the right protocol once detected */
+    if(flow->packets == 1) ndpi_thread_info[thread_id]->stats.protocol_flows[flow->detected_protocol]++;
+    ndpi_thread_info[thread_id]->stats.protocol_counter[flow->detected_protocol]++;
+    ndpi_thread_info[thread_id]->stats.protocol_counter_bytes[flow->detected_protocol] += rawsize;
   } else {
     return(0);
   }
 
-  if(flow->detection_completed) return(0);
+  if(flow->detection_completed) {
+    if(cacheable) ndpi_thread_info[thread_id]->flow_cache[slot] = flow;
+    return(0);
+  }
 
-  protocol = (const u_int32_t)ndpi_detection_process_packet(ndpi_thread_info[thread_id].ndpi_struct, ndpi_flow,
+  protocol = (const u_int32_t)ndpi_detection_process_packet(ndpi_thread_info[thread_id]->ndpi_struct, ndpi_flow,
 							    iph ? (uint8_t *)iph : (uint8_t *)iph6,
 							    ipsize, time, src, dst);
 
-  flow->detected_protocol = protocol;
+  set_flow_protocol(thread_id, flow, protocol);
 
   if((flow->detected_protocol != NDPI_PROTOCOL_UNKNOWN)
      || ((proto == IPPROTO_UDP) && (flow->packets > 8))
      || ((proto == IPPROTO_TCP) && (flow->packets > 10))) {
     flow->detection_completed = 1;
+    if(cacheable) ndpi_thread_info[thread_id]->flow_cache[slot] = flow;
 
 #if 0
     if(flow->ndpi_flow->l4.tcp.host_server_name[0] != '\0')
@@ -893,6 +1371,8 @@ static unsigned int packet_processing(u_int16_t thread_id,
 #endif
 
     snprintf(flow->host_server_name, sizeof(flow->host_server_name), "%s", flow->ndpi_flow->host_server_name);
+    appendDNSAddresses(flow);
+    exportFlow(thread_id, flow);
     free_ndpi_flow(flow);
 
     if(verbose > 1) {
@@ -914,17 +1394,17 @@ static unsigned int packet_processing(u_int16_t thread_id,
 #endif
 
   if(live_capture) {
-    if(ndpi_thread_info[thread_id].last_idle_scan_time + IDLE_SCAN_PERIOD < ndpi_thread_info[thread_id].last_time) {
+    if(ndpi_thread_info[thread_id]->last_idle_scan_time + IDLE_SCAN_PERIOD < ndpi_thread_info[thread_id]->last_time) {
       /* scan for idle flows */
-      ndpi_twalk(ndpi_thread_info[thread_id].ndpi_flows_root[ndpi_thread_info[thread_id].idle_scan_idx], node_idle_scan_walker, &thread_id);
+      ndpi_twalk(ndpi_thread_info[thread_id]->ndpi_flows_root[ndpi_thread_info[thread_id]->idle_scan_idx], node_idle_scan_walker, &thread_id);
       
       /* remove idle flows (unfortunately we cannot do this inline) */
-      while (ndpi_thread_info[thread_id].num_idle_flows > 0)
-	ndpi_tdelete(ndpi_thread_info[thread_id].idle_flows[--ndpi_thread_info[thread_id].num_idle_flows], 
-		     &ndpi_thread_info[thread_id].ndpi_flows_root[ndpi_thread_info[thread_id].idle_scan_idx], node_cmp);
+      while (ndpi_thread_info[thread_id]->num_idle_flows > 0)
+	ndpi_tdelete(ndpi_thread_info[thread_id]->idle_flows[--ndpi_thread_info[thread_id]->num_idle_flows], 
+		     &ndpi_thread_info[thread_id]->ndpi_flows_root[ndpi_thread_info[thread_id]->idle_scan_idx], node_cmp);
       
-      if(++ndpi_thread_info[thread_id].idle_scan_idx == NUM_ROOTS) ndpi_thread_info[thread_id].idle_scan_idx = 0;
-      ndpi_thread_info[thread_id].last_idle_scan_time = ndpi_thread_info[thread_id].last_time;
+      if(++ndpi_thread_info[thread_id]->idle_scan_idx == NUM_ROOTS) ndpi_thread_info[thread_id]->idle_scan_idx = 0;
+      ndpi_thread_info[thread_id]->last_idle_scan_time = ndpi_thread_info[thread_id]->last_time;
     }
   }
 
@@ -989,6 +1469,89 @@ static void json_init() {
 
 /* ***************************************************** */
 
+/* Library memory per subsystem, and what a flow and a rule cost */
+static void printMemoryStats(void) {
+  ndpi_memory_stats_t mem;
+  u_int64_t rules_bytes;
+  u_int32_t num_rules, i;
+
+  ndpi_get_memory_stats(ndpi_thread_info[0]->ndpi_struct, &mem);
+
+  printf("\nMemory usage (nDPI library, all threads):\n");
+
+  for(i = 0; i < NDPI_MEM_NUM_TAGS; i++) {
+    if(mem.tag[i].peak_bytes == 0) continue;
+
+    printf("\t%-12s bytes: %-13llu peak: %-13llu allocations: %-13llu\n",
+	   ndpi_get_memory_tag_name(i),
+	   (long long unsigned int)mem.tag[i].bytes,
+	   (long long unsigned int)mem.tag[i].peak_bytes,
+	   (long long unsigned int)mem.tag[i].allocations);
+  }
+
+  printf("\tTotal        bytes: %-13llu\n", (long long unsigned int)mem.total_bytes);
+
+  /* flow struct + two id structs while the flow is being detected */
+  printf("\tBytes per flow:        %u detection state + %u flow entry\n",
+	 size_flow_struct + 2 * size_id_struct, (u_int32_t)sizeof(struct ndpi_flow));
+
+  /*
+    Every thread has its own copy of the rules. Tree nodes are left out
+    as the flow tables above use them too
+  */
+  rules_bytes = mem.tag[NDPI_MEM_AUTOMATA].bytes + mem.tag[NDPI_MEM_PORTS].bytes
+    + mem.tag[NDPI_MEM_RULES].bytes;
+  num_rules = (mem.num_host_rules + mem.num_port_rules) * num_threads;
+
+  if(num_rules > 0)
+    printf("\tBytes per rule:        %llu (%u host and %u port rules per thread)\n",
+	   (long long unsigned int)(rules_bytes / num_rules), mem.num_host_rules, mem.num_port_rules);
+}
+
+/* ***************************************************** */
+
+/* Order of the first thread, in the format read by -O */
+static void printDissectorOrder(void) {
+  struct ndpi_detection_module_struct *ndpi_struct = ndpi_thread_info[0]->ndpi_struct;
+  u_int16_t protocol_ids[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
+  u_int32_t num_ids, i, l;
+  u_int8_t l4_protos[2] = { IPPROTO_TCP, IPPROTO_UDP };
+
+  printf("\nDissector order (thread 0):\n");
+
+  for(l = 0; l < 2; l++) {
+    num_ids = ndpi_get_dissector_order(ndpi_struct, l4_protos[l], protocol_ids,
+				       NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
+
+    printf("%s", (l4_protos[l] == IPPROTO_TCP) ? "tcp" : "udp");
+    for(i = 0; i < num_ids; i++)
+      printf(" %s", ndpi_get_proto_name(ndpi_struct, protocol_ids[i]));
+    printf("\n");
+  }
+}
+
+/* ***************************************************** */
+
+#ifdef NDPI_READER_NUMA
+static void printNumaPlacement(void) {
+  u_int32_t thread_id, num_printed = 0;
+
+  for(thread_id = 0; thread_id < num_threads; thread_id++) {
+    struct reader_thread *t = ndpi_thread_info[thread_id];
+
+    if(t->numa_node < 0) continue;
+
+    if(num_printed++ == 0) printf("\nNUMA placement (sampled pages):\n");
+
+    printf("\tThread %-2u node %-2d    local: %-8u remote: %-8u%s\n", thread_id, t->numa_node,
+	   t->numa_local_pages, t->numa_remote_pages,
+	   t->numa_remote_pages ? " (cross-node allocations)" : "");
+  }
+}
+#endif
+
+/* ***************************************************** */
+
 static void printResults(u_int64_t tot_usec) {
   u_int32_t i;
   u_int64_t total_flow_bytes = 0;
@@ -1001,35 +1564,36 @@ static void printResults(u_int64_t tot_usec) {
   memset(&cumulative_stats, 0, sizeof(cumulative_stats));
 
   for(thread_id = 0; thread_id < num_threads; thread_id++) {
-    if(ndpi_thread_info[thread_id].stats.total_wire_bytes == 0) continue;
+    if((ndpi_thread_info[thread_id]->stats.total_wire_bytes == 0)
+       && (ndpi_thread_info[thread_id]->stats.raw_packet_count == 0)) continue;
 
     for(i=0; i<NUM_ROOTS; i++)
-      ndpi_twalk(ndpi_thread_info[thread_id].ndpi_flows_root[i], node_proto_guess_walker, &thread_id);
+      ndpi_twalk(ndpi_thread_info[thread_id]->ndpi_flows_root[i], node_proto_guess_walker, &thread_id);
 
     /* Stats aggregation */
-    cumulative_stats.guessed_flow_protocols += ndpi_thread_info[thread_id].stats.guessed_flow_protocols;
-    cumulative_stats.raw_packet_count += ndpi_thread_info[thread_id].stats.raw_packet_count;
-    cumulative_stats.ip_packet_count += ndpi_thread_info[thread_id].stats.ip_packet_count;
-    cumulative_stats.total_wire_bytes += ndpi_thread_info[thread_id].stats.total_wire_bytes;
-    cumulative_stats.total_ip_bytes += ndpi_thread_info[thread_id].stats.total_ip_bytes;
-    cumulative_stats.total_discarded_bytes += ndpi_thread_info[thread_id].stats.total_discarded_bytes;
-
-    for(i = 0; i < ndpi_get_num_supported_protocols(ndpi_thread_info[0].ndpi_struct); i++) {
-      cumulative_stats.protocol_counter[i] += ndpi_thread_info[thread_id].stats.protocol_counter[i];
-      cumulative_stats.protocol_counter_bytes[i] += ndpi_thread_info[thread_id].stats.protocol_counter_bytes[i];
-      cumulative_stats.protocol_flows[i] += ndpi_thread_info[thread_id].stats.protocol_flows[i];
+    cumulative_stats.guessed_flow_protocols += ndpi_thread_info[thread_id]->stats.guessed_flow_protocols;
+    cumulative_stats.raw_packet_count += ndpi_thread_info[thread_id]->stats.raw_packet_count;
+    cumulative_stats.ip_packet_count += ndpi_thread_info[thread_id]->stats.ip_packet_count;
+    cumulative_stats.total_wire_bytes += ndpi_thread_info[thread_id]->stats.total_wire_bytes;
+    cumulative_stats.total_ip_bytes += ndpi_thread_info[thread_id]->stats.total_ip_bytes;
+    cumulative_stats.total_discarded_bytes += ndpi_thread_info[thread_id]->stats.total_discarded_bytes;
+
+    for(i = 0; i < ndpi_get_num_supported_protocols(ndpi_thread_info[0]->ndpi_struct); i++) {
+      cumulative_stats.protocol_counter[i] += ndpi_thread_info[thread_id]->stats.protocol_counter[i];
+      cumulative_stats.protocol_counter_bytes[i] += ndpi_thread_info[thread_id]->stats.protocol_counter_bytes[i];
+      cumulative_stats.protocol_flows[i] += ndpi_thread_info[thread_id]->stats.protocol_flows[i];
     }
 
-    cumulative_stats.ndpi_flow_count += ndpi_thread_info[thread_id].stats.ndpi_flow_count;
-    cumulative_stats.tcp_count   += ndpi_thread_info[thread_id].stats.tcp_count;
-    cumulative_stats.udp_count   += ndpi_thread_info[thread_id].stats.udp_count;
-    cumulative_stats.mpls_count  += ndpi_thread_info[thread_id].stats.mpls_count;
-    cumulative_stats.pppoe_count += ndpi_thread_info[thread_id].stats.pppoe_count; 
-    cumulative_stats.vlan_count  += ndpi_thread_info[thread_id].stats.vlan_count;
-    cumulative_stats.fragmented_count += ndpi_thread_info[thread_id].stats.fragmented_count;
+    cumulative_stats.ndpi_flow_count += ndpi_thread_info[thread_id]->stats.ndpi_flow_count;
+    cumulative_stats.tcp_count   += ndpi_thread_info[thread_id]->stats.tcp_count;
+    cumulative_stats.udp_count   += ndpi_thread_info[thread_id]->stats.udp_count;
+    cumulative_stats.mpls_count  += ndpi_thread_info[thread_id]->stats.mpls_count;
+    cumulative_stats.pppoe_count += ndpi_thread_info[thread_id]->stats.pppoe_count; 
+    cumulative_stats.vlan_count  += ndpi_thread_info[thread_id]->stats.vlan_count;
+    cumulative_stats.fragmented_count += ndpi_thread_info[thread_id]->stats.fragmented_count;
     for(i = 0; i < 6; i++)
-      cumulative_stats.packet_len[i] += ndpi_thread_info[thread_id].stats.packet_len[i];
-    cumulative_stats.max_packet_len += ndpi_thread_info[thread_id].stats.max_packet_len;
+      cumulative_stats.packet_len[i] += ndpi_thread_info[thread_id]->stats.packet_len[i];
+    cumulative_stats.max_packet_len += ndpi_thread_info[thread_id]->stats.max_packet_len;
   }
   
   if(!json_flag) {
@@ -1072,6 +1636,13 @@ static void printResults(u_int64_t tot_usec) {
 
   if(enable_protocol_guess)
     printf("\tGuessed flow protos:   %-13u\n", cumulative_stats.guessed_flow_protocols);
+
+  printMemoryStats();
+#ifdef NDPI_READER_NUMA
+  printNumaPlacement();
+#endif
+  if((reorder_interval > 0) || (_orderFilePath != NULL))
+    printDissectorOrder();
   } else {
       if((json_fp = fopen(_jsonFilePath,"w")) == NULL) {
 	printf("Error create .json file\n");
@@ -1110,19 +1681,19 @@ static void printResults(u_int64_t tot_usec) {
   }  
 
   if(!json_flag) printf("\n\nDetected protocols:\n");
-  for(i = 0; i <= ndpi_get_num_supported_protocols(ndpi_thread_info[0].ndpi_struct); i++) {
+  for(i = 0; i <= ndpi_get_num_supported_protocols(ndpi_thread_info[0]->ndpi_struct); i++) {
     if(cumulative_stats.protocol_counter[i] > 0) {
       if(!json_flag) {
       printf("\t%-20s packets: %-13llu bytes: %-13llu "
 	     "flows: %-13u\n",
-	     ndpi_get_proto_name(ndpi_thread_info[0].ndpi_struct, i),
+	     ndpi_get_proto_name(ndpi_thread_info[0]->ndpi_struct, i),
 	     (long long unsigned int)cumulative_stats.protocol_counter[i],
 	     (long long unsigned int)cumulative_stats.protocol_counter_bytes[i],
 	     cumulative_stats.protocol_flows[i]);
       } else {
 	jObj = json_object_new_object();
 		
-	json_object_object_add(jObj,"name",json_object_new_string(ndpi_get_proto_name(ndpi_thread_info[0].ndpi_struct, i)));
+	json_object_object_add(jObj,"name",json_object_new_string(ndpi_get_proto_name(ndpi_thread_info[0]->ndpi_struct, i)));
 	json_object_object_add(jObj,"packets",json_object_new_int64(cumulative_stats.protocol_counter[i]));
 	json_object_object_add(jObj,"bytes",json_object_new_int64(cumulative_stats.protocol_counter_bytes[i]));
 	json_object_object_add(jObj,"flows",json_object_new_int(cumulative_stats.protocol_flows[i]));
@@ -1143,11 +1714,11 @@ static void printResults(u_int64_t tot_usec) {
     num_flows = 0;
     for(thread_id = 0; thread_id < num_threads; thread_id++) {
       for(i=0; i<NUM_ROOTS; i++)
-        ndpi_twalk(ndpi_thread_info[thread_id].ndpi_flows_root[i], node_print_known_proto_walker, &thread_id);
+        ndpi_twalk(ndpi_thread_info[thread_id]->ndpi_flows_root[i], node_print_known_proto_walker, &thread_id);
     }
 
     for(thread_id = 0; thread_id < num_threads; thread_id++) {
-      if(ndpi_thread_info[thread_id].stats.protocol_counter[0 /* 0 = Unknown */] > 0) {
+      if(ndpi_thread_info[thread_id]->stats.protocol_counter[0 /* 0 = Unknown */] > 0) {
         if(!json_flag) printf("\n\nUndetected flows:\n");
 
 	if(json_flag)
@@ -1158,9 +1729,9 @@ static void printResults(u_int64_t tot_usec) {
 
     num_flows = 0;
     for(thread_id = 0; thread_id < num_threads; thread_id++) {
-      if(ndpi_thread_info[thread_id].stats.protocol_counter[0] > 0) {
+      if(ndpi_thread_info[thread_id]->stats.protocol_counter[0] > 0) {
         for(i=0; i<NUM_ROOTS; i++)
-	  ndpi_twalk(ndpi_thread_info[thread_id].ndpi_flows_root[i], node_print_unknown_proto_walker, &thread_id);
+	  ndpi_twalk(ndpi_thread_info[thread_id]->ndpi_flows_root[i], node_print_unknown_proto_walker, &thread_id);
       }
     }
   }
@@ -1180,16 +1751,17 @@ static void printResults(u_int64_t tot_usec) {
 /* ***************************************************** */
 
 static void closePcapFile(u_int16_t thread_id) {
-  if(ndpi_thread_info[thread_id]._pcap_handle != NULL) {
-    pcap_close(ndpi_thread_info[thread_id]._pcap_handle);
+  if(ndpi_thread_info[thread_id]->_pcap_handle != NULL) {
+    pcap_close(ndpi_thread_info[thread_id]->_pcap_handle);
+    ndpi_thread_info[thread_id]->_pcap_handle = NULL;
   }
 }
 
 /* ***************************************************** */
 
 static void breakPcapLoop(u_int16_t thread_id) {
-  if(ndpi_thread_info[thread_id]._pcap_handle != NULL) {
-    pcap_breakloop(ndpi_thread_info[thread_id]._pcap_handle);
+  if(ndpi_thread_info[thread_id]->_pcap_handle != NULL) {
+    pcap_breakloop(ndpi_thread_info[thread_id]->_pcap_handle);
   }
 }
 
@@ -1204,44 +1776,99 @@ void sigproc(int sig) {
   shutdown_app = 1;
 
   for(thread_id=0; thread_id<num_threads; thread_id++)
-    breakPcapLoop(thread_id);
+    if(ndpi_thread_info[thread_id] != NULL)
+      breakPcapLoop(thread_id);
 }
 
 /* ***************************************************** */
 
-static int getNextPcapFileFromPlaylist(u_int16_t thread_id, char filename[], u_int32_t filename_len) {
+/* Read the whole playlist once: the threads then take its files in turn */
+static int loadPlaylist(const char *path) {
+  char filename[256];
+  u_int32_t max_files = 0;
+  FILE *fd;
 
-  if(playlist_fp[thread_id] == NULL) {
-    if((playlist_fp[thread_id] = fopen(_pcap_file[thread_id], "r")) == NULL)
-      return -1;
-  }
+  if((fd = fopen(path, "r")) == NULL)
+    return(-1);
 
-next_line:
-  if(fgets(filename, filename_len, playlist_fp[thread_id])) {
+  while(fgets(filename, sizeof(filename), fd)) {
     int l = strlen(filename);
-    if(filename[0] == '\0' || filename[0] == '#') goto next_line;
-    if(filename[l-1] == '\n') filename[l-1] = '\0';
-    return 0;
-  } else {
-    fclose(playlist_fp[thread_id]);
-    playlist_fp[thread_id] = NULL;
-    return -1;
+
+    if((l > 0) && (filename[l-1] == '\n')) filename[--l] = '\0';
+    if((filename[0] == '\0') || (filename[0] == '#')) continue;
+
+    if(playlist.num_files == max_files) {
+      char **files;
+
+      max_files = max_files ? (max_files * 2) : 64;
+
+      if((files = (char**)realloc(playlist.files, max_files * sizeof(char*))) == NULL)
+	break;
+
+      playlist.files = files;
+    }
+
+    if((playlist.files[playlist.num_files] = strdup(filename)) == NULL)
+      break;
+
+    playlist.num_files++;
+  }
+
+  fclose(fd);
+
+  playlist.next_file = 0, playlist.reading = 0;
+  playlist.route_packets = (num_threads > 1);
+
+  return(0);
+}
+
+/* ***************************************************** */
+
+static void freePlaylist(void) {
+  u_int32_t i;
+
+  for(i = 0; i < playlist.num_files; i++)
+    free(playlist.files[i]);
+
+  free(playlist.files);
+  memset(&playlist, 0, sizeof(playlist));
+}
+
+/* ***************************************************** */
+
+/* Hands out the next file unless another thread is still reading: returns 1 in that case */
+static int takeNextPcapFile(char filename[], u_int32_t filename_len) {
+  int rc = -1;
+
+  pthread_mutex_lock(&playlist_lock);
+
+  if((!shutdown_app) && (playlist.next_file < playlist.num_files)) {
+    if(playlist.reading)
+      rc = 1;
+    else {
+      snprintf(filename, filename_len, "%s", playlist.files[playlist.next_file++]);
+      playlist.reading = 1, rc = 0;
+    }
   }
+
+  pthread_mutex_unlock(&playlist_lock);
+
+  return(rc);
 }
 
 /* ***************************************************** */
 
 static void configurePcapHandle(u_int16_t thread_id) {
-  ndpi_thread_info[thread_id]._pcap_datalink_type = pcap_datalink(ndpi_thread_info[thread_id]._pcap_handle);
+  ndpi_thread_info[thread_id]->_pcap_datalink_type = pcap_datalink(ndpi_thread_info[thread_id]->_pcap_handle);
 
   if(_bpf_filter != NULL) {
     struct bpf_program fcode;
 
-    if(pcap_compile(ndpi_thread_info[thread_id]._pcap_handle, &fcode, _bpf_filter, 1, 0xFFFFFF00) < 0) {
-      printf("pcap_compile error: '%s'\n", pcap_geterr(ndpi_thread_info[thread_id]._pcap_handle));
+    if(pcap_compile(ndpi_thread_info[thread_id]->_pcap_handle, &fcode, _bpf_filter, 1, 0xFFFFFF00) < 0) {
+      printf("pcap_compile error: '%s'\n", pcap_geterr(ndpi_thread_info[thread_id]->_pcap_handle));
     } else {
-      if(pcap_setfilter(ndpi_thread_info[thread_id]._pcap_handle, &fcode) < 0) {
-	printf("pcap_setfilter error: '%s'\n", pcap_geterr(ndpi_thread_info[thread_id]._pcap_handle));
+      if(pcap_setfilter(ndpi_thread_info[thread_id]->_pcap_handle, &fcode) < 0) {
+	printf("pcap_setfilter error: '%s'\n", pcap_geterr(ndpi_thread_info[thread_id]->_pcap_handle));
       } else
 	printf("Succesfully set BPF filter to '%s'\n", _bpf_filter);
     }
@@ -1256,26 +1883,38 @@ static void openPcapFileOrDevice(u_int16_t thread_id) {
   char errbuf[PCAP_ERRBUF_SIZE];
 
   /* trying to open a live interface */
-  if((ndpi_thread_info[thread_id]._pcap_handle = pcap_open_live(_pcap_file[thread_id], snaplen, promisc, 500, errbuf)) == NULL) {
+  if((ndpi_thread_info[thread_id]->_pcap_handle = pcap_open_live(_pcap_file[thread_id], snaplen, promisc, 500, errbuf)) == NULL) {
     capture_until = 0;
 
     live_capture = 0;
-    num_threads = 1; /* Open pcap files in single threads mode */
 
     /* trying to open a pcap file */
-    if((ndpi_thread_info[thread_id]._pcap_handle = pcap_open_offline(_pcap_file[thread_id], ndpi_thread_info[thread_id]._pcap_error_buffer)) == NULL) {
+    if((ndpi_thread_info[thread_id]->_pcap_handle = pcap_open_offline(_pcap_file[thread_id], ndpi_thread_info[thread_id]->_pcap_error_buffer)) == NULL) {
       char filename[256];
 
-      /* trying to open a pcap playlist */
-      if(getNextPcapFileFromPlaylist(thread_id, filename, sizeof(filename)) != 0 ||
-          (ndpi_thread_info[thread_id]._pcap_handle = pcap_open_offline(filename, ndpi_thread_info[thread_id]._pcap_error_buffer)) == NULL) {
+      /* trying to open a pcap playlist (loaded once, then shared by the threads) */
+      if((playlist.files == NULL) && (loadPlaylist(_pcap_file[thread_id]) != 0)) {
+        printf("ERROR: could not open pcap file or playlist: %s\n", ndpi_thread_info[thread_id]->_pcap_error_buffer);
+        exit(-1);
+      }
 
-        printf("ERROR: could not open pcap file or playlist: %s\n", ndpi_thread_info[thread_id]._pcap_error_buffer);
+      if(thread_id != 0) {
+	/* thread 0 reads the first file: the others wait for their turn */
+      } else if(takeNextPcapFile(filename, sizeof(filename)) != 0) {
+	printf("ERROR: empty pcap playlist %s\n", _pcap_file[thread_id]);
+	exit(-1);
+      } else if((ndpi_thread_info[thread_id]->_pcap_handle = pcap_open_offline(filename, ndpi_thread_info[thread_id]->_pcap_error_buffer)) == NULL) {
+        printf("ERROR: could not open pcap file or playlist: %s\n", ndpi_thread_info[thread_id]->_pcap_error_buffer);
         exit(-1);
       } else {
-        if(!json_flag) printf("Reading packets from playlist %s...\n", _pcap_file[thread_id]);
+        if((!json_flag) && (thread_id == 0)) printf("Reading packets from playlist %s...\n", _pcap_file[thread_id]);
       }
+
+      if(ndpi_thread_info[thread_id]->_pcap_handle == NULL)
+	return;
     } else {
+      num_threads = 1; /* Open pcap files in single threads mode */
+
       if(!json_flag) printf("Reading packets from pcap file %s...\n", _pcap_file[thread_id]);
     }
   } else {
@@ -1299,22 +1938,397 @@ static void openPcapFileOrDevice(u_int16_t thread_id) {
 
 /* ***************************************************** */
 
+static void openStatsShm(void) {
+#ifndef WIN32
+  size_t len = NDPI_STATS_SHM_LEN(num_threads);
+  u_int32_t i, num_protocols;
+  int fd;
+
+  if((_statsShmName == NULL) || (stats_shm != NULL))
+    return;
+
+  if((fd = shm_open(_statsShmName, O_CREAT | O_RDWR, 0644)) < 0) {
+    printf("ERROR: unable to create shared memory segment %s\n", _statsShmName);
+    exit(-1);
+  }
+
+  if(ftruncate(fd, len) != 0
+     || (stats_shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    printf("ERROR: unable to map shared memory segment %s\n", _statsShmName);
+    close(fd);
+    shm_unlink(_statsShmName);
+    exit(-1);
+  }
+
+  close(fd);
+  memset(stats_shm, 0, len);
+
+  num_protocols = ndpi_get_num_supported_protocols(ndpi_thread_info[0]->ndpi_struct);
+  if(num_protocols > NDPI_STATS_NUM_PROTOCOLS) num_protocols = NDPI_STATS_NUM_PROTOCOLS;
+
+  for(i = 0; i < num_protocols; i++)
+    snprintf(stats_shm->protocol_names[i], NDPI_STATS_PROTO_NAME_LEN, "%s",
+	     ndpi_get_proto_name(ndpi_thread_info[0]->ndpi_struct, i));
+
+  stats_shm->num_threads = num_threads, stats_shm->num_protocols = num_protocols;
+  stats_shm->slot_len = sizeof(struct ndpi_stats_shm_slot), stats_shm->pid = getpid();
+  stats_shm->version = NDPI_STATS_SHM_VERSION;
+
+  /* readers check the magic last */
+  ndpi_memory_barrier();
+  stats_shm->magic = NDPI_STATS_SHM_MAGIC;
+
+  if(!json_flag) printf("Publishing live statistics in shared memory segment %s\n", _statsShmName);
+#endif
+}
+
+/* ***************************************************** */
+
+static void closeStatsShm(void) {
+#ifndef WIN32
+  if(stats_shm == NULL)
+    return;
+
+  munmap(stats_shm, NDPI_STATS_SHM_LEN(stats_shm->num_threads));
+  shm_unlink(_statsShmName);
+  stats_shm = NULL;
+#endif
+}
+
+/* ***************************************************** */
+
+static void openFlowsShm(void) {
+#ifndef WIN32
+  size_t len = NDPI_FLOWS_SHM_LEN(num_threads, NDPI_FLOWS_RING_SLOTS);
+  u_int32_t i, num_protocols;
+  int fd;
+
+  if((_flowsShmName == NULL) || (flows_shm != NULL))
+    return;
+
+  if((fd = shm_open(_flowsShmName, O_CREAT | O_RDWR, 0644)) < 0) {
+    printf("ERROR: unable to create shared memory segment %s\n", _flowsShmName);
+    exit(-1);
+  }
+
+  if(ftruncate(fd, len) != 0
+     || (flows_shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    printf("ERROR: unable to map shared memory segment %s\n", _flowsShmName);
+    close(fd);
+    shm_unlink(_flowsShmName);
+    flows_shm = NULL;
+    exit(-1);
+  }
+
+  close(fd);
+  memset(flows_shm, 0, len);
+
+  num_protocols = ndpi_get_num_supported_protocols(ndpi_thread_info[0]->ndpi_struct);
+  if(num_protocols > NDPI_FLOWS_NUM_PROTOCOLS) num_protocols = NDPI_FLOWS_NUM_PROTOCOLS;
+
+  for(i = 0; i < num_protocols; i++)
+    snprintf(flows_shm->protocol_names[i], NDPI_FLOWS_PROTO_NAME_LEN, "%s",
+	     ndpi_get_proto_name(ndpi_thread_info[0]->ndpi_struct, i));
+
+  flows_shm->num_rings = num_threads, flows_shm->ring_slots = NDPI_FLOWS_RING_SLOTS;
+  flows_shm->record_len = sizeof(struct ndpi_flow_record), flows_shm->pid = getpid();
+  flows_shm->num_protocols = num_protocols, flows_shm->version = NDPI_FLOWS_SHM_VERSION;
+
+  /* consumers check the magic last */
+  ndpi_memory_barrier();
+  flows_shm->magic = NDPI_FLOWS_SHM_MAGIC;
+
+  if(!json_flag) printf("Exporting flows to shared memory segment %s\n", _flowsShmName);
+#endif
+}
+
+/* ***************************************************** */
+
+static void closeFlowsShm(void) {
+#ifndef WIN32
+  if(flows_shm == NULL)
+    return;
+
+  /* consumers still attached keep their mapping and read what is left */
+  munmap(flows_shm, NDPI_FLOWS_SHM_LEN(flows_shm->num_rings, flows_shm->ring_slots));
+  shm_unlink(_flowsShmName);
+  flows_shm = NULL;
+#endif
+}
+
+/* ***************************************************** */
+
+/* Called by each reader thread on its own ring only (single producer) */
+static void exportFlow(u_int16_t thread_id, struct ndpi_flow *flow) {
+  struct ndpi_flows_ring *ring;
+  struct ndpi_flow_record *r;
+  u_int64_t head;
+  u_int32_t i;
+
+  if(flows_shm == NULL)
+    return;
+
+  ring = NDPI_FLOWS_SHM_RING(flows_shm, thread_id);
+  head = ring->head;
+
+  if(head - ring->tail >= NDPI_FLOWS_RING_SLOTS) {
+    ring->dropped++; /* consumer too slow (or missing): never wait for it */
+    return;
+  }
+
+  /* the consumer is done with the slot once tail is past it: don't overwrite it earlier */
+  ndpi_memory_barrier();
+
+  r = NDPI_FLOWS_RING_RECORD(ring, NDPI_FLOWS_RING_SLOTS, head);
+
+  memcpy(r->lower_ip, flow->lower_ip, sizeof(r->lower_ip));
+  memcpy(r->upper_ip, flow->upper_ip, sizeof(r->upper_ip));
+  r->lower_port = flow->lower_port, r->upper_port = flow->upper_port;
+  r->ip_version = flow->ip_version, r->l4_protocol = flow->protocol;
+
+  for(i = 0; i < NDPI_FLOWS_STACK_LEN; i++)
+    r->protocol_stack[i] = (flow->ndpi_flow && (i < NDPI_PROTOCOL_HISTORY_SIZE))
+      ? flow->ndpi_flow->detected_protocol_stack[i] : NDPI_PROTOCOL_UNKNOWN;
+
+  r->last_seen = flow->last_seen;
+  r->packets = flow->packets, r->bytes = flow->bytes;
+  memcpy(r->host_server_name, flow->host_server_name, NDPI_FLOWS_HOST_NAME_LEN);
+
+  /* the consumer reads the record only once head is past it */
+  ndpi_memory_barrier();
+  ring->head = head + 1;
+}
+
+/* ***************************************************** */
+
+/* Called by each reader thread on its own slot only: no locks needed */
+static void publishThreadStats(u_int16_t thread_id) {
+  struct reader_thread *t = ndpi_thread_info[thread_id];
+  struct ndpi_stats_shm_slot *slot;
+  u_int64_t delta;
+
+  if(stats_shm == NULL)
+    return;
+
+  slot = NDPI_STATS_SHM_SLOT(stats_shm, thread_id);
+  delta = t->last_time - t->last_stats_publish_time;
+
+  slot->seq++; /* odd: update in progress */
+  ndpi_memory_barrier();
+
+  if((delta > 0) && (t->last_stats_publish_time > 0)) {
+    slot->pps = ((t->stats.raw_packet_count - t->last_stats_packets) * detection_tick_resolution) / delta;
+    slot->bps = ((t->stats.total_wire_bytes - t->last_stats_bytes) * 8 * detection_tick_resolution) / delta;
+  }
+
+  slot->last_update = t->last_time;
+  memcpy(&slot->stats, &t->stats, sizeof(slot->stats));
+
+  ndpi_memory_barrier();
+  slot->seq++;
+
+  t->last_stats_publish_time = t->last_time;
+  t->last_stats_packets = t->stats.raw_packet_count, t->last_stats_bytes = t->stats.total_wire_bytes;
+}
+
+/* ***************************************************** */
+
+/* Symmetric in the two endpoints (like the flow lookup): both directions get the same owner */
+static u_int16_t flowOwnerThread(const struct ndpi_iphdr *iph, const struct ndpi_ip6_hdr *iph6,
+				 u_int16_t caplen) {
+  const u_int8_t *l4;
+  u_int32_t h, l3_len;
+  u_int8_t proto;
+
+  if(iph) {
+    h = iph->saddr + iph->daddr, proto = iph->protocol;
+    l3_len = iph->ihl * 4, l4 = (const u_int8_t*)iph + l3_len;
+  } else {
+    const u_int32_t *src = (const u_int32_t*)&iph6->ip6_src, *dst = (const u_int32_t*)&iph6->ip6_dst;
+
+    h = src[0] + src[1] + src[2] + src[3] + dst[0] + dst[1] + dst[2] + dst[3];
+    proto = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    l3_len = sizeof(struct ndpi_ip6_hdr), l4 = (const u_int8_t*)iph6 + l3_len;
+  }
+
+  h += proto;
+
+  if(((proto == IPPROTO_TCP) || (proto == IPPROTO_UDP)) && (caplen >= l3_len + 4))
+    h += get_u_int16_t(l4, 0) + get_u_int16_t(l4, 2);
+
+  return(((h * 0x9E3779B1) >> 16) % num_threads);
+}
+
+/* ***************************************************** */
+
+static void queueBatch(u_int16_t owner, struct packet_batch *batch) {
+  struct reader_thread *t = ndpi_thread_info[owner];
+
+  batch->next = NULL;
+
+  pthread_mutex_lock(&t->inbox_lock);
+  while(t->inbox_batches >= ROUTE_MAX_QUEUED_BATCHES)
+    pthread_cond_wait(&t->inbox_cond, &t->inbox_lock);
+  t->inbox_batches++;
+  if(t->inbox_tail)
+    t->inbox_tail->next = batch;
+  else
+    t->inbox_head = batch;
+  t->inbox_tail = batch;
+  pthread_cond_broadcast(&t->inbox_cond);
+  pthread_mutex_unlock(&t->inbox_lock);
+}
+
+/* ***************************************************** */
+
+static void flushRoutedPackets(u_int16_t thread_id) {
+  u_int16_t owner;
+
+  for(owner = 0; owner < num_threads; owner++) {
+    if(ndpi_thread_info[thread_id]->out_batch[owner] != NULL) {
+      queueBatch(owner, ndpi_thread_info[thread_id]->out_batch[owner]);
+      ndpi_thread_info[thread_id]->out_batch[owner] = NULL;
+    }
+  }
+}
+
+/* ***************************************************** */
+
+/* Copy the packet (from its IP header) into the batch of its owner */
+static void routePacket(u_int16_t thread_id, u_int16_t owner, u_int64_t time,
+			const u_char *ip_packet, u_int16_t ipsize, u_int16_t rawsize) {
+  struct packet_batch *batch = ndpi_thread_info[thread_id]->out_batch[owner];
+  u_int32_t len = (sizeof(struct routed_packet) + ipsize + 7) & ~7;
+  struct routed_packet *r;
+
+  if((batch != NULL) && (batch->len + len > ROUTE_BATCH_SIZE)) {
+    queueBatch(owner, batch);
+    batch = NULL;
+  }
+
+  if(batch == NULL) {
+    if((batch = (struct packet_batch*)malloc(sizeof(struct packet_batch))) == NULL) {
+      printf("ERROR: not enough memory to route packets to thread %u\n", owner);
+      return;
+    }
+
+    batch->len = 0;
+    ndpi_thread_info[thread_id]->out_batch[owner] = batch;
+  }
+
+  r = (struct routed_packet*)&batch->data[batch->len];
+  r->time = time, r->ipsize = ipsize, r->rawsize = rawsize;
+  memcpy(&r[1], ip_packet, ipsize);
+  batch->len += len;
+}
+
+/* ***************************************************** */
+
+static void processBatch(u_int16_t thread_id, struct packet_batch *batch) {
+  u_int32_t off = 0;
+
+  while(off < batch->len) {
+    struct routed_packet *r = (struct routed_packet*)&batch->data[off];
+    u_int8_t *ip_packet = (u_int8_t*)&r[1];
+
+    /* keep the time of this thread monotonic */
+    if(ndpi_thread_info[thread_id]->last_time < r->time)
+      ndpi_thread_info[thread_id]->last_time = r->time;
+
+    if((ip_packet[0] >> 4) == 4)
+      packet_processing(thread_id, ndpi_thread_info[thread_id]->last_time,
+			(struct ndpi_iphdr*)ip_packet, NULL, 0, r->ipsize, r->rawsize);
+    else
+      packet_processing(thread_id, ndpi_thread_info[thread_id]->last_time,
+			NULL, (struct ndpi_ip6_hdr*)ip_packet, 0, r->ipsize, r->rawsize);
+
+    off += (sizeof(struct routed_packet) + r->ipsize + 7) & ~7;
+  }
+}
+
+/* ***************************************************** */
+
+/*
+  Process the packets queued by the other threads. With wait set, block
+  until no thread is reading a file and return once nothing is left.
+*/
+static void drainRoutedPackets(u_int16_t thread_id, u_int8_t wait) {
+  struct reader_thread *t = ndpi_thread_info[thread_id];
+  struct packet_batch *batch, *next;
+
+  while(1) {
+    pthread_mutex_lock(&t->inbox_lock);
+    while(wait && (t->inbox_head == NULL) && playlist.reading)
+      pthread_cond_wait(&t->inbox_cond, &t->inbox_lock);
+    batch = t->inbox_head;
+    t->inbox_head = t->inbox_tail = NULL;
+    if(t->inbox_batches >= ROUTE_MAX_QUEUED_BATCHES)
+      pthread_cond_broadcast(&t->inbox_cond); /* the reader is waiting for room */
+    t->inbox_batches = 0;
+    pthread_mutex_unlock(&t->inbox_lock);
+
+    if(batch == NULL)
+      return;
+
+    for(; batch != NULL; batch = next) {
+      next = batch->next;
+      processBatch(thread_id, batch);
+      free(batch);
+    }
+
+    if(!wait)
+      return;
+  }
+}
+
+/* ***************************************************** */
+
+/* This thread is done with its file: hand over the next one and wake up the owners */
+static void playlistFileDone(u_int16_t thread_id) {
+  u_int16_t i;
+
+  flushRoutedPackets(thread_id);
+
+  pthread_mutex_lock(&playlist_lock);
+  playlist.reading = 0;
+  pthread_mutex_unlock(&playlist_lock);
+
+  for(i = 0; i < num_threads; i++) {
+    pthread_mutex_lock(&ndpi_thread_info[i]->inbox_lock);
+    pthread_cond_broadcast(&ndpi_thread_info[i]->inbox_cond);
+    pthread_mutex_unlock(&ndpi_thread_info[i]->inbox_lock);
+  }
+}
+
+/* ***************************************************** */
+
+/* Wait for the current file to be read, processing meanwhile the packets routed here */
+static int getNextPcapFileFromPlaylist(u_int16_t thread_id, char filename[], u_int32_t filename_len) {
+  int rc;
+
+  while((rc = takeNextPcapFile(filename, filename_len)) == 1)
+    drainRoutedPackets(thread_id, 1);
+
+  return(rc);
+}
+
+/* ***************************************************** */
+
 static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header, const u_char *packet) {
   const struct ndpi_ethhdr *ethernet;
   struct ndpi_iphdr *iph;
   struct ndpi_ip6_hdr *iph6;
   u_int64_t time;
-  u_int16_t type, ip_offset, ip_len;
+  u_int16_t type, ip_offset, ipsize;
   u_int16_t frag_off = 0;
-  u_int8_t proto = 0;
   u_int16_t thread_id = *((u_int16_t*)args);
 
   // printf("[ndpiReader] pcap_packet_callback : [%u.%u.%u.%u.%u -> %u.%u.%u.%u.%u]\n", ethernet->h_dest[1],ethernet->h_dest[2],ethernet->h_dest[3],ethernet->h_dest[4],ethernet->h_dest[5],ethernet->h_source[1],ethernet->h_source[2],ethernet->h_source[3],ethernet->h_source[4],ethernet->h_source[5]);
-  ndpi_thread_info[thread_id].stats.raw_packet_count++;
+  ndpi_thread_info[thread_id]->stats.raw_packet_count++;
 
   if((capture_until != 0) && (header->ts.tv_sec >= capture_until)) {
-    if(ndpi_thread_info[thread_id]._pcap_handle != NULL)
-      pcap_breakloop(ndpi_thread_info[thread_id]._pcap_handle);
+    if(ndpi_thread_info[thread_id]->_pcap_handle != NULL)
+      pcap_breakloop(ndpi_thread_info[thread_id]->_pcap_handle);
 
     return;
   }
@@ -1322,24 +2336,27 @@ static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header,
   time = ((uint64_t) header->ts.tv_sec) * detection_tick_resolution +
     header->ts.tv_usec / (1000000 / detection_tick_resolution);
 
-  if(ndpi_thread_info[thread_id].last_time > time) { /* safety check */
-    // printf("\nWARNING: timestamp bug in the pcap file (ts delta: %llu, repairing)\n", ndpi_thread_info[thread_id].last_time - time);
-    time = ndpi_thread_info[thread_id].last_time;
+  if(ndpi_thread_info[thread_id]->last_time > time) { /* safety check */
+    // printf("\nWARNING: timestamp bug in the pcap file (ts delta: %llu, repairing)\n", ndpi_thread_info[thread_id]->last_time - time);
+    time = ndpi_thread_info[thread_id]->last_time;
   }
-  ndpi_thread_info[thread_id].last_time = time;
+  ndpi_thread_info[thread_id]->last_time = time;
+
+  if(ndpi_thread_info[thread_id]->last_stats_publish_time + NDPI_STATS_PUBLISH_PERIOD <= time)
+    publishThreadStats(thread_id);
 
-  if(ndpi_thread_info[thread_id]._pcap_datalink_type == DLT_NULL) {
+  if(ndpi_thread_info[thread_id]->_pcap_datalink_type == DLT_NULL) {
     if(ntohl(*((u_int32_t*)packet)) == 2)
       type = ETH_P_IP;
     else
       type = 0x86DD; /* IPv6 */
 
     ip_offset = 4;
-  } else if(ndpi_thread_info[thread_id]._pcap_datalink_type == DLT_EN10MB) {
+  } else if(ndpi_thread_info[thread_id]->_pcap_datalink_type == DLT_EN10MB) {
     ethernet = (struct ndpi_ethhdr *) packet;
     ip_offset = sizeof(struct ndpi_ethhdr);
     type = ntohs(ethernet->h_proto);
-  } else if(ndpi_thread_info[thread_id]._pcap_datalink_type == 113 /* Linux Cooked Capture */) {
+  } else if(ndpi_thread_info[thread_id]->_pcap_datalink_type == 113 /* Linux Cooked Capture */) {
     type = (packet[14] << 8) + packet[15];
     ip_offset = 16;
   } else
@@ -1349,11 +2366,11 @@ static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header,
     if(type == 0x8100 /* VLAN */) {
       type = (packet[ip_offset+2] << 8) + packet[ip_offset+3];
       ip_offset += 4;
-      ndpi_thread_info[thread_id].stats.vlan_count++;
+      ndpi_thread_info[thread_id]->stats.vlan_count++;
     } else if(type == 0x8847 /* MPLS */) {
       u_int32_t label = ntohl(*((u_int32_t*)&packet[ip_offset]));
 
-      ndpi_thread_info[thread_id].stats.mpls_count++;
+      ndpi_thread_info[thread_id]->stats.mpls_count++;
       type = 0x800, ip_offset += 4;
 
       while((label & 0x100) != 0x100) {
@@ -1361,7 +2378,7 @@ static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header,
 	label = ntohl(*((u_int32_t*)&packet[ip_offset]));
       }
     } else if(type == 0x8864 /* PPPoE */) {
-      ndpi_thread_info[thread_id].stats.pppoe_count++;
+      ndpi_thread_info[thread_id]->stats.pppoe_count++;
       type = 0x0800;
       ip_offset += 8;
     } else
@@ -1374,7 +2391,6 @@ static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header,
   if(type == ETH_P_IP && header->caplen >= ip_offset) {
     frag_off = ntohs(iph->frag_off);
 
-    proto = iph->protocol;
     if(header->caplen < header->len) {
       static u_int8_t cap_warning_used = 0;
 
@@ -1386,80 +2402,148 @@ static void pcap_packet_callback(u_char *args, const struct pcap_pkthdr *header,
   }
 
   if(iph->version == 4) {
-    ip_len = ((u_short)iph->ihl * 4);
     iph6 = NULL;
 
     if((frag_off & 0x3FFF) != 0) {
       static u_int8_t ipv4_frags_warning_used = 0;
 
      v4_frags_warning:
-      ndpi_thread_info[thread_id].stats.fragmented_count++;
+      ndpi_thread_info[thread_id]->stats.fragmented_count++;
       if(ipv4_frags_warning_used == 0) {
 	if(!json_flag) printf("\n\nWARNING: IPv4 fragments are not handled by this demo (nDPI supports them)\n");
 	ipv4_frags_warning_used = 1;
       }
 
-      ndpi_thread_info[thread_id].stats.total_discarded_bytes +=  header->len;
+      ndpi_thread_info[thread_id]->stats.total_discarded_bytes +=  header->len;
       return;
     }
   } else if(iph->version == 6) {
     iph6 = (struct ndpi_ip6_hdr *)&packet[ip_offset];
-    proto = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-    ip_len = sizeof(struct ndpi_ip6_hdr);
     iph = NULL;
   } else {
     static u_int8_t ipv4_warning_used = 0;
 
-   v4_warning:
     if(ipv4_warning_used == 0) {
       if(!json_flag) printf("\n\nWARNING: only IPv4/IPv6 packets are supported in this demo (nDPI supports both IPv4 and IPv6), all other packets will be discarded\n\n");
       ipv4_warning_used = 1;
     }
 
-    ndpi_thread_info[thread_id].stats.total_discarded_bytes +=  header->len;
+    ndpi_thread_info[thread_id]->stats.total_discarded_bytes +=  header->len;
     return;
   }
 
-  if(decode_tunnels && (proto == IPPROTO_UDP)) {
-    struct ndpi_udphdr *udp = (struct ndpi_udphdr *)&packet[ip_offset+ip_len];
-    u_int16_t sport = ntohs(udp->source), dport = ntohs(udp->dest);
+  if(decode_tunnels) {
+    const u_int8_t *inner;
+    u_int16_t inner_len;
+    ndpi_tunnel_info_t tunnel;
+
+    if((ndpi_decap_packet(&packet[ip_offset], header->caplen - ip_offset, 0 /* IP */,
+			  &tunnel, &inner, &inner_len) == 0)
+       && (tunnel.num_layers > 0)) {
+      ip_offset = inner - packet;
 
-    if((sport == GTP_U_V1_PORT) || (dport == GTP_U_V1_PORT)) {
-      /* Check if it's GTPv1 */
-      u_int offset = ip_offset+ip_len+sizeof(struct ndpi_udphdr);
-      u_int8_t flags = packet[offset];
-      u_int8_t message_type = packet[offset+1];
+      if((inner[0] >> 4) == 4) {
+	iph = (struct ndpi_iphdr *)inner, iph6 = NULL;
+
+	if((ntohs(iph->frag_off) & 0x3FFF) != 0)
+	  goto v4_frags_warning;
+      } else
+	iph6 = (struct ndpi_ip6_hdr *)inner, iph = NULL;
+    }
+  }
 
-      if((((flags & 0xE0) >> 5) == 1 /* GTPv1 */) && (message_type == 0xFF /* T-PDU */)) {
-	ip_offset = ip_offset+ip_len+sizeof(struct ndpi_udphdr)+8 /* GTPv1 header len */;
+  /* only the captured bytes are parsed, whichever thread owns the flow */
+  ipsize = ((header->caplen < header->len) ? header->caplen : header->len) - ip_offset;
 
-	if(flags & 0x04) ip_offset += 1; /* next_ext_header is present */
-	if(flags & 0x02) ip_offset += 4; /* sequence_number is present (it also includes next_ext_header and pdu_number) */
-	if(flags & 0x01) ip_offset += 1; /* pdu_number is present */
+  if(playlist.route_packets) {
+    u_int16_t owner = flowOwnerThread(iph, iph6, ipsize);
 
-	iph = (struct ndpi_iphdr *) &packet[ip_offset];
+    if(ndpi_thread_info[thread_id]->inbox_head != NULL)
+      drainRoutedPackets(thread_id, 0);
 
-	if(iph->version != 4) {
-	  // printf("WARNING: not good (packet_id=%u)!\n", (unsigned int)ndpi_thread_info[thread_id].stats.raw_packet_count);
-	  goto v4_warning;
-	}
-      }
+    if(owner != thread_id) {
+      routePacket(thread_id, owner, time, &packet[ip_offset], ipsize, header->len);
+      return;
     }
   }
 
   // process the packet
-  packet_processing(thread_id, time, iph, iph6, ip_offset, header->len - ip_offset, header->len);
+  packet_processing(thread_id, time, iph, iph6, ip_offset, ipsize, header->len);
 }
 
 /* ******************************************************************** */
 
 static void runPcapLoop(u_int16_t thread_id) {
-  if((!shutdown_app) && (ndpi_thread_info[thread_id]._pcap_handle != NULL))
-    pcap_loop(ndpi_thread_info[thread_id]._pcap_handle, -1, &pcap_packet_callback, (u_char*)&thread_id);
+  if((!shutdown_app) && (ndpi_thread_info[thread_id]->_pcap_handle != NULL))
+    pcap_loop(ndpi_thread_info[thread_id]->_pcap_handle, -1, &pcap_packet_callback, (u_char*)&thread_id);
 }
 
 /* ******************************************************************** */
 
+#ifdef NDPI_READER_NUMA
+
+#define NUMA_MAX_SAMPLED_PAGES   4096
+
+struct numa_sample {
+  void *pages[NUMA_MAX_SAMPLED_PAGES];
+  int status[NUMA_MAX_SAMPLED_PAGES];
+  u_int32_t num_pages;
+};
+
+static void numaSampleRange(struct numa_sample *s, const void *addr, size_t len) {
+  uintptr_t page_size = numa_pagesize(), p = (uintptr_t)addr & ~(page_size - 1);
+
+  for(; (p < (uintptr_t)addr + len) && (s->num_pages < NUMA_MAX_SAMPLED_PAGES); p += page_size)
+    s->pages[s->num_pages++] = (void*)p;
+}
+
+/* ***************************************************** */
+
+static void numaSampleFlow(const void *node, ndpi_VISIT which, int depth, void *user_data) {
+  struct ndpi_flow *flow = *(struct ndpi_flow**)node;
+
+  if((which == ndpi_preorder) || (which == ndpi_leaf)) {
+    numaSampleRange((struct numa_sample*)user_data, flow, sizeof(struct ndpi_flow));
+
+    if(flow->ndpi_flow)
+      numaSampleRange((struct numa_sample*)user_data, flow->ndpi_flow, size_flow_struct);
+  }
+}
+
+/* ***************************************************** */
+
+/* Count the pages of the thread state (up to a budget) living on another node */
+static void checkNumaPlacement(u_int16_t thread_id) {
+  struct reader_thread *t = ndpi_thread_info[thread_id];
+  struct numa_sample *s;
+  u_int32_t i;
+
+  if((t->numa_node < 0) || ((s = (struct numa_sample*)calloc(1, sizeof(struct numa_sample))) == NULL))
+    return;
+
+  numaSampleRange(s, t, sizeof(struct reader_thread));
+  numaSampleRange(s, t->ndpi_struct, sizeof(struct ndpi_detection_module_struct));
+
+  for(i = 0; i < NUM_ROOTS; i++)
+    ndpi_twalk(t->ndpi_flows_root[i], numaSampleFlow, s);
+
+  /* no target nodes: only report where the pages are */
+  if(numa_move_pages(0, s->num_pages, s->pages, NULL, s->status, 0) == 0) {
+    for(i = 0; i < s->num_pages; i++) {
+      if(s->status[i] == t->numa_node)
+	t->numa_local_pages++;
+      else if(s->status[i] >= 0)
+	t->numa_remote_pages++;
+    }
+  }
+
+  free(s);
+}
+
+#endif
+
+/* ******************************************************************** */
+
 void *processing_thread(void *_thread_id) {
   long thread_id = (long) _thread_id;
 
@@ -1478,19 +2562,47 @@ void *processing_thread(void *_thread_id) {
 #endif 
     if(!json_flag) printf("Running thread %ld...\n", thread_id);
 
+  /* built once bound: module and flows are first touched on this node */
+  setupDetection(thread_id);
+
+  pthread_mutex_lock(&setup_lock);
+  num_threads_ready++;
+  pthread_cond_broadcast(&setup_cond);
+  while(!start_processing)
+    pthread_cond_wait(&setup_cond, &setup_lock);
+  pthread_mutex_unlock(&setup_lock);
+
 pcap_loop:
   runPcapLoop(thread_id);
 
-  if(playlist_fp[thread_id] != NULL) { /* playlist: read next file */
+  if(playlist.files != NULL) { /* playlist: take the next file once the current one is read */
     char filename[256];
 
-    if(getNextPcapFileFromPlaylist(thread_id, filename, sizeof(filename)) == 0 &&
-        (ndpi_thread_info[thread_id]._pcap_handle = pcap_open_offline(filename, ndpi_thread_info[thread_id]._pcap_error_buffer)) != NULL) {
-      configurePcapHandle(thread_id);
-      goto pcap_loop;
+    if(ndpi_thread_info[thread_id]->_pcap_handle != NULL) {
+      closePcapFile(thread_id);
+      playlistFileDone(thread_id);
     }
+
+    while(getNextPcapFileFromPlaylist(thread_id, filename, sizeof(filename)) == 0) {
+      if((ndpi_thread_info[thread_id]->_pcap_handle = pcap_open_offline(filename, ndpi_thread_info[thread_id]->_pcap_error_buffer)) != NULL) {
+	configurePcapHandle(thread_id);
+	goto pcap_loop;
+      }
+
+      printf("WARNING: skipping %s: %s\n", filename, ndpi_thread_info[thread_id]->_pcap_error_buffer);
+      playlistFileDone(thread_id);
+    }
+
+    if(playlist.route_packets)
+      drainRoutedPackets(thread_id, 1);
   }
 
+  publishThreadStats(thread_id);
+
+#ifdef NDPI_READER_NUMA
+  checkNumaPlacement(thread_id);
+#endif
+
   return NULL;
 }
 
@@ -1503,20 +2615,38 @@ void test_lib() {
   
   json_init();
 
+  /* -l: every loop starts its threads again */
+  pthread_mutex_lock(&setup_lock);
+  num_threads_ready = 0, start_processing = 0;
+  pthread_mutex_unlock(&setup_lock);
+
   for(thread_id = 0; thread_id < num_threads; thread_id++) {
-    setupDetection(thread_id);
+    allocThreadInfo(thread_id);
     openPcapFileOrDevice(thread_id);
   }
 
+  /* Running processing threads: each one sets up its own detection */
+  for(thread_id = 0; thread_id < num_threads; thread_id++)
+    pthread_create(&ndpi_thread_info[thread_id]->pthread, NULL, processing_thread, (void *) thread_id);
+
+  pthread_mutex_lock(&setup_lock);
+  while(num_threads_ready < num_threads)
+    pthread_cond_wait(&setup_cond, &setup_lock);
+  pthread_mutex_unlock(&setup_lock);
+
+  openStatsShm();
+  openFlowsShm();
+
   gettimeofday(&begin, NULL);
 
-  /* Running processing threads */
-  for(thread_id = 0; thread_id < num_threads; thread_id++)
-    pthread_create(&ndpi_thread_info[thread_id].pthread, NULL, processing_thread, (void *) thread_id);
+  pthread_mutex_lock(&setup_lock);
+  start_processing = 1;
+  pthread_cond_broadcast(&setup_cond);
+  pthread_mutex_unlock(&setup_lock);
 
   /* Waiting for completion */
   for(thread_id = 0; thread_id < num_threads; thread_id++)
-    pthread_join(ndpi_thread_info[thread_id].pthread, NULL);
+    pthread_join(ndpi_thread_info[thread_id]->pthread, NULL);
 
   gettimeofday(&end, NULL);
   tot_usec = end.tv_sec*1000000 + end.tv_usec - (begin.tv_sec*1000000 + begin.tv_usec);
@@ -1527,7 +2657,10 @@ void test_lib() {
   for(thread_id = 0; thread_id < num_threads; thread_id++) {
     closePcapFile(thread_id);
     terminateDetection(thread_id);
+    freeThreadInfo(thread_id);
   }
+
+  freePlaylist();
 }
 
 /* ***************************************************** */
@@ -1555,6 +2688,9 @@ int main(int argc, char **argv) {
   for(i=0; i<num_loops; i++)
     test_lib();
 
+  closeStatsShm();
+  closeFlowsShm();
+
   return 0;
 }
 
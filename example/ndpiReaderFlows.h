@@ -0,0 +1,102 @@
+/*
+ * ndpiReaderFlows.h
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __NDPI_READER_FLOWS_H__
+#define __NDPI_READER_FLOWS_H__
+
+/*
+  Layout of the shared memory segment ndpiReader -e <name> exports its
+  flows to (see ndpiFlowsConsumer.h for the reading side).
+
+  The segment starts with a ndpi_flows_shm_header followed by one ring
+  per reader thread. A ring is a ndpi_flows_ring immediately followed by
+  ring_slots fixed-size ndpi_flow_record entries (ring_slots is a power
+  of 2).
+
+  Each ring has a single producer, its reader thread, and a single
+  consumer. head and tail count the records written and read since the
+  segment was created: record n lives in slot (n & (ring_slots - 1)).
+  The producer fills the slot, then advances head; the consumer copies
+  the slot, then advances tail. When the ring is full the producer drops
+  the record and increments dropped: workers never wait for consumers.
+
+  A record is written once per flow, when its detection completes
+  (protocol found or given up): packets and bytes are the counters at
+  that time.
+*/
+
+#define NDPI_FLOWS_SHM_MAGIC          0x4E44464C /* NDFL */
+#define NDPI_FLOWS_SHM_VERSION        1
+#define NDPI_FLOWS_RING_SLOTS         16384 /* records per thread */
+#define NDPI_FLOWS_PROTO_NAME_LEN     32
+#define NDPI_FLOWS_STACK_LEN          4
+#define NDPI_FLOWS_HOST_NAME_LEN      256
+#define NDPI_FLOWS_CACHE_LINE         64
+
+#define NDPI_FLOWS_NUM_PROTOCOLS      (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS + 1)
+
+#ifdef WIN32
+#define __ndpi_flows_aligned
+#else
+#define __ndpi_flows_aligned __attribute__((aligned(NDPI_FLOWS_CACHE_LINE)))
+#endif
+
+struct ndpi_flow_record {
+  u_int32_t lower_ip[4], upper_ip[4];   /* network byte order, IPv4 uses the first word */
+  u_int16_t lower_port, upper_port;     /* network byte order */
+  u_int8_t ip_version, l4_protocol;
+  u_int16_t __padding;
+  u_int16_t protocol_stack[NDPI_FLOWS_STACK_LEN]; /* [0] = detected protocol, then the underlying ones */
+  u_int64_t last_seen;                  /* msec, packet time */
+  u_int64_t packets, bytes;
+  char host_server_name[NDPI_FLOWS_HOST_NAME_LEN];
+} __ndpi_flows_aligned;
+
+struct ndpi_flows_shm_header {
+  u_int32_t magic, version;
+  u_int32_t num_rings, ring_slots;
+  u_int32_t record_len, pid;
+  u_int32_t num_protocols, __padding;
+  char protocol_names[NDPI_FLOWS_NUM_PROTOCOLS][NDPI_FLOWS_PROTO_NAME_LEN];
+} __ndpi_flows_aligned;
+
+struct ndpi_flows_ring {
+  /* written by the producer only */
+  volatile u_int64_t head;
+  u_int64_t dropped;
+
+  /* written by the consumer only, on its own cache line */
+  volatile u_int64_t tail __ndpi_flows_aligned;
+} __ndpi_flows_aligned;
+
+#define NDPI_FLOWS_RING_LEN(ring_slots) \
+  (sizeof(struct ndpi_flows_ring) + (ring_slots) * sizeof(struct ndpi_flow_record))
+
+#define NDPI_FLOWS_SHM_LEN(num_rings, ring_slots) \
+  (sizeof(struct ndpi_flows_shm_header) + (num_rings) * NDPI_FLOWS_RING_LEN(ring_slots))
+
+#define NDPI_FLOWS_SHM_RING(hdr, ring_id) \
+  ((struct ndpi_flows_ring*)((char*)(hdr) + sizeof(struct ndpi_flows_shm_header) \
+			     + (ring_id) * NDPI_FLOWS_RING_LEN((hdr)->ring_slots)))
+
+#define NDPI_FLOWS_RING_RECORD(ring, ring_slots, n) \
+  ((struct ndpi_flow_record*)((char*)(ring) + sizeof(struct ndpi_flows_ring)) + ((n) & ((ring_slots) - 1)))
+
+#endif /* __NDPI_READER_FLOWS_H__ */
@@ -0,0 +1,86 @@
+/*
+ * ndpiReaderStats.h
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __NDPI_READER_STATS_H__
+#define __NDPI_READER_STATS_H__
+
+/*
+  Layout of the shared memory segment ndpiReader -m <name> publishes and
+  ndpiStats reads.
+
+  The segment starts with a ndpi_stats_shm_header followed by one
+  ndpi_stats_shm_slot per reader thread. Each slot is written only by its
+  own thread using a sequence counter: the counter is odd while the
+  slot is being updated, so readers copy the slot and retry when the
+  counter was odd or changed during the copy. Workers never block on
+  readers.
+*/
+
+#define NDPI_STATS_SHM_MAGIC          0x4E445354 /* NDST */
+#define NDPI_STATS_SHM_VERSION        1
+#define NDPI_STATS_PUBLISH_PERIOD     1000 /* msec (packet time) */
+#define NDPI_STATS_PROTO_NAME_LEN     32
+#define NDPI_STATS_CACHE_LINE         64
+
+#define NDPI_STATS_NUM_PROTOCOLS      (NDPI_MAX_SUPPORTED_PROTOCOLS + NDPI_MAX_NUM_CUSTOM_PROTOCOLS + 1)
+
+#ifdef WIN32
+#define __ndpi_stats_aligned
+#else
+#define __ndpi_stats_aligned __attribute__((aligned(NDPI_STATS_CACHE_LINE)))
+#endif
+
+struct thread_stats {
+  u_int32_t guessed_flow_protocols;
+  u_int64_t raw_packet_count;
+  u_int64_t ip_packet_count;
+  u_int64_t total_wire_bytes, total_ip_bytes, total_discarded_bytes;
+  u_int64_t protocol_counter[NDPI_STATS_NUM_PROTOCOLS];
+  u_int64_t protocol_counter_bytes[NDPI_STATS_NUM_PROTOCOLS];
+  u_int32_t protocol_flows[NDPI_STATS_NUM_PROTOCOLS];
+  u_int32_t ndpi_flow_count;
+  u_int64_t tcp_count, udp_count;
+  u_int64_t mpls_count, pppoe_count, vlan_count, fragmented_count;
+  u_int64_t packet_len[6];
+  u_int16_t max_packet_len;
+};
+
+struct ndpi_stats_shm_header {
+  u_int32_t magic, version;
+  u_int32_t num_threads, num_protocols;
+  u_int32_t slot_len, pid;
+  char protocol_names[NDPI_STATS_NUM_PROTOCOLS][NDPI_STATS_PROTO_NAME_LEN];
+} __ndpi_stats_aligned;
+
+struct ndpi_stats_shm_slot {
+  volatile u_int32_t seq;               /* odd while the thread is writing */
+  u_int32_t __padding;
+  u_int64_t last_update;                /* msec, packet time */
+  u_int64_t pps, bps;                   /* rates over the last publish period */
+  struct thread_stats stats;
+} __ndpi_stats_aligned;
+
+#define NDPI_STATS_SHM_LEN(num_threads) \
+  (sizeof(struct ndpi_stats_shm_header) + (num_threads) * sizeof(struct ndpi_stats_shm_slot))
+
+#define NDPI_STATS_SHM_SLOT(hdr, thread_id) \
+  ((struct ndpi_stats_shm_slot*)((char*)(hdr) + sizeof(struct ndpi_stats_shm_header)) + (thread_id))
+
+#endif /* __NDPI_READER_STATS_H__ */
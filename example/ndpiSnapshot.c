@@ -0,0 +1,111 @@
+/*
+ * ndpiSnapshot.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Compiles the built-in rules, optionally extended with a protocol file,
+  into a snapshot that ndpiReader -S (or ndpi_load_snapshot()) maps at
+  startup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiSnapshot [-p <protos>] -o <snapshot>\n\n"
+	 "Usage:\n"
+	 "  -p <file>.protos          | Specify a protocol file (eg. protos.txt)\n"
+	 "  -o <file>                 | Snapshot file to create\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+static void *malloc_wrapper(unsigned long size) {
+  return malloc(size);
+}
+
+/* ***************************************************** */
+
+static void free_wrapper(void *freeable) {
+  free(freeable);
+}
+
+/* ***************************************************** */
+
+static void debug_printf(u_int32_t protocol, void *id_struct,
+			 ndpi_log_level_t log_level,
+			 const char *format, ...) {
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  struct ndpi_detection_module_struct *ndpi_struct;
+  char *protoFilePath = NULL, *snapshotPath = NULL;
+  int opt, rc;
+
+  while((opt = getopt(argc, argv, "p:o:h")) != EOF) {
+    switch(opt) {
+    case 'p':
+      protoFilePath = optarg;
+      break;
+
+    case 'o':
+      snapshotPath = optarg;
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  if(snapshotPath == NULL)
+    help();
+
+  ndpi_struct = ndpi_init_detection_module(1000, malloc_wrapper, free_wrapper, debug_printf);
+  if(ndpi_struct == NULL) {
+    printf("ERROR: global structure initialization failed\n");
+    return(-1);
+  }
+
+  if((protoFilePath != NULL) && (ndpi_load_protocols_file(ndpi_struct, protoFilePath) != 0)) {
+    printf("ERROR: unable to load protocol file %s\n", protoFilePath);
+    ndpi_exit_detection_module(ndpi_struct, free_wrapper);
+    return(-1);
+  }
+
+  if((rc = ndpi_save_snapshot(ndpi_struct, snapshotPath)) == 0)
+    printf("Snapshot %s created (%u protocols)\n", snapshotPath,
+	   ndpi_get_num_supported_protocols(ndpi_struct));
+
+  ndpi_exit_detection_module(ndpi_struct, free_wrapper);
+
+  return(rc);
+}
@@ -0,0 +1,214 @@
+/*
+ * ndpiStats.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Prints the live statistics published by a running ndpiReader -m <name>
+  without stopping or locking its reader threads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+#include "ndpiReaderStats.h"
+
+#define MAX_READ_RETRIES   1000
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiStats -m <name> [-i <interval>][-c <count>][-n <top>]\n\n"
+	 "Usage:\n"
+	 "  -m <name>                 | Shared memory segment passed to ndpiReader -m\n"
+	 "  -i <interval>             | Seconds between two reports. Default: 1\n"
+	 "  -c <count>                | Number of reports (0 = until ndpiReader exits). Default: 0\n"
+	 "  -n <top>                  | Number of protocols to print. Default: 10\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+/* Consistent copy of a slot: retry while the writer is updating it */
+static int readSlot(struct ndpi_stats_shm_slot *slot, struct ndpi_stats_shm_slot *out) {
+  u_int32_t seq, retries;
+
+  for(retries = 0; retries < MAX_READ_RETRIES; retries++) {
+    seq = slot->seq;
+    ndpi_memory_barrier();
+
+    if(seq & 1) continue;
+
+    memcpy(out, slot, sizeof(*out));
+
+    ndpi_memory_barrier();
+    if(slot->seq == seq)
+      return(0);
+  }
+
+  return(-1);
+}
+
+/* ***************************************************** */
+
+static void printReport(struct ndpi_stats_shm_header *hdr, u_int32_t top) {
+  struct ndpi_stats_shm_slot slot;
+  struct thread_stats total;
+  u_int64_t pps = 0, bps = 0;
+  u_int32_t thread_id, i, j, *order;
+
+  memset(&total, 0, sizeof(total));
+
+  for(thread_id = 0; thread_id < hdr->num_threads; thread_id++) {
+    if(readSlot(NDPI_STATS_SHM_SLOT(hdr, thread_id), &slot) != 0) {
+      printf("\tThread %-2u: busy, skipped\n", thread_id);
+      continue;
+    }
+
+    printf("\tThread %-2u: %10llu pps %14llu bps %10u flows %14llu packets\n", thread_id,
+	   (long long unsigned int)slot.pps, (long long unsigned int)slot.bps,
+	   slot.stats.ndpi_flow_count, (long long unsigned int)slot.stats.raw_packet_count);
+
+    pps += slot.pps, bps += slot.bps;
+    total.raw_packet_count += slot.stats.raw_packet_count;
+    total.total_wire_bytes += slot.stats.total_wire_bytes;
+    total.ndpi_flow_count += slot.stats.ndpi_flow_count;
+
+    for(i = 0; i < hdr->num_protocols; i++) {
+      total.protocol_counter[i] += slot.stats.protocol_counter[i];
+      total.protocol_counter_bytes[i] += slot.stats.protocol_counter_bytes[i];
+      total.protocol_flows[i] += slot.stats.protocol_flows[i];
+    }
+  }
+
+  printf("\tTotal    : %10llu pps %14llu bps %10u flows %14llu packets\n",
+	 (long long unsigned int)pps, (long long unsigned int)bps,
+	 total.ndpi_flow_count, (long long unsigned int)total.raw_packet_count);
+
+  if((top == 0) || ((order = malloc(hdr->num_protocols * sizeof(u_int32_t))) == NULL))
+    return;
+
+  /* partial selection sort: only the first <top> entries are needed */
+  for(i = 0; i < hdr->num_protocols; i++) order[i] = i;
+
+  for(i = 0; (i < top) && (i < hdr->num_protocols); i++) {
+    for(j = i + 1; j < hdr->num_protocols; j++) {
+      if(total.protocol_counter_bytes[order[j]] > total.protocol_counter_bytes[order[i]]) {
+	u_int32_t tmp = order[i];
+
+	order[i] = order[j], order[j] = tmp;
+      }
+    }
+
+    if(total.protocol_counter[order[i]] == 0) break;
+
+    printf("\t\t%-20s packets: %-13llu bytes: %-13llu flows: %-13u\n",
+	   hdr->protocol_names[order[i]],
+	   (long long unsigned int)total.protocol_counter[order[i]],
+	   (long long unsigned int)total.protocol_counter_bytes[order[i]],
+	   total.protocol_flows[order[i]]);
+  }
+
+  free(order);
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  struct ndpi_stats_shm_header *hdr;
+  char *shmName = NULL;
+  u_int32_t interval = 1, count = 0, top = 10, n;
+  struct stat st;
+  int opt, fd;
+
+  while((opt = getopt(argc, argv, "m:i:c:n:h")) != EOF) {
+    switch(opt) {
+    case 'm':
+      shmName = optarg;
+      break;
+
+    case 'i':
+      interval = atoi(optarg);
+      break;
+
+    case 'c':
+      count = atoi(optarg);
+      break;
+
+    case 'n':
+      top = atoi(optarg);
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  if(shmName == NULL)
+    help();
+
+  if((fd = shm_open(shmName, O_RDONLY, 0)) < 0) {
+    printf("ERROR: unable to open shared memory segment %s (is ndpiReader -m running?)\n", shmName);
+    return(-1);
+  }
+
+  if((fstat(fd, &st) != 0)
+     || (st.st_size < (off_t)sizeof(struct ndpi_stats_shm_header))
+     || ((hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    printf("ERROR: unable to map shared memory segment %s\n", shmName);
+    close(fd);
+    return(-1);
+  }
+
+  close(fd);
+
+  if((hdr->magic != NDPI_STATS_SHM_MAGIC)
+     || (hdr->version != NDPI_STATS_SHM_VERSION)
+     || (hdr->slot_len != sizeof(struct ndpi_stats_shm_slot))
+     || (hdr->num_protocols > NDPI_STATS_NUM_PROTOCOLS)
+     || ((size_t)st.st_size < NDPI_STATS_SHM_LEN(hdr->num_threads))) {
+    printf("ERROR: %s is not a compatible ndpiReader statistics segment\n", shmName);
+    munmap(hdr, st.st_size);
+    return(-1);
+  }
+
+  for(n = 0; (count == 0) || (n < count); n++) {
+    if(n > 0) sleep(interval);
+
+    /* ndpiReader gone: the segment was unlinked and nobody updates it */
+    if(kill(hdr->pid, 0) != 0) break;
+
+    printf("\nndpiReader [pid %u] live statistics:\n", hdr->pid);
+    printReport(hdr, top);
+    fflush(stdout);
+  }
+
+  munmap(hdr, st.st_size);
+
+  return(0);
+}
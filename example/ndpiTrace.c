@@ -0,0 +1,174 @@
+/*
+ * ndpiTrace.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Decodes the binary traces written by ndpi_trace_dump() (ndpiReader -T).
+  NDPI_LOG events only carry the source line, not the file that logged
+  it: the protocol printed is the one passed to NDPI_LOG().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "../config.h"
+#include "ndpi_api.h"
+
+static ndpi_trace_file_header_t header;
+static char *protocol_names = NULL;
+
+/* ***************************************************** */
+
+static void help(void) {
+  printf("ndpiTrace [-p <proto>] [-e <event>] <file>\n\n"
+	 "Usage:\n"
+	 "  -p <proto>                | Print only the events of this protocol\n"
+	 "  -e <event>                | Print only these events (LOG, PACKET, PROTOCOL_FOUND, PAYLOAD)\n"
+	 "  -h                        | This help\n");
+  exit(0);
+}
+
+/* ***************************************************** */
+
+static const char* protoName(u_int32_t protocol_id) {
+  if(protocol_id >= header.num_protocols)
+    return("Unknown");
+
+  return(&protocol_names[protocol_id * header.proto_name_len]);
+}
+
+/* ***************************************************** */
+
+static void printEvent(ndpi_trace_event_t *e) {
+  static const char *log_levels[] = { "ERROR", "TRACE", "DEBUG" };
+  u_int32_t i;
+
+  printf("%10u %-16s %-14s ", e->timestamp, protoName(e->protocol_id), ndpi_trace_event_name(e->event_id));
+
+  switch(e->event_id) {
+  case NDPI_TRACE_LOG:
+    printf("[line %u][%s]", e->args[0], (e->args[1] <= NDPI_LOG_DEBUG) ? log_levels[e->args[1]] : "?");
+    break;
+
+  case NDPI_TRACE_PACKET:
+    printf("[%s][len %u][%u -> %u]",
+	   (e->args[0] == 6) ? "TCP" : ((e->args[0] == 17) ? "UDP" : "IP"),
+	   e->args[1], e->args[2], e->args[3]);
+    break;
+
+  case NDPI_TRACE_PROTOCOL_FOUND:
+    printf("[%s/%s][direction %u][%s]", protoName(e->args[0]), protoName(e->args[1]), e->args[2],
+	   (e->args[3] == NDPI_REAL_PROTOCOL) ? "real" : "correlated");
+    break;
+
+  case NDPI_TRACE_PAYLOAD:
+    printf("[len %u][+%u:", e->args[0], e->args[1]);
+    for(i = 0; i < 8; i++)
+      printf(" %02X", (e->args[2 + i / 4] >> (24 - 8 * (i % 4))) & 0xFF);
+    printf("]");
+    break;
+
+  default:
+    printf("[%u %u %u %u]", e->args[0], e->args[1], e->args[2], e->args[3]);
+    break;
+  }
+
+  printf("\n");
+}
+
+/* ***************************************************** */
+
+int main(int argc, char **argv) {
+  ndpi_trace_event_t e;
+  char *proto = NULL, *event = NULL;
+  u_int32_t i, num_printed = 0;
+  FILE *fd;
+  int opt;
+
+  while((opt = getopt(argc, argv, "p:e:h")) != EOF) {
+    switch(opt) {
+    case 'p':
+      proto = optarg;
+      break;
+
+    case 'e':
+      event = optarg;
+      break;
+
+    default:
+      help();
+      break;
+    }
+  }
+
+  if(optind >= argc)
+    help();
+
+  if((fd = fopen(argv[optind], "rb")) == NULL) {
+    printf("ERROR: unable to open %s\n", argv[optind]);
+    return(-1);
+  }
+
+  if((fread(&header, sizeof(header), 1, fd) != 1)
+     || (header.magic != NDPI_TRACE_FILE_MAGIC)
+     || (header.version != NDPI_TRACE_FILE_VERSION)
+     || (header.event_len != sizeof(ndpi_trace_event_t))
+     || (header.proto_name_len == 0) || (header.proto_name_len > 256)) {
+    printf("ERROR: %s is not a trace written by this nDPI version\n", argv[optind]);
+    fclose(fd);
+    return(-1);
+  }
+
+  if(((protocol_names = calloc(header.num_protocols, header.proto_name_len)) == NULL)
+     || (fread(protocol_names, header.proto_name_len, header.num_protocols, fd) != header.num_protocols)) {
+    printf("ERROR: truncated trace %s\n", argv[optind]);
+    fclose(fd);
+    return(-1);
+  }
+
+  for(i = 0; i < header.num_protocols; i++)
+    protocol_names[(i + 1) * header.proto_name_len - 1] = '\0';
+
+  for(i = 0; i < header.num_events; i++) {
+    if(fread(&e, sizeof(e), 1, fd) != 1) {
+      printf("WARNING: trace truncated after %u events\n", i);
+      break;
+    }
+
+    if((proto != NULL) && (strcasecmp(proto, protoName(e.protocol_id)) != 0))
+      continue;
+
+    if((event != NULL) && (strcasecmp(event, ndpi_trace_event_name(e.event_id)) != 0))
+      continue;
+
+    printEvent(&e);
+    num_printed++;
+  }
+
+  printf("%u events printed, %u in the trace, %llu recorded (%llu overwritten)\n",
+	 num_printed, header.num_events, (long long unsigned int)header.num_recorded,
+	 (long long unsigned int)(header.num_recorded - header.num_events));
+
+  fclose(fd);
+  free(protocol_names);
+
+  return(0);
+}
@@ -54,6 +54,32 @@ extern "C" {
   void  ndpi_free(void *ptr);
   void *ndpi_realloc(void *ptr, size_t old_size, size_t new_size);
   char *ndpi_strdup(const char *s);
+
+  /* Accounted malloc/free: memory must be released with ndpi_free_tag() */
+  void* ndpi_malloc_tag(unsigned long size, ndpi_mem_tag_t tag);
+  void* ndpi_calloc_tag(unsigned long count, unsigned long size, ndpi_mem_tag_t tag);
+  void *ndpi_realloc_tag(void *ptr, size_t old_size, size_t new_size);
+  char *ndpi_strdup_tag(const char *s, ndpi_mem_tag_t tag);
+  void  ndpi_free_tag(void *ptr);
+
+  /**
+   * Returns the bytes allocated by the library per subsystem (shared by
+   * all the modules of the process) and the number of rules of a module,
+   * so that the cost of a flow or of a rule can be derived.
+   * Flows are accounted only when the caller allocates them with
+   * ndpi_calloc_tag(..., NDPI_MEM_FLOWS)
+   * @param ndpi_mod the detection module whose rules are counted (may be NULL)
+   * @param stats filled with the current counters
+   */
+  void ndpi_get_memory_stats(struct ndpi_detection_module_struct *ndpi_mod,
+			     ndpi_memory_stats_t *stats);
+
+  /**
+   * Returns the printable name of a memory tag
+   * @param tag the memory tag
+   * @return the tag name
+   */
+  const char* ndpi_get_memory_tag_name(ndpi_mem_tag_t tag);
  /*
  * Find the first occurrence of find in s, where the search is limited to the
  * first slen characters of s.
@@ -73,16 +99,88 @@ extern "C" {
 								  ndpi_debug_function_ptr ndpi_debug_printf);
 
   /**
-   * This function enables cache support in nDPI used for some protocol such as Skype
-   * @param cache host name
-   * @param cache port
+   * Enables the server endpoint cache: once the same (server address,
+   * port, L4 protocol) has been detected NDPI_FLOW_CACHE_MIN_CONFIDENCE
+   * times, new flows towards it are classified on their first packet.
+   * The cache is shared by all the modules of the process that enable it
+   * (they must use the same tick resolution)
+   * @param ndpi_mod the detection module
+   * @param host Redis-protocol server used to share entries (NULL for none)
+   * @param port Redis-protocol server port
    */
   void ndpi_enable_cache(struct ndpi_detection_module_struct *ndpi_mod, char* host, u_int port);
 
+  /**
+   * Enables adaptive dissector ordering: the module counts how often each
+   * dissector of the TCP payload and UDP tables detects or excludes its
+   * protocol, and every reorder_interval packets it reorders the tables
+   * so that the dissectors most likely to conclude run first. Call it
+   * after ndpi_set_protocol_detection_bitmask2(), which resets the order
+   * @param ndpi_mod the detection module
+   * @param reorder_interval packets between two reorders (0 = never reorder)
+   * @return 0 on success, -1 when out of memory
+   */
+  int ndpi_enable_adaptive_order(struct ndpi_detection_module_struct *ndpi_mod, u_int32_t reorder_interval);
+
+  /**
+   * Disables adaptive dissector ordering and restores the registration order
+   * @param ndpi_mod the detection module
+   */
+  void ndpi_disable_adaptive_order(struct ndpi_detection_module_struct *ndpi_mod);
+
+  /**
+   * Returns the order in which the dissectors of a table are called
+   * @param ndpi_mod the detection module
+   * @param l4_proto IPPROTO_TCP (payload table) or IPPROTO_UDP
+   * @param protocol_ids filled with the protocol id of each dissector
+   * @param max_ids size of protocol_ids
+   * @return the number of protocol ids written
+   */
+  u_int32_t ndpi_get_dissector_order(struct ndpi_detection_module_struct *ndpi_mod,
+				     u_int8_t l4_proto, u_int16_t *protocol_ids, u_int32_t max_ids);
+
+  /**
+   * Pins the order of a table, e.g. one previously exported with
+   * ndpi_get_dissector_order(): the listed dissectors run first, in the
+   * given order, followed by the others. Adaptive reordering stops until
+   * ndpi_enable_adaptive_order() is called again
+   * @param ndpi_mod the detection module
+   * @param l4_proto IPPROTO_TCP (payload table) or IPPROTO_UDP
+   * @param protocol_ids the protocol ids, first to run first
+   * @param num_ids number of entries in protocol_ids
+   * @return 0 on success, -1 on error
+   */
+  int ndpi_set_dissector_order(struct ndpi_detection_module_struct *ndpi_mod,
+			       u_int8_t l4_proto, const u_int16_t *protocol_ids, u_int32_t num_ids);
+
+  /**
+   * Returns the dissectors tried first on a port, before the whole table:
+   * the protocols registered on the port followed by the ones that
+   * detected flows there, most detected first
+   * @param ndpi_mod the detection module
+   * @param l4_proto IPPROTO_TCP or IPPROTO_UDP
+   * @param port the port (host byte order)
+   * @param protocol_ids filled with the candidate protocol ids
+   * @param max_ids size of protocol_ids
+   * @return the number of protocol ids written
+   */
+  u_int32_t ndpi_get_port_candidates(struct ndpi_detection_module_struct *ndpi_mod,
+				     u_int8_t l4_proto, u_int16_t port,
+				     u_int16_t *protocol_ids, u_int32_t max_ids);
+
+
+  /**
+   * Releases the per-protocol records dissectors attached to a host id.
+   * Call it before freeing or reusing an ndpi_id_struct
+   * @param id the host id
+   */
+  void ndpi_free_id_state(struct ndpi_id_struct *id);
+
   /**
    * This function destroys the detection module
    * @param ndpi_struct the to clearing detection module
-   * @param ndpi_free function pointer to a memory free function
+   * @param ndpi_free unused: the module memory is released with the free
+   *        function passed to ndpi_init_detection_module()
    */
   void
   ndpi_exit_detection_module(struct ndpi_detection_module_struct
@@ -162,6 +260,47 @@ extern "C" {
   int ndpi_match_content_subprotocol(struct ndpi_detection_module_struct *ndpi_struct,
 				     struct ndpi_flow_struct *flow,
 				     char *string_to_match, u_int string_to_match_len);
+  /**
+   * classifies an HTTP User-Agent line in a single pass: sets
+   * flow->detected_os_id, flow->detected_client_id and flow->detected_os
+   * when an operating system or client is recognised
+   * @param ndpi_struct the detection module
+   * @param flow the flow
+   * @param ua the User-Agent value (not NULL terminated)
+   * @param ua_len length of ua
+   */
+  void ndpi_match_user_agent(struct ndpi_detection_module_struct *ndpi_struct,
+			     struct ndpi_flow_struct *flow,
+			     const char *ua, u_int ua_len);
+  /**
+   * @return the name of an ndpi_os_id_t, "Unknown" when out of range
+   */
+  const char* ndpi_get_os_name(u_int8_t os_id);
+  /**
+   * @return the name of an ndpi_ua_client_id_t, "Unknown" when out of range
+   */
+  const char* ndpi_get_ua_client_name(u_int8_t client_id);
+  /**
+   * registers a payload prefix for a protocol. All prefixes are kept in a single
+   * anchored trie that is walked once per packet before the dissectors are called.
+   * @param ndpi_struct the detection module
+   * @param prefix the bytes the payload must start with
+   * @param prefix_len length of the prefix
+   * @param protocol_id the protocol the prefix belongs to
+   * @param kind NDPI_PREFIX_REQUEST or NDPI_PREFIX_RESPONSE
+   * @return 0 on success, a negative value on error
+   */
+  int ndpi_add_prefix_signature(struct ndpi_detection_module_struct *ndpi_struct,
+				const u_int8_t *prefix, u_int16_t prefix_len,
+				u_int16_t protocol_id, u_int8_t kind);
+  /**
+   * checks whether the current packet payload starts with a prefix registered
+   * for the given protocol and kind
+   * @return 1 if a prefix matched, 0 otherwise
+   */
+  int ndpi_match_prefix_signature(struct ndpi_detection_module_struct *ndpi_struct,
+				  struct ndpi_flow_struct *flow,
+				  u_int16_t protocol_id, u_int8_t kind);
   char* ndpi_get_proto_name(struct ndpi_detection_module_struct *mod, u_int16_t proto_id);
   int ndpi_get_protocol_id(struct ndpi_detection_module_struct *ndpi_mod, char *proto);
   void ndpi_dump_protocols(struct ndpi_detection_module_struct *mod);
@@ -169,6 +308,159 @@ extern "C" {
 			  char *string_to_match, u_int string_to_match_len);
 
   int ndpi_load_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char* path);
+  /**
+   * builds new port trees and host automa from the default protocol settings
+   * and the given protos file, then publishes them in place of the current
+   * ones. It can be called by a thread other than the one processing packets,
+   * which is never blocked: the replaced rules are freed once no packet
+   * processing can reference them anymore. Reloads of the same module must
+   * not run concurrently. The protocols are not reloaded: a file using a
+   * protocol the module does not know yet is refused
+   * @param ndpi_mod the detection module
+   * @param path the protos file
+   * @return 0 on success, -4 if the file defines new protocols (on error
+   *         the current rules are left untouched)
+   */
+  int ndpi_reload_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char* path);
+  /**
+   * frees the rules replaced by ndpi_reload_protocols_file() that are no
+   * longer in use
+   * @param ndpi_mod the detection module
+   * @return the number of replaced rules still in use
+   */
+  int ndpi_free_retired_rules(struct ndpi_detection_module_struct *ndpi_mod);
+  /**
+   * saves the rules in use (protocols, ports and host automa) into a
+   * precompiled snapshot file
+   * @param ndpi_mod the detection module
+   * @param path the snapshot file to create
+   * @return 0 on success
+   */
+  int ndpi_save_snapshot(struct ndpi_detection_module_struct *ndpi_mod, char *path);
+  /**
+   * maps a snapshot created by ndpi_save_snapshot() and uses it in place
+   * of the rules in use. The snapshot must come from the same nDPI build
+   * @param ndpi_mod the detection module
+   * @param path the snapshot file
+   * @return 0 on success (on error the current rules are left untouched)
+   */
+  int ndpi_load_snapshot(struct ndpi_detection_module_struct *ndpi_mod, char *path);
+  /**
+   * walks the encapsulation stack of a packet (VLAN, MPLS, PPPoE, GRE,
+   * GTP-U, VXLAN, IP-in-IP, in any order and nesting) without copying it
+   * and returns the innermost IP packet
+   * @param data the packet, starting at the header described by ethertype
+   * @param len the number of bytes available at data
+   * @param ethertype type of the first header (e.g. 0x0800 for IPv4, 0x8847
+   *        for MPLS, 0x6558 for Ethernet) or 0 to use the IP version field
+   * @param info if not NULL, filled with the layers crossed and their
+   *        identifiers (TEID, VNI, GRE key, ...)
+   * @param inner set to the innermost IPv4/IPv6 header
+   * @param inner_len set to the length of the innermost IP packet
+   * @return 0 on success, -1 when the packet is truncated, malformed or
+   *         does not end with IP
+   */
+  int ndpi_decap_packet(const u_int8_t *data, u_int16_t len, u_int16_t ethertype,
+			ndpi_tunnel_info_t *info, const u_int8_t **inner, u_int16_t *inner_len);
+  /**
+   * creates a flow table feeding ndpi_detection_process_packet(). It
+   * tracks flows by canonical tuple, allocates their flow and id structs
+   * and expires them. A manager is not thread safe: use one per thread
+   * @param ndpi_mod the detection module used by the flows
+   * @param max_memory bytes the flows may use (0 = no cap): the least
+   *        recently seen flows are evicted to stay below it
+   * @param idle_timeout flows not seen for longer are expired, in the
+   *        unit of the packet timestamps (0 = never)
+   * @return the manager or NULL if there is not enough memory
+   */
+  ndpi_flow_manager_t* ndpi_flow_manager_init(struct ndpi_detection_module_struct *ndpi_mod,
+					      u_int64_t max_memory, u_int64_t idle_timeout);
+  /**
+   * sets the functions called when the detection of a flow completes
+   * (protocol found or given up), when it is expired for being idle and
+   * when it is evicted to honor the memory cap. flow->ndpi_flow is still
+   * valid in flow_detected. The flow is freed after flow_idle and
+   * flow_evicted return. Each function may be NULL
+   * @param fm the flow manager
+   * @param user_data passed back to the functions
+   */
+  void ndpi_flow_manager_set_callbacks(ndpi_flow_manager_t *fm,
+				       ndpi_flow_manager_callback flow_detected,
+				       ndpi_flow_manager_callback flow_idle,
+				       ndpi_flow_manager_callback flow_evicted,
+				       void *user_data);
+  /**
+   * processes a packet: finds or creates its flow, updates its counters
+   * and runs the detection until it completes. Idle flows are expired
+   * as time goes by
+   * @param fm the flow manager
+   * @param packet the packet, starting at its IPv4 or IPv6 header
+   * @param packetlen the number of bytes available at packet
+   * @param time the packet timestamp (ticks of the detection module, not
+   *        decreasing)
+   * @return the flow of the packet, NULL if the packet is not IP, is a
+   *         non-first fragment, is malformed or no memory is left
+   */
+  ndpi_managed_flow_t* ndpi_flow_manager_process_packet(ndpi_flow_manager_t *fm,
+							const u_int8_t *packet, u_int16_t packetlen,
+							u_int64_t time);
+  /**
+   * expires the flows idle at a given time (e.g. when no packets arrive)
+   * @param fm the flow manager
+   * @param time the current time
+   * @return the number of flows expired
+   */
+  u_int32_t ndpi_flow_manager_expire_idle(ndpi_flow_manager_t *fm, u_int64_t time);
+  /**
+   * calls a function for each flow, most recently seen first. The
+   * function must not add or remove flows
+   * @param fm the flow manager
+   * @param walker the function
+   * @param user_data passed back to walker
+   */
+  void ndpi_flow_manager_walk(ndpi_flow_manager_t *fm, ndpi_flow_manager_callback walker, void *user_data);
+  /**
+   * frees the manager and its flows without calling any callback
+   * @param fm the flow manager
+   */
+  void ndpi_flow_manager_release(ndpi_flow_manager_t *fm);
+  /**
+   * enables the binary trace of a module: NDPI_TRACE() events and
+   * NDPI_LOG() calls (line and level only, unless debug messages are
+   * compiled in) are recorded in a ring, overwriting the oldest ones.
+   * The ring is not locked: it belongs to the thread using the module
+   * @param ndpi_struct the detection module
+   * @param num_events ring size, rounded up to a power of 2
+   * @return 0 on success, -1 if there is not enough memory
+   */
+  int ndpi_trace_enable(struct ndpi_detection_module_struct *ndpi_struct, u_int32_t num_events);
+  /**
+   * restricts the trace to some protocols (all by default). Events not
+   * bound to a protocol (e.g. NDPI_TRACE_PACKET) use NDPI_PROTOCOL_UNKNOWN
+   * @param ndpi_struct the detection module
+   * @param protocols the protocols to trace
+   * @return 0 on success, -1 if the trace is not enabled
+   */
+  int ndpi_trace_set_protocols(struct ndpi_detection_module_struct *ndpi_struct,
+			       NDPI_PROTOCOL_BITMASK *protocols);
+  /**
+   * stops the trace and frees its ring
+   * @param ndpi_struct the detection module
+   */
+  void ndpi_trace_disable(struct ndpi_detection_module_struct *ndpi_struct);
+  /**
+   * writes the events of the ring (oldest first) and the protocol names
+   * to a file decoded by example/ndpiTrace
+   * @param ndpi_struct the detection module
+   * @param path the file to create
+   * @return 0 on success, a negative value on error
+   */
+  int ndpi_trace_dump(struct ndpi_detection_module_struct *ndpi_struct, const char *path);
+  /**
+   * @param event_id a ndpi_trace_event_id_t
+   * @return the name of the event
+   */
+  const char* ndpi_trace_event_name(u_int16_t event_id);
   u_int ndpi_get_num_supported_protocols(struct ndpi_detection_module_struct *ndpi_mod);
   char* ndpi_revision(void);
   void ndpi_set_automa(struct ndpi_detection_module_struct *ndpi_struct, void* automa);
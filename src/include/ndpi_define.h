@@ -145,6 +145,53 @@
 #define MAX_PACKET_COUNTER                                   65000
 #define MAX_DEFAULT_PORTS                                        5
 
+/* Anchored prefix signatures (see ndpi_add_prefix_signature) */
+#define NDPI_MAX_PREFIX_HITS                                     8
+#define NDPI_PREFIX_REQUEST                                      0
+#define NDPI_PREFIX_RESPONSE                                     1
+
+/* Dissectors tried first on a port (see ndpi_get_port_candidates) */
+#define NDPI_MAX_PORT_CANDIDATES                                 6
+#define NDPI_MAX_LEARNED_PORTS                                   1024 /* per l4 protocol */
+#define NDPI_LAST_LEARNED_PORT                                   49151 /* below the ephemeral range */
+
+/* Anchored host rules (=name, *.name, ~name): markers framing the matched name */
+#define NDPI_HOST_BEGIN_MARKER                                   '\x02'
+#define NDPI_HOST_END_MARKER                                     '\x03'
+#define NDPI_HOST_RULE_MAX_PATTERNS                              4
+
+/* Address to host name cache learnt from DNS responses (see ndpi_dns_cache_add) */
+#define NDPI_DNS_CACHE_SIZE                                      1024 /* entries */
+#define NDPI_DNS_CACHE_WAYS                                      4
+#define NDPI_DNS_CACHE_NAME_LEN                                  64
+#define NDPI_DNS_CACHE_MAX_TTL                                   3600 /* sec */
+
+/* DNS message parser (protocols/dns.c) */
+#define NDPI_MAX_DNS_REQUESTS                                    16 /* questions/answers a message may announce */
+#define NDPI_DNS_MAX_ADDRESSES                                   15 /* A/AAAA answers kept in flow->protos.dns */
+#define NDPI_DNS_MAX_RECORDS                                     (NDPI_DNS_MAX_ADDRESSES + 1 /* CNAME */)
+#define NDPI_DNS_RDATA_LEN                                       96 /* answer data kept in flow->protos.dns */
+#define NDPI_DNS_CNAME_MAX_LEN                                   32 /* first CNAME target kept, NUL included */
+#define NDPI_DNS_MAX_NAME_STEPS                                  128 /* labels and pointers followed per name */
+#define NDPI_DNS_TYPE_A                                          1
+#define NDPI_DNS_TYPE_CNAME                                      5
+#define NDPI_DNS_TYPE_AAAA                                       28
+
+/* TLS ClientHello parser (protocols/ssl.c) */
+#define NDPI_TLS_ALPN_LEN                                        48 /* protocols offered, comma separated */
+
+/* Server endpoint to protocol cache (see ndpi_enable_cache) */
+#define NDPI_FLOW_CACHE_SHARDS                                   16
+#define NDPI_FLOW_CACHE_SETS                                     256 /* per shard */
+#define NDPI_FLOW_CACHE_WAYS                                     4
+#define NDPI_FLOW_CACHE_TTL                                      600 /* sec */
+#define NDPI_FLOW_CACHE_MIN_CONFIDENCE                           2 /* matching detections */
+
+/* Tunnel decapsulation (see ndpi_decap_packet) */
+#define NDPI_MAX_TUNNEL_LAYERS                                   8
+#define NDPI_GTP_U_PORT                                          2152
+#define NDPI_VXLAN_PORT                                          4789
+
 /**********************
  * detection features *
  **********************/
@@ -165,11 +212,32 @@
 #define NDPI_JABBER_FT_TIMEOUT				       5
 #define NDPI_SOULSEEK_CONNECTION_IP_TICK_TIMEOUT               600
 
+#define NDPI_TRACE_NUM_ARGS                                    4
+#define NDPI_TRACE_FILE_MAGIC                                  0x4E445054 /* NDPT */
+#define NDPI_TRACE_FILE_VERSION                                1
+#define NDPI_TRACE_PROTO_NAME_LEN                              32
+
+/* records a binary event in the trace ring of the module (if any) */
+#define NDPI_TRACE(mod, proto, event, a0, a1, a2, a3)			\
+  {									\
+    if(((mod) != NULL) && ((mod)->trace_ring != NULL)		\
+       && ((u_int32_t)(proto) < NDPI_NUM_BITS)				\
+       && NDPI_COMPARE_PROTOCOL_TO_BITMASK((mod)->trace_ring->protocols, (proto))) \
+      ndpi_trace_record(mod, proto, event, a0, a1, a2, a3);		\
+  }
+
+/* payload length, offset and the 8 payload bytes found there (zero past the end) */
+#define NDPI_TRACE_PAYLOAD_BYTES(mod, proto, payload, payload_len, offset) \
+  NDPI_TRACE(mod, proto, NDPI_TRACE_PAYLOAD, payload_len, offset,	\
+	     ndpi_trace_payload_word(payload, payload_len, offset),	\
+	     ndpi_trace_payload_word(payload, payload_len, (offset) + 4))
+
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
 
 #define NDPI_LOG(proto, mod, log_level, args...)		\
   {								\
     if(mod != NULL) {						\
+      NDPI_TRACE(mod, proto, NDPI_TRACE_LOG, __LINE__, log_level, 0, 0); \
       mod->ndpi_debug_print_file=__FILE__;                      \
       mod->ndpi_debug_print_function=__FUNCTION__;              \
       mod->ndpi_debug_print_line=__LINE__;                      \
@@ -182,7 +250,9 @@
 #if defined(WIN32)
 #define NDPI_LOG(...) {}
 #else
-#define NDPI_LOG(proto, mod, log_level, args...) {}
+/* the format arguments are dropped: ndpiTrace maps (protocol, line) back to the source */
+#define NDPI_LOG(proto, mod, log_level, args...)			\
+  NDPI_TRACE(mod, proto, NDPI_TRACE_LOG, __LINE__, log_level, 0, 0)
 #endif
 
 #endif							/* NDPI_ENABLE_DEBUG_MESSAGES */
@@ -278,6 +348,14 @@
 
 #endif							/* __BYTE_ORDER */
 
+#ifdef __KERNEL__
+#define ndpi_memory_barrier() smp_mb()
+#elif defined(WIN32)
+#define ndpi_memory_barrier() MemoryBarrier()
+#else
+#define ndpi_memory_barrier() __sync_synchronize()
+#endif
+
 /* define memory callback function */
 #define match_first_bytes(payload,st) (memcmp((payload),(st),(sizeof(st)-1))==0)
 
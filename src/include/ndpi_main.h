@@ -119,6 +119,37 @@ extern void ndpi_int_change_protocol(struct ndpi_detection_module_struct *ndpi_s
 extern void ndpi_set_proto_defaults(struct ndpi_detection_module_struct *ndpi_mod,
 				    u_int16_t protoId, char *protoName,
 				    ndpi_port_range *tcpDefPorts, ndpi_port_range *udpDefPorts);
+extern ndpi_port_range* ndpi_build_default_ports(ndpi_port_range *ports,
+						 u_int16_t portA, u_int16_t portB, u_int16_t portC,
+						 u_int16_t portD, u_int16_t portE);
+extern ndpi_rules_t* ndpi_alloc_rules(void);
+extern void ndpi_free_rules(ndpi_rules_t *rules);
+extern void ndpi_publish_rules(struct ndpi_detection_module_struct *ndpi_mod, ndpi_rules_t *rules);
+extern void ndpi_snapshot_release(ndpi_snapshot_t *snapshot);
+extern u_int16_t ndpi_snapshot_find_port(const ndpi_snapshot_t *snapshot, u_int8_t proto, u_int16_t port);
+extern u_int16_t ndpi_snapshot_match_host(const ndpi_snapshot_t *snapshot,
+					  const char *string_to_match, u_int string_to_match_len);
+extern void ndpi_dns_cache_add(struct ndpi_detection_module_struct *ndpi_struct,
+			       const u_int32_t *addr, u_int8_t is_ipv6,
+			       const char *name, u_int name_len,
+			       u_int32_t ttl, u_int32_t now);
+extern void ndpi_flow_state_free(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow);
+extern void ndpi_flow_state_pool_free(struct ndpi_detection_module_struct *ndpi_struct);
+extern void ndpi_run_with_flow_state(struct ndpi_detection_module_struct *ndpi_struct,
+				     struct ndpi_flow_struct *flow,
+				     u_int16_t protocol_id, u_int8_t len,
+				     ndpi_flow_state_func_t func);
+extern void* ndpi_get_id_state(struct ndpi_id_struct *id, u_int16_t protocol_id);
+extern void* ndpi_claim_id_state(struct ndpi_id_struct *id, u_int16_t protocol_id, u_int16_t len);
+extern void ndpi_flow_cache_release(struct ndpi_detection_module_struct *ndpi_struct);
+extern u_int16_t ndpi_flow_cache_lookup(struct ndpi_detection_module_struct *ndpi_struct,
+					struct ndpi_flow_struct *flow);
+extern void ndpi_flow_cache_record(struct ndpi_detection_module_struct *ndpi_struct,
+				   struct ndpi_flow_struct *flow);
+extern void ndpi_trace_record(struct ndpi_detection_module_struct *ndpi_struct,
+			      u_int16_t protocol_id, u_int16_t event_id,
+			      u_int32_t arg0, u_int32_t arg1, u_int32_t arg2, u_int32_t arg3);
+extern u_int32_t ndpi_trace_payload_word(const u_int8_t *payload, u_int32_t payload_len, u_int32_t offset);
 extern void ndpi_int_reset_packet_protocol(struct ndpi_packet_struct *packet);
 extern void ndpi_int_reset_protocol(struct ndpi_flow_struct *flow);
 extern int ndpi_packet_src_ip_eql(const struct ndpi_packet_struct *packet, const ndpi_ip_addr_t * ip);
@@ -88,6 +88,62 @@ typedef union {
 } ndpi_ip_addr_t;
 
 
+/*
+  Per-host state that only a few dissectors need. It is kept out of
+  ndpi_id_struct and allocated the first time a dissector stores
+  something for the host (see ndpi_claim_id_state()), so that idle
+  hosts only pay for the core fields below.
+*/
+#ifdef NDPI_PROTOCOL_IRC
+struct ndpi_irc_id_state {
+  u_int32_t last_time_port_used[16];
+  u_int16_t irc_port[16];
+  u_int8_t irc_number_of_port;
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_UNENCRYPED_JABBER
+#define JABBER_MAX_STUN_PORTS 6
+struct ndpi_jabber_id_state {
+  u_int32_t jabber_stun_or_ft_ts;
+  u_int16_t jabber_voice_stun_port[JABBER_MAX_STUN_PORTS];
+  u_int16_t jabber_file_transfer_port[2];
+  u_int8_t jabber_voice_stun_used_ports;
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_OSCAR
+struct ndpi_oscar_id_state {
+  u_int32_t oscar_last_safe_access_time;
+  u_int8_t oscar_ssl_session_id[33];
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_GADUGADU
+struct ndpi_gadugadu_id_state {
+  u_int32_t gg_ft_ip_address;
+  u_int32_t gg_timeout;
+  u_int16_t gg_ft_port;
+  u_int8_t gg_call_id[2][7];
+  u_int8_t gg_fmnumber[8];
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_RTSP
+struct ndpi_rtsp_id_state {
+  ndpi_ip_addr_t rtsp_ip_address;
+  u_int32_t rtsp_timer;
+  u_int32_t rtsp_ts_set:1;
+};
+#endif
+
+/* One extension record, chained from ndpi_id_struct.state */
+typedef struct ndpi_id_state {
+  struct ndpi_id_state *next;
+  u_int16_t protocol_id, len;
+  u_int64_t data[];
+} ndpi_id_state_t;
+
 typedef struct ndpi_id_struct {
   /* detected_protocol_bitmask:
    * access this bitmask to find out whether an id has used skype or not
@@ -100,17 +156,12 @@ typedef struct ndpi_id_struct {
    * }
    */
   NDPI_PROTOCOL_BITMASK detected_protocol_bitmask;
-#ifdef NDPI_PROTOCOL_RTSP
-  ndpi_ip_addr_t rtsp_ip_address;
-#endif
+  struct ndpi_id_state *state;  /* per-protocol extension records */
 #ifdef NDPI_PROTOCOL_SIP
 #ifdef NDPI_PROTOCOL_YAHOO
   u_int32_t yahoo_video_lan_timer;
 #endif
 #endif
-#ifdef NDPI_PROTOCOL_IRC
-  u_int32_t last_time_port_used[16];
-#endif
 #ifdef NDPI_PROTOCOL_IRC
   u_int32_t irc_ts;
 #endif
@@ -123,22 +174,9 @@ typedef struct ndpi_id_struct {
 #ifdef NDPI_PROTOCOL_THUNDER
   u_int32_t thunder_ts;
 #endif
-#ifdef NDPI_PROTOCOL_RTSP
-  u_int32_t rtsp_timer;
-#endif
-#ifdef NDPI_PROTOCOL_OSCAR
-  u_int32_t oscar_last_safe_access_time;
-#endif
-#ifdef NDPI_PROTOCOL_GADUGADU
-  u_int32_t gg_ft_ip_address;
-  u_int32_t gg_timeout;
-#endif
 #ifdef NDPI_PROTOCOL_ZATTOO
   u_int32_t zattoo_ts;
 #endif
-#ifdef NDPI_PROTOCOL_UNENCRYPED_JABBER
-  u_int32_t jabber_stun_or_ft_ts;
-#endif
 #ifdef NDPI_PROTOCOL_DIRECTCONNECT
   u_int32_t directconnect_last_safe_access_time;
 #endif
@@ -150,17 +188,6 @@ typedef struct ndpi_id_struct {
   u_int16_t detected_directconnect_udp_port;
   u_int16_t detected_directconnect_ssl_port;
 #endif
-#ifdef NDPI_PROTOCOL_IRC
-  u_int16_t irc_port[16];
-#endif
-#ifdef NDPI_PROTOCOL_GADUGADU
-  u_int16_t gg_ft_port;
-#endif
-#ifdef NDPI_PROTOCOL_UNENCRYPED_JABBER
-#define JABBER_MAX_STUN_PORTS 6
-  u_int16_t jabber_voice_stun_port[JABBER_MAX_STUN_PORTS];
-  u_int16_t jabber_file_transfer_port[2];
-#endif
 #ifdef NDPI_PROTOCOL_GNUTELLA
   u_int16_t detected_gnutella_port;
 #endif
@@ -171,19 +198,6 @@ typedef struct ndpi_id_struct {
 #ifdef NDPI_PROTOCOL_SOULSEEK
   u_int16_t soulseek_listen_port;
 #endif
-#ifdef NDPI_PROTOCOL_IRC
-  u_int8_t irc_number_of_port;
-#endif
-#ifdef NDPI_PROTOCOL_OSCAR
-  u_int8_t oscar_ssl_session_id[33];
-#endif
-#ifdef NDPI_PROTOCOL_GADUGADU
-  u_int8_t gg_call_id[2][7];
-  u_int8_t gg_fmnumber[8];
-#endif
-#ifdef NDPI_PROTOCOL_UNENCRYPED_JABBER
-  u_int8_t jabber_voice_stun_used_ports;
-#endif
 #ifdef NDPI_PROTOCOL_SIP
 #ifdef NDPI_PROTOCOL_YAHOO
   u_int32_t yahoo_video_lan_dir:1;
@@ -193,9 +207,6 @@ typedef struct ndpi_id_struct {
   u_int32_t yahoo_conf_logged_in:1;
   u_int32_t yahoo_voice_conf_logged_in:1;
 #endif
-#ifdef NDPI_PROTOCOL_RTSP
-  u_int32_t rtsp_ts_set:1;
-#endif
 } ndpi_id_struct;
 
 /* ************************************************** */
@@ -213,19 +224,6 @@ struct ndpi_flow_tcp_struct {
 #ifdef NDPI_PROTOCOL_TDS
   u_int8_t tds_login_version;
 #endif
-#ifdef NDPI_PROTOCOL_IRC
-  u_int8_t irc_stage;
-  u_int8_t irc_port;
-#endif
-#ifdef NDPI_PROTOCOL_GNUTELLA
-  u_int8_t gnutella_msg_id[3];
-#endif
-#ifdef NDPI_PROTOCOL_IRC
-  u_int32_t irc_3a_counter:3;
-  u_int32_t irc_stage2:5;
-  u_int32_t irc_direction:2;
-  u_int32_t irc_0x1000_full:1;
-#endif
 #ifdef NDPI_PROTOCOL_WINMX
   u_int32_t winmx_stage:1;			// 0-1
 #endif
@@ -250,9 +248,6 @@ struct ndpi_flow_tcp_struct {
   u_int32_t http_empty_line_seen:1;
   u_int32_t http_wait_for_retransmission:1;
 #endif							// NDPI_PROTOCOL_HTTP
-#ifdef NDPI_PROTOCOL_GNUTELLA
-  u_int32_t gnutella_stage:2;		//0-2
-#endif
 #ifdef NDPI_CONTENT_MMS
   u_int32_t mms_stage:2;
 #endif
@@ -324,15 +319,6 @@ struct ndpi_flow_tcp_struct {
 #ifdef NDPI_PROTOCOL_LOTUS_NOTES
   u_int8_t lotus_notes_packet_id;
 #endif
-
-#ifdef NDPI_PROTOCOL_TEAMVIEWER
-  u_int8_t teamviewer_stage;
-#endif
-
-#ifdef NDPI_PROTOCOL_ZMQ
-  u_int8_t prev_zmq_pkt_len;
-  u_char prev_zmq_pkt[10];
-#endif
 }
 #if !defined(WIN32)
   __attribute__ ((__packed__))
@@ -375,9 +361,6 @@ struct ndpi_flow_udp_struct {
 #ifdef NDPI_PROTOCOL_SKYPE
   u_int8_t skype_packet_id;
 #endif
-#ifdef NDPI_PROTOCOL_TEAMVIEWER
-  u_int8_t teamviewer_stage;
-#endif
 }
 #if !defined(WIN32)
   __attribute__ ((__packed__))
@@ -386,6 +369,102 @@ struct ndpi_flow_udp_struct {
 
 /* ************************************************** */
 
+/*
+  State of the dissectors that only a few flows need. It is kept in the
+  flow state slab (see ndpi_run_with_flow_state()): a record is created
+  the first time the dissector stores something and dropped when the
+  protocol is excluded or the flow is detected.
+*/
+#ifdef NDPI_PROTOCOL_IRC
+struct ndpi_irc_flow_state {
+  u_int8_t irc_stage;
+  u_int8_t irc_port;
+  u_int8_t irc_3a_counter:3;
+  u_int8_t irc_direction:2;
+  u_int8_t irc_0x1000_full:1;
+  u_int8_t irc_stage2:5;
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_GNUTELLA
+struct ndpi_gnutella_flow_state {
+  u_int8_t gnutella_msg_id[3];
+  u_int8_t gnutella_stage:2;		//0-2
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_ZMQ
+struct ndpi_zmq_flow_state {
+  u_int8_t prev_zmq_pkt_len;
+  u_char prev_zmq_pkt[10];
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_TEAMVIEWER
+struct ndpi_teamviewer_flow_state {
+  u_int8_t teamviewer_stage;
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_THUNDER
+struct ndpi_thunder_flow_state {
+  u_int8_t thunder_stage:2;		// 0-3
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_STEAM
+struct ndpi_steam_flow_state {
+  u_int16_t steam_stage:3;
+  u_int16_t steam_stage1:3;			// 0 - 4
+  u_int16_t steam_stage2:2;			// 0 - 2
+  u_int16_t steam_stage3:2;			// 0 - 2
+};
+#endif
+
+#ifdef NDPI_PROTOCOL_PPLIVE
+struct ndpi_pplive_flow_state {
+  u_int8_t pplive_stage1:3;			// 0-6
+  u_int8_t pplive_stage2:2;			// 0-2
+  u_int8_t pplive_stage3:2;			// 0-2
+};
+#endif
+
+#define NDPI_FLOW_STATE_MAX_RECORDS    8
+#define NDPI_FLOW_STATE_MAX_LEN       32 /* bytes per record */
+#define NDPI_FLOW_STATE_SLAB_LEN      64 /* data bytes of a slab */
+#define NDPI_FLOW_STATE_POOL_CHUNK   256 /* slabs allocated at once */
+#define NDPI_FLOW_STATE_POOL_CHUNKS  255 /* at most 65280 slabs per module */
+#define NDPI_FLOW_STATE_IDLE          60 /* sec: the slab of a silent flow can be reused */
+
+typedef struct ndpi_flow_state_record {
+  u_int16_t protocol_id; /* NDPI_PROTOCOL_UNKNOWN: unused */
+  u_int8_t offset, len;  /* into data[] */
+} ndpi_flow_state_record_t;
+
+typedef struct ndpi_flow_state_slab {
+  u_int16_t generation;  /* bumped whenever the slab changes owner */
+  u_int8_t num_records, num_live_records;
+  u_int8_t used;         /* bytes of data[] */
+  u_int32_t last_used;   /* tick */
+  u_int32_t next_free;   /* free list: index + 1, 0 at the end */
+  ndpi_flow_state_record_t records[NDPI_FLOW_STATE_MAX_RECORDS];
+  u_int32_t data[NDPI_FLOW_STATE_SLAB_LEN / sizeof(u_int32_t)];
+} ndpi_flow_state_slab_t;
+
+/*
+  Slabs of a detection module. A flow refers to its slab by index and
+  generation, so the flows the application frees before they are
+  detected do not leak: their slab is reused once idle.
+*/
+typedef struct ndpi_flow_state_pool {
+  ndpi_flow_state_slab_t *chunks[NDPI_FLOW_STATE_POOL_CHUNKS];
+  u_int32_t num_slabs;
+  u_int32_t free_head;   /* index + 1, 0 when empty */
+  u_int32_t clock_hand;  /* next slab checked for idleness */
+} ndpi_flow_state_pool_t;
+
+/* ************************************************** */
+
 typedef struct ndpi_int_one_line_struct {
   const u_int8_t *ptr;
   u_int16_t len;
@@ -459,19 +538,46 @@ typedef struct ndpi_packet_struct {
   u_int8_t empty_line_position_set;
   u_int8_t packet_direction:1;
   u_int8_t ssl_certificate_detected:4, ssl_certificate_num_checks:4;
+
+  /* prefix trie nodes matched by the payload start (set once per packet) */
+  u_int16_t prefix_hits[NDPI_MAX_PREFIX_HITS];
+  u_int8_t num_prefix_hits;
 } ndpi_packet_struct_t;
 
 struct ndpi_detection_module_struct;
 struct ndpi_flow_struct;
 
+/* dissector run by ndpi_run_with_flow_state() */
+typedef void (*ndpi_flow_state_func_t)(struct ndpi_detection_module_struct *ndpi_struct,
+				       struct ndpi_flow_struct *flow, void *state);
+
 typedef struct ndpi_call_function_struct {
   NDPI_PROTOCOL_BITMASK detection_bitmask;
   NDPI_PROTOCOL_BITMASK excluded_protocol_bitmask;
   NDPI_SELECTION_BITMASK_PROTOCOL_SIZE ndpi_selection_bitmask;
   void (*func) (struct ndpi_detection_module_struct *, struct ndpi_flow_struct *flow);
+  u_int16_t ndpi_protocol_id;
   u_int8_t detection_feature;
 } ndpi_call_function_struct_t;
 
+/* How often a dissector concluded when called from the tcp payload/udp tables */
+typedef struct ndpi_dissector_stats {
+  u_int32_t calls, hits, exclusions;
+} ndpi_dissector_stats_t;
+
+/*
+  Adaptive dissector ordering (see ndpi_enable_adaptive_order()). The
+  tcp payload and udp tables are reordered into the snapshot that is not
+  in use and then published by swapping the callback_order_* pointers,
+  so a table walk always sees a complete order.
+*/
+typedef struct ndpi_adaptive_order {
+  u_int32_t reorder_interval, num_packets;
+  u_int8_t pinned;
+  struct ndpi_call_function_struct *tcp_payload[2], *udp[2];
+  ndpi_dissector_stats_t stats[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
+} ndpi_adaptive_order_t;
+
 typedef struct ndpi_subprotocol_conf_struct {
   void (*func) (struct ndpi_detection_module_struct *, char *attr, char *value, int protocol_id);
 } ndpi_subprotocol_conf_struct_t;
@@ -485,6 +591,7 @@ typedef struct {
 typedef struct ndpi_proto_defaults {
   char *protoName;
   u_int16_t protoId, protoIdx;
+  ndpi_port_range tcp_default_ports[MAX_DEFAULT_PORTS], udp_default_ports[MAX_DEFAULT_PORTS];
   void (*func) (struct ndpi_detection_module_struct *, struct ndpi_flow_struct *flow);
 } ndpi_proto_defaults_t;
 
@@ -493,11 +600,173 @@ typedef struct ndpi_default_ports_tree_node {
   u_int16_t default_port;
 } ndpi_default_ports_tree_node_t;
 
+/*
+  Dissectors worth trying first on a port: the protocols registered on
+  it followed by the ones detected there, most detected first.
+*/
+typedef struct ndpi_port_candidates {
+  u_int16_t port;
+  u_int8_t num_candidates;
+  u_int16_t protocol_id[NDPI_MAX_PORT_CANDIDATES];
+  u_int32_t hits[NDPI_MAX_PORT_CANDIDATES];
+} ndpi_port_candidates_t;
+
 typedef struct _ndpi_automa {
   void *ac_automa; /* Real type is AC_AUTOMATA_t */
   u_int8_t ac_automa_finalized;
+  u_int8_t ac_automa_anchored; /* has =, *. or ~ host rules */
 } ndpi_automa;
 
+/*
+  Snapshot file (see ndpi_save_snapshot). All the references are
+  offsets or indexes so that the file can be mmap-ed anywhere.
+*/
+#define NDPI_SNAPSHOT_MAGIC   0x4E445053 /* NDPS */
+#define NDPI_SNAPSHOT_VERSION 2
+
+typedef struct ndpi_snapshot_header {
+  u_int32_t magic, version, header_len, file_len;
+  u_int32_t max_supported_protocols, num_protocols, protocols_offset;
+  u_int32_t names_offset, names_len;
+  u_int32_t tcp_ports_offset, num_tcp_ports, udp_ports_offset, num_udp_ports;
+  u_int32_t nodes_offset, num_nodes, edges_offset, num_edges;
+  u_int8_t alphabet[256]; /* Host automa alphabet-class map */
+} ndpi_snapshot_header_t;
+
+typedef struct ndpi_snapshot_protocol {
+  u_int32_t name_offset; /* into the names section */
+  u_int16_t protoId, pad;
+} ndpi_snapshot_protocol_t;
+
+typedef struct ndpi_snapshot_port {
+  u_int16_t port, protoId; /* sorted by port */
+} ndpi_snapshot_port_t;
+
+typedef struct ndpi_snapshot_node {
+  u_int32_t first_edge, failure;
+  u_int16_t num_edges, protoId; /* protoId of the first pattern accepted here */
+  u_int8_t final, pad[3];
+} ndpi_snapshot_node_t;
+
+typedef struct ndpi_snapshot_edge {
+  u_int32_t next;
+  u_int8_t alpha, pad[3]; /* sorted by alpha within a node */
+} ndpi_snapshot_edge_t;
+
+typedef struct ndpi_snapshot {
+  void *base;
+  u_int32_t len;
+  const ndpi_snapshot_header_t *header;
+  const ndpi_snapshot_port_t *tcp_ports, *udp_ports;
+  const ndpi_snapshot_node_t *nodes;
+  const ndpi_snapshot_edge_t *edges;
+} ndpi_snapshot_t;
+
+/*
+  Port trees and host automa used by the lookups. They are swapped as
+  a whole by ndpi_reload_protocols_file() while packets are processed.
+  When a snapshot is loaded it is looked up first.
+*/
+typedef struct ndpi_rules {
+  ndpi_snapshot_t *snapshot;
+  ndpi_default_ports_tree_node_t *tcpRoot, *udpRoot;
+  ndpi_automa host_automa;
+  char **strings; /* host patterns owned by the rules */
+  u_int32_t num_strings, max_strings;
+  u_int32_t retire_epoch;
+  struct ndpi_rules *next; /* retired rules */
+} ndpi_rules_t;
+
+/*
+  Anchored trie of payload prefixes. Node 0 is the root, index 0
+  is also used as "none" for child/sibling/signature links.
+*/
+typedef struct ndpi_prefix_signature {
+  u_int16_t protocol_id, next;
+  u_int8_t kind; /* NDPI_PREFIX_REQUEST, NDPI_PREFIX_RESPONSE */
+} ndpi_prefix_signature_t;
+
+typedef struct ndpi_prefix_node {
+  u_int16_t first_child, next_sibling, signatures;
+  u_int8_t byte;
+} ndpi_prefix_node_t;
+
+typedef struct _ndpi_prefix_trie {
+  u_int16_t root[256]; /* first payload byte -> node */
+  ndpi_prefix_node_t *nodes;
+  ndpi_prefix_signature_t *signatures;
+  u_int16_t num_nodes, max_nodes, num_signatures, max_signatures;
+} ndpi_prefix_trie;
+
+typedef struct ndpi_dns_cache_entry {
+  u_int32_t addr[4]; /* IPv4 addresses use addr[0] only */
+  u_int32_t expire; /* tick */
+  u_int8_t is_ipv6, name_len;
+  char name[NDPI_DNS_CACHE_NAME_LEN]; /* tail of the name when longer */
+} ndpi_dns_cache_entry_t;
+
+typedef struct ndpi_flow_cache_key {
+  u_int32_t addr[4]; /* server address, IPv4 uses addr[0] only */
+  u_int16_t port; /* server port, 0 when unused */
+  u_int8_t l4_proto, is_ipv6;
+} ndpi_flow_cache_key_t;
+
+typedef struct ndpi_flow_cache_entry {
+  volatile u_int32_t version; /* odd while the entry is being written */
+  ndpi_flow_cache_key_t key;
+  u_int16_t protocol_stack[NDPI_PROTOCOL_HISTORY_SIZE];
+  u_int8_t stack_size_minus_one, entry_is_real_protocol;
+  u_int8_t confidence; /* number of detections that agreed */
+  u_int32_t expire, last_used; /* ticks, expire is 0 until first used */
+} ndpi_flow_cache_entry_t;
+
+typedef struct ndpi_flow_cache_shard {
+  volatile u_int32_t lock; /* writers only */
+  ndpi_flow_cache_entry_t entries[NDPI_FLOW_CACHE_SETS * NDPI_FLOW_CACHE_WAYS];
+} ndpi_flow_cache_shard_t;
+
+typedef struct ndpi_flow_cache {
+  u_int32_t num_users;
+  ndpi_flow_cache_shard_t shards[NDPI_FLOW_CACHE_SHARDS];
+
+  /* Optional Redis-protocol peer */
+  int redis_fd;
+  u_int8_t redis_connecting; /* a module is connecting, outside of the cache lock */
+  volatile u_int32_t redis_lock;
+} ndpi_flow_cache_t;
+
+/* Static event ids of the trace ring (see NDPI_TRACE) */
+typedef enum {
+  NDPI_TRACE_LOG = 0,         /* NDPI_LOG() call: line, log level */
+  NDPI_TRACE_PACKET,          /* packet entering detection: l4 protocol, payload len, sport, dport */
+  NDPI_TRACE_PROTOCOL_FOUND,  /* flow protocol set: protocol, lower protocol, packet direction, protocol type */
+  NDPI_TRACE_PAYLOAD,         /* dissector payload dump: payload len, offset, 8 bytes at offset */
+  NDPI_TRACE_NUM_EVENTS
+} ndpi_trace_event_id_t;
+
+typedef struct ndpi_trace_event {
+  u_int32_t timestamp;        /* tick of the packet being processed */
+  u_int16_t event_id;         /* ndpi_trace_event_id_t */
+  u_int16_t protocol_id;
+  u_int32_t args[NDPI_TRACE_NUM_ARGS];
+} ndpi_trace_event_t;
+
+/* One per module: the ring is written by the thread using the module only */
+typedef struct ndpi_trace_ring {
+  NDPI_PROTOCOL_BITMASK protocols;  /* events of other protocols are not recorded */
+  u_int64_t head;                   /* events recorded, the oldest are overwritten */
+  u_int32_t mask;                   /* number of events - 1 (power of 2) */
+  ndpi_trace_event_t *events;
+} ndpi_trace_ring_t;
+
+/* ndpi_trace_dump() file: header, num_protocols names, num_events events (oldest first) */
+typedef struct ndpi_trace_file_header {
+  u_int32_t magic, version;
+  u_int32_t event_len, num_events;
+  u_int32_t num_protocols, proto_name_len;
+  u_int64_t num_recorded;           /* more than num_events when the ring wrapped */
+} ndpi_trace_file_header_t;
+
 typedef struct ndpi_detection_module_struct {
   NDPI_PROTOCOL_BITMASK detection_bitmask;
   NDPI_PROTOCOL_BITMASK generic_http_packet_bitmask;
@@ -524,7 +793,15 @@ typedef struct ndpi_detection_module_struct {
   struct ndpi_call_function_struct callback_buffer_non_tcp_udp[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
   u_int32_t callback_buffer_size_non_tcp_udp;
 
-  ndpi_default_ports_tree_node_t *tcpRoot, *udpRoot;
+  /* order in which the tcp payload and udp tables are walked */
+  struct ndpi_call_function_struct *callback_order_tcp_payload, *callback_order_udp;
+  ndpi_adaptive_order_t *adaptive_order;
+
+  ndpi_port_candidates_t *tcp_port_candidates, *udp_port_candidates; /* trees */
+  u_int32_t num_learned_tcp_ports, num_learned_udp_ports;
+
+  ndpi_rules_t *rules, *retired_rules;
+  volatile u_int32_t rules_epoch; /* odd while a packet is being processed */
 
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
   /* debug callback, only set when debug is used */
@@ -533,6 +810,9 @@ typedef struct ndpi_detection_module_struct {
   const char *ndpi_debug_print_function;
   u_int32_t ndpi_debug_print_line;
 #endif
+  /* binary trace, NULL unless ndpi_trace_enable() was called */
+  ndpi_trace_ring_t *trace_ring;
+
   /* misc parameters */
   u_int32_t tcp_max_retransmission_window_size;
 
@@ -545,7 +825,18 @@ typedef struct ndpi_detection_module_struct {
   u_int ndpi_num_custom_protocols;
 
   /* HTTP (and soon DNS) host matching */
-  ndpi_automa host_automa, content_automa;
+  ndpi_automa content_automa;
+  ndpi_automa ua_automa; /* patterns of ua_match[], built once */
+  ndpi_prefix_trie prefix_trie;
+
+  /* NDPI_DNS_CACHE_SIZE entries, sets of NDPI_DNS_CACHE_WAYS */
+  ndpi_dns_cache_entry_t *dns_cache;
+
+  /* Shared by all the modules that called ndpi_enable_cache() */
+  ndpi_flow_cache_t *flow_cache;
+
+  /* state of the long-tail dissectors, allocated on first use */
+  ndpi_flow_state_pool_t *flow_state_pool;
 
   /* irc parameters */
   u_int32_t irc_timeout;
@@ -580,6 +871,55 @@ typedef struct ndpi_detection_module_struct {
   u_int8_t match_dns_host_names:1;
 } ndpi_detection_module_struct_t;
 
+/* Operating systems and clients recognised in HTTP User-Agent lines (see ndpi_match_user_agent) */
+typedef enum {
+  NDPI_OS_UNKNOWN = 0,
+  NDPI_OS_WINDOWS,
+  NDPI_OS_WINDOWS_2000,
+  NDPI_OS_WINDOWS_XP,
+  NDPI_OS_WINDOWS_2003,
+  NDPI_OS_WINDOWS_VISTA,
+  NDPI_OS_WINDOWS_7,
+  NDPI_OS_WINDOWS_8,
+  NDPI_OS_WINDOWS_8_1,
+  NDPI_OS_WINDOWS_10,
+  NDPI_OS_WINDOWS_PHONE,
+  NDPI_OS_MACOS,
+  NDPI_OS_IOS,
+  NDPI_OS_ANDROID,
+  NDPI_OS_LINUX,
+  NDPI_OS_CHROMEOS,
+  NDPI_OS_MAX /* keep it last */
+} ndpi_os_id_t;
+
+typedef enum {
+  NDPI_UA_CLIENT_UNKNOWN = 0,
+  NDPI_UA_CLIENT_IE,
+  NDPI_UA_CLIENT_EDGE,
+  NDPI_UA_CLIENT_CHROME,
+  NDPI_UA_CLIENT_FIREFOX,
+  NDPI_UA_CLIENT_SAFARI,
+  NDPI_UA_CLIENT_OPERA,
+  NDPI_UA_CLIENT_CURL,
+  NDPI_UA_CLIENT_WGET,
+  NDPI_UA_CLIENT_OKHTTP,
+  NDPI_UA_CLIENT_DALVIK,
+  NDPI_UA_CLIENT_CFNETWORK,
+  NDPI_UA_CLIENT_PYTHON,
+  NDPI_UA_CLIENT_JAVA,
+  NDPI_UA_CLIENT_GO,
+  NDPI_UA_CLIENT_APACHE_HTTPCLIENT,
+  NDPI_UA_CLIENT_MAX /* keep it last */
+} ndpi_ua_client_id_t;
+
+/* A, AAAA or CNAME answer of a DNS response (see flow->protos.dns) */
+typedef struct ndpi_dns_record {
+  u_int32_t ttl;
+  u_int16_t rsp_type;     /* NDPI_DNS_TYPE_A, NDPI_DNS_TYPE_AAAA or NDPI_DNS_TYPE_CNAME */
+  u_int8_t data_offset;   /* in protos.dns.rdata: address (network byte order) or NUL terminated target */
+  u_int8_t data_len;      /* 4 (A), 16 (AAAA) or the target length */
+} ndpi_dns_record_t;
+
 typedef struct ndpi_flow_struct {
   u_int16_t detected_protocol_stack[NDPI_PROTOCOL_HISTORY_SIZE];
 #if NDPI_PROTOCOL_HISTORY_SIZE > 1
@@ -614,8 +954,11 @@ typedef struct ndpi_flow_struct {
 
   u_int8_t protocol_id_already_guessed;
   u_int16_t guessed_protocol_id;
-  u_char host_server_name[256]; /* HTTP host or DNS query   */
+  ndpi_port_candidates_t *port_candidates; /* set with guessed_protocol_id */
+  ndpi_flow_cache_key_t cache_key; /* set on the first packet when the cache is enabled */
+  u_char host_server_name[256]; /* HTTP host, DNS query or TLS SNI */
   u_char detected_os[32];       /* Via HTTP User-Agent      */
+  u_int8_t detected_os_id, detected_client_id; /* ndpi_os_id_t, ndpi_ua_client_id_t */
   u_char nat_ip[24];            /* Via HTTP X-Forwarded-For */
 
   union {
@@ -623,13 +966,28 @@ typedef struct ndpi_flow_struct {
       u_int8_t num_queries, num_answers, ret_code;
       u_int8_t bad_packet /* the received packet looks bad */;
       u_int16_t query_type, query_class, rsp_type;
+      /* answers of the last response parsed while their data fits in rdata
+	 (only the first CNAME, truncated): the query name is in host_server_name */
+      u_int8_t num_records, rdata_len;
+      ndpi_dns_record_t records[NDPI_DNS_MAX_RECORDS];
+      u_int8_t rdata[NDPI_DNS_RDATA_LEN];
     } dns;
+
+    struct {
+      /* from the ClientHello, the server name (SNI) is in host_server_name */
+      u_int16_t version;              /* highest offered: 0x0301 (TLS 1.0) ... 0x0304 (TLS 1.3) */
+      char alpn[NDPI_TLS_ALPN_LEN];
+    } ssl;
   } protos;
   /* ALL protocol specific 64 bit variables here */
 
   /* protocols which have marked a connection as this connection cannot be protocol XXX, multiple u_int64_t */
   NDPI_PROTOCOL_BITMASK excluded_protocol_bitmask;
 
+  /* slab of the long-tail dissectors in the module pool:
+     index + 1 (low 16 bits) and generation, 0 until one of them needs it */
+  u_int32_t state_ref;
+
 #if 0
 #ifdef NDPI_PROTOCOL_RTP
   u_int32_t rtp_ssid[2];
@@ -677,9 +1035,6 @@ typedef struct ndpi_flow_struct {
 #ifdef NDPI_PROTOCOL_QQ
   u_int32_t qq_stage:3;
 #endif
-#ifdef NDPI_PROTOCOL_THUNDER
-  u_int32_t thunder_stage:2;		// 0-3
-#endif
 #ifdef NDPI_PROTOCOL_OSCAR
   u_int32_t oscar_ssl_voice_stage:3;
   u_int32_t oscar_video_voice:1;
@@ -708,17 +1063,6 @@ typedef struct ndpi_flow_struct {
 #ifdef NDPI_PROTOCOL_PANDO
   u_int32_t pando_stage:3;
 #endif
-#ifdef NDPI_PROTOCOL_STEAM
-  u_int32_t steam_stage:3;
-  u_int32_t steam_stage1:3;			// 0 - 4
-  u_int32_t steam_stage2:2;			// 0 - 2
-  u_int32_t steam_stage3:2;			// 0 - 2
-#endif
-#ifdef NDPI_PROTOCOL_PPLIVE
-  u_int32_t pplive_stage1:3;			// 0-6
-  u_int32_t pplive_stage2:2;			// 0-2
-  u_int32_t pplive_stage3:2;			// 0-2
-#endif
 
   /* internal structures to save functions calls */
   struct ndpi_packet_struct packet;
@@ -733,6 +1077,95 @@ typedef enum {
 } ndpi_protocol_type_t;
 
 
+typedef enum {
+  ndpi_no_tunnel = 0,
+  ndpi_gtp_tunnel,    /* GTP-U (UDP 2152) */
+  ndpi_gre_tunnel,
+  ndpi_vxlan_tunnel,  /* UDP 4789 */
+  ndpi_ip_in_ip_tunnel, /* IPv4/IPv6 in IPv4/IPv6 */
+  ndpi_mpls_tunnel,
+  ndpi_vlan_tunnel,
+  ndpi_pppoe_tunnel
+} ndpi_tunnel_type_t;
+
+typedef struct ndpi_tunnel_info {
+  u_int8_t num_layers; /* outermost first */
+  u_int8_t layers[NDPI_MAX_TUNNEL_LAYERS]; /* ndpi_tunnel_type_t */
+
+  /* innermost value of each kind, valid when the matching flag is set */
+  u_int32_t gtp_teid, vxlan_vni, gre_key, mpls_label;
+  u_int16_t vlan_id;
+  u_int8_t has_gtp_teid:1, has_vxlan_vni:1, has_gre_key:1, has_mpls_label:1, has_vlan_id:1;
+} ndpi_tunnel_info_t;
+
+/* Subsystems accounted by ndpi_malloc_tag() */
+typedef enum {
+  NDPI_MEM_MODULE = 0,  /* detection module structures */
+  NDPI_MEM_AUTOMATA,    /* Aho-Corasick automata */
+  NDPI_MEM_PORTS,       /* default port entries */
+  NDPI_MEM_TREES,       /* ndpi_tsearch() nodes */
+  NDPI_MEM_PROTOCOLS,   /* protocol defaults */
+  NDPI_MEM_RULES,       /* rule sets, payload prefixes and snapshots */
+  NDPI_MEM_CACHES,      /* DNS and server endpoint caches */
+  NDPI_MEM_FLOWS,       /* flow and id structures */
+  NDPI_MEM_OTHER,
+  NDPI_MEM_NUM_TAGS
+} ndpi_mem_tag_t;
+
+typedef struct ndpi_memory_stats {
+  struct {
+    u_int64_t bytes, peak_bytes; /* payload bytes, headers excluded */
+    u_int64_t allocations;       /* live allocations */
+  } tag[NDPI_MEM_NUM_TAGS];
+
+  u_int64_t total_bytes;
+  u_int32_t num_host_rules, num_port_rules; /* of the module passed */
+} ndpi_memory_stats_t;
+
+/* Flow owned by an ndpi_flow_manager_t */
+typedef struct ndpi_managed_flow {
+  /* canonical key: the lower endpoint has the lower address (then port) */
+  u_int32_t lower_ip[4], upper_ip[4];   /* network byte order, IPv4 uses the first word */
+  u_int16_t lower_port, upper_port;     /* network byte order, 0 for non TCP/UDP */
+  u_int8_t ip_version, l4_protocol;
+  u_int8_t detection_completed;
+  u_int8_t __padding;
+
+  u_int32_t detected_protocol;
+  u_int64_t first_seen, last_seen;      /* timestamps passed with the packets */
+  u_int64_t packets, bytes;
+  void *user_data;                      /* left to the application */
+
+  /* detection state, released once detection_completed is set */
+  struct ndpi_flow_struct *ndpi_flow;
+  struct ndpi_id_struct *lower_id, *upper_id;
+
+  /* hash chain and LRU list (most recently seen first) */
+  struct ndpi_managed_flow *hash_next, *lru_prev, *lru_next;
+  u_int32_t hash;
+} ndpi_managed_flow_t;
+
+typedef void (*ndpi_flow_manager_callback)(ndpi_managed_flow_t *flow, void *user_data);
+
+typedef struct ndpi_flow_manager {
+  struct ndpi_detection_module_struct *ndpi_struct;
+
+  ndpi_managed_flow_t **buckets;
+  u_int32_t num_buckets;                /* power of 2 */
+  u_int32_t num_flows;
+  ndpi_managed_flow_t *lru_head, *lru_tail;
+
+  u_int64_t memory_used, max_memory;    /* bytes, max_memory = 0: no cap */
+  u_int64_t idle_timeout;               /* same unit as the timestamps, 0: never */
+  u_int64_t last_time;
+  u_int32_t max_tcp_packets, max_udp_packets; /* detection given up after them */
+
+  ndpi_flow_manager_callback flow_detected, flow_idle, flow_evicted;
+  void *user_data;
+
+  u_int64_t num_detected, num_idle, num_evicted;
+} ndpi_flow_manager_t;
+
 typedef enum {
   NDPI_LOG_ERROR,
   NDPI_LOG_TRACE,
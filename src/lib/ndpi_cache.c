@@ -0,0 +1,680 @@
+/*
+ * ndpi_cache.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Server endpoint cache.
+
+  The protocol stack of every completed detection is recorded under the
+  (server address, server port, L4 protocol) of the flow, i.e. the
+  destination of its first packet. Once enough detections agreed, the
+  first packet of the next flow towards that endpoint gets the recorded
+  stack and skips the dissectors. Entries expire NDPI_FLOW_CACHE_TTL
+  seconds after the last detection that confirmed them.
+
+  The cache is shared by the modules of the process (ndpiReader uses one
+  module per thread). It is made of shards of set-associative LRU sets:
+  writers lock the shard, readers never lock and use the entry version
+  to detect concurrent updates.
+
+  Confident entries can be pushed to a Redis-protocol server (SET with
+  expiration) and are loaded back from it when the cache is enabled,
+  so that several processes or restarts share what has been learnt.
+*/
+
+#ifndef __KERNEL__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#endif
+
+#include "ndpi_api.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define NDPI_FLOW_CACHE_KEY_PREFIX   "ndpi:flow:"
+#define NDPI_FLOW_CACHE_MGET_BATCH   64
+
+static ndpi_flow_cache_t *ndpi_flow_cache = NULL;
+static volatile u_int32_t ndpi_flow_cache_lock = 0;
+
+/* ******************************************************************** */
+
+static void ndpi_spin_lock(volatile u_int32_t *lock) {
+  while(__sync_lock_test_and_set(lock, 1))
+    while(*lock)
+      ;
+}
+
+static void ndpi_spin_unlock(volatile u_int32_t *lock) {
+  __sync_lock_release(lock);
+}
+
+/* ******************************************************************** */
+
+static ndpi_flow_cache_entry_t* ndpi_flow_cache_set(ndpi_flow_cache_t *cache,
+						    const ndpi_flow_cache_key_t *key,
+						    ndpi_flow_cache_shard_t **shard) {
+  u_int32_t hash = (key->addr[0] ^ key->addr[1] ^ key->addr[2] ^ key->addr[3])
+    + ((u_int32_t)key->port << 8) + key->l4_proto;
+
+  hash *= 2654435761U;
+  *shard = &cache->shards[hash % NDPI_FLOW_CACHE_SHARDS];
+
+  return(&(*shard)->entries[((hash >> 8) % NDPI_FLOW_CACHE_SETS) * NDPI_FLOW_CACHE_WAYS]);
+}
+
+/* Copies the entry consistently with respect to concurrent writers */
+static void ndpi_flow_cache_read_entry(ndpi_flow_cache_entry_t *e, ndpi_flow_cache_entry_t *copy) {
+  u_int32_t version;
+
+  do {
+    while((version = e->version) & 1)
+      ;
+
+    ndpi_memory_barrier();
+    memcpy(copy, (void*)e, sizeof(ndpi_flow_cache_entry_t));
+    ndpi_memory_barrier();
+  } while(e->version != version);
+}
+
+/* ******************************************************************** */
+
+#ifndef WIN32
+
+static void ndpi_flow_cache_key_to_string(const ndpi_flow_cache_key_t *key, char *buf, u_int buf_len) {
+  char ip[INET6_ADDRSTRLEN];
+
+  inet_ntop(key->is_ipv6 ? AF_INET6 : AF_INET, key->addr, ip, sizeof(ip));
+  snprintf(buf, buf_len, "%s%u:%u:%s", NDPI_FLOW_CACHE_KEY_PREFIX, key->l4_proto, key->port, ip);
+}
+
+static int ndpi_flow_cache_string_to_key(const char *str, ndpi_flow_cache_key_t *key) {
+  u_int l4_proto, port;
+  int offset;
+
+  memset(key, 0, sizeof(ndpi_flow_cache_key_t));
+
+  if((sscanf(str, NDPI_FLOW_CACHE_KEY_PREFIX "%u:%u:%n", &l4_proto, &port, &offset) != 2)
+     || (port == 0) || (port > 65535) || (l4_proto > 255))
+    return(-1);
+
+  key->l4_proto = l4_proto, key->port = port;
+
+  if(inet_pton(AF_INET, &str[offset], key->addr) == 1)
+    key->is_ipv6 = 0;
+  else if(inet_pton(AF_INET6, &str[offset], key->addr) == 1)
+    key->is_ipv6 = 1;
+  else
+    return(-1);
+
+  return(0);
+}
+
+/* ******************************************************************** */
+
+/*
+  Returns 0 when the whole buffer has been sent, -2 when nothing has been
+  sent (socket buffer full) and -1 when the stream is broken, i.e. on
+  error or when only part of the command has been sent
+*/
+static int ndpi_redis_write(int fd, const char *buf, u_int len) {
+  u_int sent = 0;
+
+  while(sent < len) {
+    int rc = send(fd, &buf[sent], len - sent, MSG_NOSIGNAL);
+
+    if(rc <= 0)
+      return(((sent == 0) && (rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) ? -2 : -1);
+
+    sent += rc;
+  }
+
+  return(0);
+}
+
+/* Sends a command made of argc bulk strings */
+static int ndpi_redis_command(int fd, int argc, const char **argv) {
+  char buf[2048];
+  int i, len;
+
+  len = snprintf(buf, sizeof(buf), "*%d\r\n", argc);
+
+  for(i=0; i<argc; i++) {
+    u_int arg_len = strlen(argv[i]);
+
+    if(len + arg_len + 32 >= sizeof(buf))
+      return(-2);
+
+    len += snprintf(&buf[len], sizeof(buf)-len, "$%u\r\n%s\r\n", arg_len, argv[i]);
+  }
+
+  return(ndpi_redis_write(fd, buf, len));
+}
+
+/* ******************************************************************** */
+
+typedef struct {
+  int fd;
+  char buf[4096];
+  u_int pos, len;
+} ndpi_redis_reader_t;
+
+static int ndpi_redis_getc(ndpi_redis_reader_t *r) {
+  if(r->pos == r->len) {
+    int rc = recv(r->fd, r->buf, sizeof(r->buf), 0);
+
+    if(rc <= 0)
+      return(-1);
+
+    r->pos = 0, r->len = rc;
+  }
+
+  return((u_int8_t)r->buf[r->pos++]);
+}
+
+/* Reads a \r\n terminated line (truncated to line_len-1 chars) */
+static int ndpi_redis_read_line(ndpi_redis_reader_t *r, char *line, u_int line_len) {
+  u_int i = 0;
+  int c;
+
+  while((c = ndpi_redis_getc(r)) != '\n') {
+    if(c < 0)
+      return(-1);
+
+    if((c != '\r') && (i < (line_len-1)))
+      line[i++] = c;
+  }
+
+  line[i] = '\0';
+  return(i);
+}
+
+/* Reads a bulk string: returns its length, -2 for nil, -1 on error */
+static int ndpi_redis_read_bulk(ndpi_redis_reader_t *r, char *value, u_int value_len) {
+  char line[32];
+  int len, i;
+
+  if((ndpi_redis_read_line(r, line, sizeof(line)) < 0) || (line[0] != '$'))
+    return(-1);
+
+  if((len = atoi(&line[1])) < 0)
+    return(-2);
+
+  for(i=0; i<len+2 /* \r\n */; i++) {
+    int c = ndpi_redis_getc(r);
+
+    if(c < 0) return(-1);
+    if((i < len) && (i < (int)(value_len-1))) value[i] = c;
+  }
+
+  value[ndpi_min(len, (int)(value_len-1))] = '\0';
+  return(len);
+}
+
+static int ndpi_redis_read_array_len(ndpi_redis_reader_t *r) {
+  char line[32];
+
+  if((ndpi_redis_read_line(r, line, sizeof(line)) < 0) || (line[0] != '*'))
+    return(-1);
+
+  return(atoi(&line[1]));
+}
+
+/* ******************************************************************** */
+
+static void ndpi_flow_cache_insert(ndpi_flow_cache_t *cache, const ndpi_flow_cache_entry_t *entry);
+
+/* Loads the entries shared by the other nDPI instances */
+static int ndpi_flow_cache_redis_load(ndpi_flow_cache_t *cache, int fd) {
+  const char *keys_cmd[] = { "KEYS", NDPI_FLOW_CACHE_KEY_PREFIX "*" };
+  ndpi_redis_reader_t *r;
+  char **keys;
+  int num_keys, i, j, loaded = 0;
+
+  if((r = (ndpi_redis_reader_t*)ndpi_calloc_tag(1, sizeof(ndpi_redis_reader_t), NDPI_MEM_CACHES)) == NULL)
+    return(-1);
+
+  r->fd = fd;
+
+  if((ndpi_redis_command(fd, 2, keys_cmd) != 0) || ((num_keys = ndpi_redis_read_array_len(r)) < 0)) {
+    ndpi_free_tag(r);
+    return(-1);
+  }
+
+  if((keys = (char**)ndpi_calloc_tag(num_keys + 1, sizeof(char*), NDPI_MEM_CACHES)) == NULL) {
+    ndpi_free_tag(r);
+    return(-1);
+  }
+
+  for(i=0; i<num_keys; i++) {
+    char key[128];
+
+    if(ndpi_redis_read_bulk(r, key, sizeof(key)) < 0)
+      break;
+
+    keys[i] = ndpi_strdup_tag(key, NDPI_MEM_CACHES);
+  }
+
+  num_keys = i;
+
+  for(i=0; i<num_keys; i += NDPI_FLOW_CACHE_MGET_BATCH) {
+    const char *argv[NDPI_FLOW_CACHE_MGET_BATCH+1];
+    int num = ndpi_min(NDPI_FLOW_CACHE_MGET_BATCH, num_keys - i), n = 0;
+
+    argv[n++] = "MGET";
+    for(j=0; j<num; j++)
+      if(keys[i+j] != NULL) argv[n++] = keys[i+j];
+
+    if((n == 1) || (ndpi_redis_command(fd, n, argv) != 0) || (ndpi_redis_read_array_len(r) != (n-1)))
+      break;
+
+    for(j=1; j<n; j++) {
+      ndpi_flow_cache_entry_t e;
+      u_int size_minus_one, is_real, stack[3] = { 0 };
+      char value[64];
+
+      if(ndpi_redis_read_bulk(r, value, sizeof(value)) < 0)
+	continue; /* Expired in the meantime */
+
+      memset(&e, 0, sizeof(e));
+
+      if((ndpi_flow_cache_string_to_key(argv[j], &e.key) != 0)
+	 || (sscanf(value, "%u:%u:%u,%u,%u", &size_minus_one, &is_real, &stack[0], &stack[1], &stack[2]) < 3)
+	 || (size_minus_one >= NDPI_PROTOCOL_HISTORY_SIZE))
+	continue;
+
+      e.stack_size_minus_one = size_minus_one, e.entry_is_real_protocol = is_real;
+      for(size_minus_one=0; size_minus_one<ndpi_min(3, NDPI_PROTOCOL_HISTORY_SIZE); size_minus_one++)
+	e.protocol_stack[size_minus_one] = stack[size_minus_one];
+
+      /* Already confirmed by the peer that stored it */
+      e.confidence = NDPI_FLOW_CACHE_MIN_CONFIDENCE;
+      ndpi_flow_cache_insert(cache, &e);
+      loaded++;
+    }
+  }
+
+  for(i=0; i<num_keys; i++)
+    if(keys[i] != NULL) ndpi_free_tag(keys[i]);
+
+  ndpi_free_tag(keys);
+  ndpi_free_tag(r);
+
+  return(loaded);
+}
+
+/* ******************************************************************** */
+
+/* Returns the connected socket, -1 on error */
+static int ndpi_flow_cache_redis_connect(ndpi_flow_cache_t *cache, char *host, u_int port) {
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv = { 1, 0 };
+  char port_str[8];
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC, hints.ai_socktype = SOCK_STREAM;
+  snprintf(port_str, sizeof(port_str), "%u", port);
+
+  if(getaddrinfo(host, port_str, &hints, &res) != 0) {
+    printf("[NDPI] %s(): unable to resolve %s\n", __FUNCTION__, host);
+    return(-1);
+  }
+
+  for(ai = res; ai != NULL; ai = ai->ai_next) {
+    if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    close(fd), fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if(fd < 0) {
+    printf("[NDPI] %s(): unable to connect to %s:%u\n", __FUNCTION__, host, port);
+    return(-1);
+  }
+
+  if(ndpi_flow_cache_redis_load(cache, fd) < 0) {
+    printf("[NDPI] %s(): unable to load entries from %s:%u\n", __FUNCTION__, host, port);
+    close(fd);
+    return(-1);
+  }
+
+  /* From now on entries are pushed from the packet path: never block it */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  return(fd);
+}
+
+/* ******************************************************************** */
+
+/* Best effort: the entry is dropped if the peer can't keep up */
+static void ndpi_flow_cache_redis_set(ndpi_flow_cache_t *cache, const ndpi_flow_cache_entry_t *e) {
+  char key[96], value[64], ttl[16], drain[512];
+  const char *argv[] = { "SET", key, value, "EX", ttl };
+
+  ndpi_flow_cache_key_to_string(&e->key, key, sizeof(key));
+  snprintf(value, sizeof(value), "%u:%u:%u,%u,%u",
+	   e->stack_size_minus_one, e->entry_is_real_protocol,
+	   e->protocol_stack[0],
+	   (NDPI_PROTOCOL_HISTORY_SIZE > 1) ? e->protocol_stack[1] : 0,
+	   (NDPI_PROTOCOL_HISTORY_SIZE > 2) ? e->protocol_stack[2] : 0);
+  snprintf(ttl, sizeof(ttl), "%u", NDPI_FLOW_CACHE_TTL);
+
+  ndpi_spin_lock(&cache->redis_lock);
+
+  if(cache->redis_fd >= 0) {
+    /* Discard the +OK replies */
+    while(recv(cache->redis_fd, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+      ;
+
+    /* Half a command would corrupt all the following ones: start over */
+    if(ndpi_redis_command(cache->redis_fd, 5, argv) == -1) {
+      printf("[NDPI] %s(): write error, cache sharing disabled\n", __FUNCTION__);
+      close(cache->redis_fd);
+      cache->redis_fd = -1;
+    }
+  }
+
+  ndpi_spin_unlock(&cache->redis_lock);
+}
+
+#endif /* WIN32 */
+
+/* ******************************************************************** */
+
+void ndpi_enable_cache(struct ndpi_detection_module_struct *ndpi_mod, char* host, u_int port) {
+  ndpi_flow_cache_t *cache;
+  u_int8_t connect = 0;
+
+  if(ndpi_mod->flow_cache != NULL)
+    return;
+
+  ndpi_spin_lock(&ndpi_flow_cache_lock);
+
+  if((cache = ndpi_flow_cache) == NULL) {
+    if((cache = (ndpi_flow_cache_t*)ndpi_calloc_tag(1, sizeof(ndpi_flow_cache_t), NDPI_MEM_CACHES)) == NULL) {
+      ndpi_spin_unlock(&ndpi_flow_cache_lock);
+      printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+      return;
+    }
+
+    cache->redis_fd = -1;
+    ndpi_flow_cache = cache;
+  }
+
+  if((host != NULL) && (cache->redis_fd < 0) && (!cache->redis_connecting))
+    cache->redis_connecting = connect = 1;
+
+  cache->num_users++;
+  ndpi_mod->flow_cache = cache;
+
+  ndpi_spin_unlock(&ndpi_flow_cache_lock);
+
+  if(connect) {
+    /* Blocking: the other modules keep using the cache meanwhile */
+#ifndef WIN32
+    int fd = ndpi_flow_cache_redis_connect(cache, host, port);
+#else
+    int fd = -1;
+
+    printf("[NDPI] %s(): cache sharing is not supported on this platform\n", __FUNCTION__);
+#endif
+
+    ndpi_spin_lock(&ndpi_flow_cache_lock);
+    ndpi_spin_lock(&cache->redis_lock);
+    cache->redis_fd = fd, cache->redis_connecting = 0;
+    ndpi_spin_unlock(&cache->redis_lock);
+    ndpi_spin_unlock(&ndpi_flow_cache_lock);
+  }
+}
+
+/* ******************************************************************** */
+
+void ndpi_flow_cache_release(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_flow_cache_t *cache = ndpi_struct->flow_cache;
+
+  if(cache == NULL)
+    return;
+
+  ndpi_spin_lock(&ndpi_flow_cache_lock);
+
+  if(--cache->num_users == 0) {
+#ifndef WIN32
+    if(cache->redis_fd >= 0)
+      close(cache->redis_fd);
+#endif
+
+    ndpi_free_tag(cache);
+    ndpi_flow_cache = NULL;
+  }
+
+  ndpi_struct->flow_cache = NULL;
+  ndpi_spin_unlock(&ndpi_flow_cache_lock);
+}
+
+/* ******************************************************************** */
+
+/* Replaces the entry of the same key, or the least recently used one */
+static ndpi_flow_cache_entry_t* ndpi_flow_cache_find_slot(ndpi_flow_cache_entry_t *set,
+							  const ndpi_flow_cache_key_t *key) {
+  ndpi_flow_cache_entry_t *victim = NULL;
+  int i;
+
+  for(i=0; i<NDPI_FLOW_CACHE_WAYS; i++) {
+    if((set[i].key.port != 0) && (memcmp(&set[i].key, key, sizeof(ndpi_flow_cache_key_t)) == 0))
+      return(&set[i]);
+
+    if((victim == NULL) || (set[i].key.port == 0)
+       || ((victim->key.port != 0) && ((int32_t)(set[i].last_used - victim->last_used) < 0)))
+      victim = &set[i];
+  }
+
+  return(victim);
+}
+
+static void ndpi_flow_cache_insert(ndpi_flow_cache_t *cache, const ndpi_flow_cache_entry_t *entry) {
+  ndpi_flow_cache_shard_t *shard;
+  ndpi_flow_cache_entry_t *e, *set = ndpi_flow_cache_set(cache, &entry->key, &shard);
+
+  ndpi_spin_lock(&shard->lock);
+
+  e = ndpi_flow_cache_find_slot(set, &entry->key);
+  e->version++;
+  ndpi_memory_barrier();
+  memcpy((u_int8_t*)e + sizeof(e->version), (const u_int8_t*)entry + sizeof(entry->version),
+	 sizeof(ndpi_flow_cache_entry_t) - sizeof(e->version));
+  ndpi_memory_barrier();
+  e->version++;
+
+  ndpi_spin_unlock(&shard->lock);
+}
+
+/* ******************************************************************** */
+
+/* Updates the aging of an entry found by a reader, unless it has been reused meanwhile */
+static void ndpi_flow_cache_touch(ndpi_flow_cache_shard_t *shard, ndpi_flow_cache_entry_t *e,
+				  const ndpi_flow_cache_key_t *key, u_int32_t expire, u_int32_t now) {
+  ndpi_spin_lock(&shard->lock);
+
+  if((e->key.port != 0) && (memcmp(&e->key, key, sizeof(ndpi_flow_cache_key_t)) == 0)) {
+    e->version++;
+    ndpi_memory_barrier();
+    if(e->expire == 0) e->expire = expire;
+    e->last_used = now;
+    ndpi_memory_barrier();
+    e->version++;
+  }
+
+  ndpi_spin_unlock(&shard->lock);
+}
+
+/* ******************************************************************** */
+
+/* Called on the first packet of a flow */
+u_int16_t ndpi_flow_cache_lookup(struct ndpi_detection_module_struct *ndpi_struct,
+				 struct ndpi_flow_struct *flow) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  ndpi_flow_cache_key_t *key = &flow->cache_key;
+  ndpi_flow_cache_shard_t *shard;
+  ndpi_flow_cache_entry_t *set, copy;
+  int i;
+
+  if(ndpi_struct->flow_cache == NULL)
+    return(NDPI_PROTOCOL_UNKNOWN);
+
+  memset(key, 0, sizeof(ndpi_flow_cache_key_t));
+
+  if(packet->tcp != NULL)
+    key->port = packet->tcp->dest, key->l4_proto = IPPROTO_TCP;
+  else if(packet->udp != NULL)
+    key->port = packet->udp->dest, key->l4_proto = IPPROTO_UDP;
+  else
+    return(NDPI_PROTOCOL_UNKNOWN);
+
+  key->port = ntohs(key->port);
+
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+  if(packet->iphv6 != NULL)
+    memcpy(key->addr, &packet->iphv6->daddr, 16), key->is_ipv6 = 1;
+  else
+#endif
+    key->addr[0] = packet->iph->daddr;
+
+  set = ndpi_flow_cache_set(ndpi_struct->flow_cache, key, &shard);
+
+  for(i=0; i<NDPI_FLOW_CACHE_WAYS; i++) {
+    ndpi_flow_cache_read_entry(&set[i], &copy);
+
+    if((copy.key.port == 0) || memcmp(&copy.key, key, sizeof(ndpi_flow_cache_key_t)))
+      continue;
+
+    if(copy.expire == 0) {
+      /* Loaded from the peer: it starts aging now */
+      copy.expire = packet->tick_timestamp + NDPI_FLOW_CACHE_TTL * ndpi_struct->ticks_per_second;
+      if(copy.expire == 0) copy.expire = 1;
+      ndpi_flow_cache_touch(shard, &set[i], key, copy.expire, packet->tick_timestamp);
+      copy.last_used = packet->tick_timestamp;
+    }
+
+    if((copy.confidence < NDPI_FLOW_CACHE_MIN_CONFIDENCE)
+       || ((int32_t)(copy.expire - packet->tick_timestamp) <= 0))
+      return(NDPI_PROTOCOL_UNKNOWN);
+
+    /* The LRU stamp is refreshed at most once per second to keep hits lock free */
+    if((packet->tick_timestamp - copy.last_used) >= ndpi_struct->ticks_per_second)
+      ndpi_flow_cache_touch(shard, &set[i], key, copy.expire, packet->tick_timestamp);
+
+    memcpy(flow->detected_protocol_stack, copy.protocol_stack, sizeof(flow->detected_protocol_stack));
+    memcpy(packet->detected_protocol_stack, copy.protocol_stack, sizeof(packet->detected_protocol_stack));
+#if NDPI_PROTOCOL_HISTORY_SIZE > 1
+    flow->protocol_stack_info.current_stack_size_minus_one = copy.stack_size_minus_one;
+    flow->protocol_stack_info.entry_is_real_protocol = copy.entry_is_real_protocol;
+    packet->protocol_stack_info.current_stack_size_minus_one = copy.stack_size_minus_one;
+    packet->protocol_stack_info.entry_is_real_protocol = copy.entry_is_real_protocol;
+#endif
+
+    /* Nothing new to learn from this flow */
+    key->port = 0;
+
+    return(copy.protocol_stack[0]);
+  }
+
+  return(NDPI_PROTOCOL_UNKNOWN);
+}
+
+/* ******************************************************************** */
+
+/* Called once the dissectors have detected the flow protocol */
+void ndpi_flow_cache_record(struct ndpi_detection_module_struct *ndpi_struct,
+			    struct ndpi_flow_struct *flow) {
+  ndpi_flow_cache_t *cache = ndpi_struct->flow_cache;
+  ndpi_flow_cache_key_t *key = &flow->cache_key;
+  ndpi_flow_cache_shard_t *shard;
+  ndpi_flow_cache_entry_t *e, *set, entry;
+  u_int32_t now = flow->packet.tick_timestamp;
+  u_int8_t stack_size_minus_one = 0, entry_is_real_protocol = 0;
+
+  if((cache == NULL) || (key->port == 0))
+    return;
+
+#if NDPI_PROTOCOL_HISTORY_SIZE > 1
+  stack_size_minus_one = flow->protocol_stack_info.current_stack_size_minus_one;
+  entry_is_real_protocol = flow->protocol_stack_info.entry_is_real_protocol;
+#endif
+
+  set = ndpi_flow_cache_set(cache, key, &shard);
+
+  ndpi_spin_lock(&shard->lock);
+
+  e = ndpi_flow_cache_find_slot(set, key);
+  e->version++;
+  ndpi_memory_barrier();
+
+  if((e->key.port != 0) && (memcmp(&e->key, key, sizeof(ndpi_flow_cache_key_t)) == 0)
+     && (memcmp(e->protocol_stack, flow->detected_protocol_stack, sizeof(e->protocol_stack)) == 0)
+     && (e->stack_size_minus_one == stack_size_minus_one)) {
+    if(e->confidence < 255) e->confidence++;
+  } else {
+    /* New endpoint or the protocol has changed */
+    memcpy(&e->key, key, sizeof(ndpi_flow_cache_key_t));
+    memcpy(e->protocol_stack, flow->detected_protocol_stack, sizeof(e->protocol_stack));
+    e->stack_size_minus_one = stack_size_minus_one, e->entry_is_real_protocol = entry_is_real_protocol;
+    e->confidence = 1;
+  }
+
+  e->expire = now + NDPI_FLOW_CACHE_TTL * ndpi_struct->ticks_per_second, e->last_used = now;
+  if(e->expire == 0) e->expire = 1;
+
+  memcpy(&entry, (void*)e, sizeof(entry));
+  ndpi_memory_barrier();
+  e->version++;
+
+  ndpi_spin_unlock(&shard->lock);
+
+  key->port = 0;
+
+#ifndef WIN32
+  if((entry.confidence == NDPI_FLOW_CACHE_MIN_CONFIDENCE) && (cache->redis_fd >= 0))
+    ndpi_flow_cache_redis_set(cache, &entry);
+#endif
+}
+
+#endif
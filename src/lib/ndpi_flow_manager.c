@@ -0,0 +1,369 @@
+/*
+ * ndpi_flow_manager.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Flow manager.
+
+  A chained hash table of flows, keyed by the canonical tuple (lower and
+  upper endpoint, L4 protocol) so that both directions find the same
+  flow. The table doubles when it holds more flows than buckets. Flows
+  are also kept in a list ordered by last packet, most recent first:
+  idle flows are expired from its tail a few at a time while packets are
+  processed, and the tail is evicted when a new flow would exceed the
+  memory cap.
+
+  Each flow owns its ndpi_flow_struct and the id structs of its two
+  endpoints (as ndpiReader does) until its detection completes: they are
+  released then, only the flow record stays.
+*/
+
+#include "ndpi_api.h"
+
+#define NDPI_FLOW_MANAGER_MIN_BUCKETS    1024
+#define NDPI_FLOW_MANAGER_IDLE_BUDGET      16 /* flows expired per packet */
+#define NDPI_FLOW_MANAGER_MAX_TCP_PACKETS  10
+#define NDPI_FLOW_MANAGER_MAX_UDP_PACKETS   8
+
+/* size of a flow while its detection is running */
+#define NDPI_FLOW_MANAGER_FLOW_LEN \
+  (sizeof(ndpi_managed_flow_t) + sizeof(struct ndpi_flow_struct) + 2 * sizeof(struct ndpi_id_struct))
+
+/* ****************************************************** */
+
+ndpi_flow_manager_t* ndpi_flow_manager_init(struct ndpi_detection_module_struct *ndpi_mod,
+					    u_int64_t max_memory, u_int64_t idle_timeout) {
+  ndpi_flow_manager_t *fm;
+
+  if((fm = (ndpi_flow_manager_t*)ndpi_calloc_tag(1, sizeof(ndpi_flow_manager_t), NDPI_MEM_FLOWS)) == NULL)
+    return(NULL);
+
+  fm->num_buckets = NDPI_FLOW_MANAGER_MIN_BUCKETS;
+
+  if((fm->buckets = (ndpi_managed_flow_t**)ndpi_calloc_tag(fm->num_buckets, sizeof(ndpi_managed_flow_t*),
+							   NDPI_MEM_FLOWS)) == NULL) {
+    ndpi_free_tag(fm);
+    return(NULL);
+  }
+
+  fm->ndpi_struct = ndpi_mod;
+  fm->max_memory = max_memory, fm->idle_timeout = idle_timeout;
+  fm->memory_used = sizeof(ndpi_flow_manager_t) + fm->num_buckets * sizeof(ndpi_managed_flow_t*);
+  fm->max_tcp_packets = NDPI_FLOW_MANAGER_MAX_TCP_PACKETS;
+  fm->max_udp_packets = NDPI_FLOW_MANAGER_MAX_UDP_PACKETS;
+
+  return(fm);
+}
+
+/* ****************************************************** */
+
+void ndpi_flow_manager_set_callbacks(ndpi_flow_manager_t *fm,
+				     ndpi_flow_manager_callback flow_detected,
+				     ndpi_flow_manager_callback flow_idle,
+				     ndpi_flow_manager_callback flow_evicted,
+				     void *user_data) {
+  fm->flow_detected = flow_detected, fm->flow_idle = flow_idle, fm->flow_evicted = flow_evicted;
+  fm->user_data = user_data;
+}
+
+/* ****************************************************** */
+
+static void ndpi_flow_manager_free_state(ndpi_flow_manager_t *fm, ndpi_managed_flow_t *flow) {
+  if(flow->ndpi_flow == NULL)
+    return;
+
+  ndpi_flow_state_free(fm->ndpi_struct, flow->ndpi_flow);
+  ndpi_free_id_state(flow->lower_id), ndpi_free_id_state(flow->upper_id);
+  ndpi_free_tag(flow->ndpi_flow), ndpi_free_tag(flow->lower_id), ndpi_free_tag(flow->upper_id);
+  flow->ndpi_flow = NULL, flow->lower_id = flow->upper_id = NULL;
+
+  fm->memory_used -= NDPI_FLOW_MANAGER_FLOW_LEN - sizeof(ndpi_managed_flow_t);
+}
+
+/* ****************************************************** */
+
+static void ndpi_flow_manager_lru_unlink(ndpi_flow_manager_t *fm, ndpi_managed_flow_t *flow) {
+  if(flow->lru_prev) flow->lru_prev->lru_next = flow->lru_next; else fm->lru_head = flow->lru_next;
+  if(flow->lru_next) flow->lru_next->lru_prev = flow->lru_prev; else fm->lru_tail = flow->lru_prev;
+}
+
+/* ****************************************************** */
+
+static void ndpi_flow_manager_lru_push(ndpi_flow_manager_t *fm, ndpi_managed_flow_t *flow) {
+  flow->lru_prev = NULL, flow->lru_next = fm->lru_head;
+  if(fm->lru_head) fm->lru_head->lru_prev = flow; else fm->lru_tail = flow;
+  fm->lru_head = flow;
+}
+
+/* ****************************************************** */
+
+/* Unlink a flow from the table, let the application know and free it */
+static void ndpi_flow_manager_remove(ndpi_flow_manager_t *fm, ndpi_managed_flow_t *flow,
+				     ndpi_flow_manager_callback callback) {
+  ndpi_managed_flow_t **prev = &fm->buckets[flow->hash & (fm->num_buckets - 1)];
+
+  while(*prev != flow)
+    prev = &(*prev)->hash_next;
+
+  *prev = flow->hash_next;
+  ndpi_flow_manager_lru_unlink(fm, flow);
+  fm->num_flows--;
+
+  if(callback)
+    callback(flow, fm->user_data);
+
+  ndpi_flow_manager_free_state(fm, flow);
+  ndpi_free_tag(flow);
+  fm->memory_used -= sizeof(ndpi_managed_flow_t);
+}
+
+/* ****************************************************** */
+
+static u_int32_t ndpi_flow_manager_expire(ndpi_flow_manager_t *fm, u_int64_t time, u_int32_t budget) {
+  u_int32_t num = 0;
+
+  while((fm->lru_tail != NULL) && (num < budget)
+	&& (fm->lru_tail->last_seen + fm->idle_timeout < time)) {
+    ndpi_flow_manager_remove(fm, fm->lru_tail, fm->flow_idle);
+    fm->num_idle++, num++;
+  }
+
+  return(num);
+}
+
+/* ****************************************************** */
+
+u_int32_t ndpi_flow_manager_expire_idle(ndpi_flow_manager_t *fm, u_int64_t time) {
+  if(fm->idle_timeout == 0)
+    return(0);
+
+  return(ndpi_flow_manager_expire(fm, time, (u_int32_t)-1));
+}
+
+/* ****************************************************** */
+
+/* Double the buckets, unless the memory cap does not allow it (chains get longer) */
+static void ndpi_flow_manager_grow(ndpi_flow_manager_t *fm) {
+  u_int32_t num_buckets = fm->num_buckets * 2, i;
+  ndpi_managed_flow_t **buckets;
+
+  if((num_buckets == 0)
+     || (fm->max_memory && (fm->memory_used + fm->num_buckets * sizeof(ndpi_managed_flow_t*) > fm->max_memory))
+     || ((buckets = (ndpi_managed_flow_t**)ndpi_calloc_tag(num_buckets, sizeof(ndpi_managed_flow_t*),
+							   NDPI_MEM_FLOWS)) == NULL))
+    return;
+
+  for(i = 0; i < fm->num_buckets; i++) {
+    while(fm->buckets[i] != NULL) {
+      ndpi_managed_flow_t *flow = fm->buckets[i];
+      u_int32_t idx = flow->hash & (num_buckets - 1);
+
+      fm->buckets[i] = flow->hash_next;
+      flow->hash_next = buckets[idx], buckets[idx] = flow;
+    }
+  }
+
+  ndpi_free_tag(fm->buckets);
+  fm->memory_used += fm->num_buckets * sizeof(ndpi_managed_flow_t*);
+  fm->buckets = buckets, fm->num_buckets = num_buckets;
+}
+
+/* ****************************************************** */
+
+static ndpi_managed_flow_t* ndpi_flow_manager_new_flow(ndpi_flow_manager_t *fm) {
+  ndpi_managed_flow_t *flow;
+
+  while(fm->max_memory && (fm->memory_used + NDPI_FLOW_MANAGER_FLOW_LEN > fm->max_memory)) {
+    if(fm->lru_tail == NULL)
+      return(NULL);
+
+    ndpi_flow_manager_remove(fm, fm->lru_tail, fm->flow_evicted);
+    fm->num_evicted++;
+  }
+
+  if((flow = (ndpi_managed_flow_t*)ndpi_calloc_tag(1, sizeof(ndpi_managed_flow_t), NDPI_MEM_FLOWS)) == NULL)
+    return(NULL);
+
+  if(((flow->ndpi_flow = ndpi_calloc_tag(1, sizeof(struct ndpi_flow_struct), NDPI_MEM_FLOWS)) == NULL)
+     || ((flow->lower_id = ndpi_calloc_tag(1, sizeof(struct ndpi_id_struct), NDPI_MEM_FLOWS)) == NULL)
+     || ((flow->upper_id = ndpi_calloc_tag(1, sizeof(struct ndpi_id_struct), NDPI_MEM_FLOWS)) == NULL)) {
+    if(flow->ndpi_flow) ndpi_free_tag(flow->ndpi_flow);
+    if(flow->lower_id) ndpi_free_tag(flow->lower_id);
+    ndpi_free_tag(flow);
+    return(NULL);
+  }
+
+  fm->memory_used += NDPI_FLOW_MANAGER_FLOW_LEN;
+
+  return(flow);
+}
+
+/* ****************************************************** */
+
+ndpi_managed_flow_t* ndpi_flow_manager_process_packet(ndpi_flow_manager_t *fm,
+						      const u_int8_t *packet, u_int16_t packetlen,
+						      u_int64_t time) {
+  u_int32_t saddr[4] = { 0 }, daddr[4] = { 0 }, h, i;
+  u_int16_t sport = 0, dport = 0, l4_offset, l4_len;
+  u_int8_t ip_version, l4_protocol;
+  ndpi_managed_flow_t *flow;
+  int swap;
+
+  if(packetlen < 20)
+    return(NULL);
+
+  ip_version = packet[0] >> 4;
+
+  if(ip_version == 4) {
+    const struct ndpi_iphdr *iph = (const struct ndpi_iphdr*)packet;
+
+    l4_offset = iph->ihl * 4;
+
+    if((l4_offset < 20) || (ntohs(iph->tot_len) < l4_offset) || (ntohs(iph->tot_len) > packetlen)
+       || ((iph->frag_off & htons(0x1FFF)) != 0))
+      return(NULL);
+
+    l4_protocol = iph->protocol, l4_len = ntohs(iph->tot_len) - l4_offset;
+    saddr[0] = iph->saddr, daddr[0] = iph->daddr;
+  } else if((ip_version == 6) && (packetlen >= sizeof(struct ndpi_ip6_hdr))) {
+    const struct ndpi_ip6_hdr *iph6 = (const struct ndpi_ip6_hdr*)packet;
+    u_int32_t ip_len = sizeof(struct ndpi_ip6_hdr) + ntohs(iph6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    u_int32_t hlen = sizeof(struct ndpi_ip6_hdr);
+
+    if(ip_len > packetlen)
+      return(NULL); /* shorter ones are Ethernet padding */
+
+    /* hop-by-hop, routing, destination options and fragment */
+    for(l4_protocol = iph6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+	(l4_protocol == 0) || (l4_protocol == 43) || (l4_protocol == 44) || (l4_protocol == 60); ) {
+      if(hlen + 8 > ip_len)
+	return(NULL);
+
+      if(l4_protocol == 44) {
+	/* like IPv4, only the first fragment (offset 0) has the ports */
+	if((ntohs(get_u_int16_t(packet, hlen + 2)) & 0xFFF8) != 0)
+	  return(NULL);
+
+	l4_protocol = packet[hlen], hlen += 8;
+      } else
+	l4_protocol = packet[hlen], hlen += (packet[hlen + 1] + 1) * 8;
+    }
+
+    if(hlen > ip_len)
+      return(NULL);
+
+    l4_offset = hlen, l4_len = ip_len - hlen;
+    memcpy(saddr, &iph6->ip6_src, sizeof(saddr));
+    memcpy(daddr, &iph6->ip6_dst, sizeof(daddr));
+  } else
+    return(NULL);
+
+  if(((l4_protocol == IPPROTO_TCP) && (l4_len >= 20)) || ((l4_protocol == IPPROTO_UDP) && (l4_len >= 8)))
+    memcpy(&sport, &packet[l4_offset], 2), memcpy(&dport, &packet[l4_offset + 2], 2);
+
+  swap = memcmp(saddr, daddr, sizeof(saddr));
+  swap = ((swap > 0) || ((swap == 0) && (sport > dport))) ? 1 : 0;
+
+  /* symmetric: computed on the endpoints before ordering them */
+  h = l4_protocol + sport + dport;
+  for(i = 0; i < 4; i++) {
+    h = (h + saddr[i] + daddr[i]) * 0x9E3779B1;
+    h ^= h >> 16;
+  }
+
+  for(flow = fm->buckets[h & (fm->num_buckets - 1)]; flow != NULL; flow = flow->hash_next) {
+    if((flow->hash == h) && (flow->ip_version == ip_version) && (flow->l4_protocol == l4_protocol)
+       && (flow->lower_port == (swap ? dport : sport)) && (flow->upper_port == (swap ? sport : dport))
+       && (memcmp(flow->lower_ip, swap ? daddr : saddr, sizeof(saddr)) == 0)
+       && (memcmp(flow->upper_ip, swap ? saddr : daddr, sizeof(saddr)) == 0))
+      break;
+  }
+
+  if(time < fm->last_time)
+    time = fm->last_time; /* keep the LRU list ordered by time */
+  fm->last_time = time;
+
+  if(flow == NULL) {
+    if((flow = ndpi_flow_manager_new_flow(fm)) == NULL)
+      return(NULL);
+
+    flow->ip_version = ip_version, flow->l4_protocol = l4_protocol;
+    memcpy(flow->lower_ip, swap ? daddr : saddr, sizeof(saddr));
+    memcpy(flow->upper_ip, swap ? saddr : daddr, sizeof(saddr));
+    flow->lower_port = swap ? dport : sport, flow->upper_port = swap ? sport : dport;
+    flow->first_seen = time, flow->hash = h;
+
+    if(++fm->num_flows > fm->num_buckets)
+      ndpi_flow_manager_grow(fm);
+
+    flow->hash_next = fm->buckets[h & (fm->num_buckets - 1)];
+    fm->buckets[h & (fm->num_buckets - 1)] = flow;
+  } else
+    ndpi_flow_manager_lru_unlink(fm, flow);
+
+  ndpi_flow_manager_lru_push(fm, flow);
+  flow->last_seen = time;
+  flow->packets++, flow->bytes += packetlen;
+
+  if(!flow->detection_completed) {
+    flow->detected_protocol = ndpi_detection_process_packet(fm->ndpi_struct, flow->ndpi_flow, packet, packetlen,
+							    (u_int32_t)time,
+							    swap ? flow->upper_id : flow->lower_id,
+							    swap ? flow->lower_id : flow->upper_id);
+
+    if((flow->detected_protocol != NDPI_PROTOCOL_UNKNOWN)
+       || ((l4_protocol == IPPROTO_UDP) && (flow->packets > fm->max_udp_packets))
+       || ((l4_protocol == IPPROTO_TCP) && (flow->packets > fm->max_tcp_packets))) {
+      flow->detection_completed = 1, fm->num_detected++;
+
+      if(fm->flow_detected)
+	fm->flow_detected(flow, fm->user_data);
+
+      ndpi_flow_manager_free_state(fm, flow);
+    }
+  }
+
+  /* the flow of this packet is at the head: it is never expired here */
+  if(fm->idle_timeout)
+    ndpi_flow_manager_expire(fm, time, NDPI_FLOW_MANAGER_IDLE_BUDGET);
+
+  return(flow);
+}
+
+/* ****************************************************** */
+
+void ndpi_flow_manager_walk(ndpi_flow_manager_t *fm, ndpi_flow_manager_callback walker, void *user_data) {
+  ndpi_managed_flow_t *flow;
+
+  for(flow = fm->lru_head; flow != NULL; flow = flow->lru_next)
+    walker(flow, user_data);
+}
+
+/* ****************************************************** */
+
+void ndpi_flow_manager_release(ndpi_flow_manager_t *fm) {
+  while(fm->lru_head != NULL)
+    ndpi_flow_manager_remove(fm, fm->lru_head, NULL);
+
+  ndpi_free_tag(fm->buckets);
+  ndpi_free_tag(fm);
+}
@@ -187,7 +187,7 @@ ndpi_tsearch(const void *vkey, void **vrootp,
       &(*rootp)->left :		/* T3: follow left branch */
       &(*rootp)->right;		/* T4: follow right branch */
   }
-  q = (ndpi_node *) ndpi_malloc(sizeof(ndpi_node));	/* T5: key not found */
+  q = (ndpi_node *) ndpi_malloc_tag(sizeof(ndpi_node), NDPI_MEM_TREES);	/* T5: key not found */
   if(q != (ndpi_node *)0) {	/* make new node */
     *rootp = q;			/* link new node to old */
     q->key = key;		/* initialize new node */
@@ -233,7 +233,7 @@ ndpi_tdelete(const void *vkey, void **vrootp,
       q->right = (*rootp)->right;
     }
   }
-  ndpi_free((ndpi_node *) *rootp);	/* D4: Free node */
+  ndpi_free_tag((ndpi_node *) *rootp);	/* D4: Free node */
   *rootp = q;				/* link parent to new node */
   return(p);
 }
@@ -296,7 +296,7 @@ static void ndpi_tdestroy_recurse(ndpi_node* root, void (*free_action)(void *))
     ndpi_tdestroy_recurse(root->right, free_action);
 
   (*free_action) ((void *) root->key);
-  ndpi_free(root);
+  ndpi_free_tag(root);
 }
 
 void ndpi_tdestroy(void *vrootp, void (*freefct)(void *)) {
@@ -416,6 +416,163 @@ static void addDefaultPort(ndpi_port_range *range,
 			   ndpi_proto_defaults_t *def, ndpi_default_ports_tree_node_t **root);
 static int removeDefaultPort(ndpi_port_range *range,
 			     ndpi_proto_defaults_t *def, ndpi_default_ports_tree_node_t **root);
+static void ndpi_register_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+					  u_int8_t l4_proto, ndpi_port_range *range, u_int16_t protocol_id);
+static char* ndpi_rules_strdup(ndpi_rules_t *rules, char *value);
+
+/* ****************************************** */
+
+/*
+  Every library allocation is preceded by a small header recording its
+  size and subsystem so that the bytes in use can be accounted per tag.
+  The counters are process-wide: all the detection modules share the
+  same allocator.
+*/
+#define NDPI_MEM_MAGIC    0x4E4D454D /* NMEM */
+
+typedef struct {
+  u_int64_t size;
+  u_int32_t tag, magic;
+} ndpi_mem_header_t;
+
+static volatile u_int64_t ndpi_mem_bytes[NDPI_MEM_NUM_TAGS], ndpi_mem_peak_bytes[NDPI_MEM_NUM_TAGS];
+static volatile u_int64_t ndpi_mem_allocations[NDPI_MEM_NUM_TAGS];
+
+static const char *ndpi_mem_tag_names[NDPI_MEM_NUM_TAGS] = {
+  "Module", "Automata", "Ports", "Trees", "Protocols", "Rules", "Caches", "Flows", "Other"
+};
+
+/* ****************************************** */
+
+void* ndpi_malloc_tag(unsigned long size, ndpi_mem_tag_t tag) {
+  ndpi_mem_header_t *h;
+  u_int64_t bytes;
+
+  if(tag >= NDPI_MEM_NUM_TAGS) tag = NDPI_MEM_OTHER;
+
+  if((h = (ndpi_mem_header_t*)_ndpi_malloc(sizeof(ndpi_mem_header_t) + size)) == NULL)
+    return(NULL);
+
+  h->size = size, h->tag = tag, h->magic = NDPI_MEM_MAGIC;
+
+  bytes = __sync_add_and_fetch(&ndpi_mem_bytes[tag], size);
+  __sync_fetch_and_add(&ndpi_mem_allocations[tag], 1);
+
+  /* racy but monotonic enough for a high watermark */
+  if(bytes > ndpi_mem_peak_bytes[tag])
+    ndpi_mem_peak_bytes[tag] = bytes;
+
+  return(&h[1]);
+}
+
+/* ****************************************** */
+
+void* ndpi_calloc_tag(unsigned long count, unsigned long size, ndpi_mem_tag_t tag) {
+  unsigned long len = count*size;
+  void *p = ndpi_malloc_tag(len, tag);
+
+  if(p)
+    memset(p, 0, len);
+
+  return(p);
+}
+
+/* ****************************************** */
+
+void ndpi_free_tag(void *ptr) {
+  ndpi_mem_header_t *h;
+
+  if(ptr == NULL) return;
+
+  h = &((ndpi_mem_header_t*)ptr)[-1];
+
+  if((h->magic != NDPI_MEM_MAGIC) || (h->tag >= NDPI_MEM_NUM_TAGS)) {
+    printf("[NDPI] %s(): %p was not allocated by ndpi_malloc_tag()\n", __FUNCTION__, ptr);
+    return;
+  }
+
+  __sync_fetch_and_sub(&ndpi_mem_bytes[h->tag], h->size);
+  __sync_fetch_and_sub(&ndpi_mem_allocations[h->tag], 1);
+  h->magic = 0;
+
+  _ndpi_free(h);
+}
+
+/* ****************************************** */
+
+char *ndpi_strdup_tag(const char *s, ndpi_mem_tag_t tag) {
+  int len = strlen(s);
+  char *m = ndpi_malloc_tag(len+1, tag);
+
+  if(m) {
+    memcpy(m, s, len);
+    m[len] = '\0';
+  }
+
+  return(m);
+}
+
+/* ****************************************** */
+
+/* The new block keeps the tag of the old one */
+void *ndpi_realloc_tag(void *ptr, size_t old_size, size_t new_size) {
+  void *ret = ndpi_malloc_tag(new_size, ((ndpi_mem_header_t*)ptr)[-1].tag);
+
+  if(!ret)
+    return(ret);
+  else {
+    memcpy(ret, ptr, old_size);
+    ndpi_free_tag(ptr);
+    return(ret);
+  }
+}
+
+/* ****************************************** */
+
+static void ndpi_count_port_node(const void *node, ndpi_VISIT which, int depth, void *user_data) {
+  if((which == ndpi_preorder) || (which == ndpi_leaf))
+    (*(u_int32_t*)user_data)++;
+}
+
+/* ****************************************** */
+
+void ndpi_get_memory_stats(struct ndpi_detection_module_struct *ndpi_mod,
+			   ndpi_memory_stats_t *stats) {
+  u_int32_t i;
+
+  memset(stats, 0, sizeof(ndpi_memory_stats_t));
+
+  for(i = 0; i < NDPI_MEM_NUM_TAGS; i++) {
+    stats->tag[i].bytes = ndpi_mem_bytes[i];
+    stats->tag[i].peak_bytes = ndpi_mem_peak_bytes[i];
+    stats->tag[i].allocations = ndpi_mem_allocations[i];
+    stats->total_bytes += stats->tag[i].bytes;
+  }
+
+  if(ndpi_mod != NULL) {
+    ndpi_rules_t *rules = ndpi_mod->rules;
+
+    if(ndpi_mod->content_automa.ac_automa != NULL)
+      stats->num_host_rules += ((AC_AUTOMATA_t*)ndpi_mod->content_automa.ac_automa)->total_patterns;
+
+    if(rules != NULL) {
+      if(rules->host_automa.ac_automa != NULL)
+	stats->num_host_rules += ((AC_AUTOMATA_t*)rules->host_automa.ac_automa)->total_patterns;
+
+      if(rules->snapshot != NULL)
+	stats->num_port_rules += rules->snapshot->header->num_tcp_ports + rules->snapshot->header->num_udp_ports;
+
+      ndpi_twalk(rules->tcpRoot, ndpi_count_port_node, &stats->num_port_rules);
+      ndpi_twalk(rules->udpRoot, ndpi_count_port_node, &stats->num_port_rules);
+    }
+  }
+}
+
+/* ****************************************** */
+
+const char* ndpi_get_memory_tag_name(ndpi_mem_tag_t tag) {
+  return((tag < NDPI_MEM_NUM_TAGS) ? ndpi_mem_tag_names[tag] : "Unknown");
+}
 
 /* ****************************************** */
 
@@ -527,21 +684,31 @@ ndpi_port_range* ndpi_build_default_ports(ndpi_port_range *ports,
 void ndpi_set_proto_defaults(struct ndpi_detection_module_struct *ndpi_mod,
 			     u_int16_t protoId, char *protoName,
 			     ndpi_port_range *tcpDefPorts, ndpi_port_range *udpDefPorts) {
-  char *name = ndpi_strdup(protoName);
+  char *name = ndpi_strdup_tag(protoName, NDPI_MEM_PROTOCOLS);
   int j;
 
   if(protoId >= NDPI_MAX_SUPPORTED_PROTOCOLS+NDPI_MAX_NUM_CUSTOM_PROTOCOLS) {
     printf("[NDPI] %s(protoId=%d): INTERNAL ERROR\n", __FUNCTION__, protoId);
-    ndpi_free(name);
+    ndpi_free_tag(name);
     return;
   }
 
   ndpi_mod->proto_defaults[protoId].protoName = name,
     ndpi_mod->proto_defaults[protoId].protoId = protoId;
 
+  /* Kept for rebuilding the port trees on ndpi_reload_protocols_file() */
+  memcpy(ndpi_mod->proto_defaults[protoId].tcp_default_ports, tcpDefPorts, MAX_DEFAULT_PORTS * sizeof(ndpi_port_range));
+  memcpy(ndpi_mod->proto_defaults[protoId].udp_default_ports, udpDefPorts, MAX_DEFAULT_PORTS * sizeof(ndpi_port_range));
+
   for(j=0; j<MAX_DEFAULT_PORTS; j++) {
-    if(udpDefPorts[j].port_low != 0) addDefaultPort(&udpDefPorts[j], &ndpi_mod->proto_defaults[protoId], &ndpi_mod->udpRoot);
-    if(tcpDefPorts[j].port_low != 0) addDefaultPort(&tcpDefPorts[j], &ndpi_mod->proto_defaults[protoId], &ndpi_mod->tcpRoot);
+    if(udpDefPorts[j].port_low != 0) addDefaultPort(&udpDefPorts[j], &ndpi_mod->proto_defaults[protoId], &ndpi_mod->rules->udpRoot);
+    if(tcpDefPorts[j].port_low != 0) addDefaultPort(&tcpDefPorts[j], &ndpi_mod->proto_defaults[protoId], &ndpi_mod->rules->tcpRoot);
+
+    /* custom protocols have no dissector to try */
+    if(protoId < NDPI_MAX_SUPPORTED_PROTOCOLS) {
+      ndpi_register_port_candidates(ndpi_mod, IPPROTO_UDP, &udpDefPorts[j], protoId);
+      ndpi_register_port_candidates(ndpi_mod, IPPROTO_TCP, &tcpDefPorts[j], protoId);
+    }
   }
 
 #if 0
@@ -589,24 +756,497 @@ static void addDefaultPort(ndpi_port_range *range,
 
   // printf("[NDPI] %s(%d)\n", __FUNCTION__, port);
 
-  for(port=range->port_low; port<=range->port_high; port++) {
-    ndpi_default_ports_tree_node_t *node = (ndpi_default_ports_tree_node_t*)ndpi_malloc(sizeof(ndpi_default_ports_tree_node_t));
+  for(port=range->port_low; port<=range->port_high; port++) {
+    ndpi_default_ports_tree_node_t *node = (ndpi_default_ports_tree_node_t*)ndpi_malloc_tag(sizeof(ndpi_default_ports_tree_node_t), NDPI_MEM_PORTS);
+
+    if(!node) {
+      printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+      break;
+    }
+
+    node->proto = def, node->default_port = port;
+    ret = *(ndpi_default_ports_tree_node_t**)ndpi_tsearch(node, (void*)root, ndpi_default_ports_tree_node_t_cmp); /* Add it to the tree */
+
+    if(ret != node) {
+      printf("[NDPI] %s(): found duplicate for port %u: overwriting it with new value\n", __FUNCTION__, port);
+
+      ret->proto = def;
+      ndpi_free_tag(node);
+    }
+  }
+}
+
+/* ****************************************************** */
+
+static int ndpi_port_candidates_cmp(const void *a, const void *b) {
+  const ndpi_port_candidates_t *fa = (const ndpi_port_candidates_t*)a;
+  const ndpi_port_candidates_t *fb = (const ndpi_port_candidates_t*)b;
+
+  return((fa->port == fb->port) ? 0 : ((fa->port < fb->port) ? -1 : 1));
+}
+
+/* ****************************************************** */
+
+static ndpi_port_candidates_t** ndpi_port_candidates_root(struct ndpi_detection_module_struct *ndpi_struct,
+							  u_int8_t l4_proto) {
+  if(l4_proto == IPPROTO_TCP)
+    return(&ndpi_struct->tcp_port_candidates);
+  else if(l4_proto == IPPROTO_UDP)
+    return(&ndpi_struct->udp_port_candidates);
+  else
+    return(NULL);
+}
+
+/* ****************************************************** */
+
+static ndpi_port_candidates_t* ndpi_find_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+							 u_int8_t l4_proto, u_int16_t port, u_int8_t create) {
+  ndpi_port_candidates_t **root = ndpi_port_candidates_root(ndpi_struct, l4_proto);
+  ndpi_port_candidates_t node, *ret;
+  void *found;
+
+  if(root == NULL)
+    return(NULL);
+
+  node.port = port;
+
+  if((found = ndpi_tfind(&node, (void*)root, ndpi_port_candidates_cmp)) != NULL)
+    return(*(ndpi_port_candidates_t**)found);
+
+  if(!create)
+    return(NULL);
+
+  if((ret = (ndpi_port_candidates_t*)ndpi_calloc_tag(1, sizeof(ndpi_port_candidates_t), NDPI_MEM_PORTS)) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    return(NULL);
+  }
+
+  ret->port = port;
+
+  if(ndpi_tsearch(ret, (void**)root, ndpi_port_candidates_cmp) == NULL) {
+    ndpi_free_tag(ret);
+    return(NULL);
+  }
+
+  return(ret);
+}
+
+/* ****************************************************** */
+
+/*
+  Adds protocol_id to the candidates of a port. Registrations (hit = 0)
+  are appended while there is room; detections move the protocol up and,
+  when the list is full, replace the least detected candidate.
+*/
+static void ndpi_add_port_candidate(ndpi_port_candidates_t *node, u_int16_t protocol_id, u_int8_t hit) {
+  u_int8_t i;
+
+  for(i=0; (i<node->num_candidates) && (node->protocol_id[i] != protocol_id); i++)
+    ;
+
+  if(i == node->num_candidates) {
+    if(i < NDPI_MAX_PORT_CANDIDATES)
+      node->num_candidates++;
+    else if(hit)
+      i--;
+    else
+      return;
+
+    node->protocol_id[i] = protocol_id, node->hits[i] = 0;
+  }
+
+  if(!hit || (node->hits[i] == 0xFFFFFFFF))
+    return;
+
+  node->hits[i]++;
+
+  for(; (i > 0) && (node->hits[i] > node->hits[i-1]); i--) {
+    u_int16_t id = node->protocol_id[i];
+    u_int32_t hits = node->hits[i];
+
+    node->protocol_id[i] = node->protocol_id[i-1], node->hits[i] = node->hits[i-1];
+    node->protocol_id[i-1] = id, node->hits[i-1] = hits;
+  }
+}
+
+/* ****************************************************** */
+
+static void ndpi_register_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+					  u_int8_t l4_proto, ndpi_port_range *range, u_int16_t protocol_id) {
+  u_int32_t port;
+
+  if(range->port_low == 0)
+    return;
+
+  for(port=range->port_low; port<=range->port_high; port++) {
+    ndpi_port_candidates_t *node = ndpi_find_port_candidates(ndpi_struct, l4_proto, port, 1);
+
+    if(node == NULL)
+      break;
+
+    ndpi_add_port_candidate(node, protocol_id, 0);
+  }
+}
+
+/* ****************************************************** */
+
+/* The candidates of the well-known (lower) port come first */
+static ndpi_port_candidates_t* ndpi_flow_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+							 u_int8_t l4_proto, u_int16_t sport, u_int16_t dport) {
+  ndpi_port_candidates_t *node;
+
+  if((node = ndpi_find_port_candidates(ndpi_struct, l4_proto, ndpi_min(sport, dport), 0)) == NULL)
+    node = ndpi_find_port_candidates(ndpi_struct, l4_proto, ndpi_max(sport, dport), 0);
+
+  return(node);
+}
+
+/* ****************************************************** */
+
+/* Records the dissector that detected the flow on its port */
+static void ndpi_learn_port_candidate(struct ndpi_detection_module_struct *ndpi_struct,
+				      struct ndpi_flow_struct *flow) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  ndpi_port_candidates_t *node = flow->port_candidates;
+  u_int16_t protocol_id = flow->detected_protocol_stack[0];
+
+#if NDPI_PROTOCOL_HISTORY_SIZE > 1
+  /* sub-protocols (e.g. matched on the host name) sit on top of the dissector */
+  if((protocol_id >= NDPI_MAX_SUPPORTED_PROTOCOLS)
+     || (ndpi_struct->proto_defaults[protocol_id].func == NULL))
+    protocol_id = flow->detected_protocol_stack[1];
+#endif
+
+  if((protocol_id == NDPI_PROTOCOL_UNKNOWN)
+     || (protocol_id >= NDPI_MAX_SUPPORTED_PROTOCOLS)
+     || (ndpi_struct->proto_defaults[protocol_id].func == NULL))
+    return;
+
+  if(node == NULL) {
+    u_int8_t l4_proto = (packet->tcp != NULL) ? IPPROTO_TCP : IPPROTO_UDP;
+    u_int32_t *num_learned = (packet->tcp != NULL) ?
+      &ndpi_struct->num_learned_tcp_ports : &ndpi_struct->num_learned_udp_ports;
+    u_int16_t port;
+
+    if(packet->tcp != NULL)
+      port = ndpi_min(ntohs(packet->tcp->source), ntohs(packet->tcp->dest));
+    else if(packet->udp != NULL)
+      port = ndpi_min(ntohs(packet->udp->source), ntohs(packet->udp->dest));
+    else
+      return;
+
+    if((port == 0) || (port > NDPI_LAST_LEARNED_PORT))
+      return;
+
+    if((node = ndpi_find_port_candidates(ndpi_struct, l4_proto, port, 0)) == NULL) {
+      if(*num_learned >= NDPI_MAX_LEARNED_PORTS)
+	return;
+
+      if((node = ndpi_find_port_candidates(ndpi_struct, l4_proto, port, 1)) == NULL)
+	return;
+
+      (*num_learned)++;
+    }
+
+    flow->port_candidates = node;
+  }
+
+  ndpi_add_port_candidate(node, protocol_id, 1);
+}
+
+/* ****************************************************** */
+
+static int ndpi_prefix_trie_new_node(ndpi_prefix_trie *trie, u_int8_t byte) {
+  ndpi_prefix_node_t *node;
+
+  if(trie->num_nodes == trie->max_nodes) {
+    u_int16_t max_nodes = trie->max_nodes ? (2 * trie->max_nodes) : 64;
+    void *nodes;
+
+    if(max_nodes <= trie->max_nodes) return(-1); /* Too many nodes */
+
+    if(trie->nodes == NULL)
+      nodes = ndpi_malloc_tag(max_nodes * sizeof(ndpi_prefix_node_t), NDPI_MEM_RULES);
+    else
+      nodes = ndpi_realloc_tag(trie->nodes, trie->max_nodes * sizeof(ndpi_prefix_node_t),
+			   max_nodes * sizeof(ndpi_prefix_node_t));
+
+    if(nodes == NULL) return(-1);
+    trie->nodes = (ndpi_prefix_node_t*)nodes, trie->max_nodes = max_nodes;
+  }
+
+  node = &trie->nodes[trie->num_nodes];
+  memset(node, 0, sizeof(ndpi_prefix_node_t));
+  node->byte = byte;
+
+  return(trie->num_nodes++);
+}
+
+/* ****************************************************** */
+
+static int ndpi_prefix_trie_new_signature(ndpi_prefix_trie *trie) {
+  if(trie->num_signatures == trie->max_signatures) {
+    u_int16_t max_signatures = trie->max_signatures ? (2 * trie->max_signatures) : 64;
+    void *signatures;
+
+    if(max_signatures <= trie->max_signatures) return(-1); /* Too many signatures */
+
+    if(trie->signatures == NULL)
+      signatures = ndpi_malloc_tag(max_signatures * sizeof(ndpi_prefix_signature_t), NDPI_MEM_RULES);
+    else
+      signatures = ndpi_realloc_tag(trie->signatures, trie->max_signatures * sizeof(ndpi_prefix_signature_t),
+				max_signatures * sizeof(ndpi_prefix_signature_t));
+
+    if(signatures == NULL) return(-1);
+    trie->signatures = (ndpi_prefix_signature_t*)signatures, trie->max_signatures = max_signatures;
+  }
+
+  if(trie->num_signatures == 0)
+    trie->num_signatures = 1; /* 0 means "no signature" */
+
+  return(trie->num_signatures++);
+}
+
+/* ****************************************************** */
+
+int ndpi_add_prefix_signature(struct ndpi_detection_module_struct *ndpi_struct,
+			      const u_int8_t *prefix, u_int16_t prefix_len,
+			      u_int16_t protocol_id, u_int8_t kind) {
+  ndpi_prefix_trie *trie = &ndpi_struct->prefix_trie;
+  u_int16_t i, node = 0, s;
+  int new_id;
+
+  if((prefix_len == 0)
+     || (protocol_id >= (NDPI_MAX_SUPPORTED_PROTOCOLS+NDPI_MAX_NUM_CUSTOM_PROTOCOLS))) {
+    printf("[NDPI] %s(protoId=%d): INTERNAL ERROR\n", __FUNCTION__, protocol_id);
+    return(-1);
+  }
+
+  if((trie->num_nodes == 0) && (ndpi_prefix_trie_new_node(trie, 0) < 0))
+    return(-2);
+
+  /* Walk (and extend) the path: siblings are kept sorted by byte */
+  for(i=0; i<prefix_len; i++) {
+    u_int16_t prev = 0, child;
+
+    if(i == 0)
+      child = trie->root[prefix[0]];
+    else {
+      child = trie->nodes[node].first_child;
+
+      while((child != 0) && (trie->nodes[child].byte < prefix[i]))
+	prev = child, child = trie->nodes[child].next_sibling;
+    }
+
+    if((child == 0) || (trie->nodes[child].byte != prefix[i])) {
+      if((new_id = ndpi_prefix_trie_new_node(trie, prefix[i])) < 0)
+	return(-2);
+
+      if(i == 0)
+	trie->root[prefix[0]] = new_id;
+      else {
+	trie->nodes[new_id].next_sibling = child;
+
+	if(prev != 0)
+	  trie->nodes[prev].next_sibling = new_id;
+	else
+	  trie->nodes[node].first_child = new_id;
+      }
+
+      child = new_id;
+    }
+
+    node = child;
+  }
+
+  for(s = trie->nodes[node].signatures; s != 0; s = trie->signatures[s].next)
+    if((trie->signatures[s].protocol_id == protocol_id) && (trie->signatures[s].kind == kind))
+      return(0); /* Already registered */
+
+  if((new_id = ndpi_prefix_trie_new_signature(trie)) < 0)
+    return(-2);
+
+  trie->signatures[new_id].protocol_id = protocol_id;
+  trie->signatures[new_id].kind = kind;
+  trie->signatures[new_id].next = trie->nodes[node].signatures;
+  trie->nodes[node].signatures = new_id;
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/* Walk the trie once with the payload start and remember the matching nodes */
+static void ndpi_match_prefix_trie(struct ndpi_detection_module_struct *ndpi_struct,
+				   struct ndpi_flow_struct *flow) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  ndpi_prefix_trie *trie = &ndpi_struct->prefix_trie;
+  u_int16_t i, node;
+
+  packet->num_prefix_hits = 0;
+
+  if((trie->num_nodes == 0) || (packet->payload_packet_len == 0))
+    return;
+
+  node = trie->root[packet->payload[0]];
+
+  for(i=1; node != 0; i++) {
+    if(trie->nodes[node].signatures != 0) {
+      packet->prefix_hits[packet->num_prefix_hits++] = node;
+
+      if(packet->num_prefix_hits == NDPI_MAX_PREFIX_HITS)
+	break;
+    }
+
+    if(i == packet->payload_packet_len)
+      break;
+
+    node = trie->nodes[node].first_child;
+    while((node != 0) && (trie->nodes[node].byte < packet->payload[i]))
+      node = trie->nodes[node].next_sibling;
+
+    if((node != 0) && (trie->nodes[node].byte != packet->payload[i]))
+      node = 0;
+  }
+}
+
+/* ****************************************************** */
+
+int ndpi_match_prefix_signature(struct ndpi_detection_module_struct *ndpi_struct,
+				struct ndpi_flow_struct *flow,
+				u_int16_t protocol_id, u_int8_t kind) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  ndpi_prefix_trie *trie = &ndpi_struct->prefix_trie;
+  u_int8_t i;
+  u_int16_t s;
+
+  for(i=0; i<packet->num_prefix_hits; i++)
+    for(s = trie->nodes[packet->prefix_hits[i]].signatures; s != 0; s = trie->signatures[s].next)
+      if((trie->signatures[s].protocol_id == protocol_id) && (trie->signatures[s].kind == kind))
+	return(1);
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+static ndpi_dns_cache_entry_t* ndpi_dns_cache_set(struct ndpi_detection_module_struct *ndpi_struct,
+						  const u_int32_t *addr, u_int8_t is_ipv6) {
+  u_int32_t hash = addr[0];
+
+  if(is_ipv6) hash ^= addr[1] ^ addr[2] ^ addr[3];
+
+  hash = (hash * 2654435761U) % (NDPI_DNS_CACHE_SIZE / NDPI_DNS_CACHE_WAYS);
+
+  return(&ndpi_struct->dns_cache[hash * NDPI_DNS_CACHE_WAYS]);
+}
+
+static int ndpi_dns_cache_entry_eq(const ndpi_dns_cache_entry_t *e,
+				   const u_int32_t *addr, u_int8_t is_ipv6) {
+  if((e->name_len == 0) || (e->is_ipv6 != is_ipv6))
+    return(0);
+
+  return(is_ipv6 ? (memcmp(e->addr, addr, 16) == 0) : (e->addr[0] == addr[0]));
+}
+
+/* ****************************************************** */
+
+/*
+  Remembers that addr (network byte order) has been returned for the
+  queried name: the next flow towards addr is matched against the host
+  automa on its first packet. The entry expires after ttl seconds.
+*/
+void ndpi_dns_cache_add(struct ndpi_detection_module_struct *ndpi_struct,
+			const u_int32_t *addr, u_int8_t is_ipv6,
+			const char *name, u_int name_len,
+			u_int32_t ttl, u_int32_t now) {
+  ndpi_dns_cache_entry_t *set, *e = NULL;
+  int i;
+
+  if((ndpi_struct->dns_cache == NULL) || (name_len == 0) || (ttl == 0))
+    return;
+
+  set = ndpi_dns_cache_set(ndpi_struct, addr, is_ipv6);
+
+  for(i=0; i<NDPI_DNS_CACHE_WAYS; i++) {
+    if(ndpi_dns_cache_entry_eq(&set[i], addr, is_ipv6)) {
+      e = &set[i];
+      break;
+    }
+
+    /* Replace empty entries first, then the one expiring first */
+    if((e == NULL) || (set[i].name_len == 0)
+       || ((e->name_len != 0) && ((int32_t)(set[i].expire - e->expire) < 0)))
+      e = &set[i];
+  }
+
+  if(ttl > NDPI_DNS_CACHE_MAX_TTL) ttl = NDPI_DNS_CACHE_MAX_TTL;
+
+  if(name_len > (NDPI_DNS_CACHE_NAME_LEN-1)) {
+    /* Host rules match domains: keep the end of the name */
+    name += name_len - (NDPI_DNS_CACHE_NAME_LEN-1);
+    name_len = NDPI_DNS_CACHE_NAME_LEN-1;
+  }
+
+  memset(e->addr, 0, sizeof(e->addr));
+  memcpy(e->addr, addr, is_ipv6 ? 16 : 4);
+  e->is_ipv6 = is_ipv6, e->expire = now + ttl * ndpi_struct->ticks_per_second;
+  memcpy(e->name, name, name_len);
+  e->name[name_len] = '\0', e->name_len = name_len;
+}
+
+/* ****************************************************** */
+
+/* Classifies a new flow with the name its server address was resolved from */
+static u_int16_t ndpi_dns_cache_match(struct ndpi_detection_module_struct *ndpi_struct,
+				      struct ndpi_flow_struct *flow) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  ndpi_dns_cache_entry_t *set, *e = NULL;
+  const u_int32_t *addr;
+  u_int8_t is_ipv6;
+  u_int16_t protocol_id;
+  int i;
+
+  if(ndpi_struct->dns_cache == NULL)
+    return(NDPI_PROTOCOL_UNKNOWN);
+
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+  if(packet->iphv6 != NULL)
+    addr = packet->iphv6->daddr.ndpi_v6_addr32, is_ipv6 = 1;
+  else
+#endif
+    addr = &packet->iph->daddr, is_ipv6 = 0;
+
+  set = ndpi_dns_cache_set(ndpi_struct, addr, is_ipv6);
 
-    if(!node) {
-      printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+  for(i=0; i<NDPI_DNS_CACHE_WAYS; i++)
+    if(ndpi_dns_cache_entry_eq(&set[i], addr, is_ipv6)) {
+      e = &set[i];
       break;
     }
 
-    node->proto = def, node->default_port = port;
-    ret = *(ndpi_default_ports_tree_node_t**)ndpi_tsearch(node, (void*)root, ndpi_default_ports_tree_node_t_cmp); /* Add it to the tree */
+  if(e == NULL)
+    return(NDPI_PROTOCOL_UNKNOWN);
 
-    if(ret != node) {
-      printf("[NDPI] %s(): found duplicate for port %u: overwriting it with new value\n", __FUNCTION__, port);
+  if((int32_t)(e->expire - packet->tick_timestamp) <= 0) {
+    e->name_len = 0; /* Expired */
+    return(NDPI_PROTOCOL_UNKNOWN);
+  }
 
-      ret->proto = def;
-      ndpi_free(node);
-    }
+  protocol_id = ndpi_match_string_subprotocol(ndpi_struct, flow, e->name, e->name_len);
+
+  if((protocol_id == NDPI_PROTOCOL_UNKNOWN)
+     || (NDPI_COMPARE_PROTOCOL_TO_BITMASK(ndpi_struct->detection_bitmask, protocol_id) == 0)) {
+    packet->detected_protocol_stack[0] = NDPI_PROTOCOL_UNKNOWN;
+    return(NDPI_PROTOCOL_UNKNOWN);
   }
+
+  if(flow->host_server_name[0] == '\0')
+    memcpy(flow->host_server_name, e->name, e->name_len + 1);
+
+  ndpi_int_change_protocol(ndpi_struct, flow, protocol_id, NDPI_REAL_PROTOCOL);
+
+  return(protocol_id);
 }
 
 /* ****************************************************** */
@@ -630,7 +1270,7 @@ static int removeDefaultPort(ndpi_port_range *range,
 							  ndpi_default_ports_tree_node_t_cmp); /* Add it to the tree */
 
     if(ret != NULL) {
-      ndpi_free((ndpi_default_ports_tree_node_t*)ret);
+      ndpi_free_tag((ndpi_default_ports_tree_node_t*)ret);
       return(0);
     }
   }
@@ -661,10 +1301,87 @@ static int ndpi_string_to_automa(struct ndpi_detection_module_struct *ndpi_struc
 
 /* ****************************************************** */
 
+/*
+  Host rules
+
+    name      substring: "cnn.com" also matches "notcnn.com"
+    =name     the whole host name
+    *.name    names ending with ".name", i.e. the subdomains of name
+    ~name     name on label boundaries: "~cnn.com" matches "cnn.com",
+              "edition.cnn.com" and "cnn.com.br" but not "mycnn.com"
+
+  The anchored forms are compiled into plain automa patterns that contain
+  the markers the host name is framed with when it is matched, so they
+  cost a single pass like substrings. Returns the number of patterns, 0
+  for substrings (value is used as is) or -1 for an invalid rule.
+*/
+static int ndpi_compile_host_rule(const char *value,
+				  char patterns[NDPI_HOST_RULE_MAX_PATTERNS][AC_PATTRN_MAX_LENGTH + 1]) {
+  char begin[2] = { NDPI_HOST_BEGIN_MARKER, '\0' }, end[2] = { NDPI_HOST_END_MARKER, '\0' };
+  const char *name;
+  int num = 0;
+
+  switch(value[0]) {
+  case '=':
+  case '~':
+    name = &value[1];
+    break;
+
+  case '*':
+    if(value[1] != '.')
+      return(-1);
+    name = &value[2];
+    break;
+
+  default:
+    return(0);
+  }
+
+  if((name[0] == '\0') || (strlen(name) > (AC_PATTRN_MAX_LENGTH - 2)))
+    return(-1);
+
+  if(value[0] == '=')
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, "%s%s%s", begin, name, end);
+  else if(value[0] == '*')
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, ".%s%s", name, end);
+  else {
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, "%s%s%s", begin, name, end);
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, "%s%s.", begin, name);
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, ".%s%s", name, end);
+    snprintf(patterns[num++], AC_PATTRN_MAX_LENGTH + 1, ".%s.", name);
+  }
+
+  return(num);
+}
+
+/* ****************************************************** */
+
 static int ndpi_add_host_url_subprotocol(struct ndpi_detection_module_struct *ndpi_struct,
-					 char *value, int protocol_id) {
-  return(ndpi_string_to_automa(ndpi_struct, &ndpi_struct->host_automa,
-			       value, protocol_id));
+					 ndpi_rules_t *rules, char *value, int protocol_id) {
+  char patterns[NDPI_HOST_RULE_MAX_PATTERNS][AC_PATTRN_MAX_LENGTH + 1];
+  int num_patterns = ndpi_compile_host_rule(value, patterns), i, rc = 0;
+
+  if(num_patterns == 0)
+    return(ndpi_string_to_automa(ndpi_struct, &rules->host_automa,
+				 value, protocol_id));
+  else if(num_patterns < 0) {
+    printf("[NDPI] %s(%s): invalid host rule\n", __FUNCTION__, value);
+    return(-1);
+  }
+
+  for(i=0; i<num_patterns; i++) {
+    char *pattern = ndpi_rules_strdup(rules, patterns[i]); /* referenced by the automa */
+
+    if(pattern == NULL)
+      return(-1);
+
+    if((rc = ndpi_string_to_automa(ndpi_struct, &rules->host_automa, pattern, protocol_id)) != 0)
+      return(rc);
+  }
+
+  rules->host_automa.ac_automa_anchored = 1;
+
+  return(0);
 }
 
 /* ****************************************************** */
@@ -679,14 +1396,39 @@ int ndpi_add_content_subprotocol(struct ndpi_detection_module_struct *ndpi_struc
 /*
   NOTE
 
-  This function must be called with a semaphore set, this in order to avoid
-  changing the datastrutures while using them
+  When applied to the rules in use (ndpi_struct->rules) this function must be
+  called with a semaphore set, this in order to avoid changing the datastrutures
+  while using them. Use ndpi_reload_protocols_file() to update them safely.
 */
 static int ndpi_remove_host_url_subprotocol(struct ndpi_detection_module_struct *ndpi_struct,
-					    char *value, int protocol_id) {
+					    ndpi_rules_t *rules, char *value, int protocol_id) {
+  char patterns[NDPI_HOST_RULE_MAX_PATTERNS][AC_PATTRN_MAX_LENGTH + 1];
+  int num_patterns, num_removed = 0, i;
+  AC_PATTERN_t ac_pattern;
 
-  printf("[NDPI] Missing implementation of %s()\n", __FUNCTION__);
-  return(-1);
+  if(rules->host_automa.ac_automa == NULL) return(-2);
+
+  if((num_patterns = ndpi_compile_host_rule(value, patterns)) < 0) {
+    printf("[NDPI] %s(%s): invalid host rule\n", __FUNCTION__, value);
+    return(-1);
+  }
+
+  for(i=0; i<ndpi_max(num_patterns, 1); i++) {
+    ac_pattern.astring = (num_patterns == 0) ? value : patterns[i];
+    ac_pattern.rep.number = protocol_id;
+    ac_pattern.length = strlen(ac_pattern.astring);
+
+    /* a pattern shared with another rule of a different protocol was not added */
+    if(ac_automata_remove(((AC_AUTOMATA_t*)rules->host_automa.ac_automa), &ac_pattern) == ACERR_SUCCESS)
+      num_removed++;
+  }
+
+  if(num_removed == 0) {
+    printf("[NDPI] %s(%s): host not found for protoId=%d\n", __FUNCTION__, value, protocol_id);
+    return(-1);
+  }
+
+  return(0);
 }
 
 /* ******************************************************************** */
@@ -695,16 +1437,34 @@ static void init_string_based_protocols(struct ndpi_detection_module_struct *ndp
   int i;
 
   for(i=0; host_match[i].string_to_match != NULL; i++) {
-    ndpi_add_host_url_subprotocol(ndpi_mod, host_match[i].string_to_match, host_match[i].protocol_id);
+    ndpi_add_host_url_subprotocol(ndpi_mod, ndpi_mod->rules, host_match[i].string_to_match, host_match[i].protocol_id);
 
     if(ndpi_mod->proto_defaults[host_match[i].protocol_id].protoName == NULL) {
-      ndpi_mod->proto_defaults[host_match[i].protocol_id].protoName = ndpi_strdup(host_match[i].proto_name);
+      ndpi_mod->proto_defaults[host_match[i].protocol_id].protoName = ndpi_strdup_tag(host_match[i].proto_name, NDPI_MEM_PROTOCOLS);
       ndpi_mod->proto_defaults[host_match[i].protocol_id].protoId = host_match[i].protocol_id;
     }
   }
 
   for(i=0; content_match[i].string_to_match != NULL; i++)
     ndpi_add_content_subprotocol(ndpi_mod, content_match[i].string_to_match, content_match[i].protocol_id);
+
+  for(i=0; prefix_match[i].prefix != NULL; i++)
+    ndpi_add_prefix_signature(ndpi_mod, (u_int8_t*)prefix_match[i].prefix, strlen(prefix_match[i].prefix),
+			      prefix_match[i].protocol_id, prefix_match[i].kind);
+
+  if(ndpi_mod->ua_automa.ac_automa != NULL) {
+    for(i=0; ua_match[i].string_to_match != NULL; i++) {
+      AC_PATTERN_t ac_pattern;
+
+      ac_pattern.astring = ua_match[i].string_to_match;
+      ac_pattern.rep.number = i; /* index in ua_match[] */
+      ac_pattern.length = strlen(ac_pattern.astring);
+      ac_automata_add((AC_AUTOMATA_t*)ndpi_mod->ua_automa.ac_automa, &ac_pattern);
+    }
+
+    ac_automata_finalize((AC_AUTOMATA_t*)ndpi_mod->ua_automa.ac_automa);
+    ndpi_mod->ua_automa.ac_automa_finalized = 1;
+  }
 }
 
 /* ******************************************************************** */
@@ -1247,6 +2007,101 @@ static int ac_match_handler(AC_MATCH_t *m, void *param) {
   return 1; /* 0 to continue searching, !0 to stop */
 }
 
+/* ****************************************************** */
+
+typedef struct {
+  u_int8_t os_id, os_priority, client_id, client_priority;
+} ndpi_ua_classification;
+
+static int ac_ua_match_handler(AC_MATCH_t *m, void *param) {
+  ndpi_ua_classification *ua = (ndpi_ua_classification*)param;
+  unsigned int i;
+
+  for(i=0; i<m->match_num; i++) {
+    ndpi_ua_match *match = &ua_match[m->patterns[i].rep.number];
+
+    if((match->os_id != NDPI_OS_UNKNOWN) && (match->priority > ua->os_priority))
+      ua->os_id = match->os_id, ua->os_priority = match->priority;
+
+    if((match->client_id != NDPI_UA_CLIENT_UNKNOWN) && (match->priority > ua->client_priority))
+      ua->client_id = match->client_id, ua->client_priority = match->priority;
+  }
+
+  return 0; /* the whole line is needed */
+}
+
+/* ******************************************************************** */
+
+ndpi_rules_t* ndpi_alloc_rules(void) {
+  ndpi_rules_t *rules = (ndpi_rules_t*)ndpi_calloc_tag(1, sizeof(ndpi_rules_t), NDPI_MEM_RULES);
+
+  if(rules == NULL)
+    return(NULL);
+
+  if((rules->host_automa.ac_automa = ac_automata_init(ac_match_handler)) == NULL) {
+    ndpi_free_tag(rules);
+    return(NULL);
+  }
+
+  /* Host names are matched regardless of their case */
+  ac_automata_fold_case((AC_AUTOMATA_t*)rules->host_automa.ac_automa);
+
+  return(rules);
+}
+
+/* ******************************************************************** */
+
+void ndpi_free_rules(ndpi_rules_t *rules) {
+  u_int32_t i;
+
+#ifndef __KERNEL__
+  if(rules->snapshot != NULL)
+    ndpi_snapshot_release(rules->snapshot);
+#endif
+
+  ndpi_tdestroy(rules->udpRoot, ndpi_free_tag);
+  ndpi_tdestroy(rules->tcpRoot, ndpi_free_tag);
+
+  if(rules->host_automa.ac_automa != NULL)
+    ac_automata_release((AC_AUTOMATA_t*)rules->host_automa.ac_automa);
+
+  for(i=0; i<rules->num_strings; i++)
+    ndpi_free_tag(rules->strings[i]);
+
+  if(rules->strings != NULL)
+    ndpi_free_tag(rules->strings);
+
+  ndpi_free_tag(rules);
+}
+
+/* ******************************************************************** */
+
+/* The automa keeps a pointer to the pattern: rules own a copy of it */
+static char* ndpi_rules_strdup(ndpi_rules_t *rules, char *value) {
+  char *s;
+
+  if(rules->num_strings == rules->max_strings) {
+    u_int32_t max_strings = rules->max_strings ? (2 * rules->max_strings) : 16;
+    char **strings;
+
+    if(rules->strings == NULL)
+      strings = (char**)ndpi_malloc_tag(max_strings * sizeof(char*), NDPI_MEM_RULES);
+    else
+      strings = (char**)ndpi_realloc_tag(rules->strings, rules->max_strings * sizeof(char*),
+				     max_strings * sizeof(char*));
+
+    if(strings == NULL)
+      return(NULL);
+
+    rules->strings = strings, rules->max_strings = max_strings;
+  }
+
+  if((s = ndpi_strdup_tag(value, NDPI_MEM_RULES)) != NULL)
+    rules->strings[rules->num_strings++] = s;
+
+  return(s);
+}
+
 /* ******************************************************************** */
 
 struct ndpi_detection_module_struct *ndpi_init_detection_module(u_int32_t ticks_per_second,
@@ -1259,7 +2114,7 @@ struct ndpi_detection_module_struct *ndpi_init_detection_module(u_int32_t ticks_
   _ndpi_malloc = __ndpi_malloc;
   _ndpi_free = __ndpi_free;
 
-  ndpi_str = ndpi_malloc(sizeof(struct ndpi_detection_module_struct));
+  ndpi_str = ndpi_malloc_tag(sizeof(struct ndpi_detection_module_struct), NDPI_MEM_MODULE);
 
   if(ndpi_str == NULL) {
     ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "ndpi_init_detection_module initial malloc failed\n");
@@ -1267,10 +2122,6 @@ struct ndpi_detection_module_struct *ndpi_init_detection_module(u_int32_t ticks_
   }
   memset(ndpi_str, 0, sizeof(struct ndpi_detection_module_struct));
 
-#ifdef HAVE_REDIS
-  ndpi_str->redis = NULL;
-#endif
-
   NDPI_BITMASK_RESET(ndpi_str->detection_bitmask);
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
   ndpi_str->ndpi_debug_printf = ndpi_debug_printf;
@@ -1301,8 +2152,17 @@ struct ndpi_detection_module_struct *ndpi_init_detection_module(u_int32_t ticks_
   ndpi_str->ndpi_num_supported_protocols = NDPI_MAX_SUPPORTED_PROTOCOLS;
   ndpi_str->ndpi_num_custom_protocols = 0;
 
-  ndpi_str->host_automa.ac_automa = ac_automata_init(ac_match_handler);
+  if((ndpi_str->rules = ndpi_alloc_rules()) == NULL) {
+    ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "ndpi_init_detection_module rules malloc failed\n");
+    ndpi_free_tag(ndpi_str);
+    return NULL;
+  }
+
   ndpi_str->content_automa.ac_automa = ac_automata_init(ac_match_handler);
+  ndpi_str->ua_automa.ac_automa = ac_automata_init(ac_ua_match_handler);
+
+  /* Optional: without it flows are not classified from DNS responses */
+  ndpi_str->dns_cache = (ndpi_dns_cache_entry_t*)ndpi_calloc_tag(NDPI_DNS_CACHE_SIZE, sizeof(ndpi_dns_cache_entry_t), NDPI_MEM_CACHES);
 
   ndpi_init_protocol_defaults(ndpi_str);
   return ndpi_str;
@@ -1318,19 +2178,46 @@ void ndpi_exit_detection_module(struct ndpi_detection_module_struct
 
     for(i=0; i<(int)ndpi_struct->ndpi_num_supported_protocols; i++) {
       if(ndpi_struct->proto_defaults[i].protoName)
-	ndpi_free(ndpi_struct->proto_defaults[i].protoName);
+	ndpi_free_tag(ndpi_struct->proto_defaults[i].protoName);
     }
 
-    ndpi_tdestroy(ndpi_struct->udpRoot, ndpi_free);
-    ndpi_tdestroy(ndpi_struct->tcpRoot, ndpi_free);
+    if(ndpi_struct->rules != NULL)
+      ndpi_free_rules(ndpi_struct->rules);
 
-    if(ndpi_struct->host_automa.ac_automa != NULL)
-      ac_automata_release((AC_AUTOMATA_t*)ndpi_struct->host_automa.ac_automa);
+    while(ndpi_struct->retired_rules != NULL) {
+      ndpi_rules_t *next = ndpi_struct->retired_rules->next;
+
+      ndpi_free_rules(ndpi_struct->retired_rules);
+      ndpi_struct->retired_rules = next;
+    }
 
     if(ndpi_struct->content_automa.ac_automa != NULL)
       ac_automata_release((AC_AUTOMATA_t*)ndpi_struct->content_automa.ac_automa);
 
-    ndpi_free(ndpi_struct);
+    if(ndpi_struct->ua_automa.ac_automa != NULL)
+      ac_automata_release((AC_AUTOMATA_t*)ndpi_struct->ua_automa.ac_automa);
+
+    if(ndpi_struct->prefix_trie.nodes != NULL)
+      ndpi_free_tag(ndpi_struct->prefix_trie.nodes);
+
+    if(ndpi_struct->prefix_trie.signatures != NULL)
+      ndpi_free_tag(ndpi_struct->prefix_trie.signatures);
+
+    if(ndpi_struct->dns_cache != NULL)
+      ndpi_free_tag(ndpi_struct->dns_cache);
+
+    ndpi_disable_adaptive_order(ndpi_struct);
+    ndpi_trace_disable(ndpi_struct);
+    ndpi_flow_state_pool_free(ndpi_struct);
+
+    ndpi_tdestroy(ndpi_struct->tcp_port_candidates, ndpi_free_tag);
+    ndpi_tdestroy(ndpi_struct->udp_port_candidates, ndpi_free_tag);
+
+#ifndef __KERNEL__
+    ndpi_flow_cache_release(ndpi_struct);
+#endif
+
+    ndpi_free_tag(ndpi_struct);
   }
 }
 
@@ -1342,17 +2229,30 @@ static unsigned int ndpi_guess_protocol_id(struct ndpi_detection_module_struct *
 					   u_int32_t dhost, u_int16_t dport) {
   const void *ret;
   ndpi_default_ports_tree_node_t node;
+  ndpi_rules_t *rules = ndpi_struct->rules;
 
   if(sport && dport) {
+#ifndef __KERNEL__
+    if(rules->snapshot != NULL) {
+      u_int16_t protoId = ndpi_snapshot_find_port(rules->snapshot, proto, sport);
+
+      if(protoId == NDPI_PROTOCOL_UNKNOWN)
+	protoId = ndpi_snapshot_find_port(rules->snapshot, proto, dport);
+
+      if(protoId != NDPI_PROTOCOL_UNKNOWN)
+	return(protoId);
+    }
+#endif
+
     node.default_port = sport;
     ret = ndpi_tfind(&node,
-		     (proto == IPPROTO_TCP) ? (void*)&ndpi_struct->tcpRoot : (void*)&ndpi_struct->udpRoot,
+		     (proto == IPPROTO_TCP) ? (void*)&rules->tcpRoot : (void*)&rules->udpRoot,
 		     ndpi_default_ports_tree_node_t_cmp);
 
     if(ret == NULL) {
       node.default_port = dport;
       ret = ndpi_tfind(&node,
-		       (proto == IPPROTO_TCP) ? (void*)&ndpi_struct->tcpRoot : (void*)&ndpi_struct->udpRoot,
+		       (proto == IPPROTO_TCP) ? (void*)&rules->tcpRoot : (void*)&rules->udpRoot,
 		       ndpi_default_ports_tree_node_t_cmp);
     }
 
@@ -1424,7 +2324,7 @@ static int add_proto_default_port(u_int16_t **ports, u_int16_t new_port,
     printf("Too many ports defined: ignored port %d\n", new_port);
     return(-1);
   } else {
-    u_int16_t *new_ports = (u_int16_t*)ndpi_malloc(num_ports+1);
+    u_int16_t *new_ports = (u_int16_t*)ndpi_malloc_tag(num_ports+1, NDPI_MEM_PORTS);
     ndpi_port_range range;
 
     if(new_ports == NULL) {
@@ -1438,7 +2338,7 @@ static int add_proto_default_port(u_int16_t **ports, u_int16_t new_port,
     new_ports[i++] = new_port;
     new_ports[i++] = 0;
 
-    ndpi_free(*ports);
+    ndpi_free_tag(*ports);
     *ports = new_ports;
 
     range.port_low = range.port_high = new_port;
@@ -1456,7 +2356,8 @@ u_int ndpi_get_num_supported_protocols(struct ndpi_detection_module_struct *ndpi
 
 /* ******************************************************************** */
 
-int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule, u_int8_t do_add) {
+static int ndpi_handle_rule_in(struct ndpi_detection_module_struct *ndpi_mod,
+			      ndpi_rules_t *rules, char* rule, u_int8_t do_add) {
   char *at, *proto, *elem;
   ndpi_proto_defaults_t *def;
   int subprotocol_id, i;
@@ -1481,6 +2382,13 @@ int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule,
       /* We need to remove a rule */
       printf("Unable to find protocol '%s': skipping rule '%s'\n", proto, rule);
       return(-3);
+    } else if(rules != ndpi_mod->rules) {
+      /*
+	Rules built for a reload: the protocol table is not part of them and
+	is read by the thread processing packets, it can't grow now
+      */
+      printf("Unknown protocol '%s': a reload cannot define new protocols\n", proto);
+      return(-4);
     } else {
       ndpi_port_range ports_a[MAX_DEFAULT_PORTS], ports_b[MAX_DEFAULT_PORTS];
 
@@ -1490,7 +2398,7 @@ int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule,
 	return(-2);
       }
 
-      ndpi_set_proto_defaults(ndpi_mod, ndpi_mod->ndpi_num_supported_protocols, ndpi_strdup(proto),
+      ndpi_set_proto_defaults(ndpi_mod, ndpi_mod->ndpi_num_supported_protocols, proto,
 			      ndpi_build_default_ports(ports_a, 0, 0, 0, 0, 0) /* TCP */,
 			      ndpi_build_default_ports(ports_b, 0, 0, 0, 0, 0) /* UDP */);
       def = &ndpi_mod->proto_defaults[ndpi_mod->ndpi_num_supported_protocols];
@@ -1519,14 +2427,17 @@ int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule,
       if(sscanf(value, "%u-%u", (unsigned int *)&range.port_low, (unsigned int *)&range.port_high) != 2)
 	range.port_low = range.port_high = atoi(&elem[4]);
       if(do_add)
-	addDefaultPort(&range, def, is_tcp ? &ndpi_mod->tcpRoot : &ndpi_mod->udpRoot);
+	addDefaultPort(&range, def, is_tcp ? &rules->tcpRoot : &rules->udpRoot);
       else
-	removeDefaultPort(&range, def, is_tcp ? &ndpi_mod->tcpRoot : &ndpi_mod->udpRoot);
+	removeDefaultPort(&range, def, is_tcp ? &rules->tcpRoot : &rules->udpRoot);
     } else {
-      if(do_add)
-	ndpi_add_host_url_subprotocol(ndpi_mod, value, subprotocol_id);
-      else
-	ndpi_remove_host_url_subprotocol(ndpi_mod, value, subprotocol_id);
+      if(do_add) {
+	char *host = ndpi_rules_strdup(rules, value);
+
+	if(host != NULL)
+	  ndpi_add_host_url_subprotocol(ndpi_mod, rules, host, subprotocol_id);
+      } else
+	ndpi_remove_host_url_subprotocol(ndpi_mod, rules, value, subprotocol_id);
     }
   }
 
@@ -1535,6 +2446,12 @@ int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule,
 
 /* ******************************************************************** */
 
+int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule, u_int8_t do_add) {
+  return(ndpi_handle_rule_in(ndpi_mod, ndpi_mod->rules, rule, do_add));
+}
+
+/* ******************************************************************** */
+
 /*
   Format:
   <tcp|udp>:<port>,<tcp|udp>:<port>,.....@<proto>
@@ -1544,12 +2461,11 @@ int ndpi_handle_rule(struct ndpi_detection_module_struct *ndpi_mod, char* rule,
   udp:139@NETBIOS
 
 */
-int ndpi_load_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char* path) {
-#ifdef __KERNEL__
-  return(0);
-#else
+#ifndef __KERNEL__
+static int ndpi_load_rules_file(struct ndpi_detection_module_struct *ndpi_mod,
+				ndpi_rules_t *rules, char* path) {
   FILE *fd = fopen(path, "r");
-  int i;
+  int i, rc = 0;
 
   if(fd == NULL) {
     printf("Unable to open file %s [%s]", path, strerror(errno));
@@ -1567,20 +2483,134 @@ int ndpi_load_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char
     else
       line[i-1] = '\0';
 
-    ndpi_handle_rule(ndpi_mod, line, 1);
+    if(ndpi_handle_rule_in(ndpi_mod, rules, line, 1) == -4) {
+      rc = -4;
+      break;
+    }
   }
 
   fclose(fd);
 
 #if 0
   printf("\nTCP:\n");
-  ndpi_twalk(ndpi_mod->tcpRoot, ndpi_default_ports_tree_node_t_walker, NULL);
+  ndpi_twalk(rules->tcpRoot, ndpi_default_ports_tree_node_t_walker, NULL);
   printf("\nUDP:\n");
-  ndpi_twalk(ndpi_mod->udpRoot, ndpi_default_ports_tree_node_t_walker, NULL);
+  ndpi_twalk(rules->udpRoot, ndpi_default_ports_tree_node_t_walker, NULL);
+#endif
+
+  return(rc);
+}
+#endif
+
+/* ******************************************************************** */
+
+int ndpi_load_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char* path) {
+#ifdef __KERNEL__
+  return(0);
+#else
+  return(ndpi_load_rules_file(ndpi_mod, ndpi_mod->rules, path));
 #endif
+}
+
+/* ******************************************************************** */
+
+int ndpi_free_retired_rules(struct ndpi_detection_module_struct *ndpi_mod) {
+  ndpi_rules_t **prev = &ndpi_mod->retired_rules, *rules;
+  u_int32_t epoch;
+  int pending = 0;
+
+  ndpi_memory_barrier();
+  epoch = ndpi_mod->rules_epoch;
+
+  while((rules = *prev) != NULL) {
+    /*
+      The rules can be freed if they have been retired between two packets
+      or if the packet being processed at that time is over
+    */
+    if(((rules->retire_epoch & 1) == 0) || (rules->retire_epoch != epoch)) {
+      *prev = rules->next;
+      ndpi_free_rules(rules);
+    } else
+      prev = &rules->next, pending++;
+  }
+
+  return(pending);
+}
+
+/* ******************************************************************** */
+
+#ifndef __KERNEL__
+/* Default ports and hosts, as set up by ndpi_init_protocol_defaults() */
+static void ndpi_init_default_rules(struct ndpi_detection_module_struct *ndpi_mod,
+				    ndpi_rules_t *rules) {
+  int i, j;
+
+  for(i=0; i<(int)ndpi_mod->ndpi_num_supported_protocols; i++) {
+    ndpi_proto_defaults_t *def = &ndpi_mod->proto_defaults[i];
+
+    for(j=0; j<MAX_DEFAULT_PORTS; j++) {
+      if(def->udp_default_ports[j].port_low != 0) addDefaultPort(&def->udp_default_ports[j], def, &rules->udpRoot);
+      if(def->tcp_default_ports[j].port_low != 0) addDefaultPort(&def->tcp_default_ports[j], def, &rules->tcpRoot);
+    }
+  }
+
+  for(i=0; host_match[i].string_to_match != NULL; i++)
+    ndpi_add_host_url_subprotocol(ndpi_mod, rules, host_match[i].string_to_match, host_match[i].protocol_id);
+}
 #endif
 
+/* ******************************************************************** */
+
+/*
+  The new port trees and host automa are built aside and then published with
+  a single pointer swap: the thread processing packets never waits. The old
+  ones are freed as soon as that thread is done with the packet it might be
+  processing (see ndpi_free_retired_rules).
+*/
+int ndpi_reload_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char* path) {
+#ifdef __KERNEL__
+  return(0);
+#else
+  ndpi_rules_t *rules;
+  int rc;
+
+  if((rules = ndpi_alloc_rules()) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    return(-2);
+  }
+
+  ndpi_init_default_rules(ndpi_mod, rules);
+
+  if((rc = ndpi_load_rules_file(ndpi_mod, rules, path)) != 0) {
+    ndpi_free_rules(rules);
+    return(rc);
+  }
+
+  ndpi_publish_rules(ndpi_mod, rules);
+
   return(0);
+#endif
+}
+
+/* ******************************************************************** */
+
+/* Replaces the rules in use: the old ones are retired, not freed */
+void ndpi_publish_rules(struct ndpi_detection_module_struct *ndpi_mod, ndpi_rules_t *rules) {
+  ndpi_rules_t *old_rules;
+
+  /* Published rules must be ready to use */
+  ac_automata_finalize((AC_AUTOMATA_t*)rules->host_automa.ac_automa);
+  rules->host_automa.ac_automa_finalized = 1;
+
+  old_rules = ndpi_mod->rules;
+  ndpi_memory_barrier();
+  ndpi_mod->rules = rules;
+  ndpi_memory_barrier();
+
+  old_rules->retire_epoch = ndpi_mod->rules_epoch;
+  old_rules->next = ndpi_mod->retired_rules, ndpi_mod->retired_rules = old_rules;
+
+  ndpi_free_retired_rules(ndpi_mod);
 }
 
 /* ntop */
@@ -1609,6 +2639,7 @@ void ndpi_set_bitmask_protocol_detection( char * label,
 
     ndpi_struct->proto_defaults[ndpi_protocol_id].func =
       ndpi_struct->callback_buffer[idx].func = func;
+    ndpi_struct->callback_buffer[idx].ndpi_protocol_id = ndpi_protocol_id;
     /*
       Set ndpi_selection_bitmask for protocol
     */
@@ -3009,6 +4040,15 @@ void ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *n
       ndpi_struct->callback_buffer_size_non_tcp_udp++;
     }
   }
+
+  /* the tables have been rebuilt: start again from the registration order */
+  ndpi_struct->callback_order_tcp_payload = ndpi_struct->callback_buffer_tcp_payload;
+  ndpi_struct->callback_order_udp = ndpi_struct->callback_buffer_udp;
+
+  if(ndpi_struct->adaptive_order != NULL) {
+    memset(ndpi_struct->adaptive_order->stats, 0, sizeof(ndpi_struct->adaptive_order->stats));
+    ndpi_struct->adaptive_order->num_packets = 0, ndpi_struct->adaptive_order->pinned = 0;
+  }
 }
 
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
@@ -3271,6 +4311,7 @@ static int ndpi_init_packet_header(struct ndpi_detection_module_struct *ndpi_str
 	 && flow->init_finished != 0
 	 && flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) {
 
+	ndpi_flow_state_free(ndpi_struct, flow);
 	memset(flow, 0, sizeof(*(flow)));
 
 
@@ -3426,6 +4467,111 @@ void ndpi_connection_tracking(struct ndpi_detection_module_struct *ndpi_struct,
   }
 }
 
+/* ********************************************************************************* */
+
+static int ndpi_func_already_called(void **called, u_int8_t num_called, void *func) {
+  u_int8_t i;
+
+  for(i=0; i<num_called; i++)
+    if(called[i] == func) return(1);
+
+  return(0);
+}
+
+/* ********************************************************************************* */
+
+/*
+  Call the dissectors of the protocols whose prefix signatures matched
+  the payload start before walking the whole callback list.
+*/
+static u_int8_t ndpi_check_prefix_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+					     struct ndpi_flow_struct *flow,
+					     NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet,
+					     NDPI_PROTOCOL_BITMASK *detection_bitmask,
+					     void **called, u_int8_t num_called) {
+  ndpi_prefix_trie *trie = &ndpi_struct->prefix_trie;
+  struct ndpi_packet_struct *packet = &flow->packet;
+  u_int8_t i;
+  u_int16_t s;
+
+  for(i=0; i<packet->num_prefix_hits; i++) {
+    for(s = trie->nodes[packet->prefix_hits[i]].signatures; s != 0; s = trie->signatures[s].next) {
+      ndpi_proto_defaults_t *def = &ndpi_struct->proto_defaults[trie->signatures[s].protocol_id];
+      struct ndpi_call_function_struct *cb = &ndpi_struct->callback_buffer[def->protoIdx];
+
+      if((def->func == NULL) || (cb->func != def->func)
+	 || ndpi_func_already_called(called, num_called, cb->func))
+	continue;
+
+      if(NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask, cb->excluded_protocol_bitmask) == 0
+	 && NDPI_BITMASK_COMPARE(cb->detection_bitmask, *detection_bitmask) != 0
+	 && (cb->ndpi_selection_bitmask & *ndpi_selection_packet) == cb->ndpi_selection_bitmask) {
+	called[num_called++] = cb->func;
+	cb->func(ndpi_struct, flow);
+
+	if((flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
+	   || (num_called > NDPI_MAX_PREFIX_HITS))
+	  return(num_called);
+      }
+    }
+  }
+
+  return(num_called);
+}
+
+/* ********************************************************************************* */
+
+/*
+  Call the dissectors listed for the flow port (registered on it or seen
+  detecting flows there) before walking the whole callback list.
+*/
+static u_int8_t ndpi_check_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+					   struct ndpi_flow_struct *flow,
+					   NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet,
+					   NDPI_PROTOCOL_BITMASK *detection_bitmask,
+					   void **called, u_int8_t num_called) {
+  ndpi_port_candidates_t *node = flow->port_candidates;
+  u_int8_t i;
+
+  for(i=0; i<node->num_candidates; i++) {
+    ndpi_proto_defaults_t *def = &ndpi_struct->proto_defaults[node->protocol_id[i]];
+    struct ndpi_call_function_struct *cb = &ndpi_struct->callback_buffer[def->protoIdx];
+
+    if((def->func == NULL) || (cb->func != def->func)
+       || ndpi_func_already_called(called, num_called, cb->func))
+      continue;
+
+    if(NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask, cb->excluded_protocol_bitmask) == 0
+       && NDPI_BITMASK_COMPARE(cb->detection_bitmask, *detection_bitmask) != 0
+       && (cb->ndpi_selection_bitmask & *ndpi_selection_packet) == cb->ndpi_selection_bitmask) {
+      called[num_called++] = cb->func;
+      cb->func(ndpi_struct, flow);
+
+      if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
+	break;
+    }
+  }
+
+  return(num_called);
+}
+
+/* ********************************************************************************* */
+
+static void ndpi_count_dissector_call(struct ndpi_detection_module_struct *ndpi_struct,
+				      struct ndpi_flow_struct *flow,
+				      struct ndpi_call_function_struct *cb) {
+  ndpi_dissector_stats_t *stats = &ndpi_struct->adaptive_order->stats[cb->ndpi_protocol_id];
+
+  stats->calls++;
+
+  if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
+    stats->hits++;
+  else if(NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask, cb->excluded_protocol_bitmask) != 0)
+    stats->exclusions++;
+}
+
+/* ********************************************************************************* */
+
 void check_ndpi_other_flow_func(struct ndpi_detection_module_struct *ndpi_struct,  
 				struct ndpi_flow_struct *flow, 
 				NDPI_SELECTION_BITMASK_PROTOCOL_SIZE *ndpi_selection_packet) {
@@ -3478,7 +4624,10 @@ void check_ndpi_udp_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
   u_int32_t a;
   u_int16_t proto_index = ndpi_struct->proto_defaults[flow->guessed_protocol_id].protoIdx;
   int16_t proto_id = ndpi_struct->proto_defaults[flow->guessed_protocol_id].protoId;
+  void *called[NDPI_MAX_PREFIX_HITS + NDPI_MAX_PORT_CANDIDATES + 1];
+  u_int8_t num_called = 0;
   NDPI_PROTOCOL_BITMASK detection_bitmask;
+  struct ndpi_call_function_struct *callbacks = ndpi_struct->callback_order_udp;
 
   NDPI_SAVE_AS_BITMASK(detection_bitmask, flow->packet.detected_protocol_stack[0]);
 
@@ -3495,15 +4644,29 @@ void check_ndpi_udp_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
 	func = ndpi_struct->proto_defaults[flow->guessed_protocol_id].func;
   }
 
-  for (a = 0; a < ndpi_struct->callback_buffer_size_udp; a++) {
-    if((func != ndpi_struct->callback_buffer_tcp_payload[a].func)
-       && (ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask & *ndpi_selection_packet) ==
-       ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask
+  if(func != NULL) called[num_called++] = func;
+
+  if(flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
+    num_called = ndpi_check_prefix_candidates(ndpi_struct, flow, ndpi_selection_packet,
+					      &detection_bitmask, called, num_called);
+
+  if((flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) && (flow->port_candidates != NULL))
+    num_called = ndpi_check_port_candidates(ndpi_struct, flow, ndpi_selection_packet,
+					    &detection_bitmask, called, num_called);
+
+  for (a = 0; (a < ndpi_struct->callback_buffer_size_udp)
+	 && (flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN); a++) {
+    if((!ndpi_func_already_called(called, num_called, callbacks[a].func))
+       && (callbacks[a].ndpi_selection_bitmask & *ndpi_selection_packet) ==
+       callbacks[a].ndpi_selection_bitmask
        && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-			       ndpi_struct->callback_buffer_udp[a].excluded_protocol_bitmask) == 0
-       && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_udp[a].detection_bitmask,
+			       callbacks[a].excluded_protocol_bitmask) == 0
+       && NDPI_BITMASK_COMPARE(callbacks[a].detection_bitmask,
 			       detection_bitmask) != 0) {
-      ndpi_struct->callback_buffer_udp[a].func(ndpi_struct, flow);
+      callbacks[a].func(ndpi_struct, flow);
+
+      if(ndpi_struct->adaptive_order != NULL)
+	ndpi_count_dissector_call(ndpi_struct, flow, &callbacks[a]);
       // NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG, "[UDP,CALL] dissector of protocol as callback_buffer idx =  %d\n",a);
       if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
 	break; /* Stop after detecting the first protocol */
@@ -3521,7 +4684,10 @@ void check_ndpi_tcp_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
   u_int32_t a;
   u_int16_t proto_index = ndpi_struct->proto_defaults[flow->guessed_protocol_id].protoIdx;
   int16_t proto_id = ndpi_struct->proto_defaults[flow->guessed_protocol_id].protoId;
+  void *called[NDPI_MAX_PREFIX_HITS + NDPI_MAX_PORT_CANDIDATES + 1];
+  u_int8_t num_called = 0;
   NDPI_PROTOCOL_BITMASK detection_bitmask;
+  struct ndpi_call_function_struct *callbacks = ndpi_struct->callback_order_tcp_payload;
 
   NDPI_SAVE_AS_BITMASK(detection_bitmask, flow->packet.detected_protocol_stack[0]);
 
@@ -3539,16 +4705,29 @@ void check_ndpi_tcp_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
 	  func = ndpi_struct->proto_defaults[flow->guessed_protocol_id].func;
     }
 
+    if(func != NULL) called[num_called++] = func;
+
+    if(flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
+      num_called = ndpi_check_prefix_candidates(ndpi_struct, flow, ndpi_selection_packet,
+						&detection_bitmask, called, num_called);
+
+    if((flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) && (flow->port_candidates != NULL))
+      num_called = ndpi_check_port_candidates(ndpi_struct, flow, ndpi_selection_packet,
+					      &detection_bitmask, called, num_called);
+
     if(flow->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) {
       for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_payload; a++) {
-        if((func != ndpi_struct->callback_buffer_tcp_payload[a].func)
-	   && (ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
-	       & *ndpi_selection_packet) == ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
+        if((!ndpi_func_already_called(called, num_called, callbacks[a].func))
+	   && (callbacks[a].ndpi_selection_bitmask
+	       & *ndpi_selection_packet) == callbacks[a].ndpi_selection_bitmask
 	   && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				   ndpi_struct->callback_buffer_tcp_payload[a].excluded_protocol_bitmask) == 0
-	   && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_tcp_payload[a].detection_bitmask,
+				   callbacks[a].excluded_protocol_bitmask) == 0
+	   && NDPI_BITMASK_COMPARE(callbacks[a].detection_bitmask,
 				   detection_bitmask) != 0) {
-	  ndpi_struct->callback_buffer_tcp_payload[a].func(ndpi_struct, flow);
+	  callbacks[a].func(ndpi_struct, flow);
+
+	  if(ndpi_struct->adaptive_order != NULL)
+	    ndpi_count_dissector_call(ndpi_struct, flow, &callbacks[a]);
 
 	  if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
 	    break; /* Stop after detecting the first protocol */
@@ -3572,7 +4751,7 @@ void check_ndpi_tcp_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
     }
 
     for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_no_payload; a++) {
-      if((func != ndpi_struct->callback_buffer_tcp_payload[a].func)
+      if((func != ndpi_struct->callback_buffer_tcp_no_payload[a].func)
 	 && (ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask & *ndpi_selection_packet) ==
 	 ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask
 	 && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
@@ -3600,13 +4779,13 @@ void check_ndpi_flow_func(struct ndpi_detection_module_struct *ndpi_struct,
     check_ndpi_other_flow_func(ndpi_struct, flow, ndpi_selection_packet);
 }
 
-unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *ndpi_struct,
-					   struct ndpi_flow_struct *flow,
-					   const unsigned char *packet,
-					   const unsigned short packetlen,
-					   const u_int32_t current_tick,
-					   struct ndpi_id_struct *src,
-					   struct ndpi_id_struct *dst)
+static unsigned int ndpi_do_detection_process_packet(struct ndpi_detection_module_struct *ndpi_struct,
+						     struct ndpi_flow_struct *flow,
+						     const unsigned char *packet,
+						     const unsigned short packetlen,
+						     const u_int32_t current_tick,
+						     struct ndpi_id_struct *src,
+						     struct ndpi_id_struct *dst)
 {
   NDPI_SELECTION_BITMASK_PROTOCOL_SIZE ndpi_selection_packet;
   u_int32_t a;
@@ -3626,6 +4805,7 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
   }
 
   flow->packet.tick_timestamp = current_tick;
+  ndpi_struct->current_ts = current_tick; /* trace events timestamp */
 
   /* parse packet */
   flow->packet.iph = (struct ndpi_iphdr *) packet;
@@ -3639,6 +4819,11 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
   flow->src = src, flow->dst = dst;
 
   ndpi_connection_tracking(ndpi_struct, flow);
+  NDPI_TRACE(ndpi_struct, NDPI_PROTOCOL_UNKNOWN, NDPI_TRACE_PACKET,
+	     flow->packet.l4_protocol, flow->packet.payload_packet_len,
+	     flow->packet.tcp ? ntohs(flow->packet.tcp->source) : (flow->packet.udp ? ntohs(flow->packet.udp->source) : 0),
+	     flow->packet.tcp ? ntohs(flow->packet.tcp->dest) : (flow->packet.udp ? ntohs(flow->packet.udp->dest) : 0));
+  ndpi_match_prefix_trie(ndpi_struct, flow);
 
   /* build ndpi_selction packet bitmask */
   ndpi_selection_packet = NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC;
@@ -3686,7 +4871,19 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 
     flow->guessed_protocol_id = (int16_t)ndpi_guess_protocol_id(ndpi_struct, protocol,
 								saddr, sport, daddr, dport);
+    flow->port_candidates = (sport && dport) ?
+      ndpi_flow_port_candidates(ndpi_struct, protocol, sport, dport) : NULL;
     flow->protocol_id_already_guessed = 1;
+
+#ifndef __KERNEL__
+    /* First packet: the server endpoint might be known already */
+    if(ndpi_flow_cache_lookup(ndpi_struct, flow) != NDPI_PROTOCOL_UNKNOWN)
+      return(flow->detected_protocol_stack[0]);
+#endif
+
+    /* First packet: the server address might come from a DNS response */
+    if(ndpi_dns_cache_match(ndpi_struct, flow) != NDPI_PROTOCOL_UNKNOWN)
+      return(flow->detected_protocol_stack[0]);
   }
 
   check_ndpi_flow_func(ndpi_struct, flow, &ndpi_selection_packet);
@@ -3702,11 +4899,260 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
       flow->host_server_name[i] = tolower(flow->host_server_name[i]);
 
     flow->host_server_name[i] ='\0';
+
+    if((flow->packet.tcp != NULL) || (flow->packet.udp != NULL))
+      ndpi_learn_port_candidate(ndpi_struct, flow);
+
+#ifndef __KERNEL__
+    ndpi_flow_cache_record(ndpi_struct, flow);
+#endif
   }
 
   return a;
 }
 
+/* ********************************************************************************* */
+
+/* Rules swapped by ndpi_reload_protocols_file() are not freed while the epoch is odd */
+static void ndpi_rules_read_lock(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_struct->rules_epoch++;
+  ndpi_memory_barrier();
+}
+
+static void ndpi_rules_read_unlock(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_memory_barrier();
+  ndpi_struct->rules_epoch++;
+}
+
+/* ********************************************************************************* */
+
+int ndpi_enable_adaptive_order(struct ndpi_detection_module_struct *ndpi_struct,
+			       u_int32_t reorder_interval) {
+  ndpi_adaptive_order_t *order = ndpi_struct->adaptive_order;
+  u_int32_t table_len = (NDPI_MAX_SUPPORTED_PROTOCOLS + 1) * sizeof(struct ndpi_call_function_struct);
+  int i;
+
+  if(order == NULL) {
+    if((order = (ndpi_adaptive_order_t*)ndpi_calloc_tag(1, sizeof(ndpi_adaptive_order_t), NDPI_MEM_MODULE)) == NULL) {
+      printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+      return(-1);
+    }
+
+    for(i = 0; i < 2; i++) {
+      if(((order->tcp_payload[i] = ndpi_malloc_tag(table_len, NDPI_MEM_MODULE)) == NULL)
+	 || ((order->udp[i] = ndpi_malloc_tag(table_len, NDPI_MEM_MODULE)) == NULL)) {
+	printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+	ndpi_struct->adaptive_order = order;
+	ndpi_disable_adaptive_order(ndpi_struct);
+	return(-1);
+      }
+    }
+
+    ndpi_struct->adaptive_order = order;
+  }
+
+  order->reorder_interval = reorder_interval, order->num_packets = 0, order->pinned = 0;
+  return(0);
+}
+
+/* ********************************************************************************* */
+
+void ndpi_disable_adaptive_order(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_adaptive_order_t *order = ndpi_struct->adaptive_order;
+  int i;
+
+  if(order == NULL) return;
+
+  /* back to the registration order before the snapshots go away */
+  ndpi_struct->callback_order_tcp_payload = ndpi_struct->callback_buffer_tcp_payload;
+  ndpi_struct->callback_order_udp = ndpi_struct->callback_buffer_udp;
+  ndpi_struct->adaptive_order = NULL;
+
+  for(i = 0; i < 2; i++) {
+    if(order->tcp_payload[i] != NULL) ndpi_free_tag(order->tcp_payload[i]);
+    if(order->udp[i] != NULL)         ndpi_free_tag(order->udp[i]);
+  }
+
+  ndpi_free_tag(order);
+}
+
+/* ********************************************************************************* */
+
+/* Share of the calls that ended the walk (weighted twice) or excluded the dissector */
+static u_int32_t ndpi_dissector_score(ndpi_dissector_stats_t *stats) {
+  if(stats->calls == 0) return(0);
+
+  return((u_int32_t)((((u_int64_t)stats->hits * 2 + stats->exclusions) << 16) / stats->calls));
+}
+
+/* ********************************************************************************* */
+
+static struct ndpi_call_function_struct* ndpi_order_snapshot(struct ndpi_call_function_struct *snapshots[2],
+							     struct ndpi_call_function_struct *active) {
+  /* the snapshot a walk may be using is never written */
+  return((active == snapshots[0]) ? snapshots[1] : snapshots[0]);
+}
+
+/* ********************************************************************************* */
+
+static void ndpi_reorder_table(ndpi_adaptive_order_t *order,
+			       struct ndpi_call_function_struct *snapshots[2],
+			       struct ndpi_call_function_struct **active, u_int32_t size) {
+  struct ndpi_call_function_struct *next = ndpi_order_snapshot(snapshots, *active), tmp;
+  u_int32_t scores[NDPI_MAX_SUPPORTED_PROTOCOLS + 1], score, i, j;
+
+  memcpy(next, *active, size * sizeof(struct ndpi_call_function_struct));
+
+  for(i = 0; i < size; i++)
+    scores[i] = ndpi_dissector_score(&order->stats[next[i].ndpi_protocol_id]);
+
+  /* insertion sort: stable, so equally scored dissectors keep their order */
+  for(i = 1; i < size; i++) {
+    tmp = next[i], score = scores[i];
+
+    for(j = i; (j > 0) && (scores[j-1] < score); j--)
+      next[j] = next[j-1], scores[j] = scores[j-1];
+
+    next[j] = tmp, scores[j] = score;
+  }
+
+  ndpi_memory_barrier();
+  *active = next;
+}
+
+/* ********************************************************************************* */
+
+static void ndpi_adaptive_order_tick(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_adaptive_order_t *order = ndpi_struct->adaptive_order;
+  u_int32_t i;
+
+  if(order->pinned || (order->reorder_interval == 0)
+     || (++order->num_packets < order->reorder_interval))
+    return;
+
+  ndpi_reorder_table(order, order->tcp_payload, &ndpi_struct->callback_order_tcp_payload,
+		     ndpi_struct->callback_buffer_size_tcp_payload);
+  ndpi_reorder_table(order, order->udp, &ndpi_struct->callback_order_udp,
+		     ndpi_struct->callback_buffer_size_udp);
+
+  /* age the counters so that the order follows the traffic mix */
+  for(i = 0; i <= NDPI_MAX_SUPPORTED_PROTOCOLS; i++)
+    order->stats[i].calls >>= 1, order->stats[i].hits >>= 1, order->stats[i].exclusions >>= 1;
+
+  order->num_packets = 0;
+}
+
+/* ********************************************************************************* */
+
+u_int32_t ndpi_get_dissector_order(struct ndpi_detection_module_struct *ndpi_struct,
+				   u_int8_t l4_proto, u_int16_t *protocol_ids, u_int32_t max_ids) {
+  struct ndpi_call_function_struct *callbacks;
+  u_int32_t size, i, n = 0;
+
+  if(l4_proto == IPPROTO_TCP)
+    callbacks = ndpi_struct->callback_order_tcp_payload, size = ndpi_struct->callback_buffer_size_tcp_payload;
+  else if(l4_proto == IPPROTO_UDP)
+    callbacks = ndpi_struct->callback_order_udp, size = ndpi_struct->callback_buffer_size_udp;
+  else
+    return(0);
+
+  for(i = 0; (i < size) && (n < max_ids); i++)
+    if(callbacks[i].func != NULL)
+      protocol_ids[n++] = callbacks[i].ndpi_protocol_id;
+
+  return(n);
+}
+
+/* ********************************************************************************* */
+
+int ndpi_set_dissector_order(struct ndpi_detection_module_struct *ndpi_struct,
+			     u_int8_t l4_proto, const u_int16_t *protocol_ids, u_int32_t num_ids) {
+  struct ndpi_call_function_struct **active, *next, *snapshots[2];
+  u_int8_t placed[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
+  u_int32_t size, i, j, n = 0;
+
+  if((ndpi_struct->adaptive_order == NULL)
+     && (ndpi_enable_adaptive_order(ndpi_struct, 0) != 0))
+    return(-1);
+
+  if(l4_proto == IPPROTO_TCP) {
+    active = &ndpi_struct->callback_order_tcp_payload, size = ndpi_struct->callback_buffer_size_tcp_payload;
+    snapshots[0] = ndpi_struct->adaptive_order->tcp_payload[0], snapshots[1] = ndpi_struct->adaptive_order->tcp_payload[1];
+  } else if(l4_proto == IPPROTO_UDP) {
+    active = &ndpi_struct->callback_order_udp, size = ndpi_struct->callback_buffer_size_udp;
+    snapshots[0] = ndpi_struct->adaptive_order->udp[0], snapshots[1] = ndpi_struct->adaptive_order->udp[1];
+  } else {
+    printf("[NDPI] %s(): unsupported L4 protocol %u\n", __FUNCTION__, l4_proto);
+    return(-1);
+  }
+
+  next = ndpi_order_snapshot(snapshots, *active);
+  memset(placed, 0, size);
+
+  /* the listed dissectors first, then the others in their current order */
+  for(i = 0; i < num_ids; i++) {
+    for(j = 0; j < size; j++) {
+      if((!placed[j]) && ((*active)[j].func != NULL) && ((*active)[j].ndpi_protocol_id == protocol_ids[i])) {
+	next[n++] = (*active)[j], placed[j] = 1;
+	break;
+      }
+    }
+  }
+
+  for(j = 0; j < size; j++)
+    if(!placed[j]) next[n++] = (*active)[j];
+
+  ndpi_memory_barrier();
+  *active = next;
+  ndpi_struct->adaptive_order->pinned = 1;
+
+  return(0);
+}
+
+/* ********************************************************************************* */
+
+u_int32_t ndpi_get_port_candidates(struct ndpi_detection_module_struct *ndpi_struct,
+				   u_int8_t l4_proto, u_int16_t port,
+				   u_int16_t *protocol_ids, u_int32_t max_ids) {
+  ndpi_port_candidates_t *node = ndpi_find_port_candidates(ndpi_struct, l4_proto, port, 0);
+  u_int32_t n;
+
+  if(node == NULL)
+    return(0);
+
+  for(n = 0; (n < node->num_candidates) && (n < max_ids); n++)
+    protocol_ids[n] = node->protocol_id[n];
+
+  return(n);
+}
+
+/* ********************************************************************************* */
+
+unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *ndpi_struct,
+					   struct ndpi_flow_struct *flow,
+					   const unsigned char *packet,
+					   const unsigned short packetlen,
+					   const u_int32_t current_tick,
+					   struct ndpi_id_struct *src,
+					   struct ndpi_id_struct *dst)
+{
+  unsigned int ret;
+
+  ndpi_rules_read_lock(ndpi_struct);
+  ret = ndpi_do_detection_process_packet(ndpi_struct, flow, packet, packetlen,
+					 current_tick, src, dst);
+  ndpi_rules_read_unlock(ndpi_struct);
+
+  /* the long-tail dissectors are done with this flow */
+  if((flow->state_ref != 0) && (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN))
+    ndpi_flow_state_free(ndpi_struct, flow);
+
+  if(ndpi_struct->adaptive_order != NULL)
+    ndpi_adaptive_order_tick(ndpi_struct);
+
+  return(ret);
+}
+
 
 u_int32_t ndpi_bytestream_to_number(const u_int8_t * str, u_int16_t max_chars_to_read, u_int16_t * bytes_read)
 {
@@ -4183,6 +5629,289 @@ u_int8_t ndpi_detection_get_l4(const u_int8_t * l3, u_int16_t l3_len, const u_in
   return ndpi_detection_get_l4_internal(NULL, l3, l3_len, l4_return, l4_len_return, l4_protocol_return, flags);
 }
 
+/* ********************************************************************************* */
+
+/* Slab of the flow, NULL when it has none or when it has been reused by another flow */
+static ndpi_flow_state_slab_t* ndpi_flow_state_get(struct ndpi_detection_module_struct *ndpi_struct,
+						   struct ndpi_flow_struct *flow) {
+  ndpi_flow_state_pool_t *pool = ndpi_struct->flow_state_pool;
+  u_int32_t idx = flow->state_ref & 0xFFFF;
+  ndpi_flow_state_slab_t *slab;
+
+  if(idx == 0)
+    return(NULL);
+
+  if((pool == NULL) || (idx > pool->num_slabs)) {
+    flow->state_ref = 0;
+    return(NULL);
+  }
+
+  idx--;
+  slab = &pool->chunks[idx / NDPI_FLOW_STATE_POOL_CHUNK][idx % NDPI_FLOW_STATE_POOL_CHUNK];
+
+  if(slab->generation != (flow->state_ref >> 16)) {
+    flow->state_ref = 0;
+    return(NULL);
+  }
+
+  return(slab);
+}
+
+/* ********************************************************************************* */
+
+static ndpi_flow_state_record_t* ndpi_flow_state_find(ndpi_flow_state_slab_t *slab, u_int16_t protocol_id) {
+  u_int8_t i;
+
+  if(slab == NULL) return(NULL);
+
+  for(i = 0; i < slab->num_records; i++)
+    if(slab->records[i].protocol_id == protocol_id)
+      return(&slab->records[i]);
+
+  return(NULL);
+}
+
+/* ********************************************************************************* */
+
+/* Takes a free slab, grows the pool or reuses the slab of a flow idle for NDPI_FLOW_STATE_IDLE */
+static ndpi_flow_state_slab_t* ndpi_flow_state_slab_alloc(struct ndpi_detection_module_struct *ndpi_struct,
+							  struct ndpi_flow_struct *flow) {
+  ndpi_flow_state_pool_t *pool = ndpi_struct->flow_state_pool;
+  ndpi_flow_state_slab_t *slab = NULL;
+  u_int32_t now = flow->packet.tick_timestamp, idx, i;
+
+  if((pool == NULL)
+     && ((pool = ndpi_struct->flow_state_pool = (ndpi_flow_state_pool_t*)ndpi_calloc_tag(1, sizeof(ndpi_flow_state_pool_t),
+											   NDPI_MEM_FLOWS)) == NULL))
+    return(NULL);
+
+  if((pool->free_head == 0) && (pool->num_slabs < NDPI_FLOW_STATE_POOL_CHUNK * NDPI_FLOW_STATE_POOL_CHUNKS)) {
+    ndpi_flow_state_slab_t *chunk;
+
+    if((chunk = (ndpi_flow_state_slab_t*)ndpi_calloc_tag(NDPI_FLOW_STATE_POOL_CHUNK, sizeof(ndpi_flow_state_slab_t),
+							 NDPI_MEM_FLOWS)) != NULL) {
+      pool->chunks[pool->num_slabs / NDPI_FLOW_STATE_POOL_CHUNK] = chunk;
+
+      for(i = NDPI_FLOW_STATE_POOL_CHUNK; i > 0; i--)
+	chunk[i - 1].next_free = pool->free_head, pool->free_head = pool->num_slabs + i;
+
+      pool->num_slabs += NDPI_FLOW_STATE_POOL_CHUNK;
+    }
+  }
+
+  if(pool->free_head != 0) {
+    idx = pool->free_head - 1;
+    slab = &pool->chunks[idx / NDPI_FLOW_STATE_POOL_CHUNK][idx % NDPI_FLOW_STATE_POOL_CHUNK];
+    pool->free_head = slab->next_free;
+  } else {
+    /* pool full: look for a flow gone silent, e.g. freed before its detection completed */
+    for(i = 0; (slab == NULL) && (i < NDPI_FLOW_STATE_POOL_CHUNK); i++) {
+      ndpi_flow_state_slab_t *s;
+
+      idx = pool->clock_hand, pool->clock_hand = (pool->clock_hand + 1) % pool->num_slabs;
+      s = &pool->chunks[idx / NDPI_FLOW_STATE_POOL_CHUNK][idx % NDPI_FLOW_STATE_POOL_CHUNK];
+
+      if((int32_t)(now - s->last_used) >= (int32_t)(NDPI_FLOW_STATE_IDLE * ndpi_struct->ticks_per_second))
+	slab = s;
+    }
+
+    if(slab == NULL)
+      return(NULL);
+  }
+
+  slab->generation++, slab->next_free = 0;
+  slab->num_records = slab->num_live_records = slab->used = 0;
+  slab->last_used = now;
+  flow->state_ref = ((u_int32_t)slab->generation << 16) | (idx + 1);
+
+  return(slab);
+}
+
+/* ********************************************************************************* */
+
+/* Returns a zeroed record of len bytes, or NULL when it cannot be created */
+static void* ndpi_flow_state_claim(struct ndpi_detection_module_struct *ndpi_struct,
+				   struct ndpi_flow_struct *flow, u_int16_t protocol_id, u_int8_t len) {
+  ndpi_flow_state_slab_t *slab = ndpi_flow_state_get(ndpi_struct, flow);
+  ndpi_flow_state_record_t *rec = NULL;
+  u_int8_t i;
+
+  len = (len + 3) & ~3; /* keep the records aligned */
+
+  if((slab == NULL) && ((slab = ndpi_flow_state_slab_alloc(ndpi_struct, flow)) == NULL))
+    return(NULL);
+
+  /* a record released by a dissector that excluded itself */
+  for(i = 0; i < slab->num_records; i++)
+    if((slab->records[i].protocol_id == NDPI_PROTOCOL_UNKNOWN) && (slab->records[i].len >= len)) {
+      rec = &slab->records[i];
+      break;
+    }
+
+  if(rec == NULL) {
+    if((slab->num_records == NDPI_FLOW_STATE_MAX_RECORDS) || (slab->used + len > NDPI_FLOW_STATE_SLAB_LEN))
+      return(NULL);
+
+    rec = &slab->records[slab->num_records++];
+    rec->offset = slab->used, rec->len = len;
+    slab->used += len;
+  }
+
+  rec->protocol_id = protocol_id;
+  slab->num_live_records++;
+  memset((u_int8_t*)slab->data + rec->offset, 0, rec->len);
+
+  return((u_int8_t*)slab->data + rec->offset);
+}
+
+/* ********************************************************************************* */
+
+/* Gives the slab of the flow back to the pool */
+void ndpi_flow_state_free(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+  ndpi_flow_state_slab_t *slab = ndpi_flow_state_get(ndpi_struct, flow);
+
+  if(slab != NULL) {
+    slab->generation++;
+    slab->next_free = ndpi_struct->flow_state_pool->free_head;
+    ndpi_struct->flow_state_pool->free_head = (flow->state_ref & 0xFFFF);
+  }
+
+  flow->state_ref = 0;
+}
+
+/* ********************************************************************************* */
+
+static void ndpi_flow_state_release(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				    ndpi_flow_state_slab_t *slab, ndpi_flow_state_record_t *rec) {
+  if(--slab->num_live_records == 0) {
+    ndpi_flow_state_free(ndpi_struct, flow);
+    return;
+  }
+
+  /* the space of the last record is given back, the others are reused by ndpi_flow_state_claim() */
+  if(rec == &slab->records[slab->num_records - 1])
+    slab->num_records--, slab->used -= rec->len;
+
+  rec->protocol_id = NDPI_PROTOCOL_UNKNOWN;
+}
+
+/* ********************************************************************************* */
+
+void ndpi_flow_state_pool_free(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_flow_state_pool_t *pool = ndpi_struct->flow_state_pool;
+  u_int32_t i;
+
+  if(pool == NULL)
+    return;
+
+  for(i = 0; i < pool->num_slabs / NDPI_FLOW_STATE_POOL_CHUNK; i++)
+    ndpi_free_tag(pool->chunks[i]);
+
+  ndpi_free_tag(pool);
+  ndpi_struct->flow_state_pool = NULL;
+}
+
+/* ********************************************************************************* */
+
+/*
+  Runs a dissector that keeps len bytes of state in the flow state slab.
+  Until the dissector stores something it works on a zeroed copy, so
+  the flows it never matches do not pay for its state. A state larger
+  than NDPI_FLOW_STATE_MAX_LEN does not fit the copy: the dissector is
+  excluded from the flow instead of being run.
+*/
+void ndpi_run_with_flow_state(struct ndpi_detection_module_struct *ndpi_struct,
+			      struct ndpi_flow_struct *flow,
+			      u_int16_t protocol_id, u_int8_t len,
+			      ndpi_flow_state_func_t func) {
+  ndpi_flow_state_slab_t *slab;
+  ndpi_flow_state_record_t *rec;
+  u_int64_t local[NDPI_FLOW_STATE_MAX_LEN / sizeof(u_int64_t)];
+  u_int8_t done, i;
+  void *state;
+
+  if(len > NDPI_FLOW_STATE_MAX_LEN) {
+    printf("[NDPI] %s(protoId=%d): %u bytes of state exceed NDPI_FLOW_STATE_MAX_LEN\n",
+	   __FUNCTION__, protocol_id, len);
+    NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, protocol_id);
+    return;
+  }
+
+  slab = ndpi_flow_state_get(ndpi_struct, flow);
+  rec = ndpi_flow_state_find(slab, protocol_id);
+
+  if(rec != NULL) {
+    slab->last_used = flow->packet.tick_timestamp;
+    func(ndpi_struct, flow, (u_int8_t*)slab->data + rec->offset);
+
+    /* the dissector cannot claim other records: rec is still valid */
+    if(NDPI_COMPARE_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, protocol_id)
+       || (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN))
+      ndpi_flow_state_release(ndpi_struct, flow, slab, rec);
+
+    return;
+  }
+
+  memset(local, 0, len);
+  func(ndpi_struct, flow, local);
+
+  done = NDPI_COMPARE_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, protocol_id)
+    || (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN);
+
+  for(i = 0; (!done) && (i < len); i++) {
+    if(((u_int8_t*)local)[i] != 0) {
+      if((state = ndpi_flow_state_claim(ndpi_struct, flow, protocol_id, len)) != NULL)
+	memcpy(state, local, len);
+      break;
+    }
+  }
+}
+
+/* ********************************************************************************* */
+
+/* Returns the extension record of protocol_id, or NULL if none was stored yet */
+void* ndpi_get_id_state(struct ndpi_id_struct *id, u_int16_t protocol_id) {
+  ndpi_id_state_t *state;
+
+  for(state = id->state; state != NULL; state = state->next)
+    if(state->protocol_id == protocol_id)
+      return(state->data);
+
+  return(NULL);
+}
+
+/* ********************************************************************************* */
+
+/* Returns the extension record of protocol_id, creating a zeroed one if needed */
+void* ndpi_claim_id_state(struct ndpi_id_struct *id, u_int16_t protocol_id, u_int16_t len) {
+  ndpi_id_state_t *state;
+  void *data;
+
+  if((data = ndpi_get_id_state(id, protocol_id)) != NULL)
+    return(data);
+
+  if((state = (ndpi_id_state_t*)ndpi_calloc_tag(1, sizeof(ndpi_id_state_t) + len, NDPI_MEM_FLOWS)) == NULL)
+    return(NULL);
+
+  state->protocol_id = protocol_id, state->len = len;
+  state->next = id->state, id->state = state;
+
+  return(state->data);
+}
+
+/* ********************************************************************************* */
+
+void ndpi_free_id_state(struct ndpi_id_struct *id) {
+  while(id->state != NULL) {
+    ndpi_id_state_t *next = id->state->next;
+
+    ndpi_free_tag(id->state);
+    id->state = next;
+  }
+}
+
+/* ********************************************************************************* */
+
 void ndpi_int_add_connection(struct ndpi_detection_module_struct *ndpi_struct,
 			     struct ndpi_flow_struct *flow,
 			     u_int16_t detected_protocol, ndpi_protocol_type_t protocol_type)
@@ -4545,6 +6274,9 @@ void ndpi_int_change_protocol(struct ndpi_detection_module_struct *ndpi_struct,
 {
   ndpi_int_change_flow_protocol(ndpi_struct, flow, detected_protocol, protocol_type);
   ndpi_int_change_packet_protocol(ndpi_struct, flow, detected_protocol, protocol_type);
+
+  NDPI_TRACE(ndpi_struct, detected_protocol, NDPI_TRACE_PROTOCOL_FOUND,
+	     detected_protocol, flow->detected_protocol_stack[1], flow->packet.packet_direction, protocol_type);
 }
 
 
@@ -4736,9 +6468,12 @@ unsigned int ndpi_guess_undetected_protocol(struct ndpi_detection_module_struct
   rc = ndpi_search_tcp_or_udp_raw(ndpi_struct, proto,
 				  shost, dhost, sport, dport);
 
-  if(rc == NDPI_PROTOCOL_UNKNOWN)
+  if(rc == NDPI_PROTOCOL_UNKNOWN) {
+    ndpi_rules_read_lock(ndpi_struct);
     rc = ndpi_guess_protocol_id(ndpi_struct, proto,
 				shost, sport, dhost, dport);
+    ndpi_rules_read_unlock(ndpi_struct);
+  }
 
   if(rc != NDPI_PROTOCOL_UNKNOWN)
     return(rc);
@@ -4824,7 +6559,22 @@ static int ndpi_automa_match_string_subprotocol(struct ndpi_detection_module_str
   matching_protocol_id = NDPI_PROTOCOL_UNKNOWN;
 
   ac_input_text.astring = string_to_match, ac_input_text.length = string_to_match_len;
-  ac_automata_search (((AC_AUTOMATA_t*)automa->ac_automa), &ac_input_text, (void*)&matching_protocol_id);
+
+  if(!automa->ac_automa_anchored)
+    ac_automata_search (((AC_AUTOMATA_t*)automa->ac_automa), &ac_input_text, (void*)&matching_protocol_id);
+  else {
+    /* Frame the name with the markers anchored rules are compiled with: the automa keeps its state across searches */
+    char markers[2] = { NDPI_HOST_BEGIN_MARKER, NDPI_HOST_END_MARKER };
+    AC_TEXT_t ac_marker;
+
+    ac_marker.astring = &markers[0], ac_marker.length = 1;
+
+    if((ac_automata_search(((AC_AUTOMATA_t*)automa->ac_automa), &ac_marker, (void*)&matching_protocol_id) == 0)
+       && (ac_automata_search(((AC_AUTOMATA_t*)automa->ac_automa), &ac_input_text, (void*)&matching_protocol_id) == 0)) {
+      ac_marker.astring = &markers[1];
+      ac_automata_search(((AC_AUTOMATA_t*)automa->ac_automa), &ac_marker, (void*)&matching_protocol_id);
+    }
+  }
 
   ac_automata_reset(((AC_AUTOMATA_t*)automa->ac_automa));
 
@@ -4858,7 +6608,20 @@ static int ndpi_automa_match_string_subprotocol(struct ndpi_detection_module_str
 int ndpi_match_string_subprotocol(struct ndpi_detection_module_struct *ndpi_struct,
 				  struct ndpi_flow_struct *flow,
 				  char *string_to_match, u_int string_to_match_len) {
-  return(ndpi_automa_match_string_subprotocol(ndpi_struct, &ndpi_struct->host_automa,
+  ndpi_rules_t *rules = ndpi_struct->rules;
+
+#ifndef __KERNEL__
+  if(rules->snapshot != NULL) {
+    u_int16_t matching_protocol_id = ndpi_snapshot_match_host(rules->snapshot, string_to_match, string_to_match_len);
+
+    if(matching_protocol_id != NDPI_PROTOCOL_UNKNOWN) {
+      flow->packet.detected_protocol_stack[0] = matching_protocol_id;
+      return(matching_protocol_id);
+    }
+  }
+#endif
+
+  return(ndpi_automa_match_string_subprotocol(ndpi_struct, &rules->host_automa,
 					      flow, string_to_match, string_to_match_len));
 }
 
@@ -4873,6 +6636,56 @@ int ndpi_match_content_subprotocol(struct ndpi_detection_module_struct *ndpi_str
 
 /* ****************************************************** */
 
+static const char *ndpi_os_names[NDPI_OS_MAX] = {
+  "Unknown", "Windows", "Windows 2000", "Windows XP", "Windows Server 2003",
+  "Windows Vista", "Windows 7", "Windows 8", "Windows 8.1", "Windows 10",
+  "Windows Phone", "macOS", "iOS", "Android", "Linux", "ChromeOS"
+};
+
+static const char *ndpi_ua_client_names[NDPI_UA_CLIENT_MAX] = {
+  "Unknown", "Internet Explorer", "Edge", "Chrome", "Firefox", "Safari", "Opera",
+  "curl", "Wget", "OkHttp", "Dalvik", "CFNetwork", "Python", "Java", "Go", "Apache HttpClient"
+};
+
+/* ****************************************************** */
+
+void ndpi_match_user_agent(struct ndpi_detection_module_struct *ndpi_struct,
+			   struct ndpi_flow_struct *flow,
+			   const char *ua, u_int ua_len) {
+  AC_AUTOMATA_t *automa = (AC_AUTOMATA_t*)ndpi_struct->ua_automa.ac_automa;
+  ndpi_ua_classification result = { NDPI_OS_UNKNOWN, 0, NDPI_UA_CLIENT_UNKNOWN, 0 };
+  AC_TEXT_t ac_input_text;
+
+  if((automa == NULL) || (ua_len == 0))
+    return;
+
+  ac_input_text.astring = (char*)ua, ac_input_text.length = ua_len;
+  ac_automata_search(automa, &ac_input_text, (void*)&result);
+  ac_automata_reset(automa);
+
+  if(result.os_id != NDPI_OS_UNKNOWN) {
+    flow->detected_os_id = result.os_id;
+    snprintf((char*)flow->detected_os, sizeof(flow->detected_os), "%s", ndpi_os_names[result.os_id]);
+  }
+
+  if(result.client_id != NDPI_UA_CLIENT_UNKNOWN)
+    flow->detected_client_id = result.client_id;
+}
+
+/* ****************************************************** */
+
+const char* ndpi_get_os_name(u_int8_t os_id) {
+  return((os_id < NDPI_OS_MAX) ? ndpi_os_names[os_id] : ndpi_os_names[NDPI_OS_UNKNOWN]);
+}
+
+/* ****************************************************** */
+
+const char* ndpi_get_ua_client_name(u_int8_t client_id) {
+  return((client_id < NDPI_UA_CLIENT_MAX) ? ndpi_ua_client_names[client_id] : ndpi_ua_client_names[NDPI_UA_CLIENT_UNKNOWN]);
+}
+
+/* ****************************************************** */
+
 #ifndef __KERNEL__
 char* ndpi_revision() {
   return(NDPI_SVN_RELEASE);
@@ -0,0 +1,525 @@
+/*
+ * ndpi_snapshot.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Precompiled rules snapshot.
+
+  ndpi_save_snapshot() dumps the rules in use (protocol names, port
+  tables and the finalized host automa) into a file made of flat arrays
+  that reference each other by index. ndpi_load_snapshot() maps that
+  file read-only and looks it up in place: no parsing nor automa
+  construction happens at startup, and processes loading the same file
+  share its pages.
+
+  The file is only meant to be used by the same nDPI build on the same
+  architecture that produced it.
+*/
+
+#ifndef __KERNEL__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ahocorasick.h"
+#include "ndpi_api.h"
+
+#define NDPI_SNAPSHOT_ALIGN(a) (((a) + 7) & ~7)
+
+/* ******************************************************************** */
+
+typedef struct {
+  ndpi_snapshot_port_t *ports;
+  u_int32_t num_ports;
+} ndpi_snapshot_ports_walk_t;
+
+static void ndpi_snapshot_count_ports(const void *node, ndpi_VISIT which, int depth, void *user_data) {
+  if((which == ndpi_postorder) || (which == ndpi_leaf))
+    ((ndpi_snapshot_ports_walk_t*)user_data)->num_ports++;
+}
+
+static void ndpi_snapshot_collect_ports(const void *node, ndpi_VISIT which, int depth, void *user_data) {
+  ndpi_snapshot_ports_walk_t *walk = (ndpi_snapshot_ports_walk_t*)user_data;
+  ndpi_default_ports_tree_node_t *f = *(ndpi_default_ports_tree_node_t **)node;
+
+  if((which == ndpi_postorder) || (which == ndpi_leaf)) {
+    walk->ports[walk->num_ports].port = f->default_port;
+    walk->ports[walk->num_ports].protoId = f->proto->protoId;
+    walk->num_ports++;
+  }
+}
+
+static u_int32_t ndpi_snapshot_num_ports(ndpi_default_ports_tree_node_t *root) {
+  ndpi_snapshot_ports_walk_t walk = { NULL, 0 };
+
+  ndpi_twalk(root, ndpi_snapshot_count_ports, &walk);
+  return(walk.num_ports);
+}
+
+static int ndpi_snapshot_port_cmp(const void *a, const void *b) {
+  const ndpi_snapshot_port_t *pa = (const ndpi_snapshot_port_t*)a, *pb = (const ndpi_snapshot_port_t*)b;
+
+  return((int)pa->port - (int)pb->port);
+}
+
+/* ******************************************************************** */
+
+int ndpi_save_snapshot(struct ndpi_detection_module_struct *ndpi_mod, char *path) {
+  ndpi_rules_t *rules = ndpi_mod->rules;
+  AC_AUTOMATA_t *automa = (AC_AUTOMATA_t*)rules->host_automa.ac_automa;
+  ndpi_snapshot_header_t *header;
+  ndpi_snapshot_protocol_t *protocols;
+  ndpi_snapshot_node_t *nodes;
+  ndpi_snapshot_edge_t *edges;
+  ndpi_snapshot_ports_walk_t walk;
+  u_int32_t i, j, num_edges, names_len, len, name_offset;
+  u_int8_t *buf;
+  FILE *fd;
+  int rc = 0;
+
+  if(rules->snapshot != NULL) {
+    printf("[NDPI] %s(): rules already come from a snapshot\n", __FUNCTION__);
+    return(-3);
+  }
+
+  if(!rules->host_automa.ac_automa_finalized) {
+    ac_automata_finalize(automa);
+    rules->host_automa.ac_automa_finalized = 1;
+  }
+
+  for(i=0, num_edges=0; i<automa->all_nodes_num; i++) {
+    /* Node ids become the indexes used by the snapshot */
+    automa->all_nodes[i]->id = i;
+    num_edges += automa->all_nodes[i]->outgoing_degree;
+  }
+
+  for(i=0, names_len=0; i<ndpi_mod->ndpi_num_supported_protocols; i++)
+    if(ndpi_mod->proto_defaults[i].protoName != NULL)
+      names_len += strlen(ndpi_mod->proto_defaults[i].protoName) + 1;
+
+  if((header = (ndpi_snapshot_header_t*)ndpi_calloc_tag(1, sizeof(ndpi_snapshot_header_t), NDPI_MEM_RULES)) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    return(-2);
+  }
+
+  header->magic = NDPI_SNAPSHOT_MAGIC, header->version = NDPI_SNAPSHOT_VERSION;
+  header->header_len = sizeof(ndpi_snapshot_header_t);
+  header->max_supported_protocols = NDPI_MAX_SUPPORTED_PROTOCOLS;
+  header->num_protocols = ndpi_mod->ndpi_num_supported_protocols;
+  header->num_tcp_ports = ndpi_snapshot_num_ports(rules->tcpRoot);
+  header->num_udp_ports = ndpi_snapshot_num_ports(rules->udpRoot);
+  header->num_nodes = automa->all_nodes_num, header->num_edges = num_edges;
+  header->names_len = names_len;
+  memcpy(header->alphabet, automa->alphabet, sizeof(header->alphabet));
+
+  len = NDPI_SNAPSHOT_ALIGN(sizeof(ndpi_snapshot_header_t));
+  header->protocols_offset = len, len = NDPI_SNAPSHOT_ALIGN(len + header->num_protocols * sizeof(ndpi_snapshot_protocol_t));
+  header->tcp_ports_offset = len, len = NDPI_SNAPSHOT_ALIGN(len + header->num_tcp_ports * sizeof(ndpi_snapshot_port_t));
+  header->udp_ports_offset = len, len = NDPI_SNAPSHOT_ALIGN(len + header->num_udp_ports * sizeof(ndpi_snapshot_port_t));
+  header->nodes_offset = len, len = NDPI_SNAPSHOT_ALIGN(len + header->num_nodes * sizeof(ndpi_snapshot_node_t));
+  header->edges_offset = len, len = NDPI_SNAPSHOT_ALIGN(len + header->num_edges * sizeof(ndpi_snapshot_edge_t));
+  header->names_offset = len, len += names_len;
+  header->file_len = len;
+
+  if((buf = (u_int8_t*)ndpi_calloc_tag(1, len, NDPI_MEM_RULES)) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    ndpi_free_tag(header);
+    return(-2);
+  }
+
+  memcpy(buf, header, sizeof(ndpi_snapshot_header_t));
+  ndpi_free_tag(header);
+  header = (ndpi_snapshot_header_t*)buf;
+
+  /* Protocols */
+  protocols = (ndpi_snapshot_protocol_t*)&buf[header->protocols_offset];
+  for(i=0, name_offset=0; i<header->num_protocols; i++) {
+    char *name = ndpi_mod->proto_defaults[i].protoName;
+
+    protocols[i].protoId = i;
+
+    if(name != NULL) {
+      protocols[i].name_offset = name_offset;
+      memcpy(&buf[header->names_offset + name_offset], name, strlen(name) + 1);
+      name_offset += strlen(name) + 1;
+    } else
+      protocols[i].name_offset = names_len; /* No name */
+  }
+
+  /* Ports */
+  walk.ports = (ndpi_snapshot_port_t*)&buf[header->tcp_ports_offset], walk.num_ports = 0;
+  ndpi_twalk(rules->tcpRoot, ndpi_snapshot_collect_ports, &walk);
+  qsort(walk.ports, walk.num_ports, sizeof(ndpi_snapshot_port_t), ndpi_snapshot_port_cmp);
+
+  walk.ports = (ndpi_snapshot_port_t*)&buf[header->udp_ports_offset], walk.num_ports = 0;
+  ndpi_twalk(rules->udpRoot, ndpi_snapshot_collect_ports, &walk);
+  qsort(walk.ports, walk.num_ports, sizeof(ndpi_snapshot_port_t), ndpi_snapshot_port_cmp);
+
+  /* Host automa: edges are already sorted by ac_automata_finalize() */
+  nodes = (ndpi_snapshot_node_t*)&buf[header->nodes_offset];
+  edges = (ndpi_snapshot_edge_t*)&buf[header->edges_offset];
+  for(i=0, num_edges=0; i<automa->all_nodes_num; i++) {
+    AC_NODE_t *n = automa->all_nodes[i];
+
+    nodes[i].first_edge = num_edges, nodes[i].num_edges = n->outgoing_degree;
+    nodes[i].failure = n->failure_node ? n->failure_node->id : 0;
+
+    if(n->final && (n->matched_patterns_num > 0))
+      nodes[i].final = 1, nodes[i].protoId = n->matched_patterns[0].rep.number;
+
+    for(j=0; j<n->outgoing_degree; j++, num_edges++)
+      edges[num_edges].alpha = (u_int8_t)n->outgoing[j].alpha,
+	edges[num_edges].next = n->outgoing[j].next->id;
+  }
+
+  if((fd = fopen(path, "wb")) == NULL) {
+    printf("[NDPI] %s(): unable to create file %s\n", __FUNCTION__, path);
+    rc = -1;
+  } else {
+    if(fwrite(buf, 1, len, fd) != len) {
+      printf("[NDPI] %s(): unable to write file %s\n", __FUNCTION__, path);
+      rc = -1;
+    }
+
+    fclose(fd);
+  }
+
+  ndpi_free_tag(buf);
+  return(rc);
+}
+
+/* ******************************************************************** */
+
+static int ndpi_snapshot_check_section(const ndpi_snapshot_header_t *header,
+				       u_int32_t offset, u_int32_t num, u_int32_t size) {
+  if(offset & 3) return(0);
+  return(((u_int64_t)offset + (u_int64_t)num * size) <= header->file_len);
+}
+
+/*
+  The nodes must form a trie rooted at node 0 (every other node is the
+  target of exactly one edge) and each failure link must lead to a
+  shallower node: the search then always ends, whatever the file holds.
+*/
+static int ndpi_snapshot_check_automa(const ndpi_snapshot_t *snapshot) {
+  const ndpi_snapshot_header_t *header = snapshot->header;
+  u_int32_t *depth, *queue, head = 0, tail = 0, i, j;
+  int rc = 1;
+
+  depth = (u_int32_t*)ndpi_malloc_tag(header->num_nodes * sizeof(u_int32_t), NDPI_MEM_RULES);
+  queue = (u_int32_t*)ndpi_malloc_tag(header->num_nodes * sizeof(u_int32_t), NDPI_MEM_RULES);
+
+  if((depth == NULL) || (queue == NULL)) {
+    rc = 0;
+    goto out;
+  }
+
+  memset(depth, 0xFF, header->num_nodes * sizeof(u_int32_t));
+  depth[0] = 0, queue[tail++] = 0;
+
+  while(head < tail) {
+    const ndpi_snapshot_node_t *n = &snapshot->nodes[queue[head]];
+    u_int32_t d = depth[queue[head++]] + 1;
+
+    for(j=0; j<n->num_edges; j++) {
+      u_int32_t next = snapshot->edges[n->first_edge + j].next;
+
+      if(depth[next] != 0xFFFFFFFF) {
+	rc = 0; /* root, shared node or loop */
+	goto out;
+      }
+
+      depth[next] = d, queue[tail++] = next;
+    }
+  }
+
+  for(i=1; i<header->num_nodes; i++) {
+    if((depth[i] == 0xFFFFFFFF) /* unreachable */
+       || (depth[snapshot->nodes[i].failure] >= depth[i])) {
+      rc = 0;
+      break;
+    }
+  }
+
+ out:
+  if(depth) ndpi_free_tag(depth);
+  if(queue) ndpi_free_tag(queue);
+  return(rc);
+}
+
+/* ******************************************************************** */
+
+static int ndpi_snapshot_validate(const ndpi_snapshot_t *snapshot) {
+  const ndpi_snapshot_header_t *header = snapshot->header;
+  const u_int32_t max_protocols = NDPI_MAX_SUPPORTED_PROTOCOLS+NDPI_MAX_NUM_CUSTOM_PROTOCOLS;
+  u_int32_t i;
+
+  if((snapshot->len < sizeof(ndpi_snapshot_header_t))
+     || (header->magic != NDPI_SNAPSHOT_MAGIC)
+     || (header->version != NDPI_SNAPSHOT_VERSION)
+     || (header->header_len != sizeof(ndpi_snapshot_header_t))
+     || (header->file_len != snapshot->len)
+     || (header->max_supported_protocols != NDPI_MAX_SUPPORTED_PROTOCOLS)
+     || (header->num_protocols > max_protocols)
+     || (header->num_nodes == 0))
+    return(0);
+
+  if(!ndpi_snapshot_check_section(header, header->protocols_offset, header->num_protocols, sizeof(ndpi_snapshot_protocol_t))
+     || !ndpi_snapshot_check_section(header, header->tcp_ports_offset, header->num_tcp_ports, sizeof(ndpi_snapshot_port_t))
+     || !ndpi_snapshot_check_section(header, header->udp_ports_offset, header->num_udp_ports, sizeof(ndpi_snapshot_port_t))
+     || !ndpi_snapshot_check_section(header, header->nodes_offset, header->num_nodes, sizeof(ndpi_snapshot_node_t))
+     || !ndpi_snapshot_check_section(header, header->edges_offset, header->num_edges, sizeof(ndpi_snapshot_edge_t))
+     || ((u_int64_t)header->names_offset + header->names_len > header->file_len)
+     || ((header->names_len > 0) && (((char*)snapshot->base)[header->names_offset + header->names_len - 1] != '\0')))
+    return(0);
+
+  /* Make sure that lookups never leave the mapped file */
+  for(i=0; i<header->num_tcp_ports; i++)
+    if(snapshot->tcp_ports[i].protoId >= header->num_protocols) return(0);
+
+  for(i=0; i<header->num_udp_ports; i++)
+    if(snapshot->udp_ports[i].protoId >= header->num_protocols) return(0);
+
+  for(i=0; i<header->num_nodes; i++) {
+    const ndpi_snapshot_node_t *n = &snapshot->nodes[i];
+
+    if(((u_int64_t)n->first_edge + n->num_edges > header->num_edges)
+       || (n->failure >= header->num_nodes)
+       || (n->final && (n->protoId >= header->num_protocols)))
+      return(0);
+  }
+
+  for(i=0; i<header->num_edges; i++)
+    if(snapshot->edges[i].next >= header->num_nodes) return(0);
+
+  return(ndpi_snapshot_check_automa(snapshot));
+}
+
+/* ******************************************************************** */
+
+/* Custom protocols are defined in the snapshot and registered here */
+static int ndpi_snapshot_register_protocols(struct ndpi_detection_module_struct *ndpi_mod,
+					    const ndpi_snapshot_t *snapshot) {
+  const ndpi_snapshot_protocol_t *protocols = (const ndpi_snapshot_protocol_t*)((u_int8_t*)snapshot->base + snapshot->header->protocols_offset);
+  const char *names = (const char*)snapshot->base + snapshot->header->names_offset;
+  u_int32_t i;
+
+  for(i=0; i<snapshot->header->num_protocols; i++) {
+    const char *name;
+
+    if(protocols[i].name_offset >= snapshot->header->names_len)
+      continue; /* Unused protocol id */
+
+    name = &names[protocols[i].name_offset];
+
+    if(i < ndpi_mod->ndpi_num_supported_protocols) {
+      if((ndpi_mod->proto_defaults[i].protoName == NULL)
+	 || strcmp(ndpi_mod->proto_defaults[i].protoName, name)) {
+	printf("[NDPI] %s(): protocol %u (%s) does not match this build\n", __FUNCTION__, i, name);
+	return(-4);
+      }
+    } else if(i == ndpi_mod->ndpi_num_supported_protocols) {
+      ndpi_port_range ports_a[MAX_DEFAULT_PORTS], ports_b[MAX_DEFAULT_PORTS];
+
+      ndpi_set_proto_defaults(ndpi_mod, i, (char*)name,
+			      ndpi_build_default_ports(ports_a, 0, 0, 0, 0, 0) /* TCP */,
+			      ndpi_build_default_ports(ports_b, 0, 0, 0, 0, 0) /* UDP */);
+      ndpi_mod->ndpi_num_supported_protocols++, ndpi_mod->ndpi_num_custom_protocols++;
+    } else {
+      printf("[NDPI] %s(): unexpected protocol %u (%s)\n", __FUNCTION__, i, name);
+      return(-4);
+    }
+  }
+
+  return(0);
+}
+
+/* ******************************************************************** */
+
+int ndpi_load_snapshot(struct ndpi_detection_module_struct *ndpi_mod, char *path) {
+  ndpi_snapshot_t *snapshot;
+  ndpi_rules_t *rules;
+  struct stat st;
+  u_int8_t *base;
+  int fd, rc;
+
+  if((fd = open(path, O_RDONLY)) < 0) {
+    printf("[NDPI] %s(): unable to open file %s\n", __FUNCTION__, path);
+    return(-1);
+  }
+
+  if((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(ndpi_snapshot_header_t))) {
+    printf("[NDPI] %s(): invalid file %s\n", __FUNCTION__, path);
+    close(fd);
+    return(-1);
+  }
+
+  base = (u_int8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(base == MAP_FAILED) {
+    printf("[NDPI] %s(): unable to map file %s\n", __FUNCTION__, path);
+    return(-1);
+  }
+
+  if((snapshot = (ndpi_snapshot_t*)ndpi_calloc_tag(1, sizeof(ndpi_snapshot_t), NDPI_MEM_RULES)) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    munmap(base, st.st_size);
+    return(-2);
+  }
+
+  snapshot->base = base, snapshot->len = st.st_size;
+  snapshot->header = (const ndpi_snapshot_header_t*)base;
+  snapshot->tcp_ports = (const ndpi_snapshot_port_t*)&base[snapshot->header->tcp_ports_offset];
+  snapshot->udp_ports = (const ndpi_snapshot_port_t*)&base[snapshot->header->udp_ports_offset];
+  snapshot->nodes = (const ndpi_snapshot_node_t*)&base[snapshot->header->nodes_offset];
+  snapshot->edges = (const ndpi_snapshot_edge_t*)&base[snapshot->header->edges_offset];
+
+  if(!ndpi_snapshot_validate(snapshot)) {
+    printf("[NDPI] %s(): invalid or incompatible snapshot %s\n", __FUNCTION__, path);
+    ndpi_snapshot_release(snapshot);
+    return(-3);
+  }
+
+  if((rc = ndpi_snapshot_register_protocols(ndpi_mod, snapshot)) != 0) {
+    ndpi_snapshot_release(snapshot);
+    return(rc);
+  }
+
+  /*
+    The snapshot replaces the rules in use. The (empty) port trees and
+    host automa of the new rules still accept ndpi_handle_rule() changes.
+  */
+  if((rules = ndpi_alloc_rules()) == NULL) {
+    printf("[NDPI] %s(): not enough memory\n", __FUNCTION__);
+    ndpi_snapshot_release(snapshot);
+    return(-2);
+  }
+
+  rules->snapshot = snapshot;
+  ndpi_publish_rules(ndpi_mod, rules);
+
+  return(0);
+}
+
+/* ******************************************************************** */
+
+void ndpi_snapshot_release(ndpi_snapshot_t *snapshot) {
+  munmap(snapshot->base, snapshot->len);
+  ndpi_free_tag(snapshot);
+}
+
+/* ******************************************************************** */
+
+u_int16_t ndpi_snapshot_find_port(const ndpi_snapshot_t *snapshot, u_int8_t proto, u_int16_t port) {
+  const ndpi_snapshot_port_t *ports;
+  int min, max;
+
+  if(proto == IPPROTO_TCP)
+    ports = snapshot->tcp_ports, max = snapshot->header->num_tcp_ports - 1;
+  else
+    ports = snapshot->udp_ports, max = snapshot->header->num_udp_ports - 1;
+
+  min = 0;
+  while(min <= max) {
+    int mid = (min + max) >> 1;
+
+    if(port > ports[mid].port)
+      min = mid + 1;
+    else if(port < ports[mid].port)
+      max = mid - 1;
+    else
+      return(ports[mid].protoId);
+  }
+
+  return(NDPI_PROTOCOL_UNKNOWN);
+}
+
+/* ******************************************************************** */
+
+static const ndpi_snapshot_node_t* ndpi_snapshot_next_node(const ndpi_snapshot_t *snapshot,
+							   const ndpi_snapshot_node_t *node,
+							   AC_ALPHABET_t alpha) {
+  const ndpi_snapshot_edge_t *edges = &snapshot->edges[node->first_edge];
+  int min = 0, max = node->num_edges - 1;
+
+  /* Same ordering as node_findbs_next() */
+  while(min <= max) {
+    int mid = (min + max) >> 1;
+    AC_ALPHABET_t amid = (AC_ALPHABET_t)edges[mid].alpha;
+
+    if(alpha > amid)
+      min = mid + 1;
+    else if(alpha < amid)
+      max = mid - 1;
+    else
+      return(&snapshot->nodes[edges[mid].next]);
+  }
+
+  return(NULL);
+}
+
+/* Mirrors ac_automata_search() stopping at the first match */
+static u_int16_t ndpi_snapshot_search(const ndpi_snapshot_t *snapshot, const ndpi_snapshot_node_t **node,
+				      const char *string_to_match, u_int string_to_match_len) {
+  const ndpi_snapshot_node_t *root = snapshot->nodes, *curr = *node, *next;
+  const u_int8_t *alphabet = snapshot->header->alphabet;
+  u_int position = 0;
+
+  while(position < string_to_match_len) {
+    if((next = ndpi_snapshot_next_node(snapshot, curr,
+				       alphabet[(u_int8_t)string_to_match[position]])) == NULL) {
+      if(curr != root)
+	curr = &snapshot->nodes[curr->failure];
+      else
+	position++;
+    } else {
+      curr = next, position++;
+
+      if(curr->final)
+	return(curr->protoId);
+    }
+  }
+
+  *node = curr;
+  return(NDPI_PROTOCOL_UNKNOWN);
+}
+
+/* The name is framed with the markers anchored host rules are compiled with */
+u_int16_t ndpi_snapshot_match_host(const ndpi_snapshot_t *snapshot,
+				   const char *string_to_match, u_int string_to_match_len) {
+  const ndpi_snapshot_node_t *curr = snapshot->nodes;
+  const char markers[2] = { NDPI_HOST_BEGIN_MARKER, NDPI_HOST_END_MARKER };
+  u_int16_t protoId;
+
+  if(((protoId = ndpi_snapshot_search(snapshot, &curr, &markers[0], 1)) == NDPI_PROTOCOL_UNKNOWN)
+     && ((protoId = ndpi_snapshot_search(snapshot, &curr, string_to_match, string_to_match_len)) == NDPI_PROTOCOL_UNKNOWN))
+    protoId = ndpi_snapshot_search(snapshot, &curr, &markers[1], 1);
+
+  return(protoId);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * ndpi_trace.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Binary trace ring.
+
+  NDPI_TRACE() (and NDPI_LOG() when debug messages are not compiled in)
+  stores a fixed size event made of a static event id, the protocol id
+  and a few integers into the ring of the module. Nothing is formatted:
+  recording is a bitmask test and a 24 bytes store, so tracing can stay
+  enabled on a live probe. As a module is used by one thread at a time
+  there is no locking: the ring is per thread.
+
+  ndpi_trace_dump() writes the ring (oldest event first) and the
+  protocol names to a file decoded offline by example/ndpiTrace.
+*/
+
+#include <stdlib.h>
+#ifndef __KERNEL__
+#include <stdio.h>
+#include <string.h>
+#endif
+
+#include "ndpi_api.h"
+
+#define NDPI_TRACE_MIN_EVENTS   64
+
+static const char *ndpi_trace_event_names[NDPI_TRACE_NUM_EVENTS] = {
+  "LOG", "PACKET", "PROTOCOL_FOUND", "PAYLOAD"
+};
+
+/* ******************************************************************** */
+
+void ndpi_trace_record(struct ndpi_detection_module_struct *ndpi_struct,
+		       u_int16_t protocol_id, u_int16_t event_id,
+		       u_int32_t arg0, u_int32_t arg1, u_int32_t arg2, u_int32_t arg3) {
+  ndpi_trace_ring_t *ring = ndpi_struct->trace_ring;
+  ndpi_trace_event_t *e = &ring->events[ring->head & ring->mask];
+
+  e->timestamp = ndpi_struct->current_ts;
+  e->event_id = event_id, e->protocol_id = protocol_id;
+  e->args[0] = arg0, e->args[1] = arg1, e->args[2] = arg2, e->args[3] = arg3;
+  ring->head++;
+}
+
+/* ******************************************************************** */
+
+/* 4 payload bytes as a big endian word, bytes past the payload read as 0 */
+u_int32_t ndpi_trace_payload_word(const u_int8_t *payload, u_int32_t payload_len, u_int32_t offset) {
+  u_int32_t word = 0, i;
+
+  for(i = 0; i < 4; i++)
+    word = (word << 8) | (((payload != NULL) && (offset + i < payload_len)) ? payload[offset + i] : 0);
+
+  return(word);
+}
+
+/* ******************************************************************** */
+
+int ndpi_trace_enable(struct ndpi_detection_module_struct *ndpi_struct, u_int32_t num_events) {
+  ndpi_trace_ring_t *ring;
+  u_int32_t len = NDPI_TRACE_MIN_EVENTS;
+
+  while((len < num_events) && (len < 0x80000000))
+    len <<= 1;
+
+  if((ring = (ndpi_trace_ring_t*)ndpi_calloc_tag(1, sizeof(ndpi_trace_ring_t), NDPI_MEM_OTHER)) == NULL)
+    return(-1);
+
+  if((ring->events = (ndpi_trace_event_t*)ndpi_calloc_tag(len, sizeof(ndpi_trace_event_t), NDPI_MEM_OTHER)) == NULL) {
+    ndpi_free_tag(ring);
+    return(-1);
+  }
+
+  ring->mask = len - 1;
+  NDPI_BITMASK_SET_ALL(ring->protocols);
+
+  ndpi_trace_disable(ndpi_struct);
+  ndpi_struct->trace_ring = ring;
+
+  return(0);
+}
+
+/* ******************************************************************** */
+
+int ndpi_trace_set_protocols(struct ndpi_detection_module_struct *ndpi_struct,
+			     NDPI_PROTOCOL_BITMASK *protocols) {
+  if(ndpi_struct->trace_ring == NULL)
+    return(-1);
+
+  memcpy(&ndpi_struct->trace_ring->protocols, protocols, sizeof(NDPI_PROTOCOL_BITMASK));
+  return(0);
+}
+
+/* ******************************************************************** */
+
+void ndpi_trace_disable(struct ndpi_detection_module_struct *ndpi_struct) {
+  ndpi_trace_ring_t *ring = ndpi_struct->trace_ring;
+
+  if(ring == NULL)
+    return;
+
+  ndpi_struct->trace_ring = NULL;
+  ndpi_free_tag(ring->events);
+  ndpi_free_tag(ring);
+}
+
+/* ******************************************************************** */
+
+const char* ndpi_trace_event_name(u_int16_t event_id) {
+  return((event_id < NDPI_TRACE_NUM_EVENTS) ? ndpi_trace_event_names[event_id] : "UNKNOWN");
+}
+
+/* ******************************************************************** */
+
+#ifndef __KERNEL__
+
+int ndpi_trace_dump(struct ndpi_detection_module_struct *ndpi_struct, const char *path) {
+  ndpi_trace_ring_t *ring = ndpi_struct->trace_ring;
+  ndpi_trace_file_header_t header;
+  char name[NDPI_TRACE_PROTO_NAME_LEN];
+  u_int64_t first, i;
+  FILE *fd;
+  int rc = 0;
+
+  if(ring == NULL)
+    return(-1);
+
+  if((fd = fopen(path, "wb")) == NULL) {
+    printf("[NDPI] %s(): unable to create %s\n", __FUNCTION__, path);
+    return(-2);
+  }
+
+  first = (ring->head > ring->mask) ? (ring->head - ring->mask - 1) : 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = NDPI_TRACE_FILE_MAGIC, header.version = NDPI_TRACE_FILE_VERSION;
+  header.event_len = sizeof(ndpi_trace_event_t), header.num_events = (u_int32_t)(ring->head - first);
+  header.num_protocols = ndpi_get_num_supported_protocols(ndpi_struct);
+  header.proto_name_len = NDPI_TRACE_PROTO_NAME_LEN, header.num_recorded = ring->head;
+
+  if(fwrite(&header, sizeof(header), 1, fd) != 1)
+    rc = -3;
+
+  for(i = 0; (rc == 0) && (i < header.num_protocols); i++) {
+    char *proto_name = ndpi_get_proto_name(ndpi_struct, (u_int16_t)i);
+
+    memset(name, 0, sizeof(name));
+    if(proto_name != NULL)
+      strncpy(name, proto_name, sizeof(name) - 1);
+
+    if(fwrite(name, sizeof(name), 1, fd) != 1)
+      rc = -3;
+  }
+
+  /* the ring wraps: two contiguous chunks at most */
+  for(i = first; (rc == 0) && (i < ring->head); ) {
+    u_int64_t idx = i & ring->mask, n = ring->mask + 1 - idx;
+
+    if(n > ring->head - i) n = ring->head - i;
+
+    if(fwrite(&ring->events[idx], sizeof(ndpi_trace_event_t), n, fd) != n)
+      rc = -3;
+
+    i += n;
+  }
+
+  if(fclose(fd) != 0)
+    rc = -3;
+
+  if(rc != 0)
+    printf("[NDPI] %s(): error while writing %s\n", __FUNCTION__, path);
+
+  return(rc);
+}
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * ndpi_tunnel.c
+ *
+ * Copyright (C) 2011-14 - ntop.org
+ *
+ * This file is part of nDPI, an open source deep packet inspection
+ * library based on the OpenDPI and PACE technology by ipoque GmbH
+ *
+ * nDPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nDPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with nDPI.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  Tunnel decapsulation.
+
+  ndpi_decap_packet() is a loop over a "next header type", which is an
+  ethertype (0 meaning: look at the IP version). Every step checks the
+  header against the bytes left, records the layer and moves the data
+  pointer past it; nothing is copied. IP headers that do not carry a
+  known tunnel end the walk. When a tunnel carries something other than
+  IP (e.g. PPP in GRE), the last IP header crossed is the result.
+*/
+
+#include "ndpi_api.h"
+
+#define NDPI_ETHERTYPE_IPV4       0x0800
+#define NDPI_ETHERTYPE_IPV6       0x86DD
+#define NDPI_ETHERTYPE_VLAN       0x8100
+#define NDPI_ETHERTYPE_QINQ       0x88A8
+#define NDPI_ETHERTYPE_QINQ_OLD   0x9100
+#define NDPI_ETHERTYPE_MPLS       0x8847
+#define NDPI_ETHERTYPE_MPLS_MC    0x8848
+#define NDPI_ETHERTYPE_PPPOE      0x8864
+#define NDPI_ETHERTYPE_TEB        0x6558 /* Transparent Ethernet Bridging */
+
+#define NDPI_DECAP_NOT_A_TUNNEL   0
+#define NDPI_DECAP_TUNNEL         1
+#define NDPI_DECAP_ERROR         -1
+
+/* ****************************************************** */
+
+static void ndpi_tunnel_push(ndpi_tunnel_info_t *info, ndpi_tunnel_type_t type) {
+  if(info->num_layers < NDPI_MAX_TUNNEL_LAYERS)
+    info->layers[info->num_layers++] = type;
+}
+
+/* ****************************************************** */
+
+/*
+  Looks for a tunnel in the payload of an IP packet. On NDPI_DECAP_TUNNEL
+  *next_type and *next_offset tell what follows and where.
+*/
+static int ndpi_decap_l4(u_int8_t l4_proto, const u_int8_t *l4, u_int32_t l4_len,
+			 ndpi_tunnel_info_t *info,
+			 u_int16_t *next_type, u_int32_t *next_offset) {
+  switch(l4_proto) {
+  case 4: /* IPv4 in IP */
+    ndpi_tunnel_push(info, ndpi_ip_in_ip_tunnel);
+    *next_type = NDPI_ETHERTYPE_IPV4, *next_offset = 0;
+    return(NDPI_DECAP_TUNNEL);
+
+  case 41: /* IPv6 in IP */
+    ndpi_tunnel_push(info, ndpi_ip_in_ip_tunnel);
+    *next_type = NDPI_ETHERTYPE_IPV6, *next_offset = 0;
+    return(NDPI_DECAP_TUNNEL);
+
+  case 47: /* GRE */
+    {
+      u_int16_t flags;
+      u_int32_t hlen = 4;
+
+      if(l4_len < 4) return(NDPI_DECAP_ERROR);
+
+      flags = ntohs(get_u_int16_t(l4, 0));
+
+      if((flags & 0x0007) != 0) /* version 1 (PPTP) carries PPP */
+	return(NDPI_DECAP_NOT_A_TUNNEL);
+
+      if(flags & 0x8000) hlen += 4; /* checksum + reserved */
+
+      if(flags & 0x2000) { /* key */
+	if(l4_len < hlen + 4) return(NDPI_DECAP_ERROR);
+	info->gre_key = ntohl(get_u_int32_t(l4, hlen)), info->has_gre_key = 1;
+	hlen += 4;
+      }
+
+      if(flags & 0x1000) hlen += 4; /* sequence number */
+
+      if(hlen > l4_len) return(NDPI_DECAP_ERROR);
+
+      ndpi_tunnel_push(info, ndpi_gre_tunnel);
+      *next_type = ntohs(get_u_int16_t(l4, 2)), *next_offset = hlen;
+      return(NDPI_DECAP_TUNNEL);
+    }
+
+  case 17: /* UDP */
+    {
+      const u_int8_t *payload = &l4[8];
+      u_int32_t payload_len;
+      u_int16_t sport, dport;
+
+      if(l4_len < 8) return(NDPI_DECAP_ERROR);
+
+      payload_len = l4_len - 8;
+      sport = ntohs(get_u_int16_t(l4, 0)), dport = ntohs(get_u_int16_t(l4, 2));
+
+      if(((sport == NDPI_GTP_U_PORT) || (dport == NDPI_GTP_U_PORT))
+	 && (payload_len >= 8)
+	 && ((payload[0] >> 5) == 1 /* GTPv1 */)
+	 && (payload[0] & 0x10 /* GTP, not GTP' */)
+	 && (payload[1] == 0xFF /* G-PDU */)) {
+	u_int32_t hlen = 8;
+
+	if(payload[0] & 0x07) { /* E, S or PN: the optional fields are all present */
+	  u_int8_t next_ext;
+
+	  if(payload_len < 12) return(NDPI_DECAP_ERROR);
+
+	  next_ext = payload[11], hlen = 12;
+
+	  while((payload[0] & 0x04) && (next_ext != 0)) {
+	    u_int32_t ext_len;
+
+	    if(hlen >= payload_len) return(NDPI_DECAP_ERROR);
+
+	    ext_len = payload[hlen] * 4;
+	    if((ext_len == 0) || (hlen + ext_len > payload_len)) return(NDPI_DECAP_ERROR);
+
+	    next_ext = payload[hlen + ext_len - 1], hlen += ext_len;
+	  }
+	}
+
+	if(hlen >= payload_len) /* no user data (e.g. echo) */
+	  return(NDPI_DECAP_NOT_A_TUNNEL);
+
+	info->gtp_teid = ntohl(get_u_int32_t(payload, 4)), info->has_gtp_teid = 1;
+	ndpi_tunnel_push(info, ndpi_gtp_tunnel);
+	*next_type = 0 /* IPv4 or IPv6 */, *next_offset = 8 + hlen;
+	return(NDPI_DECAP_TUNNEL);
+      }
+
+      if((dport == NDPI_VXLAN_PORT)
+	 && (payload_len >= 8)
+	 && (payload[0] & 0x08 /* valid VNI */)) {
+	info->vxlan_vni = (payload[4] << 16) + (payload[5] << 8) + payload[6], info->has_vxlan_vni = 1;
+	ndpi_tunnel_push(info, ndpi_vxlan_tunnel);
+	*next_type = NDPI_ETHERTYPE_TEB, *next_offset = 8 + 8;
+	return(NDPI_DECAP_TUNNEL);
+      }
+    }
+    break;
+  }
+
+  return(NDPI_DECAP_NOT_A_TUNNEL);
+}
+
+/* ****************************************************** */
+
+int ndpi_decap_packet(const u_int8_t *data, u_int16_t _len, u_int16_t ethertype,
+		      ndpi_tunnel_info_t *info, const u_int8_t **inner, u_int16_t *inner_len) {
+  ndpi_tunnel_info_t dummy_info;
+  const u_int8_t *last_ip = NULL;
+  u_int32_t len = _len, last_ip_len = 0, next_offset;
+  u_int8_t last_ip_layers = 0;
+  u_int16_t next_type;
+  int rc;
+
+  if(info == NULL) info = &dummy_info;
+  memset(info, 0, sizeof(ndpi_tunnel_info_t));
+
+  /* every step below consumes at least one byte or returns */
+  while(1) {
+    switch(ethertype) {
+    case 0:
+      if(len < 1) return(-1);
+
+      if((data[0] >> 4) == 4)
+	ethertype = NDPI_ETHERTYPE_IPV4;
+      else if((data[0] >> 4) == 6)
+	ethertype = NDPI_ETHERTYPE_IPV6;
+      else
+	goto not_ip;
+      break;
+
+    case NDPI_ETHERTYPE_IPV4:
+      {
+	u_int32_t ihl, tot_len;
+
+	if((len < 20) || ((data[0] >> 4) != 4)) return(-1);
+
+	ihl = (data[0] & 0x0F) * 4, tot_len = ntohs(get_u_int16_t(data, 2));
+	if((ihl < 20) || (ihl > len) || (tot_len < ihl)) return(-1);
+
+	if(tot_len < len) len = tot_len; /* L2 padding */
+
+	last_ip = data, last_ip_len = len, last_ip_layers = info->num_layers;
+
+	/* fragments are left to the caller */
+	if(ntohs(get_u_int16_t(data, 6)) & 0x3FFF)
+	  goto innermost;
+
+	rc = ndpi_decap_l4(data[9], &data[ihl], len - ihl, info, &next_type, &next_offset);
+	if(rc == NDPI_DECAP_ERROR) return(-1);
+	if(rc == NDPI_DECAP_NOT_A_TUNNEL) goto innermost;
+
+	next_offset += ihl;
+      }
+      goto next_header;
+
+    case NDPI_ETHERTYPE_IPV6:
+      {
+	u_int32_t hlen = 40, tot_len;
+	u_int8_t nxt;
+
+	if((len < 40) || ((data[0] >> 4) != 6)) return(-1);
+
+	tot_len = 40 + ntohs(get_u_int16_t(data, 4));
+	if(tot_len < len) len = tot_len; /* L2 padding */
+
+	last_ip = data, last_ip_len = len, last_ip_layers = info->num_layers;
+
+	/* hop-by-hop, routing and destination options */
+	for(nxt = data[6]; (nxt == 0) || (nxt == 43) || (nxt == 60); ) {
+	  if(hlen + 8 > len) return(-1);
+
+	  nxt = data[hlen], hlen += (data[hlen + 1] + 1) * 8;
+	}
+
+	if(hlen > len) return(-1);
+
+	if(nxt == 44 /* fragment */)
+	  goto innermost;
+
+	rc = ndpi_decap_l4(nxt, &data[hlen], len - hlen, info, &next_type, &next_offset);
+	if(rc == NDPI_DECAP_ERROR) return(-1);
+	if(rc == NDPI_DECAP_NOT_A_TUNNEL) goto innermost;
+
+	next_offset += hlen;
+      }
+      goto next_header;
+
+    case NDPI_ETHERTYPE_TEB:
+      if(len < 14) return(-1);
+
+      next_type = ntohs(get_u_int16_t(data, 12)), next_offset = 14;
+      goto next_header;
+
+    case NDPI_ETHERTYPE_VLAN:
+    case NDPI_ETHERTYPE_QINQ:
+    case NDPI_ETHERTYPE_QINQ_OLD:
+      if(len < 4) return(-1);
+
+      info->vlan_id = ntohs(get_u_int16_t(data, 0)) & 0x0FFF, info->has_vlan_id = 1;
+      ndpi_tunnel_push(info, ndpi_vlan_tunnel);
+      next_type = ntohs(get_u_int16_t(data, 2)), next_offset = 4;
+      goto next_header;
+
+    case NDPI_ETHERTYPE_MPLS:
+    case NDPI_ETHERTYPE_MPLS_MC:
+      {
+	u_int32_t label;
+
+	next_offset = 0;
+
+	do {
+	  if(next_offset + 4 > len) return(-1);
+
+	  label = ntohl(get_u_int32_t(data, next_offset));
+	  next_offset += 4;
+	} while((label & 0x100) == 0); /* bottom of stack */
+
+	info->mpls_label = label >> 12, info->has_mpls_label = 1;
+	ndpi_tunnel_push(info, ndpi_mpls_tunnel);
+
+	/* IP, or a pseudowire control word followed by Ethernet */
+	if((next_offset < len) && ((data[next_offset] >> 4) == 0))
+	  next_type = NDPI_ETHERTYPE_TEB, next_offset += 4;
+	else
+	  next_type = 0;
+      }
+      goto next_header;
+
+    case NDPI_ETHERTYPE_PPPOE:
+      {
+	u_int16_t ppp_proto;
+
+	if(len < 8) return(-1);
+
+	ppp_proto = ntohs(get_u_int16_t(data, 6));
+
+	if(ppp_proto == 0x0021)
+	  next_type = NDPI_ETHERTYPE_IPV4;
+	else if(ppp_proto == 0x0057)
+	  next_type = NDPI_ETHERTYPE_IPV6;
+	else
+	  goto not_ip;
+
+	ndpi_tunnel_push(info, ndpi_pppoe_tunnel);
+	next_offset = 8;
+      }
+      goto next_header;
+
+    default:
+      goto not_ip;
+    }
+
+    continue;
+
+  next_header:
+    if(next_offset > len) return(-1);
+
+    data += next_offset, len -= next_offset, ethertype = next_type;
+  }
+
+ not_ip:
+  /* the tunnel does not carry IP: stop at the last IP header crossed */
+  if(last_ip == NULL) return(-1);
+
+  data = last_ip, len = last_ip_len, info->num_layers = last_ip_layers;
+
+ innermost:
+  *inner = data, *inner_len = (u_int16_t)len;
+  return(0);
+}
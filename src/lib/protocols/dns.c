@@ -26,75 +26,140 @@
 
 #ifdef NDPI_PROTOCOL_DNS
 
-static u_int getNameLength(u_int i, const u_int8_t *payload, u_int payloadLen) {
-  if(payload[i] == 0x00)
-    return(1);
-  else if(payload[i] == 0xC0)
-    return(2);
-  else {
-    u_int8_t len = payload[i];
-    u_int8_t off = len + 1;
-
-    if(off == 0) /* Bad packet */
-      return(0);
-    else
-      return(off + getNameLength(i+off, payload, payloadLen));
-  }	
+struct dns_packet_header {
+  u_int16_t transaction_id, flags, num_queries, answer_rrs, authority_rrs, additional_rrs;
+} __attribute__((packed));
+
+/* *********************************************** */
+
+static inline u_int16_t dns_get16(const u_int8_t *msg, u_int off) {
+  return((u_int16_t)((msg[off] << 8) | msg[off+1]));
+}
+
+static inline u_int32_t dns_get32(const u_int8_t *msg, u_int off) {
+  return(((u_int32_t)msg[off] << 24) | ((u_int32_t)msg[off+1] << 16) | ((u_int32_t)msg[off+2] << 8) | msg[off+3]);
 }
 
 /* *********************************************** */
 
-static char* ndpi_intoa_v4(unsigned int addr, char* buf, u_short bufLen) {
-  char *cp, *retStr;
-  uint byte;
-  int n;
-
-  cp = &buf[bufLen];
-  *--cp = '\0';
-
-  n = 4;
-  do {
-    byte = addr & 0xff;
-    *--cp = byte % 10 + '0';
-    byte /= 10;
-    if(byte > 0) {
-      *--cp = byte % 10 + '0';
-      byte /= 10;
-      if(byte > 0)
-	*--cp = byte + '0';
-    }
-    *--cp = '.';
-    addr >>= 8;
-  } while (--n > 0);
+/*
+  Walks the name stored at *off, following compression pointers. Each
+  pointer must go further back than the previous one and at most
+  NDPI_DNS_MAX_NAME_STEPS labels/pointers are read, so a name costs a
+  bounded amount of work whatever the message contains.
+
+  When name is not NULL the labels are copied into it, lowercased and
+  separated by dots (truncated to name_size-1 bytes, NUL terminated).
+  Returns the copied length and moves *off past the name, or -1 if the
+  name is truncated or malformed.
+*/
+static int ndpi_dns_parse_name(const u_int8_t *msg, u_int msg_len, u_int *off,
+			       char *name, u_int name_size) {
+  u_int pos = *off, end = 0, jump_limit = 0, name_len = 0, steps, i;
+
+  for(steps = 0; (steps < NDPI_DNS_MAX_NAME_STEPS) && (pos < msg_len); steps++) {
+    u_int8_t len = msg[pos];
+
+    if(len == 0) {
+      if(name != NULL) name[name_len] = '\0';
+      *off = (end != 0) ? end : (pos + 1);
+      return(name_len);
+    } else if((len & 0xC0) == 0xC0) {
+      u_int ptr;
+
+      if(pos + 1 >= msg_len)
+	break;
+
+      ptr = ((len & 0x3F) << 8) | msg[pos+1];
+
+      if(end == 0)
+	end = pos + 2, jump_limit = pos;
+
+      if(ptr >= jump_limit)
+	break; /* forward pointer or loop */
+
+      pos = jump_limit = ptr;
+    } else if(((len & 0xC0) != 0) || (pos + 1 + len > msg_len)) {
+      break;
+    } else {
+      if(name != NULL) {
+	if((name_len > 0) && (name_len < name_size - 1))
+	  name[name_len++] = '.';
 
-  /* Convert the string to lowercase */
-  retStr = (char*)(cp+1);
+	for(i = 1; (i <= len) && (name_len < name_size - 1); i++)
+	  name[name_len++] = tolower(msg[pos+i]);
+      }
 
-  return(retStr);
+      pos += 1 + len;
+    }
+  }
+
+  if(name != NULL) name[0] = '\0';
+  return(-1);
 }
 
 /* *********************************************** */
 
-static u_int16_t get16(int *i, const u_int8_t *payload) {
-  u_int16_t v = *(u_int16_t*)&payload[*i];
+/* Stores the data of an answer in protos.dns.rdata and appends its record */
+static void ndpi_dns_keep_record(struct ndpi_flow_struct *flow, u_int16_t rsp_type, u_int32_t ttl,
+				 const void *data, u_int data_len) {
+  ndpi_dns_record_t *r;
 
-  (*i) += 2;
+  if((flow->protos.dns.num_records == NDPI_DNS_MAX_RECORDS)
+     || (flow->protos.dns.rdata_len + data_len > NDPI_DNS_RDATA_LEN))
+    return;
 
-  return(ntohs(v));
+  r = &flow->protos.dns.records[flow->protos.dns.num_records++];
+  r->ttl = ttl, r->rsp_type = rsp_type;
+  r->data_offset = flow->protos.dns.rdata_len, r->data_len = data_len;
+  memcpy(&flow->protos.dns.rdata[r->data_offset], data, data_len);
+  flow->protos.dns.rdata_len += data_len;
 }
 
 /* *********************************************** */
 
-struct dns_packet_header {
-  u_int16_t transaction_id, flags, num_queries, answer_rrs, authority_rrs, additional_rrs;
-} __attribute__((packed));
+/*
+  Keeps an A, AAAA or (first) CNAME answer and learns the address of the
+  query name. At most NDPI_DNS_MAX_ADDRESSES addresses are kept, as many
+  as the data of a response to an A query (with a CNAME) needs.
+*/
+static void ndpi_dns_add_record(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				const u_int8_t *msg, u_int msg_len, u_int off, u_int16_t rsp_type,
+				u_int32_t ttl, u_int16_t data_len, int name_len,
+				u_int8_t *num_addresses, u_int8_t *cname_seen) {
+  if(((rsp_type == NDPI_DNS_TYPE_A) && (data_len == 4))
+     || ((rsp_type == NDPI_DNS_TYPE_AAAA) && (data_len == 16))) {
+    u_int32_t addr[4] = { 0 };
+
+    memcpy(addr, &msg[off], data_len);
+
+    /* Flows towards the answered addresses will be matched with the query name */
+    if((flow->protos.dns.ret_code == 0) && (name_len > 0))
+      ndpi_dns_cache_add(ndpi_struct, addr, (rsp_type == NDPI_DNS_TYPE_AAAA) ? 1 : 0,
+			 (char*)flow->host_server_name, name_len, ttl, flow->packet.tick_timestamp);
+
+    if(*num_addresses < NDPI_DNS_MAX_ADDRESSES) {
+      (*num_addresses)++;
+      ndpi_dns_keep_record(flow, rsp_type, ttl, addr, data_len);
+    }
+  } else if((rsp_type == NDPI_DNS_TYPE_CNAME) && (!*cname_seen)) {
+    char target[NDPI_DNS_CNAME_MAX_LEN];
+    int len = ndpi_dns_parse_name(msg, msg_len, &off, target, sizeof(target));
+
+    *cname_seen = 1;
+
+    if(len > 0)
+      ndpi_dns_keep_record(flow, rsp_type, ttl, target, len + 1);
+  }
+}
+
+/* *********************************************** */
 
 void ndpi_search_dns(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
 {
   struct ndpi_packet_struct *packet = &flow->packet;
   u_int16_t dport = 0, sport = 0;
-  
-#define NDPI_MAX_DNS_REQUESTS			16
+  u_int msg_start = (packet->tcp != NULL) ? 2 /* TCP length prefix */ : 0;
 
   NDPI_LOG(NDPI_PROTOCOL_DNS, ndpi_struct, NDPI_LOG_DEBUG, "search DNS.\n");
   
@@ -107,188 +172,105 @@ void ndpi_search_dns(struct ndpi_detection_module_struct *ndpi_struct, struct nd
   }
 
   if(((dport == 53) || (sport == 53) || (dport == 5355))
-     && (packet->payload_packet_len > sizeof(struct dns_packet_header))) {
-    int i = packet->tcp ? 2 : 0;
-    struct dns_packet_header header, *dns = (struct dns_packet_header*)&packet->payload[i];
-    u_int8_t is_query, ret_code, is_dns = 0;
-    u_int32_t a_record[NDPI_MAX_DNS_REQUESTS] = { 0 }, query_offset, num_a_records = 0;
-
-    header.flags = ntohs(dns->flags);
-    header.transaction_id = ntohs(dns->transaction_id);
-    header.num_queries = ntohs(dns->num_queries);
-    header.answer_rrs = ntohs(dns->answer_rrs);
-    header.authority_rrs = ntohs(dns->authority_rrs);
-    header.additional_rrs = ntohs(dns->additional_rrs);
+     && (packet->payload_packet_len > msg_start + sizeof(struct dns_packet_header))) {
+    const u_int8_t *msg = &packet->payload[msg_start];
+    u_int msg_len = packet->payload_packet_len - msg_start;
+    u_int off = sizeof(struct dns_packet_header);
+    struct dns_packet_header header;
+    u_int8_t is_query, ret_code, is_dns = 0, num_addresses = 0, cname_seen = 0;
+    u_int16_t num;
+    int name_len = 0;
+
+    header.transaction_id = dns_get16(msg, 0);
+    header.flags = dns_get16(msg, 2);
+    header.num_queries = dns_get16(msg, 4);
+    header.answer_rrs = dns_get16(msg, 6);
+    header.authority_rrs = dns_get16(msg, 8);
+    header.additional_rrs = dns_get16(msg, 10);
     is_query = (header.flags & 0x8000) ? 0 : 1;
     ret_code = is_query ? 0 : (header.flags & 0x0F);
-    i += sizeof(struct dns_packet_header);
-    query_offset = i;
 
     if(is_query) {
       /* DNS Request */
       if((header.num_queries > 0) && (header.num_queries <= NDPI_MAX_DNS_REQUESTS)
 	 && (((header.flags & 0x2800) == 0x2800 /* Dynamic DNS Update */)
-	     || ((header.answer_rrs == 0) && (header.authority_rrs == 0)))) {
-	/* This is a good query */
+	     || ((header.answer_rrs == 0) && (header.authority_rrs == 0))))
 	is_dns = 1;
-
-	if(header.num_queries > 0) {
-	  while(i < packet->payload_packet_len) {
-	      if(packet->payload[i] == '\0') {
-		i++;
-		flow->protos.dns.query_type = get16(&i, packet->payload);
-		break;
-	      } else
-		i++;
-	    }
-	}
-      }
     } else {
-      /* DNS Reply */
-      if((header.num_queries <= NDPI_MAX_DNS_REQUESTS) /* Don't assume that num_queries must be zero */
+      /* DNS Reply: don't assume that num_queries must be zero */
+      if((header.num_queries <= NDPI_MAX_DNS_REQUESTS)
 	 && (((header.answer_rrs > 0) && (header.answer_rrs <= NDPI_MAX_DNS_REQUESTS))
 	     || ((header.authority_rrs > 0) && (header.authority_rrs <= NDPI_MAX_DNS_REQUESTS))
-	     || ((header.additional_rrs > 0) && (header.additional_rrs <= NDPI_MAX_DNS_REQUESTS)))
-	 ) {
-	/* This is a good reply */
-	is_dns = 1;
-
-	i++;
-	
-	if(packet->payload[i] != '\0') {
-	  while((i < packet->payload_packet_len)
-		&& (packet->payload[i] != '\0')) {
-	    i++;
-	  }
-	  
-	  i++;
-	}
-
-	i += 4;
-
-	if(header.answer_rrs > 0) {
-	  u_int16_t rsp_type, rsp_class;
-	  u_int16_t num;
-
-	  for(num = 0; num < header.answer_rrs; num++) {
-	    u_int16_t data_len;
-	
-	    if((i+6) >= packet->payload_packet_len) {
-	      break;
-	    }
-
-	    if((data_len = getNameLength(i, packet->payload, packet->payload_packet_len)) == 0) {
-	      break;
-	    } else
-	      i += data_len;
-	
-	    rsp_type = get16(&i, packet->payload);
-	    rsp_class = get16(&i, packet->payload);
-
-	    i += 4;
-	    data_len = get16(&i, packet->payload);
-
-	    if((data_len <= 1) || (data_len > (packet->payload_packet_len-i))) {
-	      break;
-	    }
-
-	    flow->protos.dns.rsp_type = rsp_type;
-
-	    if(rsp_type == 1 /* A */) {
-	      if(data_len == 4) {
-		u_int32_t v = ntohl(*((u_int32_t*)&packet->payload[i]));
-
-		if(num_a_records < (NDPI_MAX_DNS_REQUESTS-1))
-		  a_record[num_a_records++] = v;
-		else
-		  break; /* One record is enough */
-	      }
-	    }
-	
-	    if(data_len == 0) {
-	      break;
-	    }
-
-	    i += data_len;
-	  } /* for */
-	}
-      }
-
-      if((header.num_queries <= NDPI_MAX_DNS_REQUESTS)
-	 && ((header.answer_rrs == 0)
-	     || (header.authority_rrs == 0)
-	     || (header.additional_rrs == 0))
-	 && (ret_code != 0 /* 0 == OK */)
-	 ) {
-	/* This is a good reply */
+	     || ((header.additional_rrs > 0) && (header.additional_rrs <= NDPI_MAX_DNS_REQUESTS))
+	     || (((header.answer_rrs == 0) || (header.authority_rrs == 0) || (header.additional_rrs == 0))
+		 && (ret_code != 0 /* 0 == OK */))))
 	is_dns = 1;
-      }
     }
 
-    if(is_dns) {
-      int j = 0;
+    if(!is_dns) {
+      flow->protos.dns.bad_packet = 1;
+      NDPI_LOG(NDPI_PROTOCOL_DNS, ndpi_struct, NDPI_LOG_DEBUG, "exclude DNS.\n");
+      NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_DNS);
+      return;
+    }
 
-      flow->protos.dns.num_queries = (u_int8_t)header.num_queries, 
-	flow->protos.dns.num_answers = (u_int8_t)(header.answer_rrs+header.authority_rrs+header.additional_rrs),
+    flow->protos.dns.num_queries = (u_int8_t)header.num_queries,
+      flow->protos.dns.num_answers = (u_int8_t)(header.answer_rrs+header.authority_rrs+header.additional_rrs),
       flow->protos.dns.ret_code = ret_code;
+    flow->protos.dns.num_records = 0, flow->protos.dns.rdata_len = 0;
 
-      i = query_offset+1;
+    /* Questions: the first one names the flow */
+    for(num = 0; num < header.num_queries; num++) {
+      int len = ndpi_dns_parse_name(msg, msg_len, &off,
+				    (num == 0) ? (char*)flow->host_server_name : NULL,
+				    sizeof(flow->host_server_name));
 
-      while((i < packet->payload_packet_len)
-	    && (j < (sizeof(flow->host_server_name)-1))	  
-	    && (packet->payload[i] != '\0')) {
-	flow->host_server_name[j] = tolower(packet->payload[i]);
-	if(flow->host_server_name[j] < ' ')
-	  flow->host_server_name[j] = '.';	
-	j++, i++;
-      }
+      if((len < 0) || (off + 4 > msg_len))
+	break;
 
-      if(a_record != 0) {
-	char a_buf[32];
-	int i;
-
-	for(i=0; i<num_a_records; i++) {
-	  j += snprintf((char*)&flow->host_server_name[j], sizeof(flow->host_server_name)-1-j, "%s%s",
-			(i == 0) ? "@" : ";",
-			ndpi_intoa_v4(a_record[i], a_buf, sizeof(a_buf)));
-	}
+      if(num == 0) {
+	name_len = len;
+	flow->protos.dns.query_type = dns_get16(msg, off);
+	flow->protos.dns.query_class = dns_get16(msg, off+2);
       }
-		      
-      flow->host_server_name[j] = '\0';
-
-      if(j > 0) {
-#ifdef DEBUG
-	printf("==> %s\n", flow->host_server_name);
-#endif
 
-	if(ndpi_struct->match_dns_host_names)
-	  ndpi_match_string_subprotocol(ndpi_struct, flow, (char *)flow->host_server_name, strlen((const char*)flow->host_server_name));
-      }
+      off += 4;
+    }
 
-      i++;
+    /* Answers: a single pass, as many as the header announces (bounded) */
+    if((!is_query) && (num == header.num_queries) && (header.answer_rrs <= NDPI_MAX_DNS_REQUESTS)) {
+      for(num = 0; num < header.answer_rrs; num++) {
+	u_int16_t rsp_type, data_len;
+	u_int32_t ttl;
 
-      memcpy(&flow->protos.dns.query_type, &packet->payload[i], 2); 
-      flow->protos.dns.query_type  = ntohs(flow->protos.dns.query_type), i += 2;
+	if((ndpi_dns_parse_name(msg, msg_len, &off, NULL, 0) < 0) || (off + 10 > msg_len))
+	  break;
 
-      memcpy(&flow->protos.dns.query_class, &packet->payload[i], 2); 
-      flow->protos.dns.query_class  = ntohs(flow->protos.dns.query_class), i += 2;
+	rsp_type = dns_get16(msg, off);
+	ttl = dns_get32(msg, off+4);
+	data_len = dns_get16(msg, off+8);
+	off += 10;
 
-#ifdef DEBUG
-      printf("%s [type=%04X][class=%04X]\n", flow->host_server_name, flow->protos.dns.query_type, flow->protos.dns.query_class);
-#endif
+	if(off + data_len > msg_len)
+	  break;
 
-      if(packet->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) {
-	/* 
-	   Do not set the protocol with DNS if ndpi_match_string_subprotocol() has
-	   matched a subprotocol
-	*/
-	NDPI_LOG(NDPI_PROTOCOL_DNS, ndpi_struct, NDPI_LOG_DEBUG, "found DNS.\n");      
-	ndpi_int_add_connection(ndpi_struct, flow, (dport == 5355) ? NDPI_PROTOCOL_LLMNR : NDPI_PROTOCOL_DNS, NDPI_REAL_PROTOCOL);
+	flow->protos.dns.rsp_type = rsp_type;
+	ndpi_dns_add_record(ndpi_struct, flow, msg, msg_len, off, rsp_type, ttl, data_len, name_len,
+			    &num_addresses, &cname_seen);
+	off += data_len;
       }
-    } else {
-      flow->protos.dns.bad_packet = 1;
-      NDPI_LOG(NDPI_PROTOCOL_DNS, ndpi_struct, NDPI_LOG_DEBUG, "exclude DNS.\n");
-      NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_DNS);
+    }
+
+    if((name_len > 0) && ndpi_struct->match_dns_host_names)
+      ndpi_match_string_subprotocol(ndpi_struct, flow, (char *)flow->host_server_name, name_len);
+
+    if(packet->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN) {
+      /* 
+	 Do not set the protocol with DNS if ndpi_match_string_subprotocol() has
+	 matched a subprotocol
+      */
+      NDPI_LOG(NDPI_PROTOCOL_DNS, ndpi_struct, NDPI_LOG_DEBUG, "found DNS.\n");      
+      ndpi_int_add_connection(ndpi_struct, flow, (dport == 5355) ? NDPI_PROTOCOL_LLMNR : NDPI_PROTOCOL_DNS, NDPI_REAL_PROTOCOL);
     }
   }
 }
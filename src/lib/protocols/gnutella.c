@@ -64,8 +64,10 @@ static void ndpi_int_gnutella_add_connection(struct ndpi_detection_module_struct
   }
 }
 
-void ndpi_search_gnutella(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+static void ndpi_search_gnutella_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state)
 {
+  struct ndpi_gnutella_flow_state *gnutella = (struct ndpi_gnutella_flow_state*)state;
   struct ndpi_packet_struct *packet = &flow->packet;
 	
   struct ndpi_id_struct *src = flow->src;
@@ -102,13 +104,15 @@ void ndpi_search_gnutella(struct ndpi_detection_module_struct *ndpi_struct, stru
   }
   if (packet->tcp != NULL) {
     /* this case works asymmetrically */
-    if (packet->payload_packet_len > 10 && memcmp(packet->payload, "GNUTELLA/", 9) == 0) {
+    if (packet->payload_packet_len > 10
+	&& ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_GNUTELLA, NDPI_PREFIX_RESPONSE)) {
       NDPI_LOG(NDPI_PROTOCOL_GNUTELLA, ndpi_struct, NDPI_LOG_TRACE, "GNUTELLA DETECTED\n");
       ndpi_int_gnutella_add_connection(ndpi_struct, flow, NDPI_REAL_PROTOCOL);
       return;
     }
     /* this case works asymmetrically */
-    if (packet->payload_packet_len > 17 && memcmp(packet->payload, "GNUTELLA CONNECT/", 17) == 0) {
+    if (packet->payload_packet_len > 17
+	&& ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_GNUTELLA, NDPI_PREFIX_REQUEST)) {
       NDPI_LOG(NDPI_PROTOCOL_GNUTELLA, ndpi_struct, NDPI_LOG_TRACE, "GNUTELLA DETECTED\n");
       ndpi_int_gnutella_add_connection(ndpi_struct, flow, NDPI_REAL_PROTOCOL);
       return;
@@ -335,32 +339,32 @@ void ndpi_search_gnutella(struct ndpi_detection_module_struct *ndpi_struct, stru
 
   /* haven't found any trace with this pattern */
   if (packet->tcp != NULL && ntohs(packet->tcp->source) >= 1024 && ntohs(packet->tcp->dest) >= 1024) {
-    if (flow->l4.tcp.gnutella_stage == 0) {
+    if (gnutella->gnutella_stage == 0) {
       if (flow->packet_counter == 1
 	  && (packet->payload_packet_len == 11
 	      || packet->payload_packet_len == 33 || packet->payload_packet_len == 37)) {
-	flow->l4.tcp.gnutella_msg_id[0] = packet->payload[4];
-	flow->l4.tcp.gnutella_msg_id[1] = packet->payload[6];
-	flow->l4.tcp.gnutella_msg_id[2] = packet->payload[8];
-	flow->l4.tcp.gnutella_stage = 1 + packet->packet_direction;
+	gnutella->gnutella_msg_id[0] = packet->payload[4];
+	gnutella->gnutella_msg_id[1] = packet->payload[6];
+	gnutella->gnutella_msg_id[2] = packet->payload[8];
+	gnutella->gnutella_stage = 1 + packet->packet_direction;
 	return;
       }
-    } else if (flow->l4.tcp.gnutella_stage == 1 + packet->packet_direction) {
+    } else if (gnutella->gnutella_stage == 1 + packet->packet_direction) {
       if (flow->packet_counter == 2 && (packet->payload_packet_len == 33 || packet->payload_packet_len == 22)
-	  && flow->l4.tcp.gnutella_msg_id[0] == packet->payload[0]
-	  && flow->l4.tcp.gnutella_msg_id[1] == packet->payload[2]
-	  && flow->l4.tcp.gnutella_msg_id[2] == packet->payload[4]
+	  && gnutella->gnutella_msg_id[0] == packet->payload[0]
+	  && gnutella->gnutella_msg_id[1] == packet->payload[2]
+	  && gnutella->gnutella_msg_id[2] == packet->payload[4]
 	  && NDPI_SRC_OR_DST_HAS_PROTOCOL(src, dst, NDPI_PROTOCOL_GNUTELLA)) {
 	NDPI_LOG(NDPI_PROTOCOL_GNUTELLA, ndpi_struct,
 			  NDPI_LOG_TRACE, "GNUTELLA DETECTED due to message ID match (NEONet protocol)\n");
 	ndpi_int_gnutella_add_connection(ndpi_struct, flow, NDPI_REAL_PROTOCOL);
 	return;
       }
-    } else if (flow->l4.tcp.gnutella_stage == 2 - packet->packet_direction) {
+    } else if (gnutella->gnutella_stage == 2 - packet->packet_direction) {
       if (flow->packet_counter == 2 && (packet->payload_packet_len == 10 || packet->payload_packet_len == 75)
-	  && flow->l4.tcp.gnutella_msg_id[0] == packet->payload[0]
-	  && flow->l4.tcp.gnutella_msg_id[1] == packet->payload[2]
-	  && flow->l4.tcp.gnutella_msg_id[2] == packet->payload[4]
+	  && gnutella->gnutella_msg_id[0] == packet->payload[0]
+	  && gnutella->gnutella_msg_id[1] == packet->payload[2]
+	  && gnutella->gnutella_msg_id[2] == packet->payload[4]
 	  && NDPI_SRC_OR_DST_HAS_PROTOCOL(src, dst, NDPI_PROTOCOL_GNUTELLA)) {
 	NDPI_LOG(NDPI_PROTOCOL_GNUTELLA, ndpi_struct,
 			  NDPI_LOG_TRACE, "GNUTELLA DETECTED due to message ID match (NEONet protocol)\n");
@@ -372,4 +376,10 @@ void ndpi_search_gnutella(struct ndpi_detection_module_struct *ndpi_struct, stru
 
   NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_GNUTELLA);
 }
+
+void ndpi_search_gnutella(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+{
+  ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_GNUTELLA,
+			   sizeof(struct ndpi_gnutella_flow_state), ndpi_search_gnutella_state);
+}
 #endif
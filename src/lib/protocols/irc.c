@@ -44,7 +44,7 @@ static inline
 #else
 __forceinline static
 #endif
-u_int8_t ndpi_is_duplicate(struct ndpi_id_struct *id_t, u_int16_t port)
+u_int8_t ndpi_is_duplicate(struct ndpi_irc_id_state *id_t, u_int16_t port)
 {
   int index = 0;
   while (index < id_t->irc_number_of_port) {
@@ -141,7 +141,8 @@ static u_int8_t ndpi_check_for_IRC_traces(const u_int8_t * ptr, u_int16_t len)
 }
 
 
-u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+static u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_irc_flow_state *irc)
 {
 
   struct ndpi_packet_struct *packet = &flow->packet;
@@ -152,26 +153,26 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
 
   /* case 1: len 1460, len 1460, len 1176 several times in one direction, than len = 4, 4096, 8192 in the other direction */
   if (packet->payload_packet_len == 1460
-      && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0) || (flow->l4.tcp.irc_stage2 == 3
-										&& flow->l4.tcp.irc_direction ==
+      && ((irc->irc_stage2 == 0 && irc->irc_direction == 0) || (irc->irc_stage2 == 3
+										&& irc->irc_direction ==
 										1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 1;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+    irc->irc_stage2 = 1;
+    irc->irc_direction = 1 + packet->packet_direction;
     return 1;
   }
-  if (packet->payload_packet_len == 1460 && flow->l4.tcp.irc_stage2 == 1
-      && flow->l4.tcp.irc_direction == 1 + packet->packet_direction) {
-    flow->l4.tcp.irc_stage2 = 2;
+  if (packet->payload_packet_len == 1460 && irc->irc_stage2 == 1
+      && irc->irc_direction == 1 + packet->packet_direction) {
+    irc->irc_stage2 = 2;
     return 1;
   }
-  if (packet->payload_packet_len == 1176 && flow->l4.tcp.irc_stage2 == 2
-      && flow->l4.tcp.irc_direction == 1 + packet->packet_direction) {
-    flow->l4.tcp.irc_stage2 = 3;
-    flow->l4.tcp.irc_0x1000_full = 1;
+  if (packet->payload_packet_len == 1176 && irc->irc_stage2 == 2
+      && irc->irc_direction == 1 + packet->packet_direction) {
+    irc->irc_stage2 = 3;
+    irc->irc_0x1000_full = 1;
     return 1;
   }
-  if (packet->payload_packet_len == 4 && (flow->l4.tcp.irc_stage2 == 3 || flow->l4.tcp.irc_0x1000_full == 1)
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 0x1000
+  if (packet->payload_packet_len == 4 && (irc->irc_stage2 == 3 || irc->irc_0x1000_full == 1)
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 0x1000
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									0x2000)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1460,1460,1176,<-4096||8192");
@@ -180,29 +181,29 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
   }
   /* case 2: len 1448, len 1448, len 1200 several times in one direction, than len = 4, 4096, 8192 in the other direction */
   if (packet->payload_packet_len == 1448
-      && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0) || (flow->l4.tcp.irc_stage2 == 6
-										&& flow->l4.tcp.irc_direction ==
+      && ((irc->irc_stage2 == 0 && irc->irc_direction == 0) || (irc->irc_stage2 == 6
+										&& irc->irc_direction ==
 										1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 4;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+    irc->irc_stage2 = 4;
+    irc->irc_direction = 1 + packet->packet_direction;
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG, "len = 1448 first\n");
     return 1;
   }
-  if (packet->payload_packet_len == 1448 && flow->l4.tcp.irc_stage2 == 4
-      && flow->l4.tcp.irc_direction == 1 + packet->packet_direction) {
-    flow->l4.tcp.irc_stage2 = 5;
+  if (packet->payload_packet_len == 1448 && irc->irc_stage2 == 4
+      && irc->irc_direction == 1 + packet->packet_direction) {
+    irc->irc_stage2 = 5;
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG, "len = 1448 second \n");
     return 1;
   }
-  if (packet->payload_packet_len == 1200 && flow->l4.tcp.irc_stage2 == 5
-      && flow->l4.tcp.irc_direction == 1 + packet->packet_direction) {
-    flow->l4.tcp.irc_stage2 = 6;
-    flow->l4.tcp.irc_0x1000_full = 1;
+  if (packet->payload_packet_len == 1200 && irc->irc_stage2 == 5
+      && irc->irc_direction == 1 + packet->packet_direction) {
+    irc->irc_stage2 = 6;
+    irc->irc_0x1000_full = 1;
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG, "len = 1200  \n");
     return 1;
   }
-  if (packet->payload_packet_len == 4 && (flow->l4.tcp.irc_stage2 == 6 || flow->l4.tcp.irc_0x1000_full == 1)
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 0x1000
+  if (packet->payload_packet_len == 4 && (irc->irc_stage2 == 6 || irc->irc_0x1000_full == 1)
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 0x1000
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									0x2000)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1448,1448,1200,<-4096||8192");
@@ -211,60 +212,60 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
   }
   /* case 3: several packets with len 1380, 1200, 1024, 1448, 1248,
    * than one packet in the other direction with the len or two times the len. */
-  if (packet->payload_packet_len == 1380 && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0)
-					     || (flow->l4.tcp.irc_stage2 == 7
-						 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 7;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+  if (packet->payload_packet_len == 1380 && ((irc->irc_stage2 == 0 && irc->irc_direction == 0)
+					     || (irc->irc_stage2 == 7
+						 && irc->irc_direction == 1 + packet->packet_direction))) {
+    irc->irc_stage2 = 7;
+    irc->irc_direction = 1 + packet->packet_direction;
     return 1;
   }
-  if (packet->payload_packet_len == 4 && flow->l4.tcp.irc_stage2 == 7
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1380
+  if (packet->payload_packet_len == 4 && irc->irc_stage2 == 7
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1380
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									2760)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1380,<-1380||2760");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
     return 1;
   }
-  if (packet->payload_packet_len == 1200 && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0)
-					     || (flow->l4.tcp.irc_stage2 == 8
-						 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 8;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+  if (packet->payload_packet_len == 1200 && ((irc->irc_stage2 == 0 && irc->irc_direction == 0)
+					     || (irc->irc_stage2 == 8
+						 && irc->irc_direction == 1 + packet->packet_direction))) {
+    irc->irc_stage2 = 8;
+    irc->irc_direction = 1 + packet->packet_direction;
     return 1;
   }
-  if (packet->payload_packet_len == 4 && flow->l4.tcp.irc_stage2 == 8
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1200
+  if (packet->payload_packet_len == 4 && irc->irc_stage2 == 8
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1200
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									2400)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1200,<-1200||2400");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
     return 1;
   }
-  if (packet->payload_packet_len == 1024 && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0)
-					     || (flow->l4.tcp.irc_stage2 == 9
-						 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 9;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+  if (packet->payload_packet_len == 1024 && ((irc->irc_stage2 == 0 && irc->irc_direction == 0)
+					     || (irc->irc_stage2 == 9
+						 && irc->irc_direction == 1 + packet->packet_direction))) {
+    irc->irc_stage2 = 9;
+    irc->irc_direction = 1 + packet->packet_direction;
     return 1;
   }
-  if (packet->payload_packet_len == 4 && (flow->l4.tcp.irc_stage2 == 9 || flow->l4.tcp.irc_stage2 == 15)
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1024
+  if (packet->payload_packet_len == 4 && (irc->irc_stage2 == 9 || irc->irc_stage2 == 15)
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1024
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									2048)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1024,<-1024||2048");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
     return 1;
   }
-  if (packet->payload_packet_len == 1248 && ((flow->l4.tcp.irc_stage2 == 0 && flow->l4.tcp.irc_direction == 0)
-					     || (flow->l4.tcp.irc_stage2 == 10
-						 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction))) {
-    flow->l4.tcp.irc_stage2 = 10;
-    flow->l4.tcp.irc_direction = 1 + packet->packet_direction;
+  if (packet->payload_packet_len == 1248 && ((irc->irc_stage2 == 0 && irc->irc_direction == 0)
+					     || (irc->irc_stage2 == 10
+						 && irc->irc_direction == 1 + packet->packet_direction))) {
+    irc->irc_stage2 = 10;
+    irc->irc_direction = 1 + packet->packet_direction;
     return 1;
   }
-  if (packet->payload_packet_len == 4 && flow->l4.tcp.irc_stage2 == 10
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1248
+  if (packet->payload_packet_len == 4 && irc->irc_stage2 == 10
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1248
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									2496)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1248,<-1248||2496");
@@ -272,14 +273,14 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
     return 1;
   }
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 5 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 11;
+      && (irc->irc_stage2 == 5 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 11;
     return 1;
   }
   if (packet->payload_packet_len == 4
-      && (flow->l4.tcp.irc_stage2 == 4 || flow->l4.tcp.irc_stage2 == 5 || flow->l4.tcp.irc_stage2 == 11
-	  || flow->l4.tcp.irc_stage2 == 13)
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1448
+      && (irc->irc_stage2 == 4 || irc->irc_stage2 == 5 || irc->irc_stage2 == 11
+	  || irc->irc_stage2 == 13)
+      && irc->irc_direction == 2 - packet->packet_direction && (ntohs(get_u_int16_t(packet->payload, 2)) == 1448
 									|| ntohs(get_u_int16_t(packet->payload, 2)) ==
 									2896)) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1448,<-1448||2896");
@@ -288,23 +289,23 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
   }
   /* case 4 : five packets with len = 1448, one with len 952, than one packet from other direction len = 8192 */
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 11 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 12;
+      && (irc->irc_stage2 == 11 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 12;
     return 1;
   }
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 12 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 13;
+      && (irc->irc_stage2 == 12 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 13;
     return 1;
   }
   if (packet->payload_packet_len == 952
-      && (flow->l4.tcp.irc_stage2 == 13 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 14;
+      && (irc->irc_stage2 == 13 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 14;
     return 1;
   }
   if (packet->payload_packet_len == 4
-      && flow->l4.tcp.irc_stage2 == 14
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 8192) {
+      && irc->irc_stage2 == 14
+      && irc->irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 8192) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 	     "IRC SSL detected: ->1448,1448,1448,1448,1448,952,<-8192");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
@@ -312,33 +313,33 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
   }
   /* case 5: len 1024, len 1448, len 1448, len 1200, len 1448, len 600 */
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 9 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 15;
+      && (irc->irc_stage2 == 9 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 15;
     return 1;
   }
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 15 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 16;
+      && (irc->irc_stage2 == 15 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 16;
     return 1;
   }
   if (packet->payload_packet_len == 1200
-      && (flow->l4.tcp.irc_stage2 == 16 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 17;
+      && (irc->irc_stage2 == 16 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 17;
     return 1;
   }
   if (packet->payload_packet_len == 1448
-      && (flow->l4.tcp.irc_stage2 == 17 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 18;
+      && (irc->irc_stage2 == 17 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 18;
     return 1;
   }
   if (packet->payload_packet_len == 600
-      && (flow->l4.tcp.irc_stage2 == 18 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 19;
+      && (irc->irc_stage2 == 18 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 19;
     return 1;
   }
   if (packet->payload_packet_len == 4
-      && flow->l4.tcp.irc_stage2 == 19
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 7168) {
+      && irc->irc_stage2 == 19
+      && irc->irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 7168) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 	     "IRC SSL detected: ->1024,1448,1448,1200,1448,600,<-7168");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
@@ -346,13 +347,13 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
   }
   /* -> 1024, 1380, -> 2404    */
   if (packet->payload_packet_len == 1380
-      && (flow->l4.tcp.irc_stage2 == 9 && flow->l4.tcp.irc_direction == 1 + packet->packet_direction)) {
-    flow->l4.tcp.irc_stage2 = 20;
+      && (irc->irc_stage2 == 9 && irc->irc_direction == 1 + packet->packet_direction)) {
+    irc->irc_stage2 = 20;
     return 1;
   }
   if (packet->payload_packet_len == 4
-      && flow->l4.tcp.irc_stage2 == 20
-      && flow->l4.tcp.irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 2404) {
+      && irc->irc_stage2 == 20
+      && irc->irc_direction == 2 - packet->packet_direction && ntohs(get_u_int16_t(packet->payload, 2)) == 2404) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "IRC SSL detected: ->1024,1380 <-2404");
     ndpi_int_irc_add_connection(ndpi_struct, flow);
     return 1;
@@ -362,12 +363,15 @@ u_int8_t ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(struct ndpi_dete
 }
 
 
-void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+static void ndpi_search_irc_tcp_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state)
 {
+  struct ndpi_irc_flow_state *irc = (struct ndpi_irc_flow_state*)state;
   struct ndpi_packet_struct *packet = &flow->packet;
 	
   struct ndpi_id_struct *src = flow->src;
   struct ndpi_id_struct *dst = flow->dst;
+  struct ndpi_irc_id_state *src_irc = NULL, *dst_irc = NULL;
   int less;
   u_int16_t c = 0;
   u_int16_t c1 = 0;
@@ -389,7 +393,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
     return;
   }
   if (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC && flow->packet_counter > 30 &&
-      flow->l4.tcp.irc_stage2 == 0) {
+      irc->irc_stage2 == 0) {
     NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG, "packet_counter > 30, exclude irc.\n");
     NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_IRC);
     return;
@@ -419,10 +423,10 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
       sport = packet->tcp->source;
       dport = packet->tcp->dest;
     }
-    if (dst != NULL) {
-      for (counter = 0; counter < dst->irc_number_of_port; counter++) {
-	if (dst->irc_port[counter] == sport || dst->irc_port[counter] == dport) {
-	  dst->last_time_port_used[counter] = packet->tick_timestamp;
+    if (dst != NULL && (dst_irc = ndpi_get_id_state(dst, NDPI_PROTOCOL_IRC)) != NULL) {
+      for (counter = 0; counter < dst_irc->irc_number_of_port; counter++) {
+	if (dst_irc->irc_port[counter] == sport || dst_irc->irc_port[counter] == dport) {
+	  dst_irc->last_time_port_used[counter] = packet->tick_timestamp;
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 		   "dest port matched with the DCC port and the flow is marked as IRC");
 	  ndpi_int_irc_add_connection(ndpi_struct, flow);
@@ -430,10 +434,10 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 	}
       }
     }
-    if (src != NULL) {
-      for (counter = 0; counter < src->irc_number_of_port; counter++) {
-	if (src->irc_port[counter] == sport || src->irc_port[counter] == dport) {
-	  src->last_time_port_used[counter] = packet->tick_timestamp;
+    if (src != NULL && (src_irc = ndpi_get_id_state(src, NDPI_PROTOCOL_IRC)) != NULL) {
+      for (counter = 0; counter < src_irc->irc_number_of_port; counter++) {
+	if (src_irc->irc_port[counter] == sport || src_irc->irc_port[counter] == dport) {
+	  src_irc->last_time_port_used[counter] = packet->tick_timestamp;
 	  ndpi_int_irc_add_connection(ndpi_struct, flow);
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 		   "Source port matched with the DCC port and the flow is marked as IRC");
@@ -475,7 +479,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
     }
   }
   if (flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC &&
-      ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(ndpi_struct, flow) != 0) {
+      ndpi_search_irc_ssl_detect_ninty_percent_but_very_fast(ndpi_struct, flow, irc) != 0) {
     return;
   }
 
@@ -496,48 +500,40 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 	} else if (packet->payload[packet->payload_packet_len - 2] == 0x0d) {
 	  ndpi_parse_packet_line_info(ndpi_struct, flow);
 	} else {
-	  flow->l4.tcp.irc_3a_counter++;
+	  irc->irc_3a_counter++;
 	}
 	for (i = 0; i < packet->parsed_lines; i++) {
 	  if (packet->line[i].ptr[0] == ':') {
-	    flow->l4.tcp.irc_3a_counter++;
-	    if (flow->l4.tcp.irc_3a_counter == 7) {	/* ':' == 0x3a */
+	    irc->irc_3a_counter++;
+	    if (irc->irc_3a_counter == 7) {	/* ':' == 0x3a */
 	      NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "0x3a. seven times. found irc.");
 	      ndpi_int_irc_add_connection(ndpi_struct, flow);
 	      goto detected_irc;
 	    }
 	  }
 	}
-	if (flow->l4.tcp.irc_3a_counter == 7) {	/* ':' == 0x3a */
+	if (irc->irc_3a_counter == 7) {	/* ':' == 0x3a */
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "0x3a. seven times. found irc.");
 	  ndpi_int_irc_add_connection(ndpi_struct, flow);
 	  goto detected_irc;
 	}
       }
-      if ((memcmp(packet->payload, "USER ", 5) == 0)
-	  || (memcmp(packet->payload, "NICK ", 5) == 0)
-	  || (memcmp(packet->payload, "PASS ", 5) == 0)
-	  || (memcmp(packet->payload, ":", 1) == 0 && ndpi_check_for_NOTICE_or_PRIVMSG(ndpi_struct, flow) != 0)
-	  || (memcmp(packet->payload, "PONG ", 5) == 0)
-	  || (memcmp(packet->payload, "PING ", 5) == 0)
-	  || (memcmp(packet->payload, "JOIN ", 5) == 0)
-	  || (memcmp(packet->payload, "NOTICE ", 7) == 0)
-	  || (memcmp(packet->payload, "PRIVMSG ", 8) == 0)
-	  || (memcmp(packet->payload, "VERSION ", 8) == 0)) {
+      if (ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_IRC, NDPI_PREFIX_REQUEST)
+	  || (memcmp(packet->payload, ":", 1) == 0 && ndpi_check_for_NOTICE_or_PRIVMSG(ndpi_struct, flow) != 0)) {
 	NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 		 "USER, NICK, PASS, NOTICE, PRIVMSG one time");
-	if (flow->l4.tcp.irc_stage == 2) {
+	if (irc->irc_stage == 2) {
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "found irc");
 	  ndpi_int_irc_add_connection(ndpi_struct, flow);
-	  flow->l4.tcp.irc_stage = 3;
+	  irc->irc_stage = 3;
 	}
-	if (flow->l4.tcp.irc_stage == 1) {
+	if (irc->irc_stage == 1) {
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "second time, stage=2");
-	  flow->l4.tcp.irc_stage = 2;
+	  irc->irc_stage = 2;
 	}
-	if (flow->l4.tcp.irc_stage == 0) {
+	if (irc->irc_stage == 0) {
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "first time, stage=1");
-	  flow->l4.tcp.irc_stage = 1;
+	  irc->irc_stage = 1;
 	}
 	/* irc packets can have either windows line breaks (0d0a) or unix line breaks (0a) */
 	if (packet->payload[packet->payload_packet_len - 2] == 0x0d
@@ -552,7 +548,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 		NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct,
 			 NDPI_LOG_TRACE, "two icq signal words in the same packet");
 		ndpi_int_irc_add_connection(ndpi_struct, flow);
-		flow->l4.tcp.irc_stage = 3;
+		irc->irc_stage = 3;
 		return;
 	      }
 	    }
@@ -570,7 +566,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 		NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 			 "two icq signal words in the same packet");
 		ndpi_int_irc_add_connection(ndpi_struct, flow);
-		flow->l4.tcp.irc_stage = 3;
+		irc->irc_stage = 3;
 		return;
 	      }
 	    }
@@ -585,7 +581,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
    * during the User login time.When the HTTP data gets posted using the POST method ,patterns
    * will be searched in the HTTP content.
    */
-  if ((flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC) && (flow->l4.tcp.irc_stage == 0)
+  if ((flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC) && (irc->irc_stage == 0)
       && (packet->payload_packet_len > 5)) {
     //HTTP POST Method being employed
     if (memcmp(packet->payload, "POST ", 5) == 0) {
@@ -602,7 +598,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 		&& (ndpi_check_for_IRC_traces(packet->referer_line.ptr, packet->referer_line.len)))) {
 	  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 		   "IRC detected from the Http URL/ Referer header ");
-	  flow->l4.tcp.irc_stage = 1;
+	  irc->irc_stage = 1;
 	  // HTTP POST Request body is not in the same packet.
 	  if (!http_content_ptr_len) {
 	    return;
@@ -612,7 +608,7 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
     }
   }
 
-  if ((flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC) && (flow->l4.tcp.irc_stage == 1)) {
+  if ((flow->detected_protocol_stack[0] != NDPI_PROTOCOL_IRC) && (irc->irc_stage == 1)) {
     if ((((packet->payload_packet_len - http_content_ptr_len) > 10)
 	 && (memcmp(packet->payload + http_content_ptr_len, "interface=", 10) == 0)
 	 && (ndpi_check_for_Nickname(ndpi_struct, flow) != 0))
@@ -721,34 +717,36 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 		      NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "port %u.",
 			       port);
 		      j = k;
+		      if (port != 0)
+			src_irc = ndpi_claim_id_state(src, NDPI_PROTOCOL_IRC, sizeof(struct ndpi_irc_id_state));
 		      // hier jetzt überlegen, wie die ports abgespeichert werden sollen
-		      if (src->irc_number_of_port < 16)
+		      if (src_irc != NULL && src_irc->irc_number_of_port < 16)
 			NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE,
 				 "src->irc_number_of_port < 16.");
-		      if (src->irc_number_of_port < 16 && port != 0) {
-			if (!ndpi_is_duplicate(src, port)) {
-			  src->irc_port[src->irc_number_of_port]
+		      if (src_irc != NULL && src_irc->irc_number_of_port < 16 && port != 0) {
+			if (!ndpi_is_duplicate(src_irc, port)) {
+			  src_irc->irc_port[src_irc->irc_number_of_port]
 			    = port;
-			  src->irc_number_of_port++;
+			  src_irc->irc_number_of_port++;
 			  NDPI_LOG
 			    (NDPI_PROTOCOL_IRC,
 			     ndpi_struct,
 			     NDPI_LOG_DEBUG, "found port=%d",
-			     ntohs(get_u_int16_t(src->irc_port, 0)));
+			     ntohs(get_u_int16_t(src_irc->irc_port, 0)));
 			  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG,
 				   "jjeeeeeeeeeeeeeeeeeeeeeeeee");
 			}
 			src->irc_ts = packet->tick_timestamp;
-		      } else if (port != 0 && src->irc_number_of_port == 16) {
-			if (!ndpi_is_duplicate(src, port)) {
+		      } else if (src_irc != NULL && port != 0 && src_irc->irc_number_of_port == 16) {
+			if (!ndpi_is_duplicate(src_irc, port)) {
 			  less = 0;
-			  NDPI_IRC_FIND_LESS(src->last_time_port_used, less);
-			  src->irc_port[less] = port;
+			  NDPI_IRC_FIND_LESS(src_irc->last_time_port_used, less);
+			  src_irc->irc_port[less] = port;
 			  NDPI_LOG
 			    (NDPI_PROTOCOL_IRC,
 			     ndpi_struct,
 			     NDPI_LOG_DEBUG, "found port=%d",
-			     ntohs(get_u_int16_t(src->irc_port, 0)));
+			     ntohs(get_u_int16_t(src_irc->irc_port, 0)));
 			}
 			src->irc_ts = packet->tick_timestamp;
 		      }
@@ -761,36 +759,38 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
 			(&packet->line[i].ptr[j], packet->payload_packet_len - j, &j);
 		      NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_TRACE, "port %u.",
 			       port);
+		      if (port != 0)
+			dst_irc = ndpi_claim_id_state(dst, NDPI_PROTOCOL_IRC, sizeof(struct ndpi_irc_id_state));
 		      // hier das gleiche wie oben.
 		      /* hier werden 16 ports pro irc flows mitgespeichert. könnte man denn nicht ein-
 		       * fach an die dst oder src einen flag setzten, dass dieser port für eine bestimmte
 		       * zeit ein irc-port bleibt?
 		       */
-		      if (dst->irc_number_of_port < 16 && port != 0) {
-			if (!ndpi_is_duplicate(dst, port)) {
-			  dst->irc_port[dst->irc_number_of_port]
+		      if (dst_irc != NULL && dst_irc->irc_number_of_port < 16 && port != 0) {
+			if (!ndpi_is_duplicate(dst_irc, port)) {
+			  dst_irc->irc_port[dst_irc->irc_number_of_port]
 			    = port;
-			  dst->irc_number_of_port++;
+			  dst_irc->irc_number_of_port++;
 			  NDPI_LOG
 			    (NDPI_PROTOCOL_IRC,
 			     ndpi_struct,
 			     NDPI_LOG_DEBUG, "found port=%d",
-			     ntohs(get_u_int16_t(dst->irc_port, 0)));
+			     ntohs(get_u_int16_t(dst_irc->irc_port, 0)));
 			  NDPI_LOG(NDPI_PROTOCOL_IRC, ndpi_struct, NDPI_LOG_DEBUG,
 				   "juuuuuuuuuuuuuuuu");
 			}
 			dst->irc_ts = packet->tick_timestamp;
-		      } else if (port != 0 && dst->irc_number_of_port == 16) {
-			if (!ndpi_is_duplicate(dst, port)) {
+		      } else if (dst_irc != NULL && port != 0 && dst_irc->irc_number_of_port == 16) {
+			if (!ndpi_is_duplicate(dst_irc, port)) {
 			  less = 0;
-			  NDPI_IRC_FIND_LESS(dst->last_time_port_used, less);
-			  dst->irc_port[less] = port;
+			  NDPI_IRC_FIND_LESS(dst_irc->last_time_port_used, less);
+			  dst_irc->irc_port[less] = port;
 
 			  NDPI_LOG
 			    (NDPI_PROTOCOL_IRC,
 			     ndpi_struct,
 			     NDPI_LOG_DEBUG, "found port=%d",
-			     ntohs(get_u_int16_t(dst->irc_port, 0)));
+			     ntohs(get_u_int16_t(dst_irc->irc_port, 0)));
 			}
 			dst->irc_ts = packet->tick_timestamp;
 		      }
@@ -813,4 +813,10 @@ void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
   }
 }
 
+void ndpi_search_irc_tcp(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+{
+  ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_IRC,
+			   sizeof(struct ndpi_irc_flow_state), ndpi_search_irc_tcp_state);
+}
+
 #endif
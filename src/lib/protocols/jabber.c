@@ -63,6 +63,7 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
   struct ndpi_packet_struct *packet = &flow->packet;
   struct ndpi_id_struct *src = flow->src;
   struct ndpi_id_struct *dst = flow->dst;
+  struct ndpi_jabber_id_state *src_jabber = NULL, *dst_jabber = NULL;
 
   u_int16_t x;
 
@@ -72,21 +73,22 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
   /* this part is working asymmetrically */
   if (packet->tcp != NULL && packet->tcp->syn != 0 && packet->payload_packet_len == 0) {
     NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG, "check jabber syn\n");
-    if (src != NULL && src->jabber_file_transfer_port[0] != 0) {
+    if (src != NULL && (src_jabber = ndpi_get_id_state(src, NDPI_PROTOCOL_UNENCRYPED_JABBER)) != NULL
+	&& src_jabber->jabber_file_transfer_port[0] != 0) {
       NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
-	       "src jabber ft port set, ports are: %u, %u\n", ntohs(src->jabber_file_transfer_port[0]),
-	       ntohs(src->jabber_file_transfer_port[1]));
+	       "src jabber ft port set, ports are: %u, %u\n", ntohs(src_jabber->jabber_file_transfer_port[0]),
+	       ntohs(src_jabber->jabber_file_transfer_port[1]));
       if (((u_int32_t)
-	   (packet->tick_timestamp - src->jabber_stun_or_ft_ts)) >= ndpi_struct->jabber_file_transfer_timeout) {
+	   (packet->tick_timestamp - src_jabber->jabber_stun_or_ft_ts)) >= ndpi_struct->jabber_file_transfer_timeout) {
 	NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
-		 NDPI_LOG_DEBUG, "JABBER src stun timeout %u %u\n", src->jabber_stun_or_ft_ts,
+		 NDPI_LOG_DEBUG, "JABBER src stun timeout %u %u\n", src_jabber->jabber_stun_or_ft_ts,
 		 packet->tick_timestamp);
-	src->jabber_file_transfer_port[0] = 0;
-	src->jabber_file_transfer_port[1] = 0;
-      } else if (src->jabber_file_transfer_port[0] == packet->tcp->dest
-		 || src->jabber_file_transfer_port[0] == packet->tcp->source
-		 || src->jabber_file_transfer_port[1] == packet->tcp->dest
-		 || src->jabber_file_transfer_port[1] == packet->tcp->source) {
+	src_jabber->jabber_file_transfer_port[0] = 0;
+	src_jabber->jabber_file_transfer_port[1] = 0;
+      } else if (src_jabber->jabber_file_transfer_port[0] == packet->tcp->dest
+		 || src_jabber->jabber_file_transfer_port[0] == packet->tcp->source
+		 || src_jabber->jabber_file_transfer_port[1] == packet->tcp->dest
+		 || src_jabber->jabber_file_transfer_port[1] == packet->tcp->source) {
 	NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
 		 "found jabber file transfer.\n");
 
@@ -94,21 +96,22 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
 				       NDPI_PROTOCOL_UNENCRYPED_JABBER, NDPI_CORRELATED_PROTOCOL);
       }
     }
-    if (dst != NULL && dst->jabber_file_transfer_port[0] != 0) {
+    if (dst != NULL && (dst_jabber = ndpi_get_id_state(dst, NDPI_PROTOCOL_UNENCRYPED_JABBER)) != NULL
+	&& dst_jabber->jabber_file_transfer_port[0] != 0) {
       NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
-	       "dst jabber ft port set, ports are: %u, %u\n", ntohs(dst->jabber_file_transfer_port[0]),
-	       ntohs(dst->jabber_file_transfer_port[1]));
+	       "dst jabber ft port set, ports are: %u, %u\n", ntohs(dst_jabber->jabber_file_transfer_port[0]),
+	       ntohs(dst_jabber->jabber_file_transfer_port[1]));
       if (((u_int32_t)
-	   (packet->tick_timestamp - dst->jabber_stun_or_ft_ts)) >= ndpi_struct->jabber_file_transfer_timeout) {
+	   (packet->tick_timestamp - dst_jabber->jabber_stun_or_ft_ts)) >= ndpi_struct->jabber_file_transfer_timeout) {
 	NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
-		 NDPI_LOG_DEBUG, "JABBER dst stun timeout %u %u\n", dst->jabber_stun_or_ft_ts,
+		 NDPI_LOG_DEBUG, "JABBER dst stun timeout %u %u\n", dst_jabber->jabber_stun_or_ft_ts,
 		 packet->tick_timestamp);
-	dst->jabber_file_transfer_port[0] = 0;
-	dst->jabber_file_transfer_port[1] = 0;
-      } else if (dst->jabber_file_transfer_port[0] == packet->tcp->dest
-		 || dst->jabber_file_transfer_port[0] == packet->tcp->source
-		 || dst->jabber_file_transfer_port[1] == packet->tcp->dest
-		 || dst->jabber_file_transfer_port[1] == packet->tcp->source) {
+	dst_jabber->jabber_file_transfer_port[0] = 0;
+	dst_jabber->jabber_file_transfer_port[1] = 0;
+      } else if (dst_jabber->jabber_file_transfer_port[0] == packet->tcp->dest
+		 || dst_jabber->jabber_file_transfer_port[0] == packet->tcp->source
+		 || dst_jabber->jabber_file_transfer_port[1] == packet->tcp->dest
+		 || dst_jabber->jabber_file_transfer_port[1] == packet->tcp->source) {
 	NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
 		 "found jabber file transfer.\n");
 
@@ -142,41 +145,45 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
 	if (packet->payload[x] == 'p') {
 	  if (memcmp(&packet->payload[x], "port=", 5) == 0) {
 	    NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG, "port=\n");
-	    if (src != NULL) {
-	      src->jabber_stun_or_ft_ts = packet->tick_timestamp;
+	    if (src != NULL
+		&& (src_jabber = ndpi_claim_id_state(src, NDPI_PROTOCOL_UNENCRYPED_JABBER,
+						    sizeof(struct ndpi_jabber_id_state))) != NULL) {
+	      src_jabber->jabber_stun_or_ft_ts = packet->tick_timestamp;
 	    }
 
-	    if (dst != NULL) {
-	      dst->jabber_stun_or_ft_ts = packet->tick_timestamp;
+	    if (dst != NULL
+		&& (dst_jabber = ndpi_claim_id_state(dst, NDPI_PROTOCOL_UNENCRYPED_JABBER,
+						    sizeof(struct ndpi_jabber_id_state))) != NULL) {
+	      dst_jabber->jabber_stun_or_ft_ts = packet->tick_timestamp;
 	    }
 	    x += 6;
 	    j_port = ntohs_ndpi_bytestream_to_number(&packet->payload[x], packet->payload_packet_len, &x);
 	    NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 		     NDPI_LOG_DEBUG, "JABBER port : %u\n", ntohs(j_port));
-	    if (src != NULL) {
-	      if (src->jabber_file_transfer_port[0] == 0 || src->jabber_file_transfer_port[0] == j_port) {
+	    if (src_jabber != NULL) {
+	      if (src_jabber->jabber_file_transfer_port[0] == 0 || src_jabber->jabber_file_transfer_port[0] == j_port) {
 		NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			 NDPI_LOG_DEBUG, "src->jabber_file_transfer_port[0] = j_port = %u;\n",
 			 ntohs(j_port));
-		src->jabber_file_transfer_port[0] = j_port;
+		src_jabber->jabber_file_transfer_port[0] = j_port;
 	      } else {
 		NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			 NDPI_LOG_DEBUG, "src->jabber_file_transfer_port[1] = j_port = %u;\n",
 			 ntohs(j_port));
-		src->jabber_file_transfer_port[1] = j_port;
+		src_jabber->jabber_file_transfer_port[1] = j_port;
 	      }
 	    }
-	    if (dst != NULL) {
-	      if (dst->jabber_file_transfer_port[0] == 0 || dst->jabber_file_transfer_port[0] == j_port) {
+	    if (dst_jabber != NULL) {
+	      if (dst_jabber->jabber_file_transfer_port[0] == 0 || dst_jabber->jabber_file_transfer_port[0] == j_port) {
 		NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			 NDPI_LOG_DEBUG, "dst->jabber_file_transfer_port[0] = j_port = %u;\n",
 			 ntohs(j_port));
-		dst->jabber_file_transfer_port[0] = j_port;
+		dst_jabber->jabber_file_transfer_port[0] = j_port;
 	      } else {
 		NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			 NDPI_LOG_DEBUG, "dst->jabber_file_transfer_port[1] = j_port = %u;\n",
 			 ntohs(j_port));
-		dst->jabber_file_transfer_port[1] = j_port;
+		dst_jabber->jabber_file_transfer_port[1] = j_port;
 	      }
 	    }
 	  }
@@ -208,12 +215,16 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
 	if (packet->payload[x] == 'p') {
 	  if (memcmp(&packet->payload[x], "port=", 5) == 0) {
 	    NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG, "port=\n");
-	    if (src != NULL) {
-	      src->jabber_stun_or_ft_ts = packet->tick_timestamp;
+	    if (src != NULL
+		&& (src_jabber = ndpi_claim_id_state(src, NDPI_PROTOCOL_UNENCRYPED_JABBER,
+						    sizeof(struct ndpi_jabber_id_state))) != NULL) {
+	      src_jabber->jabber_stun_or_ft_ts = packet->tick_timestamp;
 	    }
 
-	    if (dst != NULL) {
-	      dst->jabber_stun_or_ft_ts = packet->tick_timestamp;
+	    if (dst != NULL
+		&& (dst_jabber = ndpi_claim_id_state(dst, NDPI_PROTOCOL_UNENCRYPED_JABBER,
+						    sizeof(struct ndpi_jabber_id_state))) != NULL) {
+	      dst_jabber->jabber_stun_or_ft_ts = packet->tick_timestamp;
 	    }
 
 	    x += 6;
@@ -221,40 +232,40 @@ void ndpi_search_jabber_tcp(struct ndpi_detection_module_struct *ndpi_struct, st
 	    NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 		     NDPI_LOG_DEBUG, "JABBER port : %u\n", ntohs(j_port));
 
-	    if (src != NULL && src->jabber_voice_stun_used_ports < JABBER_MAX_STUN_PORTS - 1) {
+	    if (src_jabber != NULL && src_jabber->jabber_voice_stun_used_ports < JABBER_MAX_STUN_PORTS - 1) {
 	      if (packet->payload[5] == 'o') {
-		src->jabber_voice_stun_port[src->jabber_voice_stun_used_ports++]
+		src_jabber->jabber_voice_stun_port[src_jabber->jabber_voice_stun_used_ports++]
 		  = j_port;
 	      } else {
-		if (src->jabber_file_transfer_port[0] == 0
-		    || src->jabber_file_transfer_port[0] == j_port) {
+		if (src_jabber->jabber_file_transfer_port[0] == 0
+		    || src_jabber->jabber_file_transfer_port[0] == j_port) {
 		  NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
 			   "src->jabber_file_transfer_port[0] = j_port = %u;\n", ntohs(j_port));
-		  src->jabber_file_transfer_port[0] = j_port;
+		  src_jabber->jabber_file_transfer_port[0] = j_port;
 		} else {
 		  NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			   NDPI_LOG_DEBUG, "src->jabber_file_transfer_port[1] = j_port = %u;\n",
 			   ntohs(j_port));
-		  src->jabber_file_transfer_port[1] = j_port;
+		  src_jabber->jabber_file_transfer_port[1] = j_port;
 		}
 	      }
 	    }
 
-	    if (dst != NULL && dst->jabber_voice_stun_used_ports < JABBER_MAX_STUN_PORTS - 1) {
+	    if (dst_jabber != NULL && dst_jabber->jabber_voice_stun_used_ports < JABBER_MAX_STUN_PORTS - 1) {
 	      if (packet->payload[5] == 'o') {
-		dst->jabber_voice_stun_port[dst->jabber_voice_stun_used_ports++]
+		dst_jabber->jabber_voice_stun_port[dst_jabber->jabber_voice_stun_used_ports++]
 		  = j_port;
 	      } else {
-		if (dst->jabber_file_transfer_port[0] == 0
-		    || dst->jabber_file_transfer_port[0] == j_port) {
+		if (dst_jabber->jabber_file_transfer_port[0] == 0
+		    || dst_jabber->jabber_file_transfer_port[0] == j_port) {
 		  NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct, NDPI_LOG_DEBUG,
 			   "dst->jabber_file_transfer_port[0] = j_port = %u;\n", ntohs(j_port));
-		  dst->jabber_file_transfer_port[0] = j_port;
+		  dst_jabber->jabber_file_transfer_port[0] = j_port;
 		} else {
 		  NDPI_LOG(NDPI_PROTOCOL_UNENCRYPED_JABBER, ndpi_struct,
 			   NDPI_LOG_DEBUG, "dst->jabber_file_transfer_port[1] = j_port = %u;\n",
 			   ntohs(j_port));
-		  dst->jabber_file_transfer_port[1] = j_port;
+		  dst_jabber->jabber_file_transfer_port[1] = j_port;
 		}
 	      }
 	    }
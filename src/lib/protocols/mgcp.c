@@ -65,16 +65,7 @@ __forceinline static
 
 
 
-	if (packet->payload[0] != 'A' && packet->payload[0] != 'C' && packet->payload[0] != 'D' &&
-		packet->payload[0] != 'E' && packet->payload[0] != 'M' && packet->payload[0] != 'N' &&
-		packet->payload[0] != 'R') {
-		goto mgcp_excluded;
-	}
-	if (memcmp(packet->payload, "AUEP ", 5) != 0 && memcmp(packet->payload, "AUCX ", 5) != 0 &&
-		memcmp(packet->payload, "CRCX ", 5) != 0 && memcmp(packet->payload, "DLCX ", 5) != 0 &&
-		memcmp(packet->payload, "EPCF ", 5) != 0 && memcmp(packet->payload, "MDCX ", 5) != 0 &&
-		memcmp(packet->payload, "NTFY ", 5) != 0 && memcmp(packet->payload, "RQNT ", 5) != 0 &&
-		memcmp(packet->payload, "RSIP ", 5) != 0) {
+	if (!ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_MGCP, NDPI_PREFIX_REQUEST)) {
 		goto mgcp_excluded;
 	}
 	// now search for string "MGCP " in the rest of the message
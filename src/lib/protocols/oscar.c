@@ -35,14 +35,17 @@ static void ndpi_int_oscar_add_connection(struct ndpi_detection_module_struct *n
   struct ndpi_packet_struct *packet = &flow->packet;
   struct ndpi_id_struct *src = flow->src;
   struct ndpi_id_struct *dst = flow->dst;
+  struct ndpi_oscar_id_state *oscar;
 
   ndpi_int_add_connection(ndpi_struct, flow, NDPI_PROTOCOL_OSCAR, protocol_type);
 
-  if (src != NULL) {
-    src->oscar_last_safe_access_time = packet->tick_timestamp;
+  if (src != NULL
+      && (oscar = ndpi_claim_id_state(src, NDPI_PROTOCOL_OSCAR, sizeof(struct ndpi_oscar_id_state))) != NULL) {
+    oscar->oscar_last_safe_access_time = packet->tick_timestamp;
   }
-  if (dst != NULL) {
-    dst->oscar_last_safe_access_time = packet->tick_timestamp;
+  if (dst != NULL
+      && (oscar = ndpi_claim_id_state(dst, NDPI_PROTOCOL_OSCAR, sizeof(struct ndpi_oscar_id_state))) != NULL) {
+    oscar->oscar_last_safe_access_time = packet->tick_timestamp;
   }
 }
 
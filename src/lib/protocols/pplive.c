@@ -31,19 +31,20 @@ static void ndpi_int_pplive_add_connection(struct ndpi_detection_module_struct *
 	ndpi_int_add_connection(ndpi_struct, flow, NDPI_PROTOCOL_PPLIVE, NDPI_REAL_PROTOCOL);
 }
 
-static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_pplive_flow_state *pplive) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 	
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->pplive_stage1 == 0) {
+	if (pplive->pplive_stage1 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage 0: \n");
 		
 		if ((payload_len > 0) && match_first_bytes(packet->payload, "\xe9\x03\x41\x01")) {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "Possible PPLIVE request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->pplive_stage1 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			pplive->pplive_stage1 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 			return;
 		}
 		
@@ -51,7 +52,7 @@ static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_str
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "Possible PPLIVE request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->pplive_stage1 = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
+			pplive->pplive_stage1 = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
 			return;
 		}
 		
@@ -59,15 +60,15 @@ static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_str
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "Possible PPLIVE request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->pplive_stage1 = packet->packet_direction + 5; // packet_direction 0: stage 5, packet_direction 1: stage 6
+			pplive->pplive_stage1 = packet->packet_direction + 5; // packet_direction 0: stage 5, packet_direction 1: stage 6
 			return;
 		}			
 
-	} else if ((flow->pplive_stage1 == 1) || (flow->pplive_stage1 == 2)) {
-		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", flow->pplive_stage1);
+	} else if ((pplive->pplive_stage1 == 1) || (pplive->pplive_stage1 == 2)) {
+		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", pplive->pplive_stage1);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->pplive_stage1 - packet->packet_direction) == 1) {
+		if ((pplive->pplive_stage1 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -77,14 +78,14 @@ static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_str
 			ndpi_int_pplive_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to PPLIVE, resetting the stage to 0...\n");
-			flow->pplive_stage1 = 0;
+			pplive->pplive_stage1 = 0;
 		}
 		
-	} else if ((flow->pplive_stage1 == 3) || (flow->pplive_stage1 == 4)) {
-		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", flow->pplive_stage1);
+	} else if ((pplive->pplive_stage1 == 3) || (pplive->pplive_stage1 == 4)) {
+		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", pplive->pplive_stage1);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->pplive_stage1 - packet->packet_direction) == 3) {
+		if ((pplive->pplive_stage1 - packet->packet_direction) == 3) {
 			return;
 		}
 
@@ -94,13 +95,13 @@ static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_str
 			ndpi_int_pplive_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to PPLIVE, resetting the stage to 0...\n");
-			flow->pplive_stage1 = 0;
+			pplive->pplive_stage1 = 0;
 		}
-	} else if ((flow->pplive_stage1 == 5) || (flow->pplive_stage1 == 6)) {
-		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", flow->pplive_stage1);
+	} else if ((pplive->pplive_stage1 == 5) || (pplive->pplive_stage1 == 6)) {
+		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", pplive->pplive_stage1);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->pplive_stage1 - packet->packet_direction) == 5) {
+		if ((pplive->pplive_stage1 - packet->packet_direction) == 5) {
 			return;
 		}
 
@@ -110,32 +111,33 @@ static void ndpi_check_pplive_udp1(struct ndpi_detection_module_struct *ndpi_str
 			ndpi_int_pplive_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to PPLIVE, resetting the stage to 0...\n");
-			flow->pplive_stage1 = 0;
+			pplive->pplive_stage1 = 0;
 		}
 	}
 		
 }
 
-static void ndpi_check_pplive_udp2(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_pplive_udp2(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_pplive_flow_state *pplive) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->pplive_stage2 == 0) {
+	if (pplive->pplive_stage2 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage 0: \n");
 		
 		if ((payload_len == 57) && match_first_bytes(packet->payload, "\xe9\x03\x41\x01")) {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "Possible PPLIVE request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->pplive_stage2 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			pplive->pplive_stage2 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 		}
 
 	} else {
-		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", flow->pplive_stage2);
+		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", pplive->pplive_stage2);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->pplive_stage2 - packet->packet_direction) == 1) {
+		if ((pplive->pplive_stage2 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -145,33 +147,34 @@ static void ndpi_check_pplive_udp2(struct ndpi_detection_module_struct *ndpi_str
 			ndpi_int_pplive_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to PPLIVE, resetting the stage to 0...\n");
-			flow->pplive_stage2 = 0;
+			pplive->pplive_stage2 = 0;
 		}
 		
 	}
 }
 
-static void ndpi_check_pplive_udp3(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_pplive_udp3(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_pplive_flow_state *pplive) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 	
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->pplive_stage3 == 0) {
+	if (pplive->pplive_stage3 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage 0: \n");
 		
 		if ((payload_len == 94) && (packet->udp->dest == htons(5041) || packet->udp->source == htons(5041) || packet->udp->dest == htons(8303) || packet->udp->source == htons(8303))) {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "Possible PPLIVE request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->pplive_stage3 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			pplive->pplive_stage3 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 			return;
 		}	
 
 	} else {
-		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", flow->pplive_stage3);
+		NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE stage %u: \n", pplive->pplive_stage3);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->pplive_stage3 - packet->packet_direction) == 1) {
+		if ((pplive->pplive_stage3 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -181,13 +184,15 @@ static void ndpi_check_pplive_udp3(struct ndpi_detection_module_struct *ndpi_str
 			ndpi_int_pplive_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to PPLIVE, resetting the stage to 0...\n");
-			flow->pplive_stage3 = 0;
+			pplive->pplive_stage3 = 0;
 		}
 	}
 		
 }
 
-void ndpi_search_pplive(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_search_pplive_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state) {
+	struct ndpi_pplive_flow_state *pplive = (struct ndpi_pplive_flow_state*)state;
 	struct ndpi_packet_struct *packet = &flow->packet;
 	
 	/* Break after 20 packets. */
@@ -202,19 +207,24 @@ void ndpi_search_pplive(struct ndpi_detection_module_struct *ndpi_struct, struct
 	}
 
 	NDPI_LOG(NDPI_PROTOCOL_PPLIVE, ndpi_struct, NDPI_LOG_DEBUG, "PPLIVE detection...\n");
-	ndpi_check_pplive_udp1(ndpi_struct, flow);
+	ndpi_check_pplive_udp1(ndpi_struct, flow, pplive);
 	
 	if (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_PPLIVE) {
 	    return;
 	}
 	
-	ndpi_check_pplive_udp2(ndpi_struct, flow);
+	ndpi_check_pplive_udp2(ndpi_struct, flow, pplive);
 	
 	if (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_PPLIVE) {
 	    return;
 	}
 	
-	ndpi_check_pplive_udp3(ndpi_struct, flow);
+	ndpi_check_pplive_udp3(ndpi_struct, flow, pplive);
+}
+
+void ndpi_search_pplive(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+	ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_PPLIVE,
+				 sizeof(struct ndpi_pplive_flow_state), ndpi_search_pplive_state);
 }
 
 #endif
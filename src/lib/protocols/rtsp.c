@@ -51,6 +51,7 @@ void ndpi_search_rtsp_tcp_udp(struct ndpi_detection_module_struct
 
   struct ndpi_id_struct *src = flow->src;
   struct ndpi_id_struct *dst = flow->dst;
+  struct ndpi_rtsp_id_state *rtsp;
 
   NDPI_LOG(NDPI_PROTOCOL_RTSP, ndpi_struct, NDPI_LOG_TRACE, "RTSP detection...\n");
 
@@ -81,17 +82,19 @@ void ndpi_search_rtsp_tcp_udp(struct ndpi_detection_module_struct
     if((memcmp(packet->payload, "RTSP/1.0 ", 9) == 0)
        || (strstr(buf, "rtsp://") != NULL)) {
       NDPI_LOG(NDPI_PROTOCOL_RTSP, ndpi_struct, NDPI_LOG_TRACE, "found RTSP/1.0 .\n");
-      if (dst != NULL) {
+      if (dst != NULL
+	  && (rtsp = ndpi_claim_id_state(dst, NDPI_PROTOCOL_RTSP, sizeof(struct ndpi_rtsp_id_state))) != NULL) {
 	NDPI_LOG(NDPI_PROTOCOL_RTSP, ndpi_struct, NDPI_LOG_TRACE, "found dst.\n");
-	ndpi_packet_src_ip_get(packet, &dst->rtsp_ip_address);
-	dst->rtsp_timer = packet->tick_timestamp;
-	dst->rtsp_ts_set = 1;
+	ndpi_packet_src_ip_get(packet, &rtsp->rtsp_ip_address);
+	rtsp->rtsp_timer = packet->tick_timestamp;
+	rtsp->rtsp_ts_set = 1;
       }
-      if (src != NULL) {
+      if (src != NULL
+	  && (rtsp = ndpi_claim_id_state(src, NDPI_PROTOCOL_RTSP, sizeof(struct ndpi_rtsp_id_state))) != NULL) {
 	NDPI_LOG(NDPI_PROTOCOL_RTSP, ndpi_struct, NDPI_LOG_TRACE, "found src.\n");
-	ndpi_packet_dst_ip_get(packet, &src->rtsp_ip_address);
-	src->rtsp_timer = packet->tick_timestamp;
-	src->rtsp_ts_set = 1;
+	ndpi_packet_dst_ip_get(packet, &rtsp->rtsp_ip_address);
+	rtsp->rtsp_timer = packet->tick_timestamp;
+	rtsp->rtsp_ts_set = 1;
       }
       NDPI_LOG(NDPI_PROTOCOL_RTSP, ndpi_struct, NDPI_LOG_TRACE, "RTSP detected.\n");
       flow->rtsp_control_flow = 1;
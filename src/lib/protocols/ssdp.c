@@ -45,8 +45,7 @@ void ndpi_search_ssdp(struct ndpi_detection_module_struct *ndpi_struct, struct n
 	if (packet->udp != NULL) {
 
 		if (packet->payload_packet_len > 100) {
-			if ((memcmp(packet->payload, "M-SEARCH * HTTP/1.1", 19) == 0)
-				|| memcmp(packet->payload, "NOTIFY * HTTP/1.1", 17) == 0) {
+			if (ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_SSDP, NDPI_PREFIX_REQUEST)) {
 
 
 				NDPI_LOG(NDPI_PROTOCOL_SSDP, ndpi_struct, NDPI_LOG_DEBUG, "found ssdp.\n");
@@ -54,8 +53,7 @@ void ndpi_search_ssdp(struct ndpi_detection_module_struct *ndpi_struct, struct n
 				return;
 			}
 
-#define SSDP_HTTP "HTTP/1.1 200 OK\r\n"
-			if(memcmp(packet->payload, SSDP_HTTP, strlen(SSDP_HTTP)) == 0) {
+			if(ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_SSDP, NDPI_PREFIX_RESPONSE)) {
 			  NDPI_LOG(NDPI_PROTOCOL_SSDP, ndpi_struct, NDPI_LOG_DEBUG, "found ssdp.\n");
 			  ndpi_int_ssdp_add_connection(ndpi_struct, flow);
 			  return;
@@ -111,6 +111,198 @@ static void stripCertificateTrailer(char *buffer, int buffer_len) {
   }
 }
 
+/* ******************************************* */
+
+#define NDPI_TLS_NOT_CLIENT_HELLO   0
+#define NDPI_TLS_CLIENT_HELLO       1 /* parsed up to its last extension */
+#define NDPI_TLS_CLIENT_HELLO_PART  2 /* continues in the next segments */
+
+#define ndpi_tls_is_grease(v)       ((((v) & 0x0F0F) == 0x0A0A) && (((v) >> 8) == ((v) & 0xFF)))
+#define ndpi_tolower(ch)            ((((ch) >= 'A') && ((ch) <= 'Z')) ? ((ch) + 'a' - 'A') : (ch))
+
+static inline u_int16_t tls_get16(const u_int8_t *p, u_int off) {
+  return((u_int16_t)((p[off] << 8) | p[off+1]));
+}
+
+/* 0: the n bytes at off are there, -1: they go past end, 1: they have not been received */
+static inline int tls_check(u_int off, u_int n, u_int end, u_int avail) {
+  if(off + n > end) return(-1);
+  return((off + n > avail) ? 1 : 0);
+}
+
+static void ndpi_tls_server_name(struct ndpi_flow_struct *flow, const u_int8_t *ext, u_int ext_len) {
+  u_int name_len, i;
+
+  /* server_name_list length, then the first entry: type (0 = host_name) and length */
+  if((ext_len < 5) || (ext[2] != 0x00))
+    return;
+
+  name_len = tls_get16(ext, 3);
+  if((5 + name_len > ext_len) || (name_len >= sizeof(flow->host_server_name)))
+    return;
+
+  for(i = 0; i < name_len; i++) {
+    if(!ndpi_isprint(ext[5+i])) {
+      flow->host_server_name[0] = '\0';
+      return;
+    }
+
+    flow->host_server_name[i] = ndpi_tolower(ext[5+i]);
+  }
+
+  flow->host_server_name[name_len] = '\0';
+}
+
+static void ndpi_tls_alpn(struct ndpi_flow_struct *flow, const u_int8_t *ext, u_int ext_len) {
+  char *alpn = flow->protos.ssl.alpn;
+  u_int off = 2, end, len = 0;
+
+  if(ext_len < 2)
+    return;
+
+  end = ndpi_min(ext_len, 2 + (u_int)tls_get16(ext, 0));
+
+  while(off < end) {
+    u_int proto_len = ext[off++];
+
+    if(off + proto_len > end)
+      break;
+
+    /* protocols that do not fit are left out */
+    if(len + (len ? 1 : 0) + proto_len < NDPI_TLS_ALPN_LEN) {
+      if(len) alpn[len++] = ',';
+      memcpy(&alpn[len], &ext[off], proto_len);
+      len += proto_len;
+    }
+
+    off += proto_len;
+  }
+
+  alpn[len] = '\0';
+}
+
+static void ndpi_tls_supported_versions(struct ndpi_flow_struct *flow, const u_int8_t *ext, u_int ext_len) {
+  u_int off, end;
+
+  if(ext_len < 1)
+    return;
+
+  end = ndpi_min(ext_len, 1 + (u_int)ext[0]);
+
+  for(off = 1; off + 2 <= end; off += 2) {
+    u_int16_t version = tls_get16(ext, off);
+
+    if((!ndpi_tls_is_grease(version)) && (version > flow->protos.ssl.version))
+      flow->protos.ssl.version = version;
+  }
+}
+
+/*
+  Single pass over a ClientHello: record and handshake headers, then
+  the fixed fields and the extensions. Every length is checked against
+  the handshake message (malformed: not a ClientHello) and against the
+  bytes received (the message continues in the next segments). Fills
+  host_server_name (SNI), protos.ssl.alpn and protos.ssl.version.
+*/
+static int ndpi_parse_tls_client_hello(struct ndpi_flow_struct *flow,
+				       const u_int8_t *payload, u_int payload_len) {
+  u_int off, end, avail, record_len, hs_len, len;
+  int rc;
+
+  if((payload_len < 9)
+     || (payload[0] != 0x16 /* Handshake */) || (payload[1] != 0x03) || (payload[2] > 0x04)
+     || (payload[5] != 0x01 /* Client Hello */))
+    return(NDPI_TLS_NOT_CLIENT_HELLO);
+
+  record_len = tls_get16(payload, 3);
+  hs_len = (payload[6] << 16) | (payload[7] << 8) | payload[8];
+
+  /* version, random, session id, ciphers and compression take 41 bytes at least */
+  if((hs_len < 41) || (hs_len + 4 > record_len))
+    return(NDPI_TLS_NOT_CLIENT_HELLO);
+
+  end = 9 + hs_len, avail = ndpi_min(end, payload_len);
+  flow->host_server_name[0] = '\0', flow->protos.ssl.alpn[0] = '\0';
+
+  /* client version, random and session id length */
+  off = 9;
+  if((rc = tls_check(off, 35, end, avail)) != 0) goto hello_end;
+  flow->protos.ssl.version = tls_get16(payload, off);
+  if((len = payload[off+34]) > 32) { rc = -1; goto hello_end; }
+  off += 35 + len;
+
+  /* cipher suites */
+  if((rc = tls_check(off, 2, end, avail)) != 0) goto hello_end;
+  len = tls_get16(payload, off);
+  if((len == 0) || (len & 1)) { rc = -1; goto hello_end; }
+  off += 2 + len;
+
+  /* compression methods */
+  if((rc = tls_check(off, 1, end, avail)) != 0) goto hello_end;
+  off += 1 + payload[off];
+
+  if(off == end)
+    return(NDPI_TLS_CLIENT_HELLO); /* no extensions */
+
+  if((rc = tls_check(off, 2, end, avail)) != 0) goto hello_end;
+  len = tls_get16(payload, off), off += 2;
+  if(off + len != end) { rc = -1; goto hello_end; }
+
+  while(off < end) {
+    u_int16_t ext_id;
+
+    if((rc = tls_check(off, 4, end, avail)) != 0) goto hello_end;
+    ext_id = tls_get16(payload, off), len = tls_get16(payload, off+2), off += 4;
+    if((rc = tls_check(off, len, end, avail)) != 0) goto hello_end;
+
+    switch(ext_id) {
+    case 0:  ndpi_tls_server_name(flow, &payload[off], len); break;
+    case 16: ndpi_tls_alpn(flow, &payload[off], len); break;
+    case 43: ndpi_tls_supported_versions(flow, &payload[off], len); break;
+    }
+
+    off += len;
+  }
+
+  return(NDPI_TLS_CLIENT_HELLO);
+
+ hello_end:
+  if(rc > 0)
+    return(NDPI_TLS_CLIENT_HELLO_PART);
+
+  /* malformed: nothing extracted is kept */
+  flow->host_server_name[0] = '\0', flow->protos.ssl.alpn[0] = '\0', flow->protos.ssl.version = 0;
+  return(NDPI_TLS_NOT_CLIENT_HELLO);
+}
+
+/* ******************************************* */
+
+/* The server name of a ClientHello classifies the flow on its first payload packet */
+static int ndpi_search_tls_client_hello(struct ndpi_detection_module_struct *ndpi_struct,
+					struct ndpi_flow_struct *flow) {
+  struct ndpi_packet_struct *packet = &flow->packet;
+  int protocol_id;
+  u_int len;
+
+  if(ndpi_parse_tls_client_hello(flow, packet->payload, packet->payload_packet_len) == NDPI_TLS_NOT_CLIENT_HELLO)
+    return(0);
+
+  flow->l4.tcp.ssl_seen_client_cert = 1;
+
+  /* without a name (yet) the server certificate will tell */
+  if((len = strlen((const char*)flow->host_server_name)) == 0)
+    return(0);
+
+  packet->ssl_certificate_detected = 1;
+  protocol_id = ndpi_match_string_subprotocol(ndpi_struct, flow, (char*)flow->host_server_name, len);
+  ndpi_int_ssl_add_connection(ndpi_struct, flow,
+			      (protocol_id != NDPI_PROTOCOL_UNKNOWN) ? protocol_id : NDPI_PROTOCOL_SSL);
+
+  return(1);
+}
+
+/* ******************************************* */
+
 /* Code fixes courtesy of Alexsandro Brahm <alex@digistar.com.br> */
 int getSSLcertificate(struct ndpi_detection_module_struct *ndpi_struct,
 		      struct ndpi_flow_struct *flow,
@@ -121,7 +313,7 @@ int getSSLcertificate(struct ndpi_detection_module_struct *ndpi_struct,
     Nothing matched so far: let's decode the certificate with some heuristics 
     Patches courtesy of Denys Fedoryshchenko <nuclearcat@nuclearcat.com>
    */
-  if(packet->payload[0] == 0x16 /* Handshake */) {
+  if((packet->payload_packet_len > 9) && (packet->payload[0] == 0x16 /* Handshake */)) {
     u_int16_t total_len  = (packet->payload[3] << 8) + packet->payload[4] + 5 /* SSL Header */;
     u_int8_t handshake_protocol = packet->payload[5]; /* handshake protocol a bit misleading, it is message type according TLS specs */
 
@@ -163,9 +355,8 @@ int getSSLcertificate(struct ndpi_detection_module_struct *ndpi_struct,
 		  break;
 	      }
 
-	      // len = ndpi_min(server_len-begin, buffer_len-1);
-	      len = buffer_len-1;
-	      strncpy(buffer, &server_name[begin], len);
+	      len = ndpi_min(server_len-begin, buffer_len-1);
+	      memcpy(buffer, &server_name[begin], len);
 	      buffer[len] = '\0';
 
 	      /* We now have to check if this looks like an IP address or host name */
@@ -187,68 +378,6 @@ int getSSLcertificate(struct ndpi_detection_module_struct *ndpi_struct,
 	    }
 	  }
 	}
-      } else if(handshake_protocol == 0x01 /* Client Hello */) {
-	u_int offset, base_offset = 43;
-	u_int16_t session_id_len = packet->payload[base_offset];
-
-	if((session_id_len+base_offset+2) <= total_len) {
-	  u_int16_t cypher_len =  packet->payload[session_id_len+base_offset+2] + (packet->payload[session_id_len+base_offset+1] << 8);
-	  offset = base_offset + session_id_len + cypher_len + 2;
-
-	  flow->l4.tcp.ssl_seen_client_cert = 1;
-
-	  if(offset < total_len) {
-	    u_int16_t compression_len;
-	    u_int16_t extensions_len;
-
-	    compression_len = packet->payload[offset+1];
-	    offset += compression_len + 3;
-
-	    if(offset < total_len) {
-	      extensions_len = packet->payload[offset];
-
-	      if((extensions_len+offset) < total_len) {
-		u_int16_t extension_offset = 1; /* Move to the first extension */
-
-		while(extension_offset < extensions_len) {
-		  u_int16_t extension_id, extension_len;
-
-		  memcpy(&extension_id, &packet->payload[offset+extension_offset], 2);
-		  extension_offset += 2;
-
-		  memcpy(&extension_len, &packet->payload[offset+extension_offset], 2);
-		  extension_offset += 2;
-
-		  extension_id = ntohs(extension_id), extension_len = ntohs(extension_len);
-
-		  if(extension_id == 0) {
-		    u_int begin = 0,len;
-		    char *server_name = (char*)&packet->payload[offset+extension_offset];
-
-		    while(begin < extension_len) {
-		      if((!ndpi_isprint(server_name[begin]))
-			 || ndpi_ispunct(server_name[begin])
-			 || ndpi_isspace(server_name[begin]))
-			begin++;
-		      else
-			break;
-		    }
-
-		    len = (u_int)ndpi_min(extension_len-begin, buffer_len-1);
-		    strncpy(buffer, &server_name[begin], len);
-		    buffer[len] = '\0';
-		    stripCertificateTrailer(buffer, buffer_len);
-
-		    /* We're happy now */
-		    return(2 /* Client Certificate */);
-		  }
-
-		  extension_offset += extension_len;
-		}
-	      }
-	    }
-	  }
-	}
       }
     }
   }
@@ -259,8 +388,6 @@ int getSSLcertificate(struct ndpi_detection_module_struct *ndpi_struct,
 int sslDetectProtocolFromCertificate(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
   struct ndpi_packet_struct *packet = &flow->packet;
 
-  if(!packet->iph /* IPv4 */) return(-1);
-
   if((packet->detected_protocol_stack[0] == NDPI_PROTOCOL_UNKNOWN)
      || (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_SSL)) {
     char certificate[64];
@@ -348,9 +475,14 @@ static void ssl_mark_and_payload_search_for_other_protocols(struct
 	NDPI_LOG(NDPI_PROTOCOL_OSCAR, ndpi_struct, NDPI_LOG_DEBUG, "OSCAR SERVER SSL DETECTED\n");
 
 	if (flow->dst != NULL && packet->payload_packet_len > 75) {
-	  memcpy(flow->dst->oscar_ssl_session_id, &packet->payload[44], 32);
-	  flow->dst->oscar_ssl_session_id[32] = '\0';
-	  flow->dst->oscar_last_safe_access_time = packet->tick_timestamp;
+	  struct ndpi_oscar_id_state *oscar = ndpi_claim_id_state(flow->dst, NDPI_PROTOCOL_OSCAR,
+								  sizeof(struct ndpi_oscar_id_state));
+
+	  if (oscar != NULL) {
+	    memcpy(oscar->oscar_ssl_session_id, &packet->payload[44], 32);
+	    oscar->oscar_ssl_session_id[32] = '\0';
+	    oscar->oscar_last_safe_access_time = packet->tick_timestamp;
+	  }
 	}
 
 	ndpi_int_ssl_add_connection(ndpi_struct, flow, NDPI_PROTOCOL_OSCAR);
@@ -543,7 +675,8 @@ void ndpi_search_ssl_tcp(struct ndpi_detection_module_struct *ndpi_struct, struc
       return;
     } else {
       /* No whatsapp, let's try SSL */
-      if(sslDetectProtocolFromCertificate(ndpi_struct, flow) > 0)
+      if(ndpi_search_tls_client_hello(ndpi_struct, flow)
+	 || (sslDetectProtocolFromCertificate(ndpi_struct, flow) > 0))
 	return;
     }
   }
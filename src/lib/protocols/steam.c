@@ -42,18 +42,19 @@ static void ndpi_check_steam_http(struct ndpi_detection_module_struct *ndpi_stru
 	}
 }
 
-static void ndpi_check_steam_tcp(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_steam_tcp(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_steam_flow_state *steam) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 	
-	if (flow->steam_stage == 0) {
+	if (steam->steam_stage == 0) {
 	    NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage 0: \n");
 	    
 	    	if (((payload_len == 1) || (payload_len == 4) || (payload_len == 5)) && match_first_bytes(packet->payload, "\x01\x00\x00\x00")) {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			steam->steam_stage = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 			return;
 		}
 		
@@ -61,14 +62,14 @@ static void ndpi_check_steam_tcp(struct ndpi_detection_module_struct *ndpi_struc
 		  	NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
+			steam->steam_stage = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
 			return;
 		}
-	} else if ((flow->steam_stage == 1) || (flow->steam_stage == 2)) {
-	  	NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage);
+	} else if ((steam->steam_stage == 1) || (steam->steam_stage == 2)) {
+	  	NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage - packet->packet_direction) == 1) {
+		if ((steam->steam_stage - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -78,13 +79,13 @@ static void ndpi_check_steam_tcp(struct ndpi_detection_module_struct *ndpi_struc
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage = 0;
+			steam->steam_stage = 0;
 		}
-	} else if ((flow->steam_stage == 3) || (flow->steam_stage == 4)) {
-	  	NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage);
+	} else if ((steam->steam_stage == 3) || (steam->steam_stage == 4)) {
+	  	NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage - packet->packet_direction) == 3) {
+		if ((steam->steam_stage - packet->packet_direction) == 3) {
 			return;
 		}
 
@@ -94,12 +95,13 @@ static void ndpi_check_steam_tcp(struct ndpi_detection_module_struct *ndpi_struc
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage = 0;
+			steam->steam_stage = 0;
 		}
 	}
 }
 
-static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_steam_flow_state *steam) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 	
@@ -110,14 +112,14 @@ static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_stru
 	}
 
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->steam_stage1 == 0) {
+	if (steam->steam_stage1 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage 0: \n");
 		
 		if ((payload_len > 0) && match_first_bytes(packet->payload, "\x31\xff\x30\x2e")) {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage1 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			steam->steam_stage1 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 			return;
 		}
 		
@@ -125,15 +127,15 @@ static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_stru
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage1 = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
+			steam->steam_stage1 = packet->packet_direction + 3; // packet_direction 0: stage 3, packet_direction 1: stage 4
 			return;
 		}
 
-	} else if ((flow->steam_stage1 == 1) || (flow->steam_stage1 == 2)) {
-		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage1);
+	} else if ((steam->steam_stage1 == 1) || (steam->steam_stage1 == 2)) {
+		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage1);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage1 - packet->packet_direction) == 1) {
+		if ((steam->steam_stage1 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -143,14 +145,14 @@ static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_stru
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage1 = 0;
+			steam->steam_stage1 = 0;
 		}
 		
-	} else if ((flow->steam_stage1 == 3) || (flow->steam_stage1 == 4)) {
-		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage1);
+	} else if ((steam->steam_stage1 == 3) || (steam->steam_stage1 == 4)) {
+		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage1);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage1 - packet->packet_direction) == 3) {
+		if ((steam->steam_stage1 - packet->packet_direction) == 3) {
 			return;
 		}
 
@@ -160,32 +162,33 @@ static void ndpi_check_steam_udp1(struct ndpi_detection_module_struct *ndpi_stru
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage1 = 0;
+			steam->steam_stage1 = 0;
 		}
 		
 	}
 }
 
-static void ndpi_check_steam_udp2(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_steam_udp2(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_steam_flow_state *steam) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->steam_stage2 == 0) {
+	if (steam->steam_stage2 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage 0: \n");
 		
 		if ((payload_len == 25) && match_first_bytes(packet->payload, "\xff\xff\xff\xff")) {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage2 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			steam->steam_stage2 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 		}
 
 	} else {
-		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage2);
+		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage2);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage2 - packet->packet_direction) == 1) {
+		if ((steam->steam_stage2 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -195,32 +198,33 @@ static void ndpi_check_steam_udp2(struct ndpi_detection_module_struct *ndpi_stru
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage2 = 0;
+			steam->steam_stage2 = 0;
 		}
 		
 	}
 }
 
-static void ndpi_check_steam_udp3(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_steam_udp3(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_steam_flow_state *steam) {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	u_int32_t payload_len = packet->payload_packet_len;
 
 	/* Check if we so far detected the protocol in the request or not. */
-	if (flow->steam_stage3 == 0) {
+	if (steam->steam_stage3 == 0) {
 		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage 0: \n");
 		
 		if ((payload_len == 4) && (packet->payload[0] == 0x39) && (packet->payload[1] == 0x18) && (packet->payload[2] == 0x00) && (packet->payload[3] == 0x00)) {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "Possible STEAM request detected, we will look further for the response...\n");
 
 			/* Encode the direction of the packet in the stage, so we will know when we need to look for the response packet. */
-			flow->steam_stage3 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
+			steam->steam_stage3 = packet->packet_direction + 1; // packet_direction 0: stage 1, packet_direction 1: stage 2
 		}
 
 	} else {
-		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", flow->steam_stage3);
+		NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "STEAM stage %u: \n", steam->steam_stage3);
 
 		/* At first check, if this is for sure a response packet (in another direction. If not, do nothing now and return. */
-		if ((flow->steam_stage3 - packet->packet_direction) == 1) {
+		if ((steam->steam_stage3 - packet->packet_direction) == 1) {
 			return;
 		}
 
@@ -230,13 +234,15 @@ static void ndpi_check_steam_udp3(struct ndpi_detection_module_struct *ndpi_stru
 			ndpi_int_steam_add_connection(ndpi_struct, flow);
 		} else {
 			NDPI_LOG(NDPI_PROTOCOL_STEAM, ndpi_struct, NDPI_LOG_DEBUG, "The reply did not seem to belong to STEAM, resetting the stage to 0...\n");
-			flow->steam_stage3 = 0;
+			steam->steam_stage3 = 0;
 		}
 		
 	}
 }
 
-void ndpi_search_steam(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_search_steam_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state) {
+	struct ndpi_steam_flow_state *steam = (struct ndpi_steam_flow_state*)state;
 	struct ndpi_packet_struct *packet = &flow->packet;
 	
 	/* Break after 20 packets. */
@@ -262,25 +268,30 @@ void ndpi_search_steam(struct ndpi_detection_module_struct *ndpi_struct, struct
 	    return;
 	}
 
-	ndpi_check_steam_tcp(ndpi_struct, flow);
+	ndpi_check_steam_tcp(ndpi_struct, flow, steam);
 	
 	if (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_STEAM) {
 	    return;
 	}
 	
-	ndpi_check_steam_udp1(ndpi_struct, flow);
+	ndpi_check_steam_udp1(ndpi_struct, flow, steam);
 	
 	if (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_STEAM) {
 	    return;
 	}
 	
-	ndpi_check_steam_udp2(ndpi_struct, flow);
+	ndpi_check_steam_udp2(ndpi_struct, flow, steam);
 	
 	if (packet->detected_protocol_stack[0] == NDPI_PROTOCOL_STEAM) {
 	    return;
 	}
 	
-	ndpi_check_steam_udp3(ndpi_struct, flow);
+	ndpi_check_steam_udp3(ndpi_struct, flow, steam);
+}
+
+void ndpi_search_steam(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+	ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_STEAM,
+				 sizeof(struct ndpi_steam_flow_state), ndpi_search_steam_state);
 }
 
 #endif
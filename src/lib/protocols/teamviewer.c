@@ -35,8 +35,10 @@ static void ndpi_int_teamview_add_connection(struct ndpi_detection_module_struct
 }
 
 
-void ndpi_search_teamview(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+static void ndpi_search_teamview_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state)
 {
+  struct ndpi_teamviewer_flow_state *teamviewer = (struct ndpi_teamviewer_flow_state*)state;
   struct ndpi_packet_struct *packet = &flow->packet;
   NDPI_LOG(NDPI_PROTOCOL_TEAMVIEWER, ndpi_struct, NDPI_LOG_TRACE, "TEAMWIEWER detection...\n");
   /*
@@ -65,8 +67,8 @@ void ndpi_search_teamview(struct ndpi_detection_module_struct *ndpi_struct, stru
   if (packet->udp != NULL) {
     if (packet->payload_packet_len > 13) {
       if (packet->payload[0] == 0x00 && packet->payload[11] == 0x17 && packet->payload[12] == 0x24) { /* byte 0 is a counter/seq number, and at the start is 0 */
-	flow->l4.udp.teamviewer_stage++;
-	if (flow->l4.udp.teamviewer_stage == 4 ||
+	teamviewer->teamviewer_stage++;
+	if (teamviewer->teamviewer_stage == 4 ||
 	    packet->udp->dest == ntohs(5938) || packet->udp->source == ntohs(5938)) {
 	  ndpi_int_teamview_add_connection(ndpi_struct, flow);
 	}
@@ -77,17 +79,17 @@ void ndpi_search_teamview(struct ndpi_detection_module_struct *ndpi_struct, stru
   else if(packet->tcp != NULL) {
     if (packet->payload_packet_len > 2) {
       if (packet->payload[0] == 0x17 && packet->payload[1] == 0x24) {
-	flow->l4.udp.teamviewer_stage++;
-	if (flow->l4.udp.teamviewer_stage == 4 ||
+	teamviewer->teamviewer_stage++;
+	if (teamviewer->teamviewer_stage == 4 ||
 	    packet->tcp->dest == ntohs(5938) || packet->tcp->source == ntohs(5938)) {
 	  ndpi_int_teamview_add_connection(ndpi_struct, flow);
 	}
 	return;
       }
-      else if (flow->l4.udp.teamviewer_stage) {
+      else if (teamviewer->teamviewer_stage) {
 	if (packet->payload[0] == 0x11 && packet->payload[1] == 0x30) {
-	  flow->l4.udp.teamviewer_stage++;
-	  if (flow->l4.udp.teamviewer_stage == 4)
+	  teamviewer->teamviewer_stage++;
+	  if (teamviewer->teamviewer_stage == 4)
 	    ndpi_int_teamview_add_connection(ndpi_struct, flow);
 	}
 	return;
@@ -97,4 +99,10 @@ void ndpi_search_teamview(struct ndpi_detection_module_struct *ndpi_struct, stru
 
   NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_TEAMVIEWER);
 }
+
+void ndpi_search_teamview(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+{
+  ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_TEAMVIEWER,
+			   sizeof(struct ndpi_teamviewer_flow_state), ndpi_search_teamview_state);
+}
 #endif
@@ -51,7 +51,8 @@ static void ndpi_int_thunder_add_connection(struct ndpi_detection_module_struct
 __forceinline static
 #endif
 	 void ndpi_int_search_thunder_udp(struct ndpi_detection_module_struct
-												 *ndpi_struct, struct ndpi_flow_struct *flow)
+												 *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_thunder_flow_state *thunder)
 {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	
@@ -60,20 +61,20 @@ __forceinline static
 
 	if (packet->payload_packet_len > 8 && packet->payload[0] >= 0x30
 		&& packet->payload[0] < 0x40 && packet->payload[1] == 0 && packet->payload[2] == 0 && packet->payload[3] == 0) {
-		if (flow->thunder_stage == 3) {
+		if (thunder->thunder_stage == 3) {
 			NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG, "THUNDER udp detected\n");
 			ndpi_int_thunder_add_connection(ndpi_struct, flow, NDPI_REAL_PROTOCOL);
 			return;
 		}
 
-		flow->thunder_stage++;
+		thunder->thunder_stage++;
 		NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG,
-				"maybe thunder udp packet detected, stage increased to %u\n", flow->thunder_stage);
+				"maybe thunder udp packet detected, stage increased to %u\n", thunder->thunder_stage);
 		return;
 	}
 
 	NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG,
-			"excluding thunder udp at stage %u\n", flow->thunder_stage);
+			"excluding thunder udp at stage %u\n", thunder->thunder_stage);
 
 	NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_THUNDER);
 }
@@ -85,7 +86,8 @@ __forceinline static
 __forceinline static
 #endif
 	 void ndpi_int_search_thunder_tcp(struct ndpi_detection_module_struct
-												 *ndpi_struct, struct ndpi_flow_struct *flow)
+												 *ndpi_struct, struct ndpi_flow_struct *flow,
+				struct ndpi_thunder_flow_state *thunder)
 {
 	struct ndpi_packet_struct *packet = &flow->packet;
 	
@@ -94,19 +96,19 @@ __forceinline static
 
 	if (packet->payload_packet_len > 8 && packet->payload[0] >= 0x30
 		&& packet->payload[0] < 0x40 && packet->payload[1] == 0 && packet->payload[2] == 0 && packet->payload[3] == 0) {
-		if (flow->thunder_stage == 3) {
+		if (thunder->thunder_stage == 3) {
 			NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG, "THUNDER tcp detected\n");
 			ndpi_int_thunder_add_connection(ndpi_struct, flow, NDPI_REAL_PROTOCOL);
 			return;
 		}
 
-		flow->thunder_stage++;
+		thunder->thunder_stage++;
 		NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG,
-				"maybe thunder tcp packet detected, stage increased to %u\n", flow->thunder_stage);
+				"maybe thunder tcp packet detected, stage increased to %u\n", thunder->thunder_stage);
 		return;
 	}
 
-	if (flow->thunder_stage == 0 && packet->payload_packet_len > 17
+	if (thunder->thunder_stage == 0 && packet->payload_packet_len > 17
 		&& memcmp(packet->payload, "POST / HTTP/1.1\r\n", 17) == 0) {
 		ndpi_parse_packet_line_info(ndpi_struct, flow);
 
@@ -131,7 +133,7 @@ __forceinline static
 		}
 	}
 	NDPI_LOG(NDPI_PROTOCOL_THUNDER, ndpi_struct, NDPI_LOG_DEBUG,
-			"excluding thunder tcp at stage %u\n", flow->thunder_stage);
+			"excluding thunder tcp at stage %u\n", thunder->thunder_stage);
 
 	NDPI_ADD_PROTOCOL_TO_BITMASK(flow->excluded_protocol_bitmask, NDPI_PROTOCOL_THUNDER);
 }
@@ -193,8 +195,10 @@ __forceinline static
 	}
 }
 
-void ndpi_search_thunder(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+static void ndpi_search_thunder_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				void *state)
 {
+	struct ndpi_thunder_flow_state *thunder = (struct ndpi_thunder_flow_state*)state;
 	struct ndpi_packet_struct *packet = &flow->packet;
 	//
 	//struct ndpi_id_struct *src = flow->src;
@@ -202,10 +206,16 @@ void ndpi_search_thunder(struct ndpi_detection_module_struct *ndpi_struct, struc
 
 	if (packet->tcp != NULL) {
 		ndpi_int_search_thunder_http(ndpi_struct, flow);
-		ndpi_int_search_thunder_tcp(ndpi_struct, flow);
+		ndpi_int_search_thunder_tcp(ndpi_struct, flow, thunder);
 	} else if (packet->udp != NULL) {
-		ndpi_int_search_thunder_udp(ndpi_struct, flow);
+		ndpi_int_search_thunder_udp(ndpi_struct, flow, thunder);
 	}
 }
 
+void ndpi_search_thunder(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow)
+{
+	ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_THUNDER,
+				 sizeof(struct ndpi_thunder_flow_state), ndpi_search_thunder_state);
+}
+
 #endif
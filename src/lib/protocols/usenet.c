@@ -59,8 +59,7 @@ void ndpi_search_usenet_tcp(struct ndpi_detection_module_struct
 	   201    Service available, posting prohibited
 	 */
 	if (flow->l4.tcp.usenet_stage == 0 && packet->payload_packet_len > 10
-		&& ((memcmp(packet->payload, "200 ", 4) == 0)
-			|| (memcmp(packet->payload, "201 ", 4) == 0))) {
+		&& ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_USENET, NDPI_PREFIX_RESPONSE)) {
 
 		NDPI_LOG(NDPI_PROTOCOL_USENET, ndpi_struct, NDPI_LOG_DEBUG, "USENET: found 200 or 201.\n");
 		flow->l4.tcp.usenet_stage = 1 + packet->packet_direction;
@@ -139,10 +139,7 @@ static void ndpi_search_yahoo_tcp(struct ndpi_detection_module_struct *ndpi_stru
 
   /* now test for http login, at least 100 a bytes packet */
   if (ndpi_struct->yahoo_detect_http_connections != 0 && packet->payload_packet_len > 100) {
-    if (memcmp(packet->payload, "POST /relay?token=", 18) == 0
-	|| memcmp(packet->payload, "GET /relay?token=", 17) == 0
-	|| memcmp(packet->payload, "GET /?token=", 12) == 0
-	|| memcmp(packet->payload, "HEAD /relay?token=", 18) == 0) {
+    if (ndpi_match_prefix_signature(ndpi_struct, flow, NDPI_PROTOCOL_YAHOO, NDPI_PREFIX_REQUEST)) {
       if ((src != NULL
 	   && NDPI_COMPARE_PROTOCOL_TO_BITMASK(src->detected_protocol_bitmask, NDPI_PROTOCOL_YAHOO)
 	   != 0) || (dst != NULL
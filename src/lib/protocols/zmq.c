@@ -29,7 +29,8 @@ static void ndpi_int_zmq_add_connection(struct ndpi_detection_module_struct *ndp
 }
 
 
-static void ndpi_check_zmq(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_check_zmq(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+			   struct ndpi_zmq_flow_state *zmq) {
   struct ndpi_packet_struct *packet = &flow->packet;
   u_int32_t payload_len = packet->payload_packet_len;
   u_char p0[] =  { 0x00, 0x00, 0x00, 0x05, 0x01, 0x66, 0x6c, 0x6f, 0x77 };
@@ -45,38 +46,38 @@ static void ndpi_check_zmq(struct ndpi_detection_module_struct *ndpi_struct, str
     return;
   }
 
-  if(flow->l4.tcp.prev_zmq_pkt_len == 0) {
-    flow->l4.tcp.prev_zmq_pkt_len = ndpi_min(packet->payload_packet_len, 10);
-    memcpy(flow->l4.tcp.prev_zmq_pkt, packet->payload, flow->l4.tcp.prev_zmq_pkt_len);
+  if(zmq->prev_zmq_pkt_len == 0) {
+    zmq->prev_zmq_pkt_len = ndpi_min(packet->payload_packet_len, 10);
+    memcpy(zmq->prev_zmq_pkt, packet->payload, zmq->prev_zmq_pkt_len);
     return; /* Too early */
   }
 
   if(payload_len == 2) {
-    if(flow->l4.tcp.prev_zmq_pkt_len == 2) {
+    if(zmq->prev_zmq_pkt_len == 2) {
       if((memcmp(packet->payload, "\01\01", 2) == 0)
-	 && (memcmp(flow->l4.tcp.prev_zmq_pkt, "\01\02", 2) == 0)) {
+	 && (memcmp(zmq->prev_zmq_pkt, "\01\02", 2) == 0)) {
 	ndpi_int_zmq_add_connection(ndpi_struct, flow);
 	return;
       }
-    } else if(flow->l4.tcp.prev_zmq_pkt_len == 9) {
+    } else if(zmq->prev_zmq_pkt_len == 9) {
       if((memcmp(packet->payload, "\00\00", 2) == 0)
-	 && (memcmp(flow->l4.tcp.prev_zmq_pkt, p0, 9) == 0)) {
+	 && (memcmp(zmq->prev_zmq_pkt, p0, 9) == 0)) {
 	ndpi_int_zmq_add_connection(ndpi_struct, flow);
 	return;
       }
-    } else if(flow->l4.tcp.prev_zmq_pkt_len == 10) {
+    } else if(zmq->prev_zmq_pkt_len == 10) {
       if((memcmp(packet->payload, "\01\02", 2) == 0)
-	 && (memcmp(flow->l4.tcp.prev_zmq_pkt, p1, 10) == 0)) {
+	 && (memcmp(zmq->prev_zmq_pkt, p1, 10) == 0)) {
 	ndpi_int_zmq_add_connection(ndpi_struct, flow);
 	return;
       }
     }
   } else if(payload_len >= 10) {
-    if(flow->l4.tcp.prev_zmq_pkt_len == 10) {
+    if(zmq->prev_zmq_pkt_len == 10) {
       if(((memcmp(packet->payload, p1, 10) == 0)
-	  && (memcmp(flow->l4.tcp.prev_zmq_pkt, p1, 10) == 0))
+	  && (memcmp(zmq->prev_zmq_pkt, p1, 10) == 0))
 	 || ((memcmp(&packet->payload[1], p2, sizeof(p2)) == 0)
-	     && (memcmp(&flow->l4.tcp.prev_zmq_pkt[1], p2, sizeof(p2)) == 0))) {
+	     && (memcmp(&zmq->prev_zmq_pkt[1], p2, sizeof(p2)) == 0))) {
 	ndpi_int_zmq_add_connection(ndpi_struct, flow);
 	return;
       }
@@ -84,7 +85,8 @@ static void ndpi_check_zmq(struct ndpi_detection_module_struct *ndpi_struct, str
   }
 }
 
-void ndpi_search_zmq(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+static void ndpi_search_zmq_state(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow,
+				  void *state) {
   struct ndpi_packet_struct *packet = &flow->packet;
 
   NDPI_LOG(NDPI_PROTOCOL_ZMQ, ndpi_struct, NDPI_LOG_TRACE, "ZMQ detection...\n");
@@ -92,9 +94,14 @@ void ndpi_search_zmq(struct ndpi_detection_module_struct *ndpi_struct, struct nd
   /* skip marked packets */
   if (packet->detected_protocol_stack[0] != NDPI_PROTOCOL_ZMQ) {
     if (packet->tcp_retransmission == 0) {
-      ndpi_check_zmq(ndpi_struct, flow);
+      ndpi_check_zmq(ndpi_struct, flow, (struct ndpi_zmq_flow_state*)state);
     }
   }
 }
 
+void ndpi_search_zmq(struct ndpi_detection_module_struct *ndpi_struct, struct ndpi_flow_struct *flow) {
+  ndpi_run_with_flow_state(ndpi_struct, flow, NDPI_PROTOCOL_ZMQ,
+			   sizeof(struct ndpi_zmq_flow_state), ndpi_search_zmq_state);
+}
+
 #endif
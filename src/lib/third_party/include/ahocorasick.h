@@ -55,11 +55,17 @@ typedef struct
   /* Statistic Variables */
   unsigned long total_patterns; /* Total patterns in the automata */
 
+  /* Alphabet-class map applied to both patterns and input text: identity
+   * by default, see ac_automata_fold_case() */
+  unsigned char alphabet[256];
+
 } AC_AUTOMATA_t;
 
 
 AC_AUTOMATA_t * ac_automata_init     (MATCH_CALBACK_f mc);
+AC_ERROR_t      ac_automata_fold_case(AC_AUTOMATA_t * thiz);
 AC_ERROR_t      ac_automata_add      (AC_AUTOMATA_t * thiz, AC_PATTERN_t * str);
+AC_ERROR_t      ac_automata_remove   (AC_AUTOMATA_t * thiz, AC_PATTERN_t * str);
 void            ac_automata_finalize (AC_AUTOMATA_t * thiz);
 int             ac_automata_search   (AC_AUTOMATA_t * thiz, AC_TEXT_t * str, void * param);
 void            ac_automata_reset    (AC_AUTOMATA_t * thiz);
@@ -51,11 +51,15 @@ static void ac_automata_traverse_setfailure
  ******************************************************************************/
 AC_AUTOMATA_t * ac_automata_init (MATCH_CALBACK_f mc)
 {
-  AC_AUTOMATA_t * thiz = (AC_AUTOMATA_t *)ndpi_malloc(sizeof(AC_AUTOMATA_t));
+  AC_AUTOMATA_t * thiz = (AC_AUTOMATA_t *)ndpi_malloc_tag(sizeof(AC_AUTOMATA_t), NDPI_MEM_AUTOMATA);
+  unsigned int i;
+
   memset (thiz, 0, sizeof(AC_AUTOMATA_t));
+  for (i=0; i<256; i++)
+    thiz->alphabet[i] = i;
   thiz->root = node_create ();
   thiz->all_nodes_max = REALLOC_CHUNK_ALLNODES;
-  thiz->all_nodes = (AC_NODE_t **) ndpi_malloc (thiz->all_nodes_max*sizeof(AC_NODE_t *));
+  thiz->all_nodes = (AC_NODE_t **) ndpi_malloc_tag (thiz->all_nodes_max*sizeof(AC_NODE_t *), NDPI_MEM_AUTOMATA);
   thiz->match_callback = mc;
   ac_automata_register_nodeptr (thiz, thiz->root);
   ac_automata_reset (thiz);
@@ -64,6 +68,28 @@ AC_AUTOMATA_t * ac_automata_init (MATCH_CALBACK_f mc)
   return thiz;
 }
 
+/******************************************************************************
+ * FUNCTION: ac_automata_fold_case
+ * Makes the automata case insensitive: upper case letters are mapped to
+ * lower case ones while adding patterns and while searching, so no copy of
+ * the input text is needed. It must be called before adding any pattern.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * RETUERN VALUE: AC_ERROR_t
+ ******************************************************************************/
+AC_ERROR_t ac_automata_fold_case (AC_AUTOMATA_t * thiz)
+{
+  unsigned int i;
+
+  if(!thiz->automata_open || thiz->total_patterns)
+    return ACERR_AUTOMATA_CLOSED;
+
+  for (i='A'; i<='Z'; i++)
+    thiz->alphabet[i] = i - 'A' + 'a';
+
+  return ACERR_SUCCESS;
+}
+
 /******************************************************************************
  * FUNCTION: ac_automata_add
  * Adds pattern to the automata.
@@ -91,7 +117,7 @@ AC_ERROR_t ac_automata_add (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
 
   for (i=0; i<patt->length; i++)
     {
-      alpha = patt->astring[i];
+      alpha = thiz->alphabet[(unsigned char)patt->astring[i]];
       if ((next = node_find_next(n, alpha)))
 	{
 	  n = next;
@@ -116,6 +142,68 @@ AC_ERROR_t ac_automata_add (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
   return ACERR_SUCCESS;
 }
 
+/******************************************************************************
+ * FUNCTION: ac_automata_remove
+ * Removes a pattern from the automata. The pattern is identified by its
+ * string, length and representative number. Nodes are left in place: the
+ * pattern is only dropped from the accepted patterns of its own node and,
+ * if the automata is finalized, of the nodes that inherited it through
+ * their failure node. It works on both open and finalized automata.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_PATTERN_t * patt: the pointer to the pattern to remove
+ * RETUERN VALUE: AC_ERROR_t
+ ******************************************************************************/
+AC_ERROR_t ac_automata_remove (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
+{
+  unsigned int i, j, k, removed = 0;
+  AC_NODE_t * n = thiz->root;
+  AC_NODE_t * m, * f;
+
+  if (!patt->length)
+    return ACERR_ZERO_PATTERN;
+
+  for (i=0; n && i<patt->length; i++)
+    n = node_find_next(n, thiz->alphabet[(unsigned char)patt->astring[i]]);
+
+  if (!n)
+    return ACERR_PATTERN_NOT_FOUND;
+
+  for (i=0; i < thiz->all_nodes_num; i++)
+    {
+      m = thiz->all_nodes[i];
+
+      /* Only n and the nodes having n in their failure chain accept it */
+      for (f = m; f && (f != n) && (f->depth > n->depth); f = f->failure_node)
+	;
+
+      if (f != n)
+	continue;
+
+      for (j=0, k=0; j < m->matched_patterns_num; j++)
+	{
+	  if ((m->matched_patterns[j].length == patt->length)
+	      && (m->matched_patterns[j].rep.number == patt->rep.number))
+	    {
+	      removed++;
+	      continue;
+	    }
+	  m->matched_patterns[k++] = m->matched_patterns[j];
+	}
+
+      m->matched_patterns_num = k;
+      if (k == 0)
+	m->final = 0;
+    }
+
+  if (!removed)
+    return ACERR_PATTERN_NOT_FOUND;
+
+  thiz->total_patterns--;
+
+  return ACERR_SUCCESS;
+}
+
 /******************************************************************************
  * FUNCTION: ac_automata_finalize
  * Locate the failure node for all nodes and collect all matched pattern for
@@ -131,7 +219,7 @@ void ac_automata_finalize (AC_AUTOMATA_t * thiz)
   AC_ALPHABET_t *alphas;
   AC_NODE_t * node;
 
-  if((alphas = ndpi_malloc(AC_PATTRN_MAX_LENGTH)) != NULL) {
+  if((alphas = ndpi_malloc_tag(AC_PATTRN_MAX_LENGTH, NDPI_MEM_AUTOMATA)) != NULL) {
     ac_automata_traverse_setfailure (thiz, thiz->root, alphas);
 
     for (i=0; i < thiz->all_nodes_num; i++)
@@ -141,7 +229,7 @@ void ac_automata_finalize (AC_AUTOMATA_t * thiz)
 	node_sort_edges (node);
       }
     thiz->automata_open = 0; /* do not accept patterns any more */
-    ndpi_free(alphas);
+    ndpi_free_tag(alphas);
   }
 }
 
@@ -178,7 +266,7 @@ int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * txt, void * param)
    * it must be keep as lightweight as possible. */
   while (position < txt->length)
     {
-      if(!(next = node_findbs_next(curr, txt->astring[position])))
+      if(!(next = node_findbs_next(curr, thiz->alphabet[(unsigned char)txt->astring[position]])))
 	{
 	  if(curr->failure_node /* we are not in the root node */)
 	    curr = curr->failure_node;
@@ -241,8 +329,8 @@ void ac_automata_release (AC_AUTOMATA_t * thiz)
       n = thiz->all_nodes[i];
       node_release(n);
     }
-  ndpi_free(thiz->all_nodes);
-  ndpi_free(thiz);
+  ndpi_free_tag(thiz->all_nodes);
+  ndpi_free_tag(thiz);
 }
 
 #ifndef __KERNEL__
@@ -309,7 +397,7 @@ static void ac_automata_register_nodeptr (AC_AUTOMATA_t * thiz, AC_NODE_t * node
 {
   if(thiz->all_nodes_num >= thiz->all_nodes_max)
     {
-      thiz->all_nodes = ndpi_realloc(thiz->all_nodes, 
+      thiz->all_nodes = ndpi_realloc_tag(thiz->all_nodes, 
 				     thiz->all_nodes_max*sizeof(AC_NODE_t *),
 				     (REALLOC_CHUNK_ALLNODES+thiz->all_nodes_max)*sizeof(AC_NODE_t *)
 				     );
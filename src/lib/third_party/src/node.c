@@ -50,7 +50,7 @@ int  node_has_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * newstr);
  ******************************************************************************/
 AC_NODE_t * node_create(void)
 {
-  AC_NODE_t * thiz =  (AC_NODE_t *) ndpi_malloc (sizeof(AC_NODE_t));
+  AC_NODE_t * thiz =  (AC_NODE_t *) ndpi_malloc_tag (sizeof(AC_NODE_t), NDPI_MEM_AUTOMATA);
   node_init(thiz);
   node_assign_id(thiz);
   return thiz;
@@ -65,12 +65,12 @@ void node_init(AC_NODE_t * thiz)
   memset(thiz, 0, sizeof(AC_NODE_t));
 
   thiz->outgoing_max = REALLOC_CHUNK_OUTGOING;
-  thiz->outgoing = (struct edge *) ndpi_malloc
-    (thiz->outgoing_max*sizeof(struct edge));
+  thiz->outgoing = (struct edge *) ndpi_malloc_tag
+    (thiz->outgoing_max*sizeof(struct edge), NDPI_MEM_AUTOMATA);
 
   thiz->matched_patterns_max = REALLOC_CHUNK_MATCHSTR;
-  thiz->matched_patterns = (AC_PATTERN_t *) ndpi_malloc
-    (thiz->matched_patterns_max*sizeof(AC_PATTERN_t));
+  thiz->matched_patterns = (AC_PATTERN_t *) ndpi_malloc_tag
+    (thiz->matched_patterns_max*sizeof(AC_PATTERN_t), NDPI_MEM_AUTOMATA);
 }
 
 /******************************************************************************
@@ -79,9 +79,9 @@ void node_init(AC_NODE_t * thiz)
  ******************************************************************************/
 void node_release(AC_NODE_t * thiz)
 {
-  ndpi_free(thiz->matched_patterns);
-  ndpi_free(thiz->outgoing);
-  ndpi_free(thiz);
+  ndpi_free_tag(thiz->matched_patterns);
+  ndpi_free_tag(thiz->outgoing);
+  ndpi_free_tag(thiz);
 }
 
 /******************************************************************************
@@ -187,7 +187,7 @@ void node_register_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * str)
   /* Manage memory */
   if (thiz->matched_patterns_num >= thiz->matched_patterns_max)
     {
-      thiz->matched_patterns = (AC_PATTERN_t *) ndpi_realloc 
+      thiz->matched_patterns = (AC_PATTERN_t *) ndpi_realloc_tag
 	(thiz->matched_patterns, thiz->matched_patterns_max*sizeof(AC_PATTERN_t),
 	 (REALLOC_CHUNK_MATCHSTR+thiz->matched_patterns_max)*sizeof(AC_PATTERN_t));
 
@@ -209,7 +209,7 @@ void node_register_outgoing
 {
   if(thiz->outgoing_degree >= thiz->outgoing_max)
     {
-      thiz->outgoing = (struct edge *) ndpi_realloc 
+      thiz->outgoing = (struct edge *) ndpi_realloc_tag
 	(thiz->outgoing, thiz->outgoing_max*sizeof(struct edge),
 	 (REALLOC_CHUNK_OUTGOING+thiz->outgoing_max)*sizeof(struct edge));
       thiz->outgoing_max += REALLOC_CHUNK_OUTGOING;